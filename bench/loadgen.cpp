@@ -0,0 +1,420 @@
+// Small HTTP/1.1 load generator used by `make bench`.
+//
+// Closed loop (-r 0): every connection sends its next request as soon as the previous
+// response is complete. Open loop (-r N): requests are scheduled at a fixed total rate and
+// latency is measured from the scheduled time, so a slow server also pays for the queueing
+// it causes (no coordinated omission).
+//
+// Prints one JSON object with the results on stdout.
+
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <ctime>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+struct Options
+{
+	std::string name;
+	std::string host;
+	int port;
+	int connections;
+	double duration;
+	double rate;
+	bool keepAlive;
+	std::string method;
+	std::string path;
+	std::vector<std::string> headers;
+	std::string body;
+	int idle;
+
+	Options()
+		: name("unnamed"), host("127.0.0.1"), port(8080), connections(1), duration(5), rate(0),
+		  keepAlive(true), method("GET"), path("/"), idle(0) {}
+};
+
+struct Connection
+{
+	enum State { CLOSED, CONNECTING, SENDING, READING, IDLE };
+
+	int fd;
+	State state;
+	size_t sent;
+	std::string input;
+	double started;
+	bool mustClose;
+
+	Connection() : fd(-1), state(CLOSED), sent(0), started(0), mustClose(false) {}
+};
+
+struct Results
+{
+	unsigned long requests;
+	unsigned long errors;
+	unsigned long connects;
+	unsigned long bytesReceived;
+	std::map<int, unsigned long> statuses;
+	std::vector<double> latencies;
+
+	Results() : requests(0), errors(0), connects(0), bytesReceived(0) {}
+};
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage()
+{
+	std::cerr << "Usage: loadgen [-n name] [-h host] [-p port] [-c connections] [-d seconds]\n"
+				 "               [-r rate|0] [-k 0|1] [-m method] [-u path] [-H 'Header: value']...\n"
+				 "               [-b body_file] [-i idle_connections]\n";
+	std::exit(2);
+}
+
+static std::string readFile(const std::string &path)
+{
+	std::ifstream file(path.c_str(), std::ios::binary);
+	if (!file)
+	{
+		std::cerr << "loadgen: cannot read " << path << "\n";
+		std::exit(2);
+	}
+	std::ostringstream content;
+	content << file.rdbuf();
+	return content.str();
+}
+
+static Options parseOptions(int argc, char **argv)
+{
+	Options opt;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string flag = argv[i];
+		if (i + 1 >= argc)
+			usage();
+		std::string value = argv[++i];
+		if (flag == "-n") opt.name = value;
+		else if (flag == "-h") opt.host = value;
+		else if (flag == "-p") opt.port = std::atoi(value.c_str());
+		else if (flag == "-c") opt.connections = std::atoi(value.c_str());
+		else if (flag == "-d") opt.duration = std::atof(value.c_str());
+		else if (flag == "-r") opt.rate = std::atof(value.c_str());
+		else if (flag == "-k") opt.keepAlive = (value != "0");
+		else if (flag == "-m") opt.method = value;
+		else if (flag == "-u") opt.path = value;
+		else if (flag == "-H") opt.headers.push_back(value);
+		else if (flag == "-b") opt.body = readFile(value);
+		else if (flag == "-i") opt.idle = std::atoi(value.c_str());
+		else usage();
+	}
+	if (opt.connections < 1 || opt.duration <= 0)
+		usage();
+	return opt;
+}
+
+static std::string buildRequest(const Options &opt)
+{
+	std::ostringstream req;
+	req << opt.method << " " << opt.path << " HTTP/1.1\r\n"
+		<< "Host: " << opt.host << "\r\n"
+		<< "User-Agent: webserv-loadgen\r\n"
+		<< "Connection: " << (opt.keepAlive ? "keep-alive" : "close") << "\r\n";
+	for (size_t i = 0; i < opt.headers.size(); ++i)
+		req << opt.headers[i] << "\r\n";
+	if (!opt.body.empty() || opt.method == "POST")
+		req << "Content-Length: " << opt.body.size() << "\r\n";
+	req << "\r\n" << opt.body;
+	return req.str();
+}
+
+static int openSocket(const Options &opt)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	sockaddr_in addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(opt.port);
+	addr.sin_addr.s_addr = inet_addr(opt.host.c_str());
+	if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1 && errno != EINPROGRESS)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void closeConnection(Connection &conn)
+{
+	if (conn.fd != -1)
+		close(conn.fd);
+	conn.fd = -1;
+	conn.state = Connection::CLOSED;
+	conn.input.clear();
+	conn.sent = 0;
+	conn.mustClose = false;
+}
+
+static std::string lower(const std::string &s)
+{
+	std::string out(s);
+	for (size_t i = 0; i < out.size(); ++i)
+		out[i] = std::tolower(out[i]);
+	return out;
+}
+
+// Returns the full response length once it has been received, 0 while incomplete
+static size_t responseComplete(const std::string &input, bool peerClosed, int &status, bool &mustClose)
+{
+	size_t headerEnd = input.find("\r\n\r\n");
+	if (headerEnd == std::string::npos)
+		return 0;
+	status = std::atoi(input.c_str() + input.find(' ') + 1);
+	std::string head = lower(input.substr(0, headerEnd));
+	mustClose = head.find("\nconnection: close") != std::string::npos;
+	size_t pos = head.find("\ncontent-length:");
+	if (pos == std::string::npos)
+		return peerClosed ? input.size() : 0;
+	size_t total = headerEnd + 4 + std::strtoul(head.c_str() + pos + 16, NULL, 10);
+	return input.size() >= total ? total : 0;
+}
+
+static double percentile(const std::vector<double> &sorted, double fraction)
+{
+	if (sorted.empty())
+		return 0;
+	size_t index = static_cast<size_t>(fraction * (sorted.size() - 1) + 0.5);
+	return sorted[index];
+}
+
+int main(int argc, char **argv)
+{
+	signal(SIGPIPE, SIG_IGN);
+	Options opt = parseOptions(argc, argv);
+	std::string request = buildRequest(opt);
+
+	// Idle connections are opened first and kept open without sending anything
+	std::vector<int> idle;
+	for (int i = 0; i < opt.idle; ++i)
+	{
+		int fd = openSocket(opt);
+		if (fd != -1)
+			idle.push_back(fd);
+	}
+
+	std::vector<Connection> conns(opt.connections);
+	std::deque<double> backlog; // scheduled start times of open-loop requests waiting for a connection
+	Results results;
+	double start = now();
+	double end = start + opt.duration;
+	double nextSchedule = start;
+	char buf[65536];
+
+	while (true)
+	{
+		double t = now();
+		bool running = t < end;
+
+		// Open loop: queue every request whose scheduled time has passed
+		if (opt.rate > 0 && running)
+		{
+			while (nextSchedule <= t)
+			{
+				backlog.push_back(nextSchedule);
+				nextSchedule += 1.0 / opt.rate;
+			}
+		}
+
+		// Hand out work to connections that are free
+		bool busy = false;
+		for (size_t i = 0; i < conns.size(); ++i)
+		{
+			Connection &conn = conns[i];
+			bool wantsWork = (conn.state == Connection::CLOSED || conn.state == Connection::IDLE);
+			if (wantsWork && running && (opt.rate == 0 || !backlog.empty()))
+			{
+				if (conn.state == Connection::CLOSED)
+				{
+					conn.fd = openSocket(opt);
+					if (conn.fd == -1)
+					{
+						++results.errors;
+						continue;
+					}
+					++results.connects;
+					conn.state = Connection::CONNECTING;
+				}
+				else
+					conn.state = Connection::SENDING;
+				if (opt.rate > 0)
+				{
+					conn.started = backlog.front();
+					backlog.pop_front();
+				}
+				else
+					conn.started = now();
+				conn.sent = 0;
+				conn.input.clear();
+			}
+			if (conn.state != Connection::CLOSED && conn.state != Connection::IDLE)
+				busy = true;
+		}
+		if (!running && !busy)
+			break;
+		if (t > end + 5) // give in-flight requests a grace period, then count them as errors
+		{
+			for (size_t i = 0; i < conns.size(); ++i)
+				if (conns[i].state != Connection::CLOSED && conns[i].state != Connection::IDLE)
+					++results.errors;
+			break;
+		}
+
+		std::vector<pollfd> pfds;
+		std::vector<size_t> owners;
+		for (size_t i = 0; i < conns.size(); ++i)
+		{
+			Connection &conn = conns[i];
+			if (conn.state == Connection::CLOSED || conn.state == Connection::IDLE)
+				continue;
+			pollfd pfd;
+			pfd.fd = conn.fd;
+			pfd.events = POLLIN;
+			if (conn.state == Connection::CONNECTING || conn.state == Connection::SENDING)
+				pfd.events |= POLLOUT;
+			pfd.revents = 0;
+			pfds.push_back(pfd);
+			owners.push_back(i);
+		}
+		int timeout = 10;
+		if (opt.rate > 0 && running)
+		{
+			double wait = (nextSchedule - now()) * 1000;
+			timeout = wait < 1 ? 0 : (wait > 10 ? 10 : static_cast<int>(wait));
+		}
+		if (poll(pfds.empty() ? NULL : &pfds[0], pfds.size(), timeout) < 0 && errno != EINTR)
+			break;
+
+		for (size_t p = 0; p < pfds.size(); ++p)
+		{
+			Connection &conn = conns[owners[p]];
+			short revents = pfds[p].revents;
+			if (!revents)
+				continue;
+			if (conn.state == Connection::CONNECTING && (revents & (POLLOUT | POLLERR | POLLHUP)))
+			{
+				int err = 0;
+				socklen_t len = sizeof(err);
+				getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+				if (err != 0)
+				{
+					++results.errors;
+					closeConnection(conn);
+					continue;
+				}
+				conn.state = Connection::SENDING;
+			}
+			if (conn.state == Connection::SENDING && (revents & POLLOUT))
+			{
+				ssize_t n = send(conn.fd, request.data() + conn.sent, request.size() - conn.sent, 0);
+				if (n > 0)
+					conn.sent += n;
+				if (conn.sent == request.size())
+					conn.state = Connection::READING;
+			}
+			// The server may answer before the whole request is sent (e.g. 503, 413)
+			if ((conn.state == Connection::READING || conn.state == Connection::SENDING) && (revents & (POLLIN | POLLHUP | POLLERR)))
+			{
+				ssize_t n = recv(conn.fd, buf, sizeof(buf), 0);
+				if (n > 0)
+				{
+					conn.input.append(buf, n);
+					results.bytesReceived += n;
+				}
+				int status = 0;
+				bool mustClose = false;
+				size_t complete = responseComplete(conn.input, n <= 0, status, mustClose);
+				if (complete)
+				{
+					results.latencies.push_back(now() - conn.started);
+					++results.requests;
+					++results.statuses[status];
+					if (!opt.keepAlive || mustClose || n <= 0)
+						closeConnection(conn);
+					else
+					{
+						conn.input.erase(0, complete);
+						conn.state = Connection::IDLE;
+					}
+				}
+				else if (n <= 0 && (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)))
+				{
+					++results.errors;
+					closeConnection(conn);
+				}
+			}
+		}
+	}
+	double elapsed = now() - start;
+
+	// Counting the idle connections the server kept open until the end
+	size_t idleAlive = 0;
+	for (size_t i = 0; i < idle.size(); ++i)
+	{
+		char c;
+		ssize_t n = recv(idle[i], &c, 1, MSG_PEEK | MSG_DONTWAIT);
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			++idleAlive;
+		close(idle[i]);
+	}
+	for (size_t i = 0; i < conns.size(); ++i)
+		closeConnection(conns[i]);
+
+	std::sort(results.latencies.begin(), results.latencies.end());
+	double sum = 0;
+	for (size_t i = 0; i < results.latencies.size(); ++i)
+		sum += results.latencies[i];
+
+	char line[512];
+	std::cout << "{\"name\":\"" << opt.name << "\",";
+	snprintf(line, sizeof(line),
+		"\"mode\":\"%s\",\"connections\":%d,\"rate\":%.1f,\"keep_alive\":%s,\"duration_s\":%.3f,"
+		"\"requests\":%lu,\"errors\":%lu,\"connects\":%lu,\"bytes_received\":%lu,\"rps\":%.1f,",
+		opt.rate > 0 ? "open" : "closed", opt.connections, opt.rate, opt.keepAlive ? "true" : "false", elapsed,
+		results.requests, results.errors, results.connects, results.bytesReceived,
+		results.requests / elapsed);
+	std::cout << line;
+	snprintf(line, sizeof(line),
+		"\"latency_ms\":{\"mean\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f},",
+		results.latencies.empty() ? 0 : sum / results.latencies.size() * 1000,
+		percentile(results.latencies, 0.5) * 1000, percentile(results.latencies, 0.9) * 1000,
+		percentile(results.latencies, 0.99) * 1000,
+		results.latencies.empty() ? 0 : results.latencies.back() * 1000);
+	std::cout << line << "\"status\":{";
+	for (std::map<int, unsigned long>::iterator it = results.statuses.begin(); it != results.statuses.end(); ++it)
+		std::cout << (it == results.statuses.begin() ? "" : ",") << "\"" << it->first << "\":" << it->second;
+	std::cout << "},\"idle_requested\":" << opt.idle << ",\"idle_alive\":" << idleAlive << "}" << std::endl;
+	return 0;
+}
@@ -0,0 +1,380 @@
+// Microbenchmarks for the request hot path, built by `make microbench`.
+//
+// Links the server objects directly (without main.o) and runs the parser, the
+// lookup functions and the serializers in tight loops over bench/corpus.
+// The roundtrip benchmarks drive a non-listening Server through LoopbackClient,
+// so they measure whole event loop iterations without any process startup.
+// Heap allocations are counted by replacing the global operator new.
+// The scan rows compare the std::string::find calls the request path used to make
+// with each set of Scan.hpp kernels the CPU supports.
+
+#include "../include/Server.hpp"
+#include "../include/ConfigParser.hpp"
+#include "../include/Logger.hpp"
+#include "../include/Utils.hpp"
+#include "../include/LoopbackClient.hpp"
+#include "../include/Scan.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <new>
+#include <algorithm>
+#include <dirent.h>
+
+static size_t g_allocations = 0;
+static size_t g_allocatedBytes = 0;
+
+void *operator new(std::size_t size) throw(std::bad_alloc)
+{
+	++g_allocations;
+	g_allocatedBytes += size;
+	void *ptr = std::malloc(size ? size : 1);
+	if (!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void *operator new[](std::size_t size) throw(std::bad_alloc)
+{
+	return operator new(size);
+}
+
+void operator delete(void *ptr) throw()
+{
+	std::free(ptr);
+}
+
+void operator delete[](void *ptr) throw()
+{
+	std::free(ptr);
+}
+
+// Shared state of the benchmarks, filled once before timing starts
+struct Fixture
+{
+	std::vector<std::string> requests;
+	std::vector<Body> received; // the requests as the parser gets them from a connection
+	std::vector<std::string> paths;
+	std::vector<std::string> hosts;
+	std::vector<std::string> chunkedBodies;
+	std::vector<std::string> headerNames;
+	std::string multipartBody;
+	std::string boundary;
+	std::string cgiOutput;
+	std::string keepAliveRequest;
+	std::string closeRequest;
+	Response response;
+	Server *server;
+	const std::vector<LocationConfig> *locations;
+};
+
+static Fixture g_fixture;
+static volatile size_t g_sink;
+
+typedef void (*BenchFunction)(size_t iterations);
+
+// Reuses one arena across requests, as a connection does
+static void benchParseRequest(size_t iterations)
+{
+	const std::vector<Body> &corpus = g_fixture.received;
+	Arena arena;
+	for (size_t i = 0; i < iterations; ++i)
+	{
+		arena.reset();
+		Request req(&arena);
+		Response res;
+		parseHttpRequest(corpus[i % corpus.size()], req, res);
+		g_sink += res.getStatus();
+	}
+}
+
+static void benchMatchLocation(size_t iterations)
+{
+	const std::vector<std::string> &paths = g_fixture.paths;
+	Request req;
+	for (size_t i = 0; i < iterations; ++i)
+	{
+		req.setPath(paths[i % paths.size()]);
+		matchLocation(req, *g_fixture.locations);
+		g_sink += reinterpret_cast<size_t>(req.getMatchedLocation());
+	}
+}
+
+static void benchFindExactServerConfig(size_t iterations)
+{
+	const std::vector<std::string> &hosts = g_fixture.hosts;
+	for (size_t i = 0; i < iterations; ++i)
+		g_sink += reinterpret_cast<size_t>(g_fixture.server->findExactServerConfig("127.0.0.1", 18081, hosts[i % hosts.size()]));
+}
+
+static void benchResponseToString(size_t iterations)
+{
+	for (size_t i = 0; i < iterations; ++i)
+		g_sink += g_fixture.response.toString().size();
+}
+
+static void benchParseCgiOutput(size_t iterations)
+{
+	for (size_t i = 0; i < iterations; ++i)
+	{
+		Response res;
+		res.parseCgiOutput(g_fixture.cgiOutput);
+		g_sink += res.getStatus();
+	}
+}
+
+static void benchDecodeChunkedBody(size_t iterations)
+{
+	const std::vector<std::string> &bodies = g_fixture.chunkedBodies;
+	for (size_t i = 0; i < iterations; ++i)
+	{
+		std::istringstream stream(bodies[i % bodies.size()]);
+		g_sink += decodeChunkedBody(stream).size();
+	}
+}
+
+static void benchGetContentType(size_t iterations)
+{
+	const std::vector<std::string> &paths = g_fixture.paths;
+	for (size_t i = 0; i < iterations; ++i)
+		g_sink += getContentType(paths[i % paths.size()]).size();
+}
+
+static void benchFindHeaderEnd(size_t iterations)
+{
+	const std::vector<std::string> &corpus = g_fixture.requests;
+	for (size_t i = 0; i < iterations; ++i)
+		g_sink += corpus[i % corpus.size()].find("\r\n\r\n");
+}
+
+static void benchScanHeaderEnd(size_t iterations)
+{
+	const std::vector<std::string> &corpus = g_fixture.requests;
+	for (size_t i = 0; i < iterations; ++i)
+		g_sink += findHeaderEnd(corpus[i % corpus.size()]);
+}
+
+// Every line of a request head, as headerSizeError walks them
+static void benchFindLines(size_t iterations)
+{
+	const std::vector<std::string> &corpus = g_fixture.requests;
+	for (size_t i = 0; i < iterations; ++i)
+	{
+		const std::string &request = corpus[i % corpus.size()];
+		for (size_t pos = request.find("\r\n"); pos != std::string::npos; pos = request.find("\r\n", pos + 2))
+			g_sink += pos;
+	}
+}
+
+static void benchScanLines(size_t iterations)
+{
+	const std::vector<std::string> &corpus = g_fixture.requests;
+	for (size_t i = 0; i < iterations; ++i)
+	{
+		const std::string &request = corpus[i % corpus.size()];
+		for (size_t pos = findCrlf(request); pos != std::string::npos; pos = findCrlf(request, pos + 2))
+			g_sink += pos;
+	}
+}
+
+static void benchFindBoundary(size_t iterations)
+{
+	for (size_t i = 0; i < iterations; ++i)
+		g_sink += g_fixture.multipartBody.find(g_fixture.boundary);
+}
+
+static void benchScanBoundary(size_t iterations)
+{
+	for (size_t i = 0; i < iterations; ++i)
+		g_sink += findSubstring(g_fixture.multipartBody, g_fixture.boundary);
+}
+
+static void benchScanHeaderNames(size_t iterations)
+{
+	const std::vector<std::string> &names = g_fixture.headerNames;
+	for (size_t i = 0; i < iterations; ++i)
+	{
+		const std::string &name = names[i % names.size()];
+		g_sink += isToken(name.data(), name.size());
+	}
+}
+
+// The server closes a connection after MAX_REQUESTS requests, like a real client we reconnect then
+static void benchRoundTripKeepAlive(size_t iterations)
+{
+	LoopbackClient *client = new LoopbackClient(*g_fixture.server, "127.0.0.1", 18081);
+	for (size_t i = 0; i < iterations; ++i)
+	{
+		g_sink += client->roundTrip(g_fixture.keepAliveRequest).size();
+		if (client->isClosed())
+		{
+			delete client;
+			client = new LoopbackClient(*g_fixture.server, "127.0.0.1", 18081);
+		}
+	}
+	delete client;
+}
+
+static void benchRoundTripConnect(size_t iterations)
+{
+	for (size_t i = 0; i < iterations; ++i)
+	{
+		LoopbackClient client(*g_fixture.server, "127.0.0.1", 18081);
+		g_sink += client.roundTrip(g_fixture.closeRequest).size();
+	}
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Grows the iteration count until one run takes at least minSeconds, then reports per-op costs
+static void run(const char *name, BenchFunction function, double minSeconds)
+{
+	function(100); // warm-up
+	size_t iterations = 1000;
+	double elapsed;
+	size_t allocations, bytes;
+	while (true)
+	{
+		allocations = g_allocations;
+		bytes = g_allocatedBytes;
+		double start = now();
+		function(iterations);
+		elapsed = now() - start;
+		allocations = g_allocations - allocations;
+		bytes = g_allocatedBytes - bytes;
+		if (elapsed >= minSeconds || iterations >= 1000000000)
+			break;
+		iterations *= (elapsed < minSeconds / 10) ? 10 : 2;
+	}
+	std::printf("%-28s %12lu %12.1f %12.2f %12.1f\n", name, static_cast<unsigned long>(iterations),
+		elapsed * 1e9 / iterations, static_cast<double>(allocations) / iterations,
+		static_cast<double>(bytes) / iterations);
+}
+
+static std::string readFile(const std::string &path)
+{
+	std::ifstream file(path.c_str(), std::ios::binary);
+	std::ostringstream content;
+	content << file.rdbuf();
+	return content.str();
+}
+
+static void loadCorpus(const std::string &dir)
+{
+	DIR *d = opendir(dir.c_str());
+	if (!d)
+	{
+		std::cerr << "microbench: cannot open corpus directory " << dir << std::endl;
+		std::exit(1);
+	}
+	std::vector<std::string> names;
+	for (struct dirent *entry = readdir(d); entry; entry = readdir(d))
+		names.push_back(entry->d_name);
+	closedir(d);
+	std::sort(names.begin(), names.end());
+
+	for (size_t i = 0; i < names.size(); ++i)
+	{
+		const std::string &name = names[i];
+		std::string content = readFile(dir + "/" + name);
+		if (name.size() > 5 && name.substr(name.size() - 5) == ".http")
+		{
+			g_fixture.requests.push_back(content);
+			g_fixture.received.push_back(Body(content));
+			std::istringstream line(content);
+			std::string method, path;
+			line >> method >> path;
+			g_fixture.paths.push_back(path);
+			size_t headerEnd = content.find("\r\n\r\n");
+			if (content.find("Transfer-Encoding: chunked") < headerEnd)
+				g_fixture.chunkedBodies.push_back(content.substr(headerEnd + 4));
+			for (size_t pos = content.find("\r\n") + 2; pos < headerEnd; pos = content.find("\r\n", pos) + 2)
+				g_fixture.headerNames.push_back(content.substr(pos, content.find(':', pos) - pos));
+		}
+		else if (name.size() > 4 && name.substr(name.size() - 4) == ".out")
+			g_fixture.cgiOutput = content;
+	}
+	if (g_fixture.requests.empty() || g_fixture.chunkedBodies.empty() || g_fixture.cgiOutput.empty())
+	{
+		std::cerr << "microbench: corpus in " << dir << " is incomplete" << std::endl;
+		std::exit(1);
+	}
+	g_fixture.paths.push_back("/");
+	g_fixture.paths.push_back("/image/photos/2024/summer.jpeg");
+	g_fixture.paths.push_back("/does/not/exist.js");
+}
+
+int main(int argc, char **argv)
+{
+	std::string corpusDir = argc > 1 ? argv[1] : "bench/corpus";
+	std::string configPath = argc > 2 ? argv[2] : "bench/microbench.conf";
+	double minSeconds = argc > 3 ? std::atof(argv[3]) : 0.3;
+
+	Logger::getInstance().setLevel(Logger::CRITICAL);
+	Logger::getInstance().setConsoleOutput(false);
+
+	loadCorpus(corpusDir);
+	ConfigParser parser(configPath);
+	std::vector<ServerConfig> configs = parser.parse();
+	Server server(configs, false);
+	g_fixture.server = &server;
+	g_fixture.locations = &server.findExactServerConfig("127.0.0.1", 18081, "localhost:8080")->getLocations();
+	g_fixture.hosts.push_back("localhost:8080");
+	g_fixture.hosts.push_back("static.local");
+	g_fixture.hosts.push_back("unknown.example");
+
+	Response &res = g_fixture.response;
+	res.setStatus(200);
+	res.setHeader("Content-Type", "text/html");
+	res.setHeader("Connection", "keep-alive");
+	res.setHeader("Cache-Control", "max-age=60");
+	res.setBody(readFile("www/index.html"));
+
+	// An upload of 256 KiB of binary data; the boundary only comes at the end
+	g_fixture.boundary = "------WebKitFormBoundary7MA4YWxkTrZu0gW";
+	std::srand(42);
+	for (size_t i = 0; i < 256 * 1024; ++i)
+		g_fixture.multipartBody += static_cast<char>(std::rand());
+	g_fixture.multipartBody += "\r\n" + g_fixture.boundary + "--\r\n";
+
+	g_fixture.keepAliveRequest = "GET /index.html HTTP/1.1\r\nHost: localhost:8080\r\n\r\n";
+	g_fixture.closeRequest = "GET /index.html HTTP/1.1\r\nHost: localhost:8080\r\nConnection: close\r\n\r\n";
+
+	std::printf("%-28s %12s %12s %12s %12s\n", "benchmark", "iterations", "ns/op", "allocs/op", "bytes/op");
+	run("parseHttpRequest", benchParseRequest, minSeconds);
+	run("matchLocation", benchMatchLocation, minSeconds);
+	run("findExactServerConfig", benchFindExactServerConfig, minSeconds);
+	run("Response::toString", benchResponseToString, minSeconds);
+	run("Response::parseCgiOutput", benchParseCgiOutput, minSeconds);
+	run("decodeChunkedBody", benchDecodeChunkedBody, minSeconds);
+	run("getContentType", benchGetContentType, minSeconds);
+	run("roundtrip keep-alive", benchRoundTripKeepAlive, minSeconds);
+	run("roundtrip connect+close", benchRoundTripConnect, minSeconds);
+
+	run("headerEnd string::find", benchFindHeaderEnd, minSeconds);
+	run("crlf lines string::find", benchFindLines, minSeconds);
+	run("boundary string::find", benchFindBoundary, minSeconds);
+	std::string best = scanKernel();
+	const char *kernels[] = { "avx2", "sse2", "scalar" };
+	for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); ++i)
+	{
+		if (!setScanKernel(kernels[i]))
+			continue;
+		std::string kernel = std::string(" ") + kernels[i];
+		run(("headerEnd" + kernel).c_str(), benchScanHeaderEnd, minSeconds);
+		run(("crlf lines" + kernel).c_str(), benchScanLines, minSeconds);
+		run(("boundary" + kernel).c_str(), benchScanBoundary, minSeconds);
+		run(("header names" + kernel).c_str(), benchScanHeaderNames, minSeconds);
+	}
+	setScanKernel(best);
+	return 0;
+}
@@ -0,0 +1,204 @@
+#!/usr/bin/env python3
+# Runs the end-to-end benchmark scenarios against a local webserv.
+# Usually started through `make bench`; writes the results as JSON.
+
+import argparse
+import json
+import os
+import resource
+import shutil
+import socket
+import subprocess
+import re
+import sys
+import tempfile
+import time
+
+HOST = "127.0.0.1"
+PORT = 18080
+FIXTURE_DIR = "www/bench"
+UPLOAD_NAME = "bench_upload.bin"
+RAW_UPLOAD_NAME = "bench_raw.bin"
+BOUNDARY = "----webservbench"
+
+# name, loadgen arguments
+SCENARIOS = [
+    ("static_small", ["-u", "/bench/small.html", "-c", "16"]),
+    ("static_small_close", ["-u", "/bench/small.html", "-c", "16", "-k", "0"]),
+    ("static_small_open_loop", ["-u", "/bench/small.html", "-c", "32", "-r", "1000"]),
+    ("static_1mb", ["-u", "/bench/1mb.bin", "-c", "4"]),
+    ("error_404", ["-u", "/bench/missing.html", "-c", "16"]),
+    ("autoindex", ["-u", "/bench/listing/", "-c", "8"]),
+    ("cgi_get", ["-u", "/cgi-bin/test-get.py", "-c", "2"]),
+    ("upload_multipart", ["-m", "POST", "-u", "/upload", "-c", "4",
+                          "-H", "Content-Type: multipart/form-data; boundary=" + BOUNDARY,
+                          "-b", os.path.join(FIXTURE_DIR, "multipart.body")]),
+    # Above client_body_buffer_size: spooled to a file and linked into place
+    ("upload_raw_2mb", ["-m", "POST", "-u", "/upload/" + RAW_UPLOAD_NAME, "-c", "4",
+                        "-b", os.path.join(FIXTURE_DIR, "raw.body")]),
+    ("idle_1k", ["-u", "/bench/small.html", "-c", "4", "-i", "1000"]),
+]
+
+
+def create_fixtures():
+    os.makedirs(os.path.join(FIXTURE_DIR, "listing"), exist_ok=True)
+    with open(os.path.join(FIXTURE_DIR, "small.html"), "w") as f:
+        f.write("<html><body>" + "x" * 1000 + "</body></html>\n")
+    with open(os.path.join(FIXTURE_DIR, "1mb.bin"), "wb") as f:
+        f.write(os.urandom(1024 * 1024))
+    for i in range(200):
+        open(os.path.join(FIXTURE_DIR, "listing", "file_%03d.txt" % i), "w").close()
+    payload = os.urandom(64 * 1024).hex()[:64 * 1024]
+    body = ("--%s\r\nContent-Disposition: form-data; name=\"file\"; filename=\"%s\"\r\n"
+            "Content-Type: application/octet-stream\r\n\r\n%s\r\n--%s--\r\n"
+            % (BOUNDARY, UPLOAD_NAME, payload, BOUNDARY))
+    with open(os.path.join(FIXTURE_DIR, "multipart.body"), "w") as f:
+        f.write(body)
+    with open(os.path.join(FIXTURE_DIR, "raw.body"), "wb") as f:
+        f.write(os.urandom(2 * 1024 * 1024))
+
+
+def remove_fixtures():
+    shutil.rmtree(FIXTURE_DIR, ignore_errors=True)
+    for name in (UPLOAD_NAME, RAW_UPLOAD_NAME):
+        upload = os.path.join("www/upload", name)
+        if os.path.exists(upload):
+            os.remove(upload)
+
+
+def wait_for_port(timeout=5):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        try:
+            socket.create_connection((HOST, PORT), timeout=0.2).close()
+            return True
+        except OSError:
+            time.sleep(0.05)
+    return False
+
+
+# CPU seconds used so far and current/peak RSS in KiB, from /proc (Linux only)
+def process_stats(pid):
+    try:
+        with open("/proc/%d/stat" % pid) as f:
+            fields = f.read().rsplit(")", 1)[1].split()
+        ticks = os.sysconf("SC_CLK_TCK")
+        cpu = (int(fields[11]) + int(fields[12])) / ticks
+        rss = peak = None
+        with open("/proc/%d/status" % pid) as f:
+            for line in f:
+                if line.startswith("VmRSS:"):
+                    rss = int(line.split()[1])
+                elif line.startswith("VmHWM:"):
+                    peak = int(line.split()[1])
+        return cpu, rss, peak
+    except (OSError, IndexError, ValueError):
+        return None, None, None
+
+
+def raise_fd_limit():
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    wanted = 4096 if hard == resource.RLIM_INFINITY else min(4096, hard)
+    if soft < wanted:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (wanted, hard))
+
+
+def server_syscalls():
+    """Event loop syscalls the server counted so far, from the "Event loop:" line of /status."""
+    try:
+        with socket.create_connection((HOST, PORT), timeout=2) as sock:
+            sock.sendall(b"GET /status HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n")
+            data = b""
+            while True:
+                chunk = sock.recv(65536)
+                if not chunk:
+                    break
+                data += chunk
+    except OSError:
+        return None
+    match = re.search(rb"Event loop: \S+ syscalls: (\d+)", data)
+    return int(match.group(1)) if match else None
+
+
+def events_config(config, backend):
+    """Copy of config with an events block selecting backend, removed by the caller."""
+    with open(config) as f:
+        text = f.read()
+    fd, path = tempfile.mkstemp(suffix=".conf")
+    with os.fdopen(fd, "w") as f:
+        f.write("events {\n\tuse %s;\n}\n\n" % backend + text)
+    return path
+
+
+def run_scenario(loadgen, server, name, args, duration):
+    syscalls_before = server_syscalls()
+    cpu_before, _, _ = process_stats(server.pid)
+    cmd = [loadgen, "-n", name, "-h", HOST, "-p", str(PORT), "-d", str(duration)] + args
+    out = subprocess.run(cmd, stdout=subprocess.PIPE, check=True, text=True,
+                         preexec_fn=raise_fd_limit).stdout
+    result = json.loads(out)
+    cpu_after, rss, peak = process_stats(server.pid)
+    if cpu_before is not None and cpu_after is not None:
+        result["server_cpu_s"] = round(cpu_after - cpu_before, 3)
+        result["server_cpu_pct"] = round(100 * (cpu_after - cpu_before) / result["duration_s"], 1)
+    result["server_rss_kb"] = rss
+    result["server_rss_peak_kb"] = peak
+    syscalls_after = server_syscalls()
+    if syscalls_before is not None and syscalls_after is not None:
+        result["server_syscalls"] = syscalls_after - syscalls_before
+        if result["requests"]:
+            result["syscalls_per_request"] = round(result["server_syscalls"] / result["requests"], 2)
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Run the webserv benchmark scenarios")
+    parser.add_argument("--server", default="./webserv")
+    parser.add_argument("--loadgen", default="bench/loadgen")
+    parser.add_argument("--config", default="bench/bench.conf")
+    parser.add_argument("--out", default="bench_results.json")
+    parser.add_argument("--duration", type=float, default=5)
+    parser.add_argument("--only", nargs="*", help="run only these scenarios")
+    parser.add_argument("--events", choices=["poll", "io_uring"],
+                        help="event loop backend, overrides the config")
+    opts = parser.parse_args()
+
+    config = opts.config
+    if opts.events:
+        config = events_config(opts.config, opts.events)
+    create_fixtures()
+    server = subprocess.Popen([opts.server, config], stdout=subprocess.DEVNULL,
+                              stderr=subprocess.DEVNULL, preexec_fn=raise_fd_limit)
+    results = []
+    try:
+        if not wait_for_port():
+            sys.exit("webserv did not start listening on %s:%d" % (HOST, PORT))
+        for name, args in SCENARIOS:
+            if opts.only and name not in opts.only:
+                continue
+            result = run_scenario(opts.loadgen, server, name, args, opts.duration)
+            results.append(result)
+            print("%-24s %10.1f rps  p50 %8.3f ms  p99 %8.3f ms  errors %d  syscalls/req %s" % (
+                name, result["rps"], result["latency_ms"]["p50"], result["latency_ms"]["p99"],
+                result["errors"], result.get("syscalls_per_request", "-")))
+            time.sleep(0.5)
+    finally:
+        server.terminate()
+        try:
+            server.wait(timeout=5)
+        except subprocess.TimeoutExpired:
+            server.kill()
+        remove_fixtures()
+        if config != opts.config:
+            os.unlink(config)
+
+    commit = subprocess.run(["git", "rev-parse", "--short", "HEAD"], stdout=subprocess.PIPE,
+                            stderr=subprocess.DEVNULL, text=True).stdout.strip()
+    with open(opts.out, "w") as f:
+        json.dump({"commit": commit, "timestamp": int(time.time()), "events": opts.events or "config",
+                   "scenarios": results}, f, indent=2)
+    print("Results written to " + opts.out)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+#include <ctime>
+
+class AccessLog;
+
+// Everything the access log needs to know about one request. Times are monotonic
+// seconds (see monotonicTime()), 0 meaning "not reached yet".
+struct AccessRecord
+{
+	std::string clientAddr;
+	std::string vhost;
+	std::string method;
+	std::string path;
+	std::string protocol;
+	std::string referer;
+	std::string userAgent;
+	int status;
+	size_t bytesSent;
+	double start;
+	double headersDone;
+	double handlerDone;
+	double firstByte;
+	double end;
+	AccessLog *log;
+
+	AccessRecord();
+	void reset();
+};
+
+// Buffered access log writer configured with `access_log`. Lines are collected in memory
+// and written out when the buffer gets large or when flushIfDue() is called by the event loop.
+class AccessLog
+{
+public:
+	enum Format { COMBINED, JSON };
+
+	AccessLog(const std::string &path, Format format, int sample);
+	~AccessLog();
+
+	void write(const AccessRecord &record);
+	void flush();
+	void flushIfDue(time_t now);
+
+	static Format parseFormat(const std::string &name);
+
+private:
+	AccessLog(const AccessLog &);
+	AccessLog &operator=(const AccessLog &);
+
+	int _fd;
+	Format _format;
+	int _sample;
+	unsigned long _counter;
+	std::string _buffer;
+	time_t _lastFlush;
+	time_t _stampTime;
+	std::string _stamp;
+
+	void appendCombined(const AccessRecord &record);
+	void appendJson(const AccessRecord &record);
+	const std::string &timestamp(time_t now);
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+
+// Bump allocator for data that lives exactly as long as one request on a connection:
+// the parsed header fields and the serialized response head. Allocating is a pointer
+// increment, nothing is freed on its own; reset() drops everything at once and keeps
+// the first block, so a connection in steady state does not touch the heap for these.
+// Blocks are BufferPool slabs and go back to the pool when the arena is destroyed.
+class Arena
+{
+public:
+	Arena();
+	~Arena();
+
+	void *allocate(size_t size);
+	char *copy(const char *data, size_t size);
+	void reset();
+	size_t getUsed() const;
+
+private:
+	struct Block
+	{
+		Block *next;
+		size_t size;
+		size_t used;
+	};
+
+	Block *_first;
+	Block *_current;
+
+	static Block *newBlock(size_t size);
+	static void freeBlock(Block *block);
+	static char *data(Block *block);
+
+	Arena(const Arena& other);
+	Arena& operator=(const Arena& other);
+};
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+// A request body: a slice of a reference counted buffer. Copies and slices share the
+// buffer, so an upload is held once however many handlers, disk jobs and CGI runs look
+// at it, and the receive buffer it arrived in is adopted (swapped in) instead of copied.
+// A body spooled to a temporary file is a read-only mapping of that file instead.
+// The count is not atomic: Body objects are created, copied and destroyed on the event
+// loop thread only, disk workers just read the bytes of the Body in their job.
+class Body
+{
+public:
+	Body();
+	explicit Body(const std::string &data);
+	Body(const Body &other);
+	Body &operator=(const Body &other);
+	~Body();
+
+	// Takes over the memory of buffer, which is left empty
+	static Body adopt(std::string &buffer);
+	// Maps the first size bytes of the file fd, which the body owns from then on: it is
+	// closed with the last reference. Empty (and fd closed) if the mapping fails.
+	static Body map(int fd, size_t size);
+
+	const char *data() const;
+	size_t size() const;
+	bool empty() const;
+	// Like std::string::find, within the slice
+	size_t find(const char *needle, size_t from = 0) const;
+	size_t find(const std::string &needle, size_t from = 0) const;
+	// Shares the buffer; clamped to the end of this slice
+	Body slice(size_t offset, size_t size = std::string::npos) const;
+	// A copy, for the callers that need a string of their own
+	std::string str() const;
+	// The file a spooled body is in, -1 for a body in memory, and where the slice starts in it
+	int fd() const;
+	size_t offset() const;
+	// True if this is all of a spooled file, which can then be linked into place or read
+	// by a CGI script directly
+	bool spansFile() const;
+
+private:
+	struct Shared
+	{
+		std::string bytes;
+		const char *begin; // bytes, or the mapping of fd
+		int fd;
+		size_t mapped;
+		size_t references;
+	};
+
+	Shared *_shared;
+	size_t _offset;
+	size_t _size;
+
+	void release();
+};
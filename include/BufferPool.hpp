@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Process-wide free list of fixed-size slabs for short-lived I/O memory: the receive
+// buffer of handleClient and the blocks of the connection arenas. Released slabs are
+// kept for reuse up to BUFFER_POOL_MAX_FREE, so a busy server stops going to the heap
+// for them while the memory of an idle one is bounded. Only used from the event loop.
+class BufferPool
+{
+public:
+	enum { SLAB_SIZE = 16384 };
+
+	static char *acquire();
+	static void release(char *slab);
+	static size_t getFreeCount();
+
+private:
+	struct FreeList
+	{
+		std::vector<char *> slabs;
+		~FreeList();
+	};
+
+	static FreeList _free;
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "Response.hpp"
+#include <string>
+#include <map>
+#include <ctime>
+
+class Request;
+
+// Small in-memory cache for CGI responses, configured per location with `cgi_cache`.
+// Entries are keyed by method, host, path and query string. An entry that has expired
+// may still be served during its stale window while a single refresh runs. When the cache
+// is full, expired entries go first and then the least recently used one.
+class CGICache
+{
+public:
+	enum Status { MISS, HIT, STALE, UPDATING };
+
+	CGICache(size_t maxEntries = 1024);
+
+	static std::string makeKey(const Request &req);
+	static int ttlFromCacheControl(const std::string &cacheControl, int defaultTtl, int &staleTtl);
+	// A response that sets a cookie belongs to one client and is never shared
+	static bool setsCookie(const Response &res);
+
+	Status lookup(const std::string &key, Response &out);
+	void beginUpdate(const std::string &key);
+	void abortUpdate(const std::string &key);
+	void store(const std::string &key, const Response &res, int ttl, int staleTtl);
+
+	size_t getHits() const;
+	size_t getMisses() const;
+	size_t size() const;
+
+private:
+	struct Entry
+	{
+		Response response;
+		time_t expires;
+		time_t staleUntil;
+		bool updating;
+		unsigned long lastUsed;
+	};
+
+	std::map<std::string, Entry> _entries;
+	size_t _maxEntries;
+	unsigned long _clock;
+	size_t _hits;
+	size_t _misses;
+
+	void purgeExpired(time_t now);
+	void evictOldest();
+};
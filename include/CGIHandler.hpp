@@ -3,23 +3,43 @@
 
 #include <string>
 #include <map>
+#include <ctime>
+#include <sys/types.h>
 #include "Request.hpp"
 #include "LocationConfig.hpp"
 
 class CGIHandler {
 public:
 	CGIHandler(const Request& req, const LocationConfig& loc);
-	void handleFileUpload(const std::string& body, const std::string& uploadDir);
+	~CGIHandler();
+	void handleFileUpload(const Body& body, const std::string& uploadDir);
+	// Runs the script to completion and returns its output ("" on failure)
 	std::string run();
+	// run() in steps, for callers that must not wait: start() forks the script, then
+	// collect() reads what it wrote so far and returns true once it is done
+	bool start();
+	bool collect();
 	bool wasSuccessful() const;
 	std::string getError() const;
+	const std::string& getOutput() const;
 private:
 	std::string scriptPath_;
 	std::string interpreterPath_;
 	std::map<std::string, std::string> env_;
-	std::string requestBody_;
+	Body requestBody_;
 	bool success_;
 	std::string errorMsg_;
+	pid_t pid_; // -1 once reaped
+	int outFd_; // -1 once closed
+	int errFd_;
+	time_t startTime_;
+	std::string output_;
+	std::string errOutput_;
+
+	CGIHandler(const CGIHandler&);
+	CGIHandler& operator=(const CGIHandler&);
+
+	bool fail(const std::string& error);
 
 	void setupEnvironment(const Request &req);
 	std::string extractQueryString(const std::string &path);
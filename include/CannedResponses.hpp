@@ -0,0 +1,46 @@
+#pragma once
+
+#include "Response.hpp"
+#include "ServerConfig.hpp"
+#include "LocationConfig.hpp"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+
+// Responses that only depend on the virtual host or the location: error pages, the 503 of
+// a full server, redirects and the Allow header of a 405. They are built when the server
+// starts, error_page files included, so the error and shedding paths neither touch the
+// disk nor format anything; an error page edited later is picked up on the next start.
+class CannedResponses
+{
+public:
+	// The configs must stay where they are: responses are looked up by their addresses
+	void build(const std::vector<ServerConfig> &configs);
+
+	// Turns res into the error response of config (NULL: no virtual host) for status, from its
+	// error_page or a built-in page. Other headers of res, like Connection, are kept.
+	void applyError(Response &res, const ServerConfig *config, int status) const;
+	// Turns res into the 301 of a location with a redirect
+	void applyRedirect(Response &res, const LocationConfig *loc) const;
+	// Sets the Allow header of a 405 to the methods of loc
+	void applyAllow(Response &res, const LocationConfig *loc) const;
+	// All of the 503 answer to a connection there is no room for, with Connection: close
+	const std::string &getOverloaded(const ServerConfig *config) const;
+
+private:
+	struct Page
+	{
+		std::string body;
+		std::string length; // Content-Length value
+	};
+
+	std::map<std::pair<const ServerConfig*, int>, Page> _errors;
+	std::map<const LocationConfig*, Page> _redirects;
+	std::map<const LocationConfig*, std::string> _allows;
+	std::map<const ServerConfig*, std::string> _overloaded;
+
+	void addError(const ServerConfig *config, int status);
+	void addLocation(const LocationConfig &loc);
+};
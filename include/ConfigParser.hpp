@@ -7,10 +7,15 @@ class ConfigParser {
 public:
 	ConfigParser(const std::string &filename);
 	std::vector<ServerConfig> parse();
+	const std::string& getEventBackend() const;
+	int getDiskThreads() const;
 
 private:
 	std::string _fileContent;
+	std::string _eventBackend;
+	int _diskThreads;
 
 	void loadFile(const std::string &filename);
+	void parseEvents(std::istream &stream);
 	std::string cleanLine(const std::string &line);
 };
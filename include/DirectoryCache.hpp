@@ -0,0 +1,63 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <ctime>
+
+// Sorted directory listings for autoindex, together with the pages rendered from them,
+// kept until the directory changes. On Linux every cached directory has an inotify watch
+// whose events are collected on the next lookup; elsewhere the directory's mtime is
+// compared instead.
+class DirectoryCache
+{
+public:
+	struct Entry
+	{
+		std::string name;
+		bool isDirectory;
+	};
+
+	struct Listing
+	{
+		std::vector<Entry> entries;
+		std::map<std::string, std::string> pages; // rendered bodies by format and page number
+	};
+
+	DirectoryCache(size_t maxDirectories = 64);
+	~DirectoryCache();
+
+	// NULL if the directory cannot be read
+	Listing *lookup(const std::string &path);
+
+	size_t getHits() const;
+	size_t getMisses() const;
+
+private:
+	struct Slot
+	{
+		Listing listing;
+		int watch;
+		time_t mtime;
+		bool stale;
+		unsigned long lastUsed;
+	};
+
+	std::map<std::string, Slot> _slots;
+	// Paths naming the same directory (/d/ and /d//, links) share its watch: inotify
+	// returns the same descriptor for the same inode
+	std::map<int, std::vector<std::string> > _watches;
+	int _inotifyFd;
+	size_t _maxDirectories;
+	unsigned long _clock;
+	size_t _hits;
+	size_t _misses;
+
+	void processEvents();
+	void evictOldest();
+	void remove(std::map<std::string, Slot>::iterator it);
+	static bool readDirectory(const std::string &path, std::vector<Entry> &entries);
+
+	DirectoryCache(const DirectoryCache& other);
+	DirectoryCache& operator=(const DirectoryCache& other);
+};
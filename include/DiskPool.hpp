@@ -0,0 +1,83 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <cstddef>
+#include <pthread.h>
+#include "Body.hpp"
+
+// One blocking filesystem operation, run by a DiskPool worker. The worker only makes the
+// system calls: the outcome is left in the job, errors as errno values, for the event loop
+// to turn into a response.
+struct DiskJob
+{
+	enum Op
+	{
+		// Stats path: a directory is only reported. A file is opened (fd, size), and if it
+		// is smaller than limit read into data and closed again.
+		OPEN,
+		// Reads up to limit bytes from fd at its current offset into data
+		READ,
+		// Creates or truncates path and writes body to it; a spooled body is linked into
+		// place instead
+		WRITE,
+		// Removes path
+		REMOVE
+	};
+
+	unsigned long id; // set by DiskPool::submit
+	Op op;
+	std::string path;
+	std::string data;
+	Body body; // WRITE: shares the request's buffer, only its bytes are read by the worker
+	int fd;
+	size_t limit;
+	size_t size;
+	bool directory;
+	int error; // 0 on success
+
+	DiskJob(Op op);
+};
+
+// Worker threads for the blocking filesystem calls of the handlers, so a slow disk only
+// holds up the requests that wait for it. Finished jobs are queued for the event loop,
+// which polls getNotifyFd() (an eventfd on Linux, a pipe elsewhere) and collects them
+// with takeCompleted(). Without threads, jobs run in submit() and complete the same way.
+class DiskPool
+{
+public:
+	explicit DiskPool(int threads);
+	~DiskPool();
+
+	// Only takes effect before the first job is submitted
+	void setThreads(int threads);
+	void stop();
+	int getNotifyFd() const;
+	// Takes ownership of job; returns its id
+	unsigned long submit(DiskJob *job);
+	// Empties the notification fd; afterwards takeCompleted returns the finished jobs,
+	// which then belong to the caller, and NULL once there are none left
+	void acknowledge();
+	DiskJob *takeCompleted();
+
+private:
+	pthread_mutex_t _lock;
+	pthread_cond_t _wakeup;
+	std::deque<DiskJob *> _queue;
+	std::deque<DiskJob *> _completed;
+	std::vector<pthread_t> _workers;
+	int _threads;
+	bool _started;
+	bool _stopping;
+	int _notify[2]; // read end, write end; the same eventfd twice on Linux
+	unsigned long _nextId;
+
+	DiskPool(const DiskPool &);
+	DiskPool &operator=(const DiskPool &);
+
+	void start();
+	void complete(DiskJob *job);
+	static void *workerMain(void *arg);
+	static void run(DiskJob &job);
+};
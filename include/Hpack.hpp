@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <utility>
+#include <cstddef>
+
+typedef std::vector<std::pair<std::string, std::string> > HeaderList;
+
+// HPACK (RFC 7541) decoder of one HTTP/2 connection. The dynamic table is filled by the
+// peer's encoder, so every header block of the connection has to pass through decode()
+// in the order it was received, including the blocks of refused streams.
+class HpackDecoder
+{
+public:
+	enum { DEFAULT_TABLE_SIZE = 4096 };
+
+	HpackDecoder();
+
+	// Appends the fields of block to headers; false if the block is malformed, which
+	// is a connection error (COMPRESSION_ERROR). Once the fields add up to more than
+	// maxListSize (name, value and 32 bytes each, RFC 9113 6.5.2), tooLarge is set and
+	// headers is emptied: the rest is still decoded, for the dynamic table, but not kept.
+	bool decode(const char *block, size_t size, HeaderList &headers, size_t maxListSize, bool &tooLarge);
+
+private:
+	typedef std::pair<std::string, std::string> Entry;
+
+	std::deque<Entry> _table; // newest entry first
+	size_t _tableSize;
+	size_t _maxTableSize;
+
+	bool lookup(size_t index, Entry &entry) const;
+	void insert(const std::string &name, const std::string &value);
+	void evict(size_t maxSize);
+};
+
+// Encoder side. Fields are written as literals without indexing, which leaves the peer's
+// dynamic table untouched, so blocks can be built for any stream in any order.
+void hpackEncodeStatus(std::string &out, int status);
+void hpackEncodeField(std::string &out, const std::string &name, const std::string &value);
+
+bool huffmanDecode(const unsigned char *data, size_t size, std::string &out);
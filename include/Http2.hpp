@@ -0,0 +1,125 @@
+#pragma once
+
+#include "Hpack.hpp"
+#include "Body.hpp"
+#include <string>
+#include <map>
+#include <deque>
+#include <cstddef>
+
+// Framing layer of one HTTP/2 connection (RFC 9113), independent of the socket: received
+// bytes go in through receive(), complete requests come out of takeRequest(), responses
+// go in through submitResponse() and the frames to send come out of produce().
+// Streams are multiplexed: their DATA frames are interleaved round-robin as far as the
+// connection and stream send windows allow. Server push is not supported and priority
+// signals are ignored.
+class Http2Session
+{
+public:
+	enum { MAX_FRAME_SIZE = 16384, MAX_CONCURRENT_STREAMS = 100, DEFAULT_WINDOW = 65535 };
+
+	static const char PREFACE[];
+	static const size_t PREFACE_SIZE;
+
+	// 1 if data starts with the client connection preface, 0 if it is a prefix of it, -1 otherwise
+	static int matchPreface(const std::string &data);
+
+	// maxHeaderListSize is advertised as SETTINGS_MAX_HEADER_LIST_SIZE; a stream whose
+	// header list is larger is reset. Request bodies of all streams together are kept in
+	// memory up to bodyBufferSize, the stream that goes over it is spooled to a temporary
+	// file in spoolDirectory, like an HTTP/1.1 body above client_body_buffer_size.
+	Http2Session(size_t maxBodySize, size_t maxHeaderListSize, const std::string &spoolDirectory,
+		size_t bodyBufferSize);
+	~Http2Session();
+
+	// Connection upgraded from HTTP/1.1 (Upgrade: h2c): applies the HTTP2-Settings of the
+	// upgrade request, which becomes stream 1 and is answered over HTTP/2
+	bool startUpgrade(const std::string &settings);
+	// false once the connection has failed; a GOAWAY is then waiting in produce()
+	bool receive(const char *data, size_t size);
+	// Next request whose header and body are complete. tooLarge is set if the body went over
+	// the limit given to the constructor; it was discarded then.
+	bool takeRequest(int &streamId, HeaderList &headers, Body &body, bool &tooLarge);
+	// Takes ownership of bodyFd, which is sent after body
+	void submitResponse(int streamId, int status, const HeaderList &headers, const std::string &body,
+		int bodyFd, size_t bodyFileSize);
+	// Appends frames to out until it holds about limit bytes or nothing more may be sent
+	void produce(std::string &out, size_t limit);
+
+	bool wantsWrite() const;
+	// Bytes of frames queued outside the DATA flow control: ACKs, resets and HEADERS
+	size_t getControlSize() const;
+	bool isIdle() const;
+	bool isClosing() const;
+	int getCurrentStream() const;
+	void setCurrentStream(int streamId);
+
+private:
+	enum FrameType { DATA = 0x0, HEADERS = 0x1, PRIORITY = 0x2, RST_STREAM = 0x3, SETTINGS = 0x4,
+		PUSH_PROMISE = 0x5, PING = 0x6, GOAWAY = 0x7, WINDOW_UPDATE = 0x8, CONTINUATION = 0x9 };
+	enum Flag { END_STREAM = 0x1, ACK = 0x1, END_HEADERS = 0x4, PADDED = 0x8, PRIORITY_FLAG = 0x20 };
+	enum ErrorCode { NO_ERROR = 0x0, PROTOCOL_ERROR = 0x1, INTERNAL_ERROR = 0x2, FLOW_CONTROL_ERROR = 0x3,
+		STREAM_CLOSED = 0x5, FRAME_SIZE_ERROR = 0x6, REFUSED_STREAM = 0x7, COMPRESSION_ERROR = 0x9,
+		ENHANCE_YOUR_CALM = 0xb };
+
+	struct Stream
+	{
+		HeaderList headers;
+		std::string body;
+		int spoolFd; // -1 while the body is in memory
+		size_t spooled;
+		bool requestComplete;
+		bool tooLarge;
+		bool responded;
+		std::string data; // response body still to send
+		size_t dataOffset;
+		int bodyFd;
+		size_t bodyRemaining;
+		long sendWindow;
+
+		Stream();
+		bool hasData() const;
+	};
+	typedef std::map<int, Stream> StreamMap;
+
+	StreamMap _streams;
+	std::deque<int> _ready; // streams with a complete request, in arrival order
+	std::string _input; // received bytes that do not form a complete frame yet
+	std::string _control; // frames that are not flow controlled, sent before any DATA
+	HpackDecoder _decoder;
+	bool _prefaceReceived;
+	bool _closing;
+	int _lastStreamId;
+	int _currentStream;
+	int _lastServed; // round-robin position of produce()
+	// Header block split over CONTINUATION frames
+	int _continuationStream;
+	bool _continuationEndStream;
+	std::string _headerBlock;
+	long _sendWindow;
+	long _peerInitialWindow;
+	size_t _peerMaxFrameSize;
+	size_t _maxBodySize;
+	size_t _maxHeaderListSize;
+	std::string _spoolDirectory;
+	size_t _bodyBufferSize;
+	size_t _bufferedBodies; // in memory, over all streams
+
+	Http2Session(const Http2Session &);
+	Http2Session &operator=(const Http2Session &);
+
+	bool processFrame(int type, int flags, int streamId, const char *payload, size_t length);
+	bool onHeaders(int flags, int streamId, const char *payload, size_t length);
+	bool onHeaderBlock(int streamId, bool endStream);
+	bool onData(int flags, int streamId, const char *payload, size_t length);
+	bool appendBody(Stream &stream, const char *data, size_t size);
+	bool onSettings(int flags, int streamId, const char *payload, size_t length);
+	bool applySettings(const char *payload, size_t length);
+	bool onWindowUpdate(int streamId, const char *payload, size_t length);
+	bool connectionError(ErrorCode code);
+	void resetStream(int streamId, ErrorCode code);
+	void closeStream(StreamMap::iterator it);
+	void writeFrame(std::string &out, int type, int flags, int streamId, const char *payload, size_t length);
+	void writeWindowUpdate(int streamId, size_t increment);
+	StreamMap::iterator nextSendable();
+};
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <cstddef>
+#include <stdint.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+
+// io_uring backend of the event loop (Linux 5.19+), a drop-in for poll(): wait() takes the
+// same pollfd array and fills in revents, so the handlers keep their readiness model.
+// Underneath, everything the pollfds ask for is queued as requests and submitted together
+// with the wait in a single io_uring_enter per loop iteration:
+// - listeners keep ACCEPT_BATCH accepts in flight, the connections come back ready to use
+// - plain connections that want POLLIN get a recv into a buffer of the provided-buffer
+//   ring; the handler takes the data with takeReceived() instead of calling recv()
+// - everything else (POLLOUT, TLS connections) is a one-shot poll, re-armed on every wait,
+//   which keeps poll()'s level-triggered behaviour
+class IoUring
+{
+public:
+	enum Mode { POLL, RECEIVE, ACCEPT };
+	enum { ACCEPT_BATCH = 8 };
+
+	// NULL if the kernel does not offer what is needed; reason says why
+	static IoUring* create(std::string &reason);
+	~IoUring();
+
+	// Sets how POLLIN is served for fd; requests in flight for it are cancelled
+	void watch(int fd, Mode mode);
+	// fd is about to be closed or reused: cancels its requests and drops what they returned
+	void forget(int fd);
+	// Like poll(): returns the number of pollfds with revents, 0 on timeout, -1 with errno
+	int wait(std::vector<pollfd> &fds, int timeoutMs);
+
+	// What the last recv on fd returned: bytes > 0 with data in one of the ring's buffers,
+	// to be handed back with releaseBuffer(), 0 at end of file, -1 with errno. false if
+	// nothing was received for fd, the caller then reads the socket itself.
+	bool takeReceived(int fd, const char *&data, ssize_t &bytes);
+	bool ownsBuffer(const char *data) const;
+	void releaseBuffer(const char *data);
+	// A connection accepted on listener fd, -1 with errno if the accept failed
+	bool takeAccepted(int fd, int &clientFd, sockaddr_in &addr);
+	// io_uring_enter calls since the last call
+	unsigned long takeSyscalls();
+
+private:
+	enum Op { OP_POLL = 1, OP_RECV, OP_ACCEPT, OP_CANCEL };
+
+	struct Accepted
+	{
+		int fd;
+		int error;
+		sockaddr_in addr;
+	};
+	// The kernel writes the peer address of an accept in flight here, so it is never moved
+	// or freed before the ring is gone
+	struct AcceptTarget
+	{
+		sockaddr_in addr;
+		socklen_t length;
+	};
+	struct Slot
+	{
+		Mode mode;
+		size_t index; // position in the pollfd array of the current wait
+		uint64_t poll; // user_data of the request in flight, 0 if none
+		short pollEvents;
+		uint64_t recv;
+		uint64_t accepts[ACCEPT_BATCH];
+		AcceptTarget *targets;
+		bool received;
+		int receivedResult;
+		int receivedBuffer; // -1 if none
+		std::deque<Accepted> accepted;
+
+		Slot();
+	};
+
+	int _fd;
+	unsigned _sqEntries;
+	unsigned _cqEntries;
+	void *_sqRing;
+	void *_cqRing;
+	size_t _sqRingSize;
+	size_t _cqRingSize;
+	io_uring_sqe *_sqes;
+	unsigned *_sqHead;
+	unsigned *_sqTail;
+	unsigned *_sqMask;
+	unsigned *_sqArray;
+	unsigned *_cqHead;
+	unsigned *_cqTail;
+	unsigned *_cqMask;
+	io_uring_cqe *_cqes;
+	unsigned _pendingTail; // SQEs queued but not submitted end at this tail
+	io_uring_buf_ring *_bufferRing;
+	char *_buffers;
+	size_t _bufferRingSize;
+	uint16_t _bufferTail;
+	uint32_t _sequence;
+	std::vector<Slot> _slots;
+	std::vector<AcceptTarget*> _targets;
+	unsigned long _syscalls;
+
+	IoUring();
+	IoUring(const IoUring &);
+	IoUring &operator=(const IoUring &);
+
+	bool setup(std::string &reason);
+	Slot &slot(int fd);
+	io_uring_sqe *nextSqe();
+	uint64_t submit(int op, int fd, int index, short events);
+	void cancel(uint64_t target);
+	void cancelAll(Slot &slot);
+	int enter(unsigned minComplete, int timeoutMs);
+	void complete(const io_uring_cqe &cqe, std::vector<pollfd> &fds);
+	void discard(int op, const io_uring_cqe &cqe);
+	void recycle(int bufferId);
+};
@@ -2,6 +2,7 @@
 #include <string>
 #include <vector>
 #include <iostream>
+#include "RateLimiter.hpp"
 
 class LocationConfig {
 private:
@@ -9,11 +10,18 @@ private:
 	std::string root;
 	std::string index;
 	bool autoindex;
+	std::string autoindex_format;
 	std::vector<std::string> methods;
 	std::string redirect;
 	std::string cgi_path;
 	std::string cgi_ext;
 	std::string upload_dir;
+	int cgi_cache_ttl;
+	int cgi_cache_stale;
+	std::string stub_status;
+	LimitReq limit_req;
+	int limit_conn;
+	long client_max_body_size;
 public:
 
 	LocationConfig();
@@ -24,11 +32,18 @@ public:
 	const std::string& getRoot() const;
 	const std::string& getIndex() const;
 	bool isAutoindex() const;
+	const std::string& getAutoindexFormat() const;
 	const std::vector<std::string>& getMethods() const;
 	const std::string& getRedirect() const;
 	const std::string& getCgiPath() const;
 	const std::string& getCgiExt() const;
 	const std::string& getUploadDir() const;
+	int getCgiCacheTtl() const;
+	int getCgiCacheStale() const;
+	const std::string& getStubStatus() const;
+	const LimitReq& getLimitReq() const;
+	int getLimitConn() const;
+	long getClientMaxBodySize() const;
 	
     void setUploadDir(const std::string& dir);
 	void setPath(const std::string& p);
@@ -1,10 +1,19 @@
 #pragma once
 
 #include <string>
-#include <iostream>
-#include <fstream>
+#include <ctime>
+#include <pthread.h>
 
-class Logger 
+// Level-gated logging: the message expression is only built when the level is enabled,
+// so hot paths don't pay for string concatenation of filtered messages.
+#define LOG_AT(level, message) \
+    do { if (Logger::getInstance().isEnabled(level)) Logger::getInstance().log(level, message); } while (0)
+#define LOG_DEBUG(message) LOG_AT(Logger::DEBUG, message)
+#define LOG_INFO(message) LOG_AT(Logger::INFO, message)
+#define LOG_WARNING(message) LOG_AT(Logger::WARNING, message)
+#define LOG_ERROR(message) LOG_AT(Logger::ERROR, message)
+
+class Logger
 {
 public:
     enum Level { DEBUG, INFO, WARNING, ERROR, CRITICAL };
@@ -12,19 +21,65 @@ public:
     static Logger& getInstance();
 
     void setLevel(Level level);
+    bool isEnabled(Level level) const { return level >= currentLevel; }
     void setLogFile(const std::string& filename);
+    void setConsoleOutput(bool enabled);
     void log(Level level, const std::string& message);
 
+    // Starts/stops the background writer. Until start() is called, and after stop(),
+    // messages are written synchronously.
+    void start();
+    void stop();
+    unsigned long getDroppedCount() const;
+
 private:
     Logger();
     ~Logger();
     Logger(const Logger&);
     //Logger& operator=(const Logger&);
 
+    enum { RING_SIZE = 2048, MESSAGE_SIZE = 1000, WRITE_BATCH = 65536 };
+
+    // Slot of the bounded multi-producer ring buffer; sequence tells producers and
+    // the writer thread whether the slot is free or holds a message
+    struct Slot
+    {
+        unsigned long sequence;
+        Level level;
+        std::time_t time;
+        unsigned int length;
+        char message[MESSAGE_SIZE];
+    };
+
     Level currentLevel;
-    std::ofstream logFile;
-    bool fileOutputEnabled;
+    int logFd;
+    bool consoleOutput;
+
+    Slot ring[RING_SIZE];
+    unsigned long enqueuePos;
+    unsigned long dequeuePos;
+    unsigned long dropped;
+    bool running; // shared with the writer thread, only accessed through isRunning/setRunning
+    pthread_t writer;
+    // The writer sleeps on wakeUp while the ring is empty; producers only take wakeLock
+    // when sleeping says it is waiting, so logging stays lock-free while it is busy
+    bool sleeping;
+    pthread_mutex_t wakeLock;
+    pthread_cond_t wakeUp;
+
+    std::time_t cachedTime;
+    char cachedStamp[20];
 
-    std::string levelToString(Level level) const;
-    std::string getTimestamp() const;
+    bool isRunning() const;
+    void setRunning(bool value);
+    static void* writerMain(void* arg);
+    bool hasPending() const;
+    void waitForMessages();
+    void wakeWriter();
+    bool enqueue(Level level, const std::string& message);
+    size_t drain();
+    size_t format(char* out, Level level, std::time_t time, const char* message, size_t length);
+    void writeAll(int fd, const char* data, size_t length);
+    const char* levelToString(Level level) const;
+    const char* getTimestamp(std::time_t now);
 };
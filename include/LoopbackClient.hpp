@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+
+class Server;
+
+// In-process client for driving a Server without the network. One end of a socketpair
+// is attached to the server as a connection on IPv4:port, the other end stays here.
+// roundTrip() interleaves its own reads and writes with Server::runOnce(0), so a whole
+// request/response exchange happens deterministically on the calling thread.
+class LoopbackClient
+{
+public:
+	LoopbackClient(Server &server, const std::string &IPv4, int port);
+	~LoopbackClient();
+
+	std::string roundTrip(const std::string &request, int maxIterations = 10000);
+	bool isClosed() const;
+
+private:
+	Server &_server;
+	int _fd;
+	bool _closed;
+
+	LoopbackClient(const LoopbackClient &);
+	LoopbackClient &operator=(const LoopbackClient &);
+};
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <string>
+#include <map>
+
+// Latency histogram with logarithmic buckets: every power of two of microseconds is
+// split into SUB_BUCKETS linear steps, which keeps the relative error below 25%.
+class LatencyHistogram
+{
+public:
+	enum { SUB_BUCKETS = 4, BUCKETS = 32 * SUB_BUCKETS };
+
+	LatencyHistogram();
+	void record(double seconds);
+	double percentile(double fraction) const;
+	unsigned long getCount() const;
+	double getSum() const;
+	unsigned long countBelow(double seconds) const;
+
+	static double bucketUpperBound(int index);
+
+private:
+	unsigned long _buckets[BUCKETS];
+	unsigned long _count;
+	double _sum;
+};
+
+// Server-wide counters. The event loop is the only writer, so the hot path just
+// increments plain integers; the status endpoint reads them on demand.
+class Metrics
+{
+public:
+	// Snapshot of things the metrics object does not track itself
+	struct Gauges
+	{
+		unsigned long reading;
+		unsigned long writing;
+		unsigned long waiting;
+		unsigned long cacheHits;
+		unsigned long cacheMisses;
+		unsigned long buffered;
+		const char *events;
+	};
+
+	Metrics();
+
+	void connectionAccepted() { ++_accepted; ++_active; }
+	void connectionDropped() { ++_dropped; }
+	void connectionClosed() { if (_active) --_active; }
+	void bytesReceived(size_t bytes) { _bytesIn += bytes; }
+	void bytesSent(size_t bytes) { _bytesOut += bytes; }
+	void cgiSpawned() { ++_cgiSpawns; }
+	// Waits and socket I/O issued by the event loop
+	void syscalls(unsigned long count) { _syscalls += count; }
+	void requestDone(const std::string &vhost, int status, double seconds);
+
+	std::string renderText(const Gauges &gauges) const;
+	std::string renderPrometheus(const Gauges &gauges) const;
+
+private:
+	unsigned long _accepted;
+	unsigned long _dropped;
+	unsigned long _active;
+	unsigned long _requests;
+	unsigned long _statusClasses[6];
+	unsigned long _bytesIn;
+	unsigned long _bytesOut;
+	unsigned long _cgiSpawns;
+	unsigned long _syscalls;
+	std::map<std::string, LatencyHistogram> _latency;
+};
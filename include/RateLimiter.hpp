@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <vector>
+#include <stdint.h>
+
+// Fixed-size open-addressing hash table of per-client state, keyed by IPv4 address
+// (network byte order). Lookups probe at most PROBE_LIMIT slots, so the cost on the
+// request path does not depend on the number of clients. Entries whose token bucket
+// has refilled and that have no open connection are reclaimed on insert.
+class ClientTable
+{
+public:
+	enum { SLOTS = 4096, PROBE_LIMIT = 16 };
+
+	struct Entry
+	{
+		uint32_t addr;
+		bool used;
+		double tokens;
+		double last;
+		double fullAt;
+		unsigned int connections;
+	};
+
+	ClientTable();
+	Entry *find(uint32_t addr);
+	Entry *findOrInsert(uint32_t addr, double now);
+
+private:
+	std::vector<Entry> _slots;
+
+	static size_t hash(uint32_t addr);
+	static bool isReclaimable(const Entry &entry, double now);
+};
+
+// Parsed `limit_req zone=<name> rate=<N>r/s|r/m [burst=<N>] [nodelay]`
+struct LimitReq
+{
+	std::string zone;
+	double rate;
+	int burst;
+	bool nodelay;
+
+	LimitReq();
+	static LimitReq parse(std::istream &args);
+};
+
+// Request and connection limits per client IP, configured with `limit_req` and
+// `limit_conn`. Every zone has its own table; connection counts are shared by all
+// virtual hosts.
+class RateLimiter
+{
+public:
+	~RateLimiter();
+
+	// Returns 0 to serve now, the delay in seconds for requests queued in the burst,
+	// or -1 to reject the request
+	double acquire(const LimitReq &limit, uint32_t addr, double now);
+
+	void connectionOpened(uint32_t addr, double now);
+	void connectionClosed(uint32_t addr);
+	unsigned int connections(uint32_t addr);
+
+private:
+	std::map<std::string, ClientTable*> _zones;
+	ClientTable _connections;
+};
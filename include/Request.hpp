@@ -2,6 +2,9 @@
 
 #include <string>
 #include <map>
+#include <istream>
+#include "Arena.hpp"
+#include "Body.hpp"
 
 class LocationConfig;
 class ServerConfig;
@@ -9,35 +12,61 @@ class Response;
 
 class Request {
 private:
+	// Header name and value slices; both point into the arena
+	struct HeaderField
+	{
+		const char *name;
+		size_t nameSize;
+		const char *value;
+		size_t valueSize;
+	};
+
 	std::string method;
 	std::string path;
 	std::string protocol;
-	std::map<std::string, std::string> headers;
-	std::string body;
+	HeaderField *fields;
+	size_t fieldCount;
+	size_t fieldCapacity;
+	Body body;
 	const LocationConfig* matchedLocation;
 	ServerConfig* serverConfig;
+	Arena ownArena;
+	Arena *arena;
+
+	const HeaderField *findHeader(const char *key) const;
+
+	Request(const Request& other);
+	Request& operator=(const Request& other);
 
 public:
-	Request();
+	// The header fields are allocated from arena, which must outlive the request.
+	// Without one the request uses an arena of its own.
+	explicit Request(Arena *arena = NULL);
 
-	std::string getMethod() const;
-	std::string getPath() const;
-	std::string getProtocol() const;
+	const std::string& getMethod() const;
+	const std::string& getPath() const;
+	const std::string& getProtocol() const;
 	std::map<std::string, std::string> getHeaders() const;
-	std::string getBody() const;
+	const Body& getBody() const;
 	const LocationConfig* getMatchedLocation() const;
 	const ServerConfig* getServerConfig() const;
-	std::string getHeader(const std::string &key) const;
+	std::string getHeader(const char *key) const;
+	bool hasHeader(const char *key) const;
+	size_t getClientMaxBodySize() const;
+	Arena& getArena();
 
 	void setMethod(const std::string& m);
 	void setPath(const std::string& p);
 	void setProtocol(const std::string& pr);
-	void setHeaders(const std::map<std::string, std::string>& h);
-	void setBody(const std::string& b);
+	void addHeader(const char *name, size_t nameSize, const char *value, size_t valueSize);
+	void setBody(const Body& b);
 	void setMatchedLocation(const LocationConfig* loc);
 	void setServerConfig(ServerConfig* config);
 
 	void print() const;
 };
 
-void parseHttpRequest(const std::string &rawRequest, Request& request, Response& res);
+// Returns the offset of the body in rawRequest, 0 if the head is malformed
+size_t parseRequestHead(const char *rawRequest, size_t size, Request& request, Response& res);
+// spooledBody: the body if it was written to a file as it arrived, rawRequest is the head then
+void parseHttpRequest(const Body &rawRequest, Request& request, Response& res, const Body &spooledBody = Body());
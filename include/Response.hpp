@@ -5,6 +5,7 @@
 #include <sstream>
 
 class Server;
+class Arena;
 
 
 class Response
@@ -13,6 +14,9 @@ private:
 	int _statusCode;
 	std::map<std::string, std::string> _headers;
 	std::string _body;
+	std::string _bodyFile;
+	size_t _bodyFileSize;
+	int _bodyFd;
 
 public:
 	Response();
@@ -20,10 +24,17 @@ public:
 	int getStatus() const;
 	void setHeader(const std::string &key, const std::string &value);
 	void setBody(const std::string &body);
+	void setBodyFile(const std::string &path, size_t size, int fd = -1);
+	const std::string& getBodyFile() const;
+	size_t getBodyFileSize() const;
+	int getBodyFd() const;
 	void setError(int code, const std::string& message);
 	void setWarning(const std::string& message);
+	const std::string& getBody() const;
+	const char *serializeHead(Arena &arena, size_t &size) const;
 	std::string toString() const;
 	std::string getHeaderValue(const std::string &key) const;
+	const std::map<std::string, std::string>& getHeaders() const;
 	void parseCgiOutput(const std::string &cgiOutput);
 };
 
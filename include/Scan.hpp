@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+// Byte scanning kernels of the request path: line ends, the end of the header, header
+// name characters and multipart boundaries. Each has an AVX2, an SSE2 and a scalar
+// version; the widest one the CPU supports is picked on first use. Other architectures
+// than x86 only have the scalar versions.
+
+// Offsets in [data, data + size), size if there is no match
+size_t scanCrlf(const char *data, size_t size);
+size_t scanHeaderEnd(const char *data, size_t size);
+// First byte that is not a token character (RFC 9110 tchar)
+size_t scanNonToken(const char *data, size_t size);
+size_t scanSubstring(const char *data, size_t size, const char *needle, size_t needleSize);
+
+// Like std::string::find, but only matches that end before end; npos if there is none
+size_t findCrlf(const std::string &data, size_t from = 0, size_t end = std::string::npos);
+size_t findHeaderEnd(const std::string &data, size_t from = 0);
+size_t findSubstring(const std::string &data, const std::string &needle, size_t from = 0,
+	size_t end = std::string::npos);
+size_t findSubstring(const std::string &data, const char *needle, size_t from = 0,
+	size_t end = std::string::npos);
+bool isToken(const char *data, size_t size);
+
+// "avx2", "sse2" or "scalar"
+const char *scanKernel();
+// Switches to the named kernels, for benchmarks and tests; false if the CPU lacks them
+bool setScanKernel(const std::string &name);
@@ -2,10 +2,22 @@
 
 #include "ServerConfig.hpp"
 #include "Socket.hpp"
+#include "SocketTable.hpp"
 #include "Response.hpp"
 #include "Utils.hpp"
 #include "Request.hpp"
 #include "LocationConfig.hpp"
+#include "CGICache.hpp"
+#include "CGIHandler.hpp"
+#include "DirectoryCache.hpp"
+#include "AccessLog.hpp"
+#include "Metrics.hpp"
+#include "RateLimiter.hpp"
+#include "Http2.hpp"
+#include "Tls.hpp"
+#include "IoUring.hpp"
+#include "DiskPool.hpp"
+#include "CannedResponses.hpp"
 
 #include <vector>
 #include <map>
@@ -18,34 +30,141 @@
 #include <cstring>
 #include <fstream>
 #include <sstream>
+#include <csignal>
 
 class Server
 {
 public:
-	Server(const std::vector<ServerConfig> &configs);
+	Server(const std::vector<ServerConfig> &configs, bool listen = true);
+	~Server();
 	void run();
+	bool runOnce(int timeoutMs);
+	void stop(int drainSeconds = 10);
+	bool isStopped() const;
+	void attachClient(int fd, const std::string &IPv4, int port, const std::string &clientIPv4 = "127.0.0.1");
+	void useIoUring();
+	void setDiskThreads(int threads);
+	static void requestStop();
+	ServerConfig* findServerConfig(const std::string IPv4, int port);
+	ServerConfig* findExactServerConfig(const std::string IPv4, int port, std::string serverName);
 
 private:
+	// A request whose handler waits for the disk pool: what the handler needs to go on
+	struct DiskWait
+	{
+		enum Kind { GET, UPLOAD, POST, DELETE, BODY };
+
+		Kind kind;
+		int client;
+		int stream; // HTTP/2 stream, 0 on HTTP/1.1
+		Response response; // as far as processRequest got
+		AccessRecord record;
+		std::string path; // of the request
+		std::string query;
+		const ServerConfig *server;
+		const LocationConfig *location;
+
+		DiskWait() : kind(GET), client(-1), stream(0), server(NULL), location(NULL) {}
+	};
+
+	// A stale cgi_cache entry to refresh once its stale copy has gone out; the request is a
+	// copy with an arena of its own, the connection may be closed by then. cgi is the running
+	// script, deleting it kills the script.
+	struct CgiRefresh
+	{
+		std::string key;
+		Request request;
+		const LocationConfig *location;
+		CGIHandler *cgi;
+
+		CgiRefresh() : location(NULL), cgi(NULL) {}
+		~CgiRefresh() { delete cgi; }
+	};
+
 	std::vector<ServerConfig> _configs;
-	std::map<int, Socket> _sockets;
+	SocketTable _sockets;
 	std::vector<pollfd> _pollFds;
+	CGICache _cgiCache;
+	DirectoryCache _autoindexCache;
+	CannedResponses _canned;
+	std::map<int, const std::string*> _overloaded; // 503 answers by listening fd
+	std::map<std::string, AccessLog*> _accessLogs;
+	Metrics _metrics;
+	RateLimiter _rateLimiter;
+	std::vector<int> _delayed;
+	bool _stopping;
+	time_t _drainDeadline;
+	time_t _lastTimeoutSweep;
+	bool _readPaused;
+	size_t _http2BodyLimit;
+	size_t _http2HeaderLimit;
+	std::map<int, TlsContext*> _tlsContexts; // by listening fd
+	IoUring *_ring; // NULL: poll()
+	DiskPool _disk; // its notification fd is always _pollFds[0]
+	std::map<unsigned long, DiskWait> _diskWaits; // by job id
+	int _splicePipe[2]; // socket to spool file, opened on first use
+	std::vector<CgiRefresh*> _cgiRefreshes; // queued by this loop iteration
+	std::vector<CgiRefresh*> _dueRefreshes; // started at the end of this one, until their scripts finish
+
+	static volatile sig_atomic_t _stopRequested;
 
 	int createListeningSocket(const ServerConfig &config);
-	void acceptConnection(Socket& listeningSocket);
+	void acceptConnections(Socket& listeningSocket);
+	void admitClient(Socket& listeningSocket, int clientFd, const sockaddr_in &clientAddr);
+	void continueHandshake(Socket& client);
 	void handleClient(Socket& client);
+	void handleReceived(Socket& client);
+	ssize_t receiveFrom(Socket& client, const char*& data);
+	void releaseReceived(const char* data);
+	bool canSplice(const Socket& client);
+	ssize_t spliceFrom(Socket& client);
+	void processRequest(Request& req, Response& res, Socket& client);
 	void handleClientTimeouts();
-	void handleGetRequest(Response& res, const Request& req);
-	void handlePostRequest(Request &req, Response &res, const std::string &path, const std::string &requestBody);
-	void handleDeleteRequest(Response& res, const std::string &path);
+	void drainClients();
+	bool isTooSlow(const Socket& client, double now);
+	void rejectRequest(Socket& client, int status);
+	ServerConfig* resolveServerConfig(const Socket& client, const std::string& host);
+	bool inspectRequestHeader(Socket& client, size_t headerSize);
+	bool checkLimits(const Request& req, Response& res, Socket& client);
+	int releaseDelayedResponses(int timeoutMs);
+	void updateReadBackpressure();
+	Socket& registerClient(int fd, const std::string &IPv4, int port, const std::string &clientIPv4);
+	bool handleGetRequest(Response& res, const Request& req, Socket& client);
+	bool handlePostRequest(Request &req, Response &res, const std::string &path, const Body &requestBody, Socket& client);
+	bool handleDeleteRequest(Response& res, const std::string &path, Socket& client);
+	void finishGetRequest(Response& res, const DiskWait& wait, DiskJob& job);
+	void finishDeleteRequest(Response& res, const std::string& path, const std::string& fullPath, int error);
+	void submitDiskJob(Socket& client, DiskJob* job, DiskWait& wait);
+	void completeDiskJobs();
+	void finishDiskJob(Socket& client, DiskWait& wait, DiskJob& job);
+	void readBody(Socket& client);
+	void handleStatusRequest(const Request& req, Response& res, const LocationConfig* loc);
 	bool handleCgiRequest(const Request& req, Response& res, const LocationConfig* loc, Socket& client);
-	void list_directory(const std::string &path, Response& res);
+	void executeCgi(const Request& req, Response& res, const LocationConfig* loc);
+	void setCgiResult(const CGIHandler& cgi, const Request& req, Response& res);
+	void storeCgiResponse(const std::string& key, const Response& res, const LocationConfig* loc);
+	void queueCgiRefresh(const std::string& key, const Request& req, const LocationConfig* loc);
+	void runCgiRefreshes();
+	void list_directory(const std::string &path, const std::string &query, const LocationConfig *loc, Response& res);
 	void printSockets();
 	void makeReadyforSend(Response& response, Socket& client);
 	void sendResponse(Socket& client);
 	void deleteClient(Socket& client);
-	ServerConfig* findServerConfig(const std::string IPv4, int port);
-	ServerConfig* findExactServerConfig(const std::string IPv4, int port, std::string serverName);
+	AccessLog* findAccessLog(const ServerConfig* config);
+	void flushAccessLogs();
 	pollfd& findPollFd(int targetFD);
+	void addPollFd(int fd, short events);
+	void removePollFd(int fd);
+	Http2Session* newHttp2Session(const Socket& client);
+	void startHttp2(Socket& client);
+	void upgradeToHttp2(Socket& client, const Request& req);
+	void serviceHttp2(Socket& client, short revents);
+	void dispatchHttp2Requests(Socket& client);
+	void dispatchHttp2Request(Socket& client, int streamId, const HeaderList& headers, const Body& body, bool tooLarge);
+	void submitHttp2Response(Response& response, Socket& client, int bodyFd);
+	void flushHttp2(Socket& client);
 };
 
 std::string getContentType(const std::string &path);
+bool isHttp2Upgrade(const Request &req);
+void matchLocation(Request &req, const std::vector<LocationConfig> &locations);
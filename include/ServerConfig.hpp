@@ -5,6 +5,26 @@
 #include <vector>
 #include <iostream>
 
+// Socket options of a listen directive, applied to the listening socket. Accepted
+// connections inherit them, as well as TCP_NODELAY.
+struct ListenOptions
+{
+	int backlog;
+	bool deferred; // TCP_DEFER_ACCEPT: wake up only once the request has arrived
+	int fastopen; // TCP_FASTOPEN queue length, 0 if off
+	bool reuseport;
+	int rcvbuf; // 0 keeps the system default
+	int sndbuf;
+	int keepalive; // -1 keeps the system default, 0 off, 1 on
+	int keepidle; // TCP_KEEPIDLE, TCP_KEEPINTVL and TCP_KEEPCNT, 0 keeps the system default
+	int keepintvl;
+	int keepcnt;
+
+	ListenOptions();
+	// Takes one `name[=value]` parameter of listen, false if it is not a socket option
+	bool parse(const std::string &param);
+};
+
 class ServerConfig {
 private:
 	std::string host;
@@ -13,8 +33,25 @@ private:
 	std::string root;
 	std::string index;
 	size_t client_max_body_size;
+	size_t client_body_buffer_size;
 	std::map<int, std::string> error_pages;
 	std::vector<LocationConfig> locations;
+	std::string access_log;
+	std::string access_log_format;
+	int access_log_sample;
+	LimitReq limit_req;
+	int limit_conn;
+	int client_header_timeout;
+	int client_body_timeout;
+	int header_buffer_count;
+	size_t header_buffer_size;
+	size_t client_min_rate;
+	bool ssl;
+	ListenOptions listen_options;
+	std::string ssl_certificate;
+	std::string ssl_certificate_key;
+	int ssl_session_timeout;
+	bool ssl_session_tickets;
 public:
 
 	ServerConfig();
@@ -27,8 +64,25 @@ public:
 	const std::string& getRoot() const;
 	const std::string& getIndex() const;
 	size_t getClientMaxBodySize() const;
+	size_t getClientBodyBufferSize() const;
 	const std::map<int, std::string>& getErrorPages() const;
 	const std::vector<LocationConfig>& getLocations() const;
+	const std::string& getAccessLog() const;
+	const std::string& getAccessLogFormat() const;
+	int getAccessLogSample() const;
+	const LimitReq& getLimitReq() const;
+	int getLimitConn() const;
+	int getClientHeaderTimeout() const;
+	int getClientBodyTimeout() const;
+	int getHeaderBufferCount() const;
+	size_t getHeaderBufferSize() const;
+	size_t getClientMinRate() const;
+	bool isSsl() const;
+	const ListenOptions& getListenOptions() const;
+	const std::string& getSslCertificate() const;
+	const std::string& getSslCertificateKey() const;
+	int getSslSessionTimeout() const;
+	bool getSslSessionTickets() const;
 	void initialisedCheck() const;
 	const std::string& getErrorPage(int code) const;
 
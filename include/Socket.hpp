@@ -3,14 +3,23 @@
 #include <string>
 #include <ctime>
 #include <iostream>
+#include <stdint.h>
+#include <sys/types.h>
+#include "AccessLog.hpp"
+#include "Arena.hpp"
+#include "Body.hpp"
 
 class ServerConfig;
+class LocationConfig;
+class Http2Session;
+class TlsConnection;
 
 class Socket
 {
 public:
 	enum Type { LISTENING, CLIENT };
-	enum State { RECEIVING, SENDING };
+	// WAITING: the request is with the disk pool, the response is not ready yet
+	enum State { RECEIVING, SENDING, WAITING };
 
 	Socket();
 	Socket(int newFD, Type newType, State newState, const std::string IPv4, const int port);
@@ -28,6 +37,18 @@ public:
 	std::string getIPv4() const;
 	int getPort() const;
 	bool getNeedsToClose() const;
+	const std::string& getClientIPv4() const;
+	uint32_t getClientAddr() const;
+	double getSendAt() const;
+	ServerConfig* getServerConfig() const;
+	const LocationConfig* getLocation() const;
+	bool hasPendingBody() const;
+	static size_t getBufferedTotal();
+	AccessRecord& getRecord();
+	const AccessRecord& getRecord() const;
+	Arena& getArena();
+	Http2Session* getHttp2() const;
+	TlsConnection* getTls() const;
 
 
 	void increaseNbrRequests();
@@ -35,22 +56,88 @@ public:
 	void setValues(const int newFD, const Type newType, const State newState);
 	void appendToBuffer(const char* data, size_t len);
 	void clearBuffer();
+	void reserveBuffer(size_t size);
+	// Hands the buffer's memory over to into (a request body) and leaves the buffer empty
+	void takeBuffer(std::string &into);
+	// Same for the first length bytes; the rest, requests pipelined behind this one, are
+	// kept until resumePipelined() puts them back once the response is sent
+	void takeBuffer(std::string &into, size_t length);
+	bool resumePipelined();
+	void takePipelined(std::string &into);
+	// A body above client_body_buffer_size goes to a temporary file in directory instead of
+	// the buffer: spoolBody() moves what arrived after the head into it, takeSpool() hands
+	// the finished file over as the request's body
+	bool startSpool(const std::string &directory, size_t expected);
+	bool isSpooling() const;
+	bool spoolBody(size_t headerSize);
+	// Splices what the socket has of the rest of the body into the file through pipe;
+	// returns like recv(), -1 with EAGAIN if nothing is there yet
+	ssize_t spliceBody(const int pipe[2]);
+	size_t getSpooled() const;
+	Body takeSpool();
+	void closeSpool();
 	void setState(State newState);
 	void setNeedsToClose(bool needsToClose);
 	void trimBuffer(size_t len);
+	void setClientIPv4(const std::string& clientIPv4);
+	void setSendAt(double sendAt);
+	void setRequestConfig(ServerConfig* serverConfig, const LocationConfig* location);
+	void setBodyFile(int fd, size_t size);
+	size_t getBodyRemaining() const;
+	int getBodyFd() const;
+	void appendBody(const std::string& data);
+	bool readCachedBody(size_t watermark);
+	void setReadingBody(bool reading);
+	bool isReadingBody() const;
+	void detachBody();
+	void closeBody();
+	void releaseArena();
+	void setHttp2(Http2Session* session);
+	void releaseHttp2();
+	void shrinkIdle();
+	void setTls(TlsConnection* tls);
+	void releaseTls();
+	ssize_t receive(char* buffer, size_t size);
+	ssize_t transmit(const char* data, size_t size);
+	bool sendsBodyDirectly() const;
+	ssize_t sendBodyDirectly();
+	void setCorked(bool corked);
+	bool isCorked() const;
 
 	void updateActivity();
 	bool hasTimedOut(int timeoutSeconds) const;
 	friend std::ostream& operator<<(std::ostream& lhs, const Socket& rhs);
 
 private:
+	// Touched on every event loop pass over the connection
 	int _fd;
-	std::string _buffer;
-	time_t _lastActivity;
 	Type _type;
 	State _state;
+	bool _needsToClose;
+	time_t _lastActivity;
+	double _sendAt;
+	std::string _buffer;
+	std::string _pipelined;
+	int _bodyFd;
+	size_t _bodyRemaining;
+	Arena *_arena;
+	Http2Session *_http2;
+	TlsConnection *_tls;
+	bool _corked;
+	bool _readingBody;
+	// Per request
 	int _nbrRequests;
-	std::string _IPv4;
+	uint32_t _clientAddr;
+	ServerConfig* _serverConfig;
+	const LocationConfig* _location;
+	int _spoolFd;
+	size_t _spooled;
+	size_t _spoolExpected;
+	// Rarely used
 	int _port;
-	bool _needsToClose;
+	std::string _IPv4;
+	std::string _clientIPv4;
+	AccessRecord _record;
+
+	static size_t _bufferedTotal;
 };
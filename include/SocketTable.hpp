@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include "Socket.hpp"
+
+// Connections indexed by their fd. The kernel hands out the lowest free fd, so the slot
+// array stays dense; a lookup is an index operation. Sockets are constructed in place in
+// storage recycled through an intrusive free list, so they never move or get copied and
+// references to them stay valid until they are erased. Each slot also remembers where
+// the socket's pollfd is in Server::_pollFds.
+class SocketTable
+{
+public:
+	SocketTable();
+	~SocketTable();
+
+	Socket *find(int fd) const;
+	Socket &insert(int fd, Socket::Type type, const std::string &IPv4, int port);
+	void erase(int fd);
+
+	// One past the highest fd ever inserted; loops over all sockets run up to it
+	int getLimit() const;
+	bool empty() const;
+	size_t getClientCount() const;
+
+	size_t getPollIndex(int fd) const;
+	void setPollIndex(int fd, size_t index);
+
+private:
+	struct Slot
+	{
+		Socket *socket;
+		size_t pollIndex;
+	};
+
+	// Released Socket storage, linked through its first bytes
+	struct FreeNode
+	{
+		FreeNode *next;
+	};
+
+	std::vector<Slot> _slots;
+	FreeNode *_free;
+	size_t _size;
+	size_t _clients;
+
+	SocketTable(const SocketTable& other);
+	SocketTable& operator=(const SocketTable& other);
+};
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <string>
+#include <ctime>
+#include <cstddef>
+#include <sys/types.h>
+
+class ServerConfig;
+struct ssl_st;
+struct ssl_ctx_st;
+struct evp_cipher_ctx_st;
+struct evp_mac_ctx_st;
+
+// TLS termination with OpenSSL, compiled in with `make SSL=1`. Without it the classes
+// still exist, but creating a TlsContext fails, so an ssl listener is a startup error.
+
+// One per ssl listener, set up from the listener's default server: certificate, server
+// side session cache and session tickets. Ticket keys are generated in memory and
+// replaced every ssl_session_timeout; tickets of the previous key are still accepted
+// and renewed, older ones fall back to a full handshake.
+class TlsContext
+{
+public:
+	explicit TlsContext(const ServerConfig &config);
+	~TlsContext();
+
+	ssl_ctx_st* get() const;
+
+private:
+	struct TicketKey
+	{
+		unsigned char name[16];
+		unsigned char aesKey[32];
+		unsigned char hmacKey[32];
+		time_t created;
+	};
+
+	ssl_ctx_st *_ctx;
+	TicketKey _keys[2]; // current, previous
+	int _keyLifetime;
+
+	TlsContext(const TlsContext &);
+	TlsContext &operator=(const TlsContext &);
+
+	void rotateTicketKeys(time_t now);
+	static bool generateTicketKey(TicketKey &key, time_t now);
+	static int ticketKeyCallback(ssl_st *ssl, unsigned char *name, unsigned char *iv,
+		evp_cipher_ctx_st *cipher, evp_mac_ctx_st *mac, int encrypt);
+};
+
+// TLS state of one client connection on a non-blocking socket. read() and write() behave
+// like recv() and send(): -1 with errno EAGAIN when TLS has to wait for the socket.
+class TlsConnection
+{
+public:
+	enum { HANDSHAKE_DONE = 0, HANDSHAKE_FAILED = -1 };
+
+	TlsConnection(TlsContext &context, int fd);
+	~TlsConnection();
+
+	// HANDSHAKE_DONE, HANDSHAKE_FAILED or the poll events to wait for before calling again
+	int handshake();
+	bool isEstablished() const;
+	bool isResumed() const;
+	ssize_t read(char *buffer, size_t size);
+	ssize_t write(const char *data, size_t size);
+	// Kernel TLS took over encryption of sent records, so sendFile() works
+	bool canSendFile() const;
+	ssize_t sendFile(int fd, off_t offset, size_t size);
+
+private:
+	ssl_st *_ssl;
+	bool _established;
+
+	TlsConnection(const TlsConnection &);
+	TlsConnection &operator=(const TlsConnection &);
+
+	ssize_t result(int ret);
+};
@@ -14,6 +14,11 @@ std::string removeSemicolon(const std::string &str);
 std::string intToStr(int num);
 std::string decodeChunkedBody(std::istream &stream);
 std::string decodeEvents(short int events);
+int parseDuration(const std::string &value);
+long parseSize(const std::string &value);
+double monotonicTime();
+// An unlinked temporary file in directory for a request body, -1 on failure
+int openSpoolFile(const std::string &directory);
 
 // Directory listing utility functions
 bool isDirectory(const std::string &path);
@@ -23,5 +23,39 @@
 
 # define MAX_REQUESTS 100
 # define MAX_SOCKETS 100
+# define KEEPALIVE_TIMEOUT 30
+# define MIN_RATE_GRACE 5
+
+// Responses with a file body are read into the connection buffer in parts: refilled up to
+// the high watermark whenever less than the low watermark is left to send
+# define SEND_HIGH_WATERMARK (256 * 1024)
+# define SEND_LOW_WATERMARK (64 * 1024)
+// Reading from clients pauses while all connection buffers together hold more than
+// BUFFER_BUDGET bytes and resumes below BUFFER_BUDGET_LOW
+# define BUFFER_BUDGET (64 * 1024 * 1024)
+# define BUFFER_BUDGET_LOW (48 * 1024 * 1024)
+// CGI scripts run to completion before their response is sent, so all of their output sits in
+// the connection buffer at once: it gets no more than a streamed file keeps buffered
+# define CGI_OUTPUT_MAX SEND_HIGH_WATERMARK
+// Seconds a CGI script may run before it is killed, and how often the event loop checks on
+// the scripts of cgi_cache refreshes, which run alongside it
+# define CGI_TIMEOUT 5
+# define CGI_REFRESH_POLL_MS 10
+// Free slabs kept by BufferPool (16 KiB each), and how long a keep-alive connection
+// waits for its next request before its buffers are handed back
+# define BUFFER_POOL_MAX_FREE 64
+# define IDLE_SHRINK_SECONDS 1
+// Autoindex entries per page, and rendered pages kept per cached directory
+# define AUTOINDEX_PAGE_SIZE 1000
+# define AUTOINDEX_CACHED_PAGES 16
+// TLS sessions kept per ssl listener for resumption by session ID
+# define SSL_SESSION_CACHE_SIZE 20480
+// io_uring backend: submission queue size, and receive buffers (SLAB_SIZE each, a power of two)
+# define IO_URING_ENTRIES 512
+# define IO_URING_RECV_BUFFERS 128
+// Worker threads for blocking filesystem calls, `events { disk_threads n; }`
+# define DISK_THREADS 4
+// Capacity of the pipe spooled request bodies are spliced through (the default is 64 KiB)
+# define SPLICE_PIPE_SIZE (1024 * 1024)
 
 #endif
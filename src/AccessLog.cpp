@@ -0,0 +1,224 @@
+#include "../include/AccessLog.hpp"
+#include "../include/Utils.hpp"
+#include <stdexcept>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Buffered lines are written once this size is reached, even before the next periodic flush
+#define ACCESS_LOG_BUFFER_SIZE 65536
+#define ACCESS_LOG_FLUSH_INTERVAL 1
+
+AccessRecord::AccessRecord()
+{
+	reset();
+}
+
+void AccessRecord::reset()
+{
+	method.clear();
+	path.clear();
+	protocol.clear();
+	vhost.clear();
+	referer.clear();
+	userAgent.clear();
+	status = 0;
+	bytesSent = 0;
+	start = 0;
+	headersDone = 0;
+	handlerDone = 0;
+	firstByte = 0;
+	end = 0;
+	log = NULL;
+}
+
+AccessLog::AccessLog(const std::string &path, Format format, int sample)
+	: _format(format), _sample(sample > 0 ? sample : 1), _counter(0),
+	  _lastFlush(std::time(NULL)), _stampTime(0)
+{
+	_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (_fd == -1)
+	{
+		logError("Could not open access log: " + path);
+		throw std::runtime_error("Could not open access log: " + path);
+	}
+	_buffer.reserve(ACCESS_LOG_BUFFER_SIZE);
+}
+
+AccessLog::~AccessLog()
+{
+	flush();
+	close(_fd);
+}
+
+AccessLog::Format AccessLog::parseFormat(const std::string &name)
+{
+	if (name == "combined")
+		return COMBINED;
+	if (name == "json")
+		return JSON;
+	throw std::runtime_error("Unknown access_log format: " + name);
+}
+
+// With sample=N only every Nth successful request is logged; errors are always logged
+void AccessLog::write(const AccessRecord &record)
+{
+	if (record.status < 400 && _counter++ % _sample != 0)
+		return;
+	if (_format == JSON)
+		appendJson(record);
+	else
+		appendCombined(record);
+	if (_buffer.size() >= ACCESS_LOG_BUFFER_SIZE)
+		flush();
+}
+
+void AccessLog::flush()
+{
+	size_t offset = 0;
+	while (offset < _buffer.size())
+	{
+		ssize_t written = ::write(_fd, _buffer.data() + offset, _buffer.size() - offset);
+		if (written <= 0)
+			break;
+		offset += written;
+	}
+	_buffer.clear();
+	_lastFlush = std::time(NULL);
+}
+
+void AccessLog::flushIfDue(time_t now)
+{
+	if (!_buffer.empty() && now - _lastFlush >= ACCESS_LOG_FLUSH_INTERVAL)
+		flush();
+}
+
+// localtime_r: the logger's writer thread formats its own timestamps at the same time
+const std::string &AccessLog::timestamp(time_t now)
+{
+	if (now != _stampTime || _stamp.empty())
+	{
+		char buf[32];
+		struct tm local;
+		const char *layout = (_format == JSON) ? "%Y-%m-%dT%H:%M:%S%z" : "%d/%b/%Y:%H:%M:%S %z";
+		localtime_r(&now, &local);
+		std::strftime(buf, sizeof(buf), layout, &local);
+		_stamp = buf;
+		_stampTime = now;
+	}
+	return _stamp;
+}
+
+// Milliseconds between two monotonic timestamps, 0 if one of them was never reached
+static double elapsedMs(double from, double to)
+{
+	if (from == 0 || to == 0 || to < from)
+		return 0;
+	return (to - from) * 1000.0;
+}
+
+static std::string orDash(const std::string &value)
+{
+	return value.empty() ? "-" : value;
+}
+
+// Client-supplied text in the combined format: quotes, backslashes and control bytes
+// become \xHH like nginx writes them, so a field cannot end its quotes or the line
+static void appendEscaped(std::string &out, const std::string &value)
+{
+	for (size_t i = 0; i < value.size(); ++i)
+	{
+		unsigned char c = value[i];
+		if (c == '"' || c == '\\' || c < 0x20 || c == 0x7f)
+		{
+			char esc[8];
+			snprintf(esc, sizeof(esc), "\\x%02X", c);
+			out += esc;
+		}
+		else
+			out += c;
+	}
+}
+
+static void appendJsonString(std::string &out, const std::string &value)
+{
+	out += '"';
+	for (size_t i = 0; i < value.size(); ++i)
+	{
+		unsigned char c = value[i];
+		if (c == '"' || c == '\\')
+		{
+			out += '\\';
+			out += c;
+		}
+		else if (c < 0x20)
+		{
+			char esc[8];
+			snprintf(esc, sizeof(esc), "\\u%04x", c);
+			out += esc;
+		}
+		else
+			out += c;
+	}
+	out += '"';
+}
+
+// Combined log format followed by the vhost and the timings in milliseconds:
+// header parse, handler, time to first byte and total
+void AccessLog::appendCombined(const AccessRecord &record)
+{
+	char numbers[160];
+	snprintf(numbers, sizeof(numbers), "\" %d %lu", record.status, static_cast<unsigned long>(record.bytesSent));
+
+	_buffer += orDash(record.clientAddr);
+	_buffer += " - - [";
+	_buffer += timestamp(std::time(NULL));
+	_buffer += "] \"";
+	appendEscaped(_buffer, record.method);
+	_buffer += ' ';
+	appendEscaped(_buffer, record.path);
+	_buffer += ' ';
+	appendEscaped(_buffer, record.protocol);
+	_buffer += numbers;
+	_buffer += " \"";
+	appendEscaped(_buffer, orDash(record.referer));
+	_buffer += "\" \"";
+	appendEscaped(_buffer, orDash(record.userAgent));
+	_buffer += "\" ";
+	_buffer += orDash(record.vhost);
+	snprintf(numbers, sizeof(numbers), " hp=%.3f ht=%.3f fb=%.3f rt=%.3f\n",
+		elapsedMs(record.start, record.headersDone),
+		elapsedMs(record.headersDone, record.handlerDone),
+		elapsedMs(record.start, record.firstByte),
+		elapsedMs(record.start, record.end));
+	_buffer += numbers;
+}
+
+void AccessLog::appendJson(const AccessRecord &record)
+{
+	char numbers[200];
+
+	_buffer += "{\"time\":\"" + timestamp(std::time(NULL)) + "\",\"client\":";
+	appendJsonString(_buffer, record.clientAddr);
+	_buffer += ",\"vhost\":";
+	appendJsonString(_buffer, record.vhost);
+	_buffer += ",\"method\":";
+	appendJsonString(_buffer, record.method);
+	_buffer += ",\"path\":";
+	appendJsonString(_buffer, record.path);
+	_buffer += ",\"protocol\":";
+	appendJsonString(_buffer, record.protocol);
+	snprintf(numbers, sizeof(numbers), ",\"status\":%d,\"bytes\":%lu,\"referer\":",
+		record.status, static_cast<unsigned long>(record.bytesSent));
+	_buffer += numbers;
+	appendJsonString(_buffer, record.referer);
+	_buffer += ",\"user_agent\":";
+	appendJsonString(_buffer, record.userAgent);
+	snprintf(numbers, sizeof(numbers),
+		",\"header_ms\":%.3f,\"handler_ms\":%.3f,\"first_byte_ms\":%.3f,\"total_ms\":%.3f}\n",
+		elapsedMs(record.start, record.headersDone),
+		elapsedMs(record.headersDone, record.handlerDone),
+		elapsedMs(record.start, record.firstByte),
+		elapsedMs(record.start, record.end));
+	_buffer += numbers;
+}
@@ -0,0 +1,110 @@
+#include "../include/Arena.hpp"
+#include "../include/BufferPool.hpp"
+#include <cstring>
+#include <new>
+
+// Keeps every allocation aligned for any of the types stored in the arena
+static const size_t ALIGNMENT = sizeof(void *) > sizeof(double) ? sizeof(void *) : sizeof(double);
+
+static size_t alignUp(size_t size)
+{
+	return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+}
+
+Arena::Arena() : _first(NULL), _current(NULL) {}
+
+Arena::~Arena()
+{
+	while (_first)
+	{
+		Block *next = _first->next;
+		freeBlock(_first);
+		_first = next;
+	}
+}
+
+// Blocks are slabs from the BufferPool; only an allocation that does not fit into one gets
+// a block of its own from the heap
+Arena::Block *Arena::newBlock(size_t size)
+{
+	size_t header = alignUp(sizeof(Block));
+	Block *block;
+	if (header + size <= BufferPool::SLAB_SIZE)
+	{
+		block = reinterpret_cast<Block *>(BufferPool::acquire());
+		block->size = BufferPool::SLAB_SIZE - header;
+	}
+	else
+	{
+		block = static_cast<Block *>(::operator new(header + size));
+		block->size = size;
+	}
+	block->next = NULL;
+	block->used = 0;
+	return block;
+}
+
+void Arena::freeBlock(Block *block)
+{
+	if (alignUp(sizeof(Block)) + block->size == BufferPool::SLAB_SIZE)
+		BufferPool::release(reinterpret_cast<char *>(block));
+	else
+		::operator delete(block);
+}
+
+char *Arena::data(Block *block)
+{
+	return reinterpret_cast<char *>(block) + alignUp(sizeof(Block));
+}
+
+// The first block is only taken on first use, so an idle connection costs no memory
+void *Arena::allocate(size_t size)
+{
+	size = alignUp(size ? size : 1);
+	if (_current && _current->size - _current->used >= size)
+	{
+		void *ptr = data(_current) + _current->used;
+		_current->used += size;
+		return ptr;
+	}
+	Block *block = newBlock(size);
+	if (_current)
+		_current->next = block;
+	else
+		_first = block;
+	_current = block;
+	block->used = size;
+	return data(block);
+}
+
+char *Arena::copy(const char *source, size_t size)
+{
+	char *ptr = static_cast<char *>(allocate(size));
+	std::memcpy(ptr, source, size);
+	return ptr;
+}
+
+// Blocks added for an unusually large request are released, the first one is reused
+void Arena::reset()
+{
+	if (!_first)
+		return;
+	Block *block = _first->next;
+	while (block)
+	{
+		Block *next = block->next;
+		freeBlock(block);
+		block = next;
+	}
+	_first->next = NULL;
+	_first->used = 0;
+	_current = _first;
+}
+
+size_t Arena::getUsed() const
+{
+	size_t used = 0;
+	for (Block *block = _first; block; block = block->next)
+		used += block->used;
+	return used;
+}
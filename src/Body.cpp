@@ -0,0 +1,160 @@
+#include "../include/Body.hpp"
+#include "../include/Scan.hpp"
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/mman.h>
+
+Body::Body()
+	: _shared(NULL), _offset(0), _size(0)
+{
+}
+
+Body::Body(const std::string &data)
+	: _shared(NULL), _offset(0), _size(data.size())
+{
+	if (data.empty())
+		return;
+	_shared = new Shared;
+	_shared->bytes = data;
+	_shared->begin = _shared->bytes.data();
+	_shared->fd = -1;
+	_shared->mapped = 0;
+	_shared->references = 1;
+}
+
+Body::Body(const Body &other)
+	: _shared(other._shared), _offset(other._offset), _size(other._size)
+{
+	if (_shared)
+		++_shared->references;
+}
+
+Body &Body::operator=(const Body &other)
+{
+	if (_shared != other._shared)
+	{
+		release();
+		_shared = other._shared;
+		if (_shared)
+			++_shared->references;
+	}
+	_offset = other._offset;
+	_size = other._size;
+	return *this;
+}
+
+Body::~Body()
+{
+	release();
+}
+
+void Body::release()
+{
+	if (_shared && --_shared->references == 0)
+	{
+		if (_shared->mapped)
+			munmap(const_cast<char *>(_shared->begin), _shared->mapped);
+		if (_shared->fd != -1)
+			close(_shared->fd);
+		delete _shared;
+	}
+	_shared = NULL;
+}
+
+Body Body::adopt(std::string &buffer)
+{
+	Body body;
+	if (buffer.empty())
+		return body;
+	body._shared = new Shared;
+	body._shared->bytes.swap(buffer);
+	body._shared->begin = body._shared->bytes.data();
+	body._shared->fd = -1;
+	body._shared->mapped = 0;
+	body._shared->references = 1;
+	body._size = body._shared->bytes.size();
+	return body;
+}
+
+Body Body::map(int fd, size_t size)
+{
+	Body body;
+	void *mapping = size ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+	if (mapping == MAP_FAILED)
+	{
+		close(fd);
+		return body;
+	}
+	body._shared = new Shared;
+	body._shared->begin = static_cast<const char *>(mapping);
+	body._shared->fd = fd;
+	body._shared->mapped = size;
+	body._shared->references = 1;
+	body._size = size;
+	return body;
+}
+
+const char *Body::data() const
+{
+	return _shared && _shared->begin ? _shared->begin + _offset : "";
+}
+
+size_t Body::size() const
+{
+	return _size;
+}
+
+bool Body::empty() const
+{
+	return _size == 0;
+}
+
+size_t Body::find(const char *needle, size_t from) const
+{
+	size_t needleSize = std::strlen(needle);
+	if (from > _size)
+		return std::string::npos;
+	if (needleSize == 0)
+		return from;
+	size_t at = scanSubstring(data() + from, _size - from, needle, needleSize);
+	return at == _size - from ? std::string::npos : from + at;
+}
+
+size_t Body::find(const std::string &needle, size_t from) const
+{
+	if (from > _size)
+		return std::string::npos;
+	if (needle.empty())
+		return from;
+	size_t at = scanSubstring(data() + from, _size - from, needle.data(), needle.size());
+	return at == _size - from ? std::string::npos : from + at;
+}
+
+Body Body::slice(size_t offset, size_t size) const
+{
+	Body part(*this);
+	part._offset = _offset + std::min(offset, _size);
+	part._size = std::min(size, _size - std::min(offset, _size));
+	return part;
+}
+
+std::string Body::str() const
+{
+	return std::string(data(), _size);
+}
+
+int Body::fd() const
+{
+	return _shared ? _shared->fd : -1;
+}
+
+size_t Body::offset() const
+{
+	return _offset;
+}
+
+bool Body::spansFile() const
+{
+	return _shared && _shared->fd != -1 && _offset == 0 && _size == _shared->mapped;
+}
@@ -0,0 +1,33 @@
+#include "../include/BufferPool.hpp"
+#include "../include/Webserver.hpp"
+#include <new>
+
+BufferPool::FreeList BufferPool::_free;
+
+BufferPool::FreeList::~FreeList()
+{
+	for (size_t i = 0; i < slabs.size(); ++i)
+		::operator delete(slabs[i]);
+}
+
+char *BufferPool::acquire()
+{
+	if (_free.slabs.empty())
+		return static_cast<char *>(::operator new(SLAB_SIZE));
+	char *slab = _free.slabs.back();
+	_free.slabs.pop_back();
+	return slab;
+}
+
+void BufferPool::release(char *slab)
+{
+	if (_free.slabs.size() < BUFFER_POOL_MAX_FREE)
+		_free.slabs.push_back(slab);
+	else
+		::operator delete(slab);
+}
+
+size_t BufferPool::getFreeCount()
+{
+	return _free.slabs.size();
+}
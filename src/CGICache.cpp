@@ -0,0 +1,151 @@
+#include "../include/CGICache.hpp"
+#include "../include/Request.hpp"
+#include "../include/Utils.hpp"
+#include <cstdlib>
+#include <cctype>
+
+CGICache::CGICache(size_t maxEntries)
+	: _maxEntries(maxEntries), _clock(0), _hits(0), _misses(0)
+{
+}
+
+// The path of a request still carries its query string, so it is part of the key as is
+std::string CGICache::makeKey(const Request &req)
+{
+	return req.getMethod() + " " + req.getHeader("Host") + " " + req.getPath();
+}
+
+// Returns how long a response may be cached according to its Cache-Control header.
+// 0 means the response must not be cached. staleTtl is overwritten by stale-while-revalidate.
+int CGICache::ttlFromCacheControl(const std::string &cacheControl, int defaultTtl, int &staleTtl)
+{
+	std::string header;
+	for (size_t i = 0; i < cacheControl.size(); ++i)
+		header += std::tolower(cacheControl[i]);
+
+	int ttl = defaultTtl;
+	bool sharedMaxAge = false;
+	size_t start = 0;
+	while (start < header.size())
+	{
+		size_t end = header.find(',', start);
+		if (end == std::string::npos)
+			end = header.size();
+		std::string directive = removeSemicolon(header.substr(start, end - start));
+		start = end + 1;
+
+		if (directive == "no-store" || directive == "no-cache" || directive == "private")
+			return 0;
+		size_t eq = directive.find('=');
+		if (eq == std::string::npos)
+			continue;
+		std::string name = directive.substr(0, eq);
+		int value = std::atoi(directive.substr(eq + 1).c_str());
+		if (name == "s-maxage")
+		{
+			ttl = value;
+			sharedMaxAge = true;
+		}
+		else if (name == "max-age" && !sharedMaxAge)
+			ttl = value;
+		else if (name == "stale-while-revalidate")
+			staleTtl = value;
+	}
+	return ttl < 0 ? 0 : ttl;
+}
+
+bool CGICache::setsCookie(const Response &res)
+{
+	const std::map<std::string, std::string> &headers = res.getHeaders();
+	for (std::map<std::string, std::string>::const_iterator it = headers.begin(); it != headers.end(); ++it)
+	{
+		std::string name;
+		for (size_t i = 0; i < it->first.size(); ++i)
+			name += std::tolower(it->first[i]);
+		if (name == "set-cookie")
+			return true;
+	}
+	return false;
+}
+
+CGICache::Status CGICache::lookup(const std::string &key, Response &out)
+{
+	std::map<std::string, Entry>::iterator it = _entries.find(key);
+	time_t now = std::time(NULL);
+	if (it == _entries.end() || now >= it->second.staleUntil)
+	{
+		++_misses;
+		return MISS;
+	}
+	++_hits;
+	it->second.lastUsed = ++_clock;
+	out = it->second.response;
+	if (now < it->second.expires)
+		return HIT;
+	return it->second.updating ? UPDATING : STALE;
+}
+
+// Marks an entry as being refreshed, so concurrent lookups keep getting the stale copy
+// instead of spawning another process for the same key
+void CGICache::beginUpdate(const std::string &key)
+{
+	std::map<std::string, Entry>::iterator it = _entries.find(key);
+	if (it != _entries.end())
+		it->second.updating = true;
+}
+
+void CGICache::abortUpdate(const std::string &key)
+{
+	std::map<std::string, Entry>::iterator it = _entries.find(key);
+	if (it != _entries.end())
+		it->second.updating = false;
+}
+
+void CGICache::store(const std::string &key, const Response &res, int ttl, int staleTtl)
+{
+	time_t now = std::time(NULL);
+	if (ttl <= 0)
+	{
+		_entries.erase(key);
+		return;
+	}
+	if (_entries.size() >= _maxEntries && _entries.find(key) == _entries.end())
+	{
+		purgeExpired(now);
+		if (_entries.size() >= _maxEntries)
+			evictOldest();
+	}
+	Entry &entry = _entries[key];
+	entry.response = res;
+	entry.expires = now + ttl;
+	entry.staleUntil = entry.expires + (staleTtl > 0 ? staleTtl : 0);
+	entry.updating = false;
+	entry.lastUsed = ++_clock;
+}
+
+void CGICache::purgeExpired(time_t now)
+{
+	for (std::map<std::string, Entry>::iterator it = _entries.begin(); it != _entries.end();)
+	{
+		if (now >= it->second.staleUntil && !it->second.updating)
+			_entries.erase(it++);
+		else
+			++it;
+	}
+}
+
+void CGICache::evictOldest()
+{
+	std::map<std::string, Entry>::iterator oldest = _entries.begin();
+	for (std::map<std::string, Entry>::iterator it = _entries.begin(); it != _entries.end(); ++it)
+	{
+		if (it->second.lastUsed < oldest->second.lastUsed)
+			oldest = it;
+	}
+	if (oldest != _entries.end())
+		_entries.erase(oldest);
+}
+
+size_t CGICache::getHits() const { return _hits; }
+size_t CGICache::getMisses() const { return _misses; }
+size_t CGICache::size() const { return _entries.size(); }
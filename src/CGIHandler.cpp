@@ -1,13 +1,16 @@
 #include "../include/CGIHandler.hpp"
 #include "../include/Utils.hpp"
 #include "../include/Server.hpp"
+#include "../include/Webserver.hpp"
 #include <unistd.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <cerrno>
 #include <vector>
 #include <cstring>
-#include <sstream>
 #include <cstdlib>
 #include <algorithm>
 #include <iostream>
@@ -15,7 +18,7 @@
 
 #include <fstream>
 
-void CGIHandler::handleFileUpload(const std::string &body, const std::string &uploadDir)
+void CGIHandler::handleFileUpload(const Body &body, const std::string &uploadDir)
 {
 	// Extract boundary from Content-Type header
 	std::string contentType = env_["CONTENT_TYPE"];
@@ -35,11 +38,12 @@ void CGIHandler::handleFileUpload(const std::string &body, const std::string &up
 	std::string::size_type start = 0, end;
 	while ((end = body.find(boundary, start)) != std::string::npos)
 	{
-		std::string part = body.substr(start, end - start);
+		// Parts and file contents are slices of the body, not copies of it
+		Body part = body.slice(start, end - start);
 		start = end + boundary.length();
 
 		// Skip empty parts or the final boundary marker
-		if (part.empty() || part == "--")
+		if (part.empty() || (part.size() == 2 && std::memcmp(part.data(), "--", 2) == 0))
 		{
 			continue;
 		}
@@ -52,8 +56,8 @@ void CGIHandler::handleFileUpload(const std::string &body, const std::string &up
 			continue;
 		}
 
-		std::string headers = part.substr(0, headerEnd);
-		std::string fileContent = part.substr(headerEnd + 4); // Skip "\r\n\r\n"
+		std::string headers = part.slice(0, headerEnd).str();
+		Body fileContent = part.slice(headerEnd + 4); // Skip "\r\n\r\n"
 
 		// Extract filename from Content-Disposition header
 		std::string filename;
@@ -86,18 +90,18 @@ void CGIHandler::handleFileUpload(const std::string &body, const std::string &up
 			logError("Failed to open file for writing: " + filePath);
 			continue;
 		}
-		outFile.write(fileContent.c_str(), fileContent.size());
+		outFile.write(fileContent.data(), fileContent.size());
 		outFile.close();
 
-		logInfo("File uploaded successfully: " + filePath);
+		LOG_INFO("File uploaded successfully: " + filePath);
 	}
 }
 
 CGIHandler::CGIHandler(const Request &req, const LocationConfig &loc)
-	: success_(false)
+	: success_(false), pid_(-1), outFd_(-1), errFd_(-1), startTime_(0)
 {
 	std::string locationRoot = loc.getRoot();
-	std::string reqPath = req.getPath();
+	std::string reqPath = req.getPath().substr(0, req.getPath().find('?'));
 	if (!locationRoot.empty() && locationRoot[locationRoot.size() - 1] == '/')
 		locationRoot = locationRoot.substr(0, locationRoot.size() - 1);
 	if (!reqPath.empty() && reqPath[0] == '/')
@@ -114,16 +118,10 @@ CGIHandler::CGIHandler(const Request &req, const LocationConfig &loc)
 		return;
 	}
 
-	logInfo("CGI Request: " + req.getMethod() + " " + scriptPath_);
+	LOG_INFO("CGI Request: " + req.getMethod() + " " + scriptPath_);
 
-	std::string transferEncoding = req.getHeader("Transfer-Encoding");
-	if (transferEncoding == "chunked")
-	{
-		std::istringstream rawStream(req.getBody());
-		requestBody_ = decodeChunkedBody(rawStream);
-	}
-	else
-		requestBody_ = req.getBody();
+	// A chunked body was decoded by the parser already
+	requestBody_ = req.getBody();
 
 	std::string contentType = req.getHeader("Content-Type");
 	if (req.getMethod() == "POST" && contentType.find("multipart/form-data") != std::string::npos)
@@ -181,25 +179,58 @@ std::string CGIHandler::getExtension(const std::string &filename)
 
 std::string CGIHandler::run()
 {
+	if (!start())
+		return "";
+	while (!collect())
+	{
+		struct pollfd fds[2];
+		fds[0].fd = outFd_;
+		fds[1].fd = errFd_;
+		fds[0].events = fds[1].events = POLLIN;
+		// Both pipes closed: only the exit status is left to wait for
+		poll(fds, 2, (outFd_ == -1 && errFd_ == -1) ? 10 : 100);
+	}
+	return success_ ? output_ : "";
+}
+
+bool CGIHandler::start()
+{
+	if (!errorMsg_.empty())
+		return false;
 	int inPipe[2], outPipe[2], errPipe[2];
-	if (pipe(inPipe) == -1 || pipe(outPipe) == -1 || pipe(errPipe) == -1)
+	if (pipe(inPipe) == -1)
+		return fail("Pipe creation failed");
+	if (pipe(outPipe) == -1)
 	{
-		errorMsg_ = "Pipe creation failed";
-		logError(errorMsg_);
-		return "";
+		close(inPipe[0]);
+		close(inPipe[1]);
+		return fail("Pipe creation failed");
+	}
+	if (pipe(errPipe) == -1)
+	{
+		close(inPipe[0]);
+		close(inPipe[1]);
+		close(outPipe[0]);
+		close(outPipe[1]);
+		return fail("Pipe creation failed");
 	}
 
 	pid_t pid = fork();
 	if (pid < 0)
 	{
-		errorMsg_ = "Fork failed";
-		logError(errorMsg_);
-		return "";
+		int fds[6] = {inPipe[0], inPipe[1], outPipe[0], outPipe[1], errPipe[0], errPipe[1]};
+		for (int i = 0; i < 6; ++i)
+			close(fds[i]);
+		return fail("Fork failed");
 	}
 
 	if (pid == 0)
 	{
-		dup2(inPipe[0], STDIN_FILENO);
+		// A spooled body is read by the script from its file directly
+		if (requestBody_.spansFile() && lseek(requestBody_.fd(), 0, SEEK_SET) == 0)
+			dup2(requestBody_.fd(), STDIN_FILENO);
+		else
+			dup2(inPipe[0], STDIN_FILENO);
 		dup2(outPipe[1], STDOUT_FILENO);
 		dup2(errPipe[1], STDERR_FILENO);
 
@@ -225,69 +256,94 @@ std::string CGIHandler::run()
 		logError("CGI execve failed: " + std::string(strerror(errno)));
 		_exit(1);
 	}
-	else
-	{
-		close(inPipe[0]);
-		close(outPipe[1]);
-		close(errPipe[1]);
 
-		if (!requestBody_.empty())
-			write(inPipe[1], requestBody_.c_str(), requestBody_.size());
-		close(inPipe[1]);
+	close(inPipe[0]);
+	close(outPipe[1]);
+	close(errPipe[1]);
 
-		int status;
-		int timeout = 5; // Timeout in seconds
-		pid_t result;
-		time_t startTime = time(NULL);
+	if (!requestBody_.empty() && !requestBody_.spansFile())
+		write(inPipe[1], requestBody_.data(), requestBody_.size());
+	close(inPipe[1]);
 
-		do
-		{
-			result = waitpid(pid, &status, WNOHANG);
-			if (result == 0) // Child is still running
-			{
-				if (time(NULL) - startTime >= timeout)
-				{
-					kill(pid, SIGKILL); // Terminate the child process
-					logError("CGI script timed out");
-					errorMsg_ = "CGI script timed out";
-					return "";
-				}
-				usleep(100000); // Sleep for 100ms before checking again
-			}
-		} while (result == 0);
+	pid_ = pid;
+	outFd_ = outPipe[0];
+	errFd_ = errPipe[0];
+	startTime_ = time(NULL);
+	fcntl(outFd_, F_SETFL, O_NONBLOCK);
+	fcntl(errFd_, F_SETFL, O_NONBLOCK);
+	return true;
+}
 
-		if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
-		{
-			std::stringstream output;
-			char buf[4096];
-			ssize_t n;
-			while ((n = read(outPipe[0], buf, sizeof(buf))) > 0)
-				output.write(buf, n);
-			close(outPipe[0]);
-
-			std::stringstream errOutput;
-			while ((n = read(errPipe[0], buf, sizeof(buf))) > 0)
-				errOutput.write(buf, n);
-			close(errPipe[0]);
-
-			success_ = true;
-			logInfo("CGI script executed successfully: " + scriptPath_);
-			return output.str();
-		}
-		else
+// stdout and stderr are drained while the script runs: a script writing more than the pipe
+// buffer would otherwise block forever. Output above CGI_OUTPUT_MAX is refused.
+bool CGIHandler::collect()
+{
+	if (pid_ == -1)
+		return true;
+	int *pipes[2] = {&outFd_, &errFd_};
+	for (int i = 0; i < 2; ++i)
+	{
+		while (*pipes[i] != -1 && output_.size() <= CGI_OUTPUT_MAX)
 		{
-			std::stringstream errOutput;
 			char buf[4096];
-			ssize_t n;
-			while ((n = read(errPipe[0], buf, sizeof(buf))) > 0)
-				errOutput.write(buf, n);
-			close(errPipe[0]);
-
-			errorMsg_ = "CGI script failed: " + errOutput.str();
-			logError(errorMsg_ + " for script: " + scriptPath_);
-			return "";
+			ssize_t n = read(*pipes[i], buf, sizeof(buf));
+			if (n > 0)
+			{
+				(i == 0 ? output_ : errOutput_).append(buf, n);
+				continue;
+			}
+			if (n == -1 && (errno == EAGAIN || errno == EINTR))
+				break;
+			close(*pipes[i]); // EOF
+			*pipes[i] = -1;
 		}
 	}
+	if (output_.size() > CGI_OUTPUT_MAX)
+		return fail("CGI output too large");
+	if (time(NULL) - startTime_ >= CGI_TIMEOUT)
+		return fail("CGI script timed out");
+	if (outFd_ != -1 || errFd_ != -1)
+		return false;
+
+	int status;
+	pid_t result = waitpid(pid_, &status, WNOHANG);
+	if (result == 0) // Child is still running
+		return false;
+	pid_ = -1;
+	if (result > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+	{
+		success_ = true;
+		LOG_INFO("CGI script executed successfully: " + scriptPath_);
+		return true;
+	}
+	errorMsg_ = "CGI script failed: " + errOutput_;
+	logError(errorMsg_ + " for script: " + scriptPath_);
+	return true;
+}
+
+// Kills the script if it is still running; always returns true, collect() is done then
+bool CGIHandler::fail(const std::string &error)
+{
+	if (pid_ != -1)
+	{
+		kill(pid_, SIGKILL);
+		waitpid(pid_, NULL, 0);
+		pid_ = -1;
+	}
+	if (outFd_ != -1)
+		close(outFd_);
+	if (errFd_ != -1)
+		close(errFd_);
+	outFd_ = errFd_ = -1;
+	errorMsg_ = error;
+	logError(errorMsg_);
+	return true;
+}
+
+CGIHandler::~CGIHandler()
+{
+	if (pid_ != -1 || outFd_ != -1 || errFd_ != -1)
+		fail("CGI script abandoned: " + scriptPath_);
 }
 
 bool CGIHandler::wasSuccessful() const
@@ -300,15 +356,14 @@ std::string CGIHandler::getError() const
 	return errorMsg_;
 }
 
-bool Server::handleCgiRequest(const Request &req, Response &res, const LocationConfig *loc, Socket &client)
+const std::string& CGIHandler::getOutput() const
 {
-	if (!loc || loc->getCgiPath().empty() || loc->getCgiExt().empty())
-		return false;
-	std::string ext = req.getPath().substr(req.getPath().find_last_of("."));
-	if (ext != loc->getCgiExt())
-		return false;
+	return output_;
+}
 
-	logInfo("Processing CGI request: " + req.getPath());
+// Runs the CGI script for the request and fills the response with its output
+void Server::executeCgi(const Request &req, Response &res, const LocationConfig *loc)
+{
 	CGIHandler cgi(req, *loc);
 
 	// Check if the CGI script was found
@@ -316,30 +371,143 @@ bool Server::handleCgiRequest(const Request &req, Response &res, const LocationC
 	{
 		res.setStatus(404);
 		res.setHeader("Content-Type", "text/html");
-		res.setBody("<html><body><h1>404 Not Found</h1>\n<p>The requested CGI script was not found: " + req.getPath() + "</p>\n</body></html>\n");	}
+		res.setBody("<html><body><h1>404 Not Found</h1>\n<p>The requested CGI script was not found: " + req.getPath() + "</p>\n</body></html>\n");
+		return;
+	}
+	_metrics.cgiSpawned();
+	cgi.run();
+	setCgiResult(cgi, req, res);
+}
+
+// Fills the response from a CGI script that has finished
+void Server::setCgiResult(const CGIHandler &cgi, const Request &req, Response &res)
+{
+	if (cgi.wasSuccessful())
+	{
+		LOG_INFO("CGI execution successful: " + req.getPath());
+		res.setStatus(200);
+		res.parseCgiOutput(cgi.getOutput());
+	}
 	else
 	{
-		std::string cgiOutput = cgi.run();
-		if (cgi.wasSuccessful())
+		logError("CGI execution failed: " + cgi.getError());
+		res.setStatus(500);
+		res.setHeader("Content-Type", "text/plain");
+		res.setBody("CGI execution failed: " + cgi.getError());
+	}
+}
+
+// Stores a fresh CGI response in the cache, honouring the Cache-Control header of the script
+void Server::storeCgiResponse(const std::string &key, const Response &res, const LocationConfig *loc)
+{
+	if (res.getStatus() != 200)
+	{
+		_cgiCache.abortUpdate(key);
+		return;
+	}
+	int staleTtl = loc->getCgiCacheStale();
+	int ttl = CGICache::ttlFromCacheControl(res.getHeaderValue("Cache-Control"), loc->getCgiCacheTtl(), staleTtl);
+	// Storing with no ttl drops what was cached for the key
+	if (CGICache::setsCookie(res))
+		ttl = 0;
+	_cgiCache.store(key, res, ttl, staleTtl);
+}
+
+// The request's header fields live in its connection's arena, which is gone if the connection
+// closes after the stale response: they are copied into the refresh's own arena
+void Server::queueCgiRefresh(const std::string &key, const Request &req, const LocationConfig *loc)
+{
+	CgiRefresh *refresh = new CgiRefresh;
+	refresh->key = key;
+	refresh->location = loc;
+	Request &copy = refresh->request;
+	copy.setMethod(req.getMethod());
+	copy.setPath(req.getPath());
+	copy.setProtocol(req.getProtocol());
+	copy.setBody(req.getBody());
+	copy.setMatchedLocation(loc);
+	std::map<std::string, std::string> headers = req.getHeaders();
+	for (std::map<std::string, std::string>::const_iterator it = headers.begin(); it != headers.end(); ++it)
+	{
+		const char *name = copy.getArena().copy(it->first.data(), it->first.size());
+		const char *value = copy.getArena().copy(it->second.data(), it->second.size());
+		copy.addHeader(name, it->first.size(), value, it->second.size());
+	}
+	_cgiRefreshes.push_back(refresh);
+}
+
+// Starts the due refreshes and collects the output of the running ones without waiting for
+// them: the event loop keeps serving while their scripts run
+void Server::runCgiRefreshes()
+{
+	for (size_t i = 0; i < _dueRefreshes.size();)
+	{
+		CgiRefresh *refresh = _dueRefreshes[i];
+		if (!refresh->cgi)
 		{
-			logInfo("CGI execution successful: " + req.getPath());
-			res.setStatus(200);
-			res.parseCgiOutput(cgiOutput);
+			refresh->cgi = new CGIHandler(refresh->request, *refresh->location);
+			if (refresh->cgi->start())
+				_metrics.cgiSpawned();
 		}
-		else
+		if (!refresh->cgi->collect())
+		{
+			++i;
+			continue;
+		}
+		// A script that is gone or failed leaves the stale copy in place until it expires
+		Response fresh;
+		setCgiResult(*refresh->cgi, refresh->request, fresh);
+		storeCgiResponse(refresh->key, fresh, refresh->location);
+		delete refresh;
+		_dueRefreshes.erase(_dueRefreshes.begin() + i);
+	}
+}
+
+bool Server::handleCgiRequest(const Request &req, Response &res, const LocationConfig *loc, Socket &client)
+{
+	if (!loc || loc->getCgiPath().empty() || loc->getCgiExt().empty())
+		return false;
+	// The query string is not part of the script's name
+	std::string script = req.getPath().substr(0, req.getPath().find('?'));
+	size_t dot = script.find_last_of('.');
+	if (dot == std::string::npos || script.substr(dot) != loc->getCgiExt())
+		return false;
+
+	LOG_INFO("Processing CGI request: " + req.getPath());
+
+	if (loc->getCgiCacheTtl() > 0 && req.getMethod() == "GET")
+	{
+		std::string key = CGICache::makeKey(req);
+		std::string connection = res.getHeaderValue("Connection");
+		Response cached;
+		CGICache::Status status = _cgiCache.lookup(key, cached);
+		if (status != CGICache::MISS)
 		{
-			logError("CGI execution failed: " + cgi.getError());
-			res.setStatus(500);
-			res.setHeader("Content-Type", "text/plain");
-			res.setBody("CGI execution failed: " + cgi.getError());
+			res = cached;
+			res.setHeader("Connection", connection);
+			res.setHeader("X-Cache", status == CGICache::HIT ? "HIT" : "STALE");
+			makeReadyforSend(res, client);
+			// Only this request refreshes the entry, everyone else keeps getting the stale copy.
+			// The script runs after the stale response has gone out, so the client does not wait.
+			if (status == CGICache::STALE)
+			{
+				_cgiCache.beginUpdate(key);
+				queueCgiRefresh(key, req, loc);
+			}
+			return true;
 		}
+		executeCgi(req, res, loc);
+		storeCgiResponse(key, res, loc);
+		res.setHeader("X-Cache", "MISS");
 	}
+	else
+		executeCgi(req, res, loc);
 
 	// Check if connection will close before sending response
 	bool shouldClose = (res.getHeaderValue("Connection") == "close");
 
-	// Clear buffer before potentially deleting the client
-	if (!shouldClose)
+	// Clear buffer before potentially deleting the client; on HTTP/2 it holds frames of other streams
+	if (!shouldClose && !client.getHttp2())
 	{
 		client.clearBuffer();
 	}
@@ -0,0 +1,145 @@
+#include "../include/CannedResponses.hpp"
+#include "../include/Logger.hpp"
+#include "../include/Utils.hpp"
+#include <fstream>
+#include <sstream>
+
+// The error statuses the server answers with itself; configured error_page codes come on top
+static const int CANNED_STATUSES[] = { 400, 403, 404, 405, 408, 413, 414, 429, 431, 500, 501, 502, 503, 504, 505 };
+
+static std::string builtInPage(int status)
+{
+	return "<html><body><h1>" + intToStr(status) + " " + getReasonPhrase(status) + "</h1></body></html>";
+}
+
+static std::string redirectPage(const std::string &target)
+{
+	return
+		"<html><head><title>301 Moved</title></head><body>"
+		"<h1>301 Moved Permanently</h1>"
+		"<p>Redirecting to <a href=\"" + target + "\">" + target + "</a></p></body></html>";
+}
+
+static std::string joinMethods(const std::vector<std::string> &methods)
+{
+	std::string allow;
+	for (size_t i = 0; i < methods.size(); ++i)
+	{
+		if (i > 0)
+			allow += ", ";
+		allow += methods[i];
+	}
+	return allow;
+}
+
+static bool readPage(const std::string &path, std::string &body)
+{
+	std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+	if (!file)
+		return false;
+	std::ostringstream content;
+	content << file.rdbuf();
+	body = content.str();
+	return !file.bad();
+}
+
+void CannedResponses::build(const std::vector<ServerConfig> &configs)
+{
+	size_t statuses = sizeof(CANNED_STATUSES) / sizeof(CANNED_STATUSES[0]);
+	for (size_t i = 0; i < statuses; ++i)
+		addError(NULL, CANNED_STATUSES[i]);
+	for (size_t i = 0; i < configs.size(); ++i)
+	{
+		const ServerConfig *config = &configs[i];
+		for (size_t j = 0; j < statuses; ++j)
+			addError(config, CANNED_STATUSES[j]);
+		const std::map<int, std::string> &pages = config->getErrorPages();
+		for (std::map<int, std::string>::const_iterator it = pages.begin(); it != pages.end(); ++it)
+			addError(config, it->first);
+		const std::vector<LocationConfig> &locations = config->getLocations();
+		for (size_t j = 0; j < locations.size(); ++j)
+			addLocation(locations[j]);
+	}
+	// What admitClient sends as it is, the default server of the listener answers
+	for (size_t i = 0; i < configs.size(); ++i)
+	{
+		Response res;
+		res.setHeader("Connection", "close");
+		applyError(res, &configs[i], 503);
+		_overloaded[&configs[i]] = res.toString();
+	}
+	Response res;
+	res.setHeader("Connection", "close");
+	applyError(res, NULL, 503);
+	_overloaded[NULL] = res.toString();
+}
+
+void CannedResponses::addError(const ServerConfig *config, int status)
+{
+	Page &page = _errors[std::make_pair(config, status)];
+	const std::string &errorPage = config ? config->getErrorPage(status) : std::string();
+	if (errorPage.empty() || !readPage("www/" + errorPage, page.body))
+	{
+		if (!errorPage.empty())
+			logWarning("Cannot read error page www/" + errorPage + ", using the built-in page for " + intToStr(status));
+		page.body = builtInPage(status);
+	}
+	page.length = intToStr(page.body.size());
+}
+
+void CannedResponses::addLocation(const LocationConfig &loc)
+{
+	_allows[&loc] = joinMethods(loc.getMethods());
+	if (loc.getRedirect().empty())
+		return;
+	Page &page = _redirects[&loc];
+	page.body = redirectPage(loc.getRedirect());
+	page.length = intToStr(page.body.size());
+}
+
+void CannedResponses::applyError(Response &res, const ServerConfig *config, int status) const
+{
+	res.setStatus(status);
+	res.setHeader("Content-Type", "text/html");
+	std::map<std::pair<const ServerConfig*, int>, Page>::const_iterator it = _errors.find(std::make_pair(config, status));
+	if (it == _errors.end())
+	{
+		std::string body = builtInPage(status);
+		res.setHeader("Content-Length", intToStr(body.size()));
+		res.setBody(body);
+		return;
+	}
+	res.setHeader("Content-Length", it->second.length);
+	res.setBody(it->second.body);
+}
+
+void CannedResponses::applyRedirect(Response &res, const LocationConfig *loc) const
+{
+	res.setStatus(301);
+	res.setHeader("Location", loc->getRedirect());
+	res.setHeader("Content-Type", "text/html");
+	std::map<const LocationConfig*, Page>::const_iterator it = _redirects.find(loc);
+	if (it == _redirects.end())
+	{
+		std::string body = redirectPage(loc->getRedirect());
+		res.setHeader("Content-Length", intToStr(body.size()));
+		res.setBody(body);
+		return;
+	}
+	res.setHeader("Content-Length", it->second.length);
+	res.setBody(it->second.body);
+}
+
+void CannedResponses::applyAllow(Response &res, const LocationConfig *loc) const
+{
+	std::map<const LocationConfig*, std::string>::const_iterator it = _allows.find(loc);
+	res.setHeader("Allow", it != _allows.end() ? it->second : joinMethods(loc->getMethods()));
+}
+
+const std::string &CannedResponses::getOverloaded(const ServerConfig *config) const
+{
+	std::map<const ServerConfig*, std::string>::const_iterator it = _overloaded.find(config);
+	if (it == _overloaded.end())
+		it = _overloaded.find(NULL);
+	return it->second;
+}
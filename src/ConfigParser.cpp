@@ -12,6 +12,7 @@
 #include "../include/Utils.hpp"
 
 ConfigParser::ConfigParser(const std::string &filename)
+	: _eventBackend("poll"), _diskThreads(-1)
 {
 	loadFile(filename);
 }
@@ -67,7 +68,12 @@ std::vector<ServerConfig> ConfigParser::parse()
 
 	while (std::getline(stream, line))
 	{
-		if (line.find("server") != std::string::npos)
+		std::istringstream iss(line);
+		std::string key;
+		iss >> key;
+		if (key == "events")
+			parseEvents(stream);
+		else if (line.find("server") != std::string::npos)
 		{
 			ServerConfig server;
 			server.parseBlock(stream);
@@ -79,3 +85,42 @@ std::vector<ServerConfig> ConfigParser::parse()
 	}
 	return servers;
 }
+
+// events { use poll|io_uring; disk_threads n; } selects the event loop backend and the
+// size of the disk thread pool for the whole process
+void ConfigParser::parseEvents(std::istream &stream)
+{
+	std::string line;
+	while (std::getline(stream, line))
+	{
+		if (line.find('}') != std::string::npos)
+			break;
+		std::istringstream iss(removeSemicolon(line));
+		std::string key;
+		if (!(iss >> key))
+			continue;
+		bool valid;
+		if (key == "use")
+			valid = (iss >> _eventBackend) && (_eventBackend == "poll" || _eventBackend == "io_uring");
+		else if (key == "disk_threads")
+			valid = (iss >> _diskThreads) && _diskThreads >= 0 && _diskThreads <= 256;
+		else
+			valid = false;
+		if (!valid)
+		{
+			logError("Configuration error: invalid events block line: " + line);
+			throw std::runtime_error("Invalid events directive: " + line);
+		}
+	}
+}
+
+const std::string& ConfigParser::getEventBackend() const
+{
+	return _eventBackend;
+}
+
+// -1 unless the configuration sets it
+int ConfigParser::getDiskThreads() const
+{
+	return _diskThreads;
+}
@@ -0,0 +1,219 @@
+#include "../include/DirectoryCache.hpp"
+#include "../include/Utils.hpp"
+#include "../include/Logger.hpp"
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#ifdef __linux__
+# include <sys/inotify.h>
+#endif
+
+#ifdef __linux__
+static const unsigned int WATCH_MASK = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+	| IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+#endif
+
+static bool entryLess(const DirectoryCache::Entry &a, const DirectoryCache::Entry &b)
+{
+	return a.name < b.name;
+}
+
+static time_t directoryMtime(const std::string &path)
+{
+	struct stat info;
+	if (stat(path.c_str(), &info) != 0)
+		return -1;
+	return info.st_mtime;
+}
+
+DirectoryCache::DirectoryCache(size_t maxDirectories)
+	: _inotifyFd(-1), _maxDirectories(maxDirectories), _clock(0), _hits(0), _misses(0)
+{
+#ifdef __linux__
+	_inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (_inotifyFd == -1)
+		logWarning("inotify unavailable, autoindex cache falls back to mtime checks");
+#endif
+}
+
+DirectoryCache::~DirectoryCache()
+{
+	if (_inotifyFd != -1)
+		close(_inotifyFd);
+}
+
+DirectoryCache::Listing *DirectoryCache::lookup(const std::string &path)
+{
+	processEvents();
+	std::map<std::string, Slot>::iterator it = _slots.find(path);
+	if (it != _slots.end() && !it->second.stale
+		&& (it->second.watch != -1 || directoryMtime(path) == it->second.mtime))
+	{
+		++_hits;
+		it->second.lastUsed = ++_clock;
+		return &it->second.listing;
+	}
+	++_misses;
+
+	if (it == _slots.end())
+	{
+		if (_slots.size() >= _maxDirectories)
+			evictOldest();
+		Slot empty;
+		empty.watch = -1;
+		empty.mtime = -1;
+		empty.stale = true;
+		empty.lastUsed = 0;
+		it = _slots.insert(std::make_pair(path, empty)).first;
+	}
+	Slot &slot = it->second;
+#ifdef __linux__
+	// Watching before reading, so a change during readDirectory marks the fresh listing stale
+	if (slot.watch == -1 && _inotifyFd != -1)
+	{
+		slot.watch = inotify_add_watch(_inotifyFd, path.c_str(), WATCH_MASK);
+		if (slot.watch != -1)
+			_watches[slot.watch].push_back(path);
+	}
+#endif
+	slot.mtime = directoryMtime(path);
+	slot.listing.pages.clear();
+	if (!readDirectory(path, slot.listing.entries))
+	{
+		remove(it);
+		return NULL;
+	}
+	slot.stale = false;
+	slot.lastUsed = ++_clock;
+	return &slot.listing;
+}
+
+// Marks listings stale for the events queued since the last lookup
+void DirectoryCache::processEvents()
+{
+#ifdef __linux__
+	if (_inotifyFd == -1)
+		return;
+	long buffer[1024]; // aligned for struct inotify_event
+	ssize_t bytes;
+	while ((bytes = read(_inotifyFd, buffer, sizeof(buffer))) > 0)
+	{
+		const char *pos = reinterpret_cast<const char *>(buffer);
+		const char *end = pos + bytes;
+		while (pos < end)
+		{
+			const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(pos);
+			pos += sizeof(struct inotify_event) + event->len;
+			if (event->mask & IN_Q_OVERFLOW)
+			{
+				for (std::map<std::string, Slot>::iterator it = _slots.begin(); it != _slots.end(); ++it)
+					it->second.stale = true;
+				continue;
+			}
+			std::map<int, std::vector<std::string> >::iterator watch = _watches.find(event->wd);
+			if (watch == _watches.end())
+				continue;
+			std::vector<std::string> paths = watch->second;
+			// The kernel dropped the watch (directory deleted or unmounted)
+			if (event->mask & IN_IGNORED)
+				_watches.erase(watch);
+			for (size_t i = 0; i < paths.size(); ++i)
+			{
+				std::map<std::string, Slot>::iterator it = _slots.find(paths[i]);
+				if (it == _slots.end())
+					continue;
+				if (event->mask & IN_IGNORED)
+				{
+					it->second.watch = -1;
+					remove(it);
+				}
+				else
+					it->second.stale = true;
+			}
+		}
+	}
+#endif
+}
+
+void DirectoryCache::evictOldest()
+{
+	std::map<std::string, Slot>::iterator oldest = _slots.begin();
+	for (std::map<std::string, Slot>::iterator it = _slots.begin(); it != _slots.end(); ++it)
+	{
+		if (it->second.lastUsed < oldest->second.lastUsed)
+			oldest = it;
+	}
+	if (oldest != _slots.end())
+		remove(oldest);
+}
+
+void DirectoryCache::remove(std::map<std::string, Slot>::iterator it)
+{
+#ifdef __linux__
+	std::map<int, std::vector<std::string> >::iterator watch = _watches.find(it->second.watch);
+	if (watch != _watches.end())
+	{
+		std::vector<std::string> &paths = watch->second;
+		std::vector<std::string>::iterator path = std::find(paths.begin(), paths.end(), it->first);
+		if (path != paths.end())
+			paths.erase(path);
+		// The last path of the directory takes the watch with it
+		if (paths.empty())
+		{
+			inotify_rm_watch(_inotifyFd, it->second.watch);
+			_watches.erase(watch);
+		}
+	}
+#endif
+	_slots.erase(it);
+}
+
+// d_type tells directories apart without a stat() per entry; only file systems that do
+// not fill it in (DT_UNKNOWN) and symlinks need one
+bool DirectoryCache::readDirectory(const std::string &path, std::vector<Entry> &entries)
+{
+	DIR *dir = opendir(path.c_str());
+	if (!dir)
+	{
+		logError("Failed to open directory: " + path + " - " + std::string(strerror(errno)));
+		return false;
+	}
+	entries.clear();
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		const char *name = entry->d_name;
+		// Skip current and parent directory entries
+		if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+			continue;
+		Entry item;
+		item.name = name;
+#ifdef DT_DIR
+		if (entry->d_type == DT_DIR)
+			item.isDirectory = true;
+		else if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK)
+			item.isDirectory = isDirectory(path + "/" + item.name);
+		else
+			item.isDirectory = false;
+#else
+		item.isDirectory = isDirectory(path + "/" + item.name);
+#endif
+		entries.push_back(item);
+	}
+	closedir(dir);
+	std::sort(entries.begin(), entries.end(), entryLess);
+	return true;
+}
+
+size_t DirectoryCache::getHits() const
+{
+	return _hits;
+}
+
+size_t DirectoryCache::getMisses() const
+{
+	return _misses;
+}
@@ -0,0 +1,323 @@
+#include "../include/DiskPool.hpp"
+#include "../include/Logger.hpp"
+#include "../include/Utils.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <csignal>
+#include <stdexcept>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+# include <sys/eventfd.h>
+#endif
+
+DiskJob::DiskJob(Op op)
+	: id(0), op(op), fd(-1), limit(0), size(0), directory(false), error(0)
+{
+}
+
+DiskPool::DiskPool(int threads)
+	: _threads(threads), _started(false), _stopping(false), _nextId(0)
+{
+#ifdef __linux__
+	_notify[0] = _notify[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (_notify[0] == -1)
+#else
+	if (pipe(_notify) == 0)
+	{
+		for (int i = 0; i < 2; ++i)
+		{
+			fcntl(_notify[i], F_SETFL, fcntl(_notify[i], F_GETFL) | O_NONBLOCK);
+			fcntl(_notify[i], F_SETFD, FD_CLOEXEC);
+		}
+	}
+	else
+#endif
+	{
+		std::string error = "Cannot create the disk pool notification fd: " + std::string(std::strerror(errno));
+		logError(error);
+		throw std::runtime_error(error);
+	}
+	pthread_mutex_init(&_lock, NULL);
+	pthread_cond_init(&_wakeup, NULL);
+}
+
+// Jobs still queued are dropped; the fds of finished OPEN jobs are closed, READ jobs only
+// borrowed theirs
+DiskPool::~DiskPool()
+{
+	stop();
+	for (size_t i = 0; i < _completed.size(); ++i)
+	{
+		if (_completed[i]->op == DiskJob::OPEN && _completed[i]->fd != -1)
+			close(_completed[i]->fd);
+		delete _completed[i];
+	}
+	for (size_t i = 0; i < _queue.size(); ++i)
+		delete _queue[i];
+	close(_notify[0]);
+	if (_notify[1] != _notify[0])
+		close(_notify[1]);
+	pthread_cond_destroy(&_wakeup);
+	pthread_mutex_destroy(&_lock);
+}
+
+void DiskPool::setThreads(int threads)
+{
+	if (!_started)
+		_threads = threads;
+}
+
+int DiskPool::getNotifyFd() const
+{
+	return _notify[0];
+}
+
+// Lets the workers finish the job they are running and waits for them; queued jobs stay
+// queued. Must be called before the fds the jobs use are closed.
+void DiskPool::stop()
+{
+	pthread_mutex_lock(&_lock);
+	_stopping = true;
+	pthread_cond_broadcast(&_wakeup);
+	pthread_mutex_unlock(&_lock);
+	for (size_t i = 0; i < _workers.size(); ++i)
+		pthread_join(_workers[i], NULL);
+	_workers.clear();
+}
+
+// Workers are started with the first job, with all signals blocked so that SIGINT and
+// SIGTERM interrupt the event loop's wait
+void DiskPool::start()
+{
+	_started = true;
+	sigset_t all, previous;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &previous);
+	for (int i = 0; i < _threads; ++i)
+	{
+		pthread_t worker;
+		if (pthread_create(&worker, NULL, &DiskPool::workerMain, this) != 0)
+			break;
+		_workers.push_back(worker);
+	}
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+	if (static_cast<int>(_workers.size()) < _threads)
+		LOG_WARNING("Started " + intToStr(_workers.size()) + " of " + intToStr(_threads) + " disk threads");
+	LOG_DEBUG("Disk pool started with " + intToStr(_workers.size()) + " threads");
+}
+
+unsigned long DiskPool::submit(DiskJob *job)
+{
+	job->id = ++_nextId;
+	if (!_started)
+		start();
+	if (_workers.empty())
+	{
+		run(*job);
+		complete(job);
+		return job->id;
+	}
+	pthread_mutex_lock(&_lock);
+	_queue.push_back(job);
+	pthread_cond_signal(&_wakeup);
+	pthread_mutex_unlock(&_lock);
+	return job->id;
+}
+
+// The loop is only woken for the first job of a batch; it takes all of them at once
+void DiskPool::complete(DiskJob *job)
+{
+	pthread_mutex_lock(&_lock);
+	bool wake = _completed.empty();
+	_completed.push_back(job);
+	pthread_mutex_unlock(&_lock);
+	if (!wake)
+		return;
+	uint64_t one = 1;
+	ssize_t ret;
+#ifdef __linux__
+	ret = write(_notify[1], &one, sizeof(one));
+#else
+	ret = write(_notify[1], &one, 1);
+#endif
+	(void)ret; // EAGAIN: a wakeup is pending anyway
+}
+
+void DiskPool::acknowledge()
+{
+	uint64_t count;
+	while (read(_notify[0], &count, sizeof(count)) > 0)
+		;
+}
+
+DiskJob *DiskPool::takeCompleted()
+{
+	pthread_mutex_lock(&_lock);
+	DiskJob *job = NULL;
+	if (!_completed.empty())
+	{
+		job = _completed.front();
+		_completed.pop_front();
+	}
+	pthread_mutex_unlock(&_lock);
+	return job;
+}
+
+void *DiskPool::workerMain(void *arg)
+{
+	DiskPool &pool = *static_cast<DiskPool *>(arg);
+	for (;;)
+	{
+		pthread_mutex_lock(&pool._lock);
+		while (pool._queue.empty() && !pool._stopping)
+			pthread_cond_wait(&pool._wakeup, &pool._lock);
+		if (pool._stopping)
+		{
+			pthread_mutex_unlock(&pool._lock);
+			return NULL;
+		}
+		DiskJob *job = pool._queue.front();
+		pool._queue.pop_front();
+		pthread_mutex_unlock(&pool._lock);
+		run(*job);
+		pool.complete(job);
+	}
+}
+
+// Reads from fd until size bytes are in data or the file ends; false with errno on error
+static bool readInto(int fd, std::string &data, size_t size)
+{
+	data.resize(size);
+	size_t done = 0;
+	while (done < size)
+	{
+		ssize_t bytes = read(fd, &data[done], size - done);
+		if (bytes == -1 && errno == EINTR)
+			continue;
+		if (bytes == -1)
+			return false;
+		if (bytes == 0)
+			break;
+		done += bytes;
+	}
+	data.resize(done);
+	return true;
+}
+
+// Gives a spooled body (an O_TMPFILE file) the name path: linkat() does not replace an
+// existing file, so it is linked under a name of its own and renamed over path. False if
+// it cannot be linked, a file without a name of its own has to be written out then.
+static bool linkSpooled(DiskJob &job)
+{
+	std::string source = "/proc/self/fd/" + intToStr(job.body.fd());
+	std::string temporary = job.path + ".spool" + intToStr(job.id);
+	if (linkat(AT_FDCWD, source.c_str(), AT_FDCWD, temporary.c_str(), AT_SYMLINK_FOLLOW) == -1)
+		return false;
+	if (std::rename(temporary.c_str(), job.path.c_str()) == -1)
+	{
+		job.error = errno;
+		unlink(temporary.c_str());
+	}
+	return true;
+}
+
+// A slice of a spooled body is copied from file to file inside the kernel. Returns how
+// much was copied; the rest is written from the mapping (copy_file_range may not work
+// across filesystems, or not be there at all).
+static size_t copySpooled(const Body &body, int fd)
+{
+	size_t done = 0;
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+	off64_t offset = body.offset();
+	while (done < body.size())
+	{
+		ssize_t bytes = copy_file_range(body.fd(), &offset, fd, NULL, body.size() - done, 0);
+		if (bytes == -1 && errno == EINTR)
+			continue;
+		if (bytes <= 0)
+			break;
+		done += bytes;
+	}
+#else
+	(void)body;
+	(void)fd;
+#endif
+	return done;
+}
+
+static void openFile(DiskJob &job)
+{
+	struct stat info;
+	if (stat(job.path.c_str(), &info) == -1)
+	{
+		job.error = errno;
+		return;
+	}
+	if (S_ISDIR(info.st_mode))
+	{
+		job.directory = true;
+		return;
+	}
+	job.fd = open(job.path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (job.fd == -1)
+	{
+		job.error = errno;
+		return;
+	}
+	job.size = info.st_size;
+	if (job.size >= job.limit)
+		return;
+	if (!readInto(job.fd, job.data, job.size))
+		job.error = errno;
+	close(job.fd);
+	job.fd = -1;
+}
+
+// Runs on a worker thread: no logging, no state shared with the event loop
+void DiskPool::run(DiskJob &job)
+{
+	switch (job.op)
+	{
+		case DiskJob::OPEN:
+			openFile(job);
+			return;
+		case DiskJob::READ:
+			if (!readInto(job.fd, job.data, job.limit))
+				job.error = errno;
+			return;
+		case DiskJob::WRITE:
+		{
+			if (job.body.spansFile() && linkSpooled(job))
+				return;
+			int fd = open(job.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+			if (fd == -1)
+			{
+				job.error = errno;
+				return;
+			}
+			size_t done = job.body.fd() != -1 ? copySpooled(job.body, fd) : 0;
+			while (done < job.body.size())
+			{
+				ssize_t bytes = write(fd, job.body.data() + done, job.body.size() - done);
+				if (bytes == -1 && errno == EINTR)
+					continue;
+				if (bytes == -1)
+				{
+					job.error = errno;
+					break;
+				}
+				done += bytes;
+			}
+			close(fd);
+			return;
+		}
+		case DiskJob::REMOVE:
+			if (std::remove(job.path.c_str()) == -1)
+				job.error = errno;
+			return;
+	}
+}
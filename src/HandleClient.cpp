@@ -1,10 +1,17 @@
 #include "../include/Server.hpp"
 #include "../include/Socket.hpp"
 #include "../include/Request.hpp"
+#include "../include/BufferPool.hpp"
+#include "../include/Http2.hpp"
+#include "../include/Scan.hpp"
 #include "../include/Webserver.hpp"
 #include "../include/CGIHandler.hpp"
 #include "../include/Logger.hpp"
 #include "../include/Utils.hpp"
+#include <fcntl.h>
+#include <cerrno>
+#include <cctype>
+#include <cstdlib>
 
 void matchLocation(Request &req, const std::vector<LocationConfig> &locations)
 {
@@ -16,7 +23,8 @@ void matchLocation(Request &req, const std::vector<LocationConfig> &locations)
 		const std::string &locPath = locations[i].getPath();
 
 		if (req.getPath().compare(0, locPath.size(), locPath) == 0 &&
-			(req.getPath().size() == locPath.size() || req.getPath()[locPath.size()] == '/'))
+			(req.getPath().size() == locPath.size() || req.getPath()[locPath.size()] == '/' ||
+			 req.getPath()[locPath.size()] == '?'))
 
 		{
 			if (locPath.size() > longestMatch)
@@ -42,63 +50,382 @@ void matchLocation(Request &req, const std::vector<LocationConfig> &locations)
 	req.setMatchedLocation(bestMatch);
 }
 
-// after removing a client or sending a response the indices in _pollFds may no longer match the map in _sockets
 void Server::deleteClient(Socket &client)
 {
-	logInfo("Closing connection with client " + intToStr(client.getFd()));
-	close(client.getFd());
-	for (size_t i = 0; i < _pollFds.size(); ++i)
+	int fd = client.getFd();
+	LOG_INFO("Closing connection with client " + intToStr(fd));
+	client.releaseTls();
+	close(fd);
+	// Jobs still with the disk pool are dropped when they come back; a read of the body
+	// file closes the file then
+	for (std::map<unsigned long, DiskWait>::iterator it = _diskWaits.begin(); it != _diskWaits.end();)
 	{
-		if (_pollFds[i].fd == client.getFd())
+		if (it->second.client == fd)
+			_diskWaits.erase(it++);
+		else
+			++it;
+	}
+	if (client.isReadingBody())
+		client.detachBody();
+	client.closeBody();
+	client.closeSpool();
+	client.releaseArena();
+	client.releaseHttp2();
+	if (client.getType() == Socket::CLIENT)
+		_rateLimiter.connectionClosed(client.getClientAddr());
+	removePollFd(fd);
+	// client is destroyed here
+	_sockets.erase(fd);
+	_metrics.connectionClosed();
+}
+
+// Limits from large_client_header_buffers: 414 if the request line does not fit into
+// one buffer, 431 if a header line does not or the whole header exceeds all buffers
+static int headerSizeError(const std::string &request, size_t headerEnd, const ServerConfig &config)
+{
+	size_t bufferSize = config.getHeaderBufferSize();
+	size_t headerSize = (headerEnd == std::string::npos) ? request.size() : headerEnd;
+	size_t lineEnd = std::min(findCrlf(request, 0, headerSize), headerSize);
+	if (lineEnd > bufferSize)
+		return 414;
+	if (headerSize > bufferSize * config.getHeaderBufferCount())
+		return 431;
+	for (size_t start = lineEnd + 2; start < headerSize; start = lineEnd + 2)
+	{
+		lineEnd = std::min(findCrlf(request, start, headerSize), headerSize);
+		if (lineEnd - start > bufferSize)
+			return 431;
+	}
+	return 0;
+}
+
+// Walks the chunk size lines of a chunked body starting at pos; returns where the request
+// ends once the last chunk and the (possibly empty) trailer section have arrived, npos before.
+// A size line without hex digits, or with a size no body of up to limit bytes can have, sets
+// malformed: the size is checked before pos moves past it, so it can neither wrap around nor
+// keep the connection waiting for a chunk it will never accept.
+static size_t chunkedBodyEnd(const std::string &request, size_t pos, size_t limit, bool &malformed)
+{
+	malformed = false;
+	while (true)
+	{
+		size_t lineEnd = findCrlf(request, pos);
+		if (lineEnd == std::string::npos)
+			return std::string::npos;
+		const char *start = request.c_str() + pos;
+		char *end;
+		errno = 0;
+		unsigned long size = std::strtoul(start, &end, 16);
+		// Only chunk extensions may follow the size
+		while (*end == ' ' || *end == '\t')
+			++end;
+		if (!std::isxdigit(static_cast<unsigned char>(*start)) || errno == ERANGE
+			|| (end != request.c_str() + lineEnd && *end != ';') || size > limit)
+		{
+			malformed = true;
+			return std::string::npos;
+		}
+		if (size == 0)
 		{
-			_pollFds.erase(_pollFds.begin() + i);
-			break;
+			size_t trailerEnd = findHeaderEnd(request, lineEnd);
+			return trailerEnd == std::string::npos ? trailerEnd : trailerEnd + 4;
 		}
+		size_t available = request.size() - (lineEnd + 2);
+		if (size >= available || available - size < 2)
+			return std::string::npos;
+		pos = lineEnd + 2 + size + 2;
+	}
+}
+
+// Resolves the virtual host from the Host header, falling back to the listener's default server
+ServerConfig* Server::resolveServerConfig(const Socket& client, const std::string& host)
+{
+	// Getting the first serverConf that matches ip, port and name
+	ServerConfig *serverConfig = findExactServerConfig(client.getIPv4(), client.getPort(), host);
+	// If name does not match: Getting the first serverConf that matches ip and port
+	if (!serverConfig)
+		serverConfig = findServerConfig(client.getIPv4(), client.getPort());
+	// If still no match, something went wrong
+	if (!serverConfig)
+		throw std::runtime_error("Unexpected: ServerConfig not found.");
+	return serverConfig;
+}
+
+// First look at a request as soon as its header is complete: resolves the virtual host and
+// location, rejects a declared body above client_max_body_size with 413 before any of it is
+// read, answers "Expect: 100-continue" and starts spooling a body above
+// client_body_buffer_size to a file. Returns false if the request was rejected.
+bool Server::inspectRequestHeader(Socket& client, size_t headerSize)
+{
+	Arena &arena = client.getArena();
+	arena.reset();
+	Request req(&arena);
+	Response res;
+	// Malformed headers are answered by the full parse once the request is complete
+	if (!parseRequestHead(client.getBuffer().data(), client.getBuffer().size(), req, res))
+		return true;
+
+	ServerConfig *serverConfig = resolveServerConfig(client, req.getHeader("Host"));
+	req.setServerConfig(serverConfig);
+	matchLocation(req, serverConfig->getLocations());
+	client.setRequestConfig(serverConfig, req.getMatchedLocation());
+
+	size_t limit = req.getClientMaxBodySize();
+	std::string contentLength = req.getHeader("Content-Length");
+	bool chunked = req.getHeader("Transfer-Encoding") == "chunked";
+	if ((!chunked && std::strtoul(contentLength.c_str(), NULL, 10) > limit)
+		|| (chunked && client.getBuffer().size() - headerSize > limit))
+	{
+		LOG_INFO("Request body from client " + intToStr(client.getFd()) + " exceeds client_max_body_size");
+		rejectRequest(client, 413);
+		return false;
 	}
-	_sockets.erase(client.getFd());
+
+	std::string expect = req.getHeader("Expect");
+	std::transform(expect.begin(), expect.end(), expect.begin(), ::tolower);
+	if (expect == "100-continue" && req.getProtocol() == "HTTP/1.1" && client.getBuffer().size() == headerSize)
+	{
+		static const char continueResponse[] = "HTTP/1.1 100 Continue\r\n\r\n";
+		client.transmit(continueResponse, sizeof(continueResponse) - 1);
+		_metrics.syscalls(1);
+	}
+
+	// A body of known length up to client_body_buffer_size gets its room in the buffer at
+	// once instead of being copied as the buffer grows; a larger one is spooled. Chunked
+	// bodies are decoded in memory and stay there.
+	size_t length = chunked ? 0 : std::strtoul(contentLength.c_str(), NULL, 10);
+	if (length <= serverConfig->getClientBodyBufferSize())
+		client.reserveBuffer(headerSize + length);
+	else if (!client.startSpool(serverConfig->getRoot(), length))
+	{
+		logError("Cannot create a temporary file for a request body in " + serverConfig->getRoot()
+			+ ": " + std::string(std::strerror(errno)));
+		rejectRequest(client, 500);
+		return false;
+	}
+	return true;
+}
+
+// Data for a readable client: what the io_uring backend has received already, or one
+// receive into a pooled slab. Handed back with releaseReceived() once it has been copied.
+ssize_t Server::receiveFrom(Socket &client, const char *&data)
+{
+	ssize_t bytes;
+	if (_ring && _ring->takeReceived(client.getFd(), data, bytes))
+		return bytes;
+	char *slab = BufferPool::acquire();
+	data = slab;
+	_metrics.syscalls(1);
+	return client.receive(slab, BufferPool::SLAB_SIZE);
+}
+
+void Server::releaseReceived(const char *data)
+{
+	if (_ring && _ring->ownsBuffer(data))
+		_ring->releaseBuffer(data);
+	else if (data)
+		BufferPool::release(const_cast<char *>(data));
+}
+
+// The rest of a spooled body can go from the socket to its file through a pipe, without
+// passing through user space: not over TLS, and not with io_uring, which receives itself
+bool Server::canSplice(const Socket &client)
+{
+#ifdef SPLICE_F_MOVE
+	if (!client.isSpooling() || client.getTls() || _ring)
+		return false;
+	if (_splicePipe[0] == -1)
+	{
+		if (pipe(_splicePipe) == -1)
+			return false;
+		fcntl(_splicePipe[0], F_SETFD, FD_CLOEXEC);
+		fcntl(_splicePipe[1], F_SETFD, FD_CLOEXEC);
+		// Fewer, larger splices; the default size is kept if the limit is lower
+		fcntl(_splicePipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+	}
+	return true;
+#else
+	(void)client;
+	return false;
+#endif
+}
+
+// Like receiveFrom(), for the bytes moved into the spool file
+ssize_t Server::spliceFrom(Socket &client)
+{
+	ssize_t bytes = client.spliceBody(_splicePipe);
+	_metrics.syscalls(bytes > 0 ? 2 : 1);
+	// A failed write to the file leaves bytes in the pipe, which is opened again next time
+	if (bytes == -1 && errno != EAGAIN)
+	{
+		close(_splicePipe[0]);
+		close(_splicePipe[1]);
+		_splicePipe[0] = _splicePipe[1] = -1;
+	}
+	return bytes;
 }
 
 void Server::handleClient(Socket &client)
 {
-	char buffer[30000];
-	ssize_t bytes = recv(client.getFd(), buffer, sizeof(buffer) - 1, 0);
+	// Only what was received is kept in the connection's buffer
+	const char *data = NULL;
+	bool spliced = canSplice(client);
+	ssize_t bytes = spliced ? spliceFrom(client) : receiveFrom(client, data);
+	// Only TLS can come back without data: the socket was readable, but not a whole record
+	if (bytes == -1 && errno == EAGAIN)
+	{
+		releaseReceived(data);
+		return;
+	}
 	if (bytes <= 0)
 	{
+		releaseReceived(data);
 		deleteClient(client);
-		;
 		return;
 	}
-	buffer[bytes] = '\0';
-	client.appendToBuffer(buffer, bytes);
-	std::string requestString = client.getBuffer();
-	size_t headerEnd = requestString.find("\r\n\r\n");
-	if (headerEnd != std::string::npos)
+	if (!spliced)
+		client.appendToBuffer(data, bytes);
+	releaseReceived(data);
+	_metrics.bytesReceived(bytes);
+	handleReceived(client);
+}
+
+// Parses what the buffer holds so far; called on every read, and when a request that was
+// pipelined behind the previous one is put back into the buffer
+void Server::handleReceived(Socket &client)
+{
+	AccessRecord &record = client.getRecord();
+	if (record.start == 0)
+	{
+		record.start = monotonicTime();
+		// Requests rejected before the Host header is known are logged by the default server
+		record.log = findAccessLog(findServerConfig(client.getIPv4(), client.getPort()));
+	}
+	const std::string &requestString = client.getBuffer();
+	// A connection that opens with the HTTP/2 preface speaks HTTP/2 from the start (prior knowledge)
+	if (client.getNbrRequests() == 0 && record.headersDone == 0)
+	{
+		int preface = Http2Session::matchPreface(requestString);
+		if (preface == 0)
+			return;
+		if (preface == 1)
+		{
+			startHttp2(client);
+			return;
+		}
+	}
+	size_t headerEnd = findHeaderEnd(requestString);
+	// The header is checked once when it is complete, or on every read as long as it may be growing past the limits
+	const ServerConfig *defaultConfig = findServerConfig(client.getIPv4(), client.getPort());
+	if (record.headersDone == 0 && defaultConfig
+		&& (headerEnd != std::string::npos || requestString.size() > defaultConfig->getHeaderBufferSize()))
+	{
+		int status = headerSizeError(requestString, headerEnd, *defaultConfig);
+		if (status)
+		{
+			LOG_INFO("Request header from client " + intToStr(client.getFd()) + " is too large");
+			rejectRequest(client, status);
+			return;
+		}
+	}
+	// Waiting for the rest of the header; client_header_timeout limits how long
+	if (headerEnd == std::string::npos)
+		return;
+	bool chunked = findSubstring(requestString, "Transfer-Encoding: chunked", 0, headerEnd) != std::string::npos;
+	if (record.headersDone == 0)
+	{
+		record.headersDone = monotonicTime();
+		if (!inspectRequestHeader(client, headerEnd + 4))
+			return;
+	}
+	size_t requestLength = headerEnd + 4;
+	if (chunked)
 	{
-		size_t contentLengthPos = requestString.find("Content-Length:");
-		if (contentLengthPos != std::string::npos)
+		// The size of a chunked body is not known up front, so it is limited while it arrives
+		size_t limit = std::string::npos;
+		if (client.getServerConfig())
+		{
+			Request limits;
+			limits.setServerConfig(client.getServerConfig());
+			limits.setMatchedLocation(client.getLocation());
+			limit = limits.getClientMaxBodySize();
+		}
+		bool malformed;
+		requestLength = chunkedBodyEnd(requestString, headerEnd + 4, limit, malformed);
+		if (malformed)
 		{
-			size_t lenStart = contentLengthPos + 15;
-			while (lenStart < requestString.size() && (requestString[lenStart] == ' ' || requestString[lenStart] == '\t'))
-				++lenStart;
-			size_t lenEnd = requestString.find("\r\n", lenStart);
-			int contentLength = atoi(requestString.substr(lenStart, lenEnd - lenStart).c_str());
-			size_t totalExpected = headerEnd + 4 + contentLength;
-			if (requestString.size() < totalExpected)
-				return;
+			LOG_INFO("Malformed chunk size from client " + intToStr(client.getFd()));
+			rejectRequest(client, 400);
+			return;
+		}
+		// Until the body is complete, all that follows the head is part of it
+		if (requestLength == std::string::npos && requestString.size() - headerEnd - 4 > limit)
+		{
+			LOG_INFO("Request body from client " + intToStr(client.getFd()) + " exceeds client_max_body_size");
+			rejectRequest(client, 413);
+			return;
 		}
+		if (requestLength == std::string::npos)
+			return;
+	}
+	if (client.isSpooling() && !client.spoolBody(headerEnd + 4))
+	{
+		logError("Cannot write a request body to its temporary file: " + std::string(std::strerror(errno)));
+		rejectRequest(client, 500);
+		return;
 	}
-	Request req;
+	size_t contentLengthPos = findSubstring(requestString, "Content-Length:", 0, headerEnd);
+	if (contentLengthPos != std::string::npos)
+	{
+		size_t lenStart = contentLengthPos + 15;
+		while (lenStart < requestString.size() && (requestString[lenStart] == ' ' || requestString[lenStart] == '\t'))
+			++lenStart;
+		size_t lenEnd = findCrlf(requestString, lenStart);
+		int contentLength = atoi(requestString.substr(lenStart, lenEnd - lenStart).c_str());
+		size_t totalExpected = headerEnd + 4 + contentLength;
+		if (requestString.size() + client.getSpooled() < totalExpected)
+			return;
+		requestLength = totalExpected - client.getSpooled();
+	}
+	// Everything allocated from the arena for the previous request is released here
+	Arena &arena = client.getArena();
+	arena.reset();
+	Request req(&arena);
 	Response res;
-	parseHttpRequest(requestString, req, res);
-	if (res.getStatus() == 400)
+	req.setServerConfig(client.getServerConfig());
+	req.setMatchedLocation(client.getLocation());
+	// The request is complete: its body becomes a slice of the received bytes, which are
+	// moved out of the socket's buffer rather than copied, or the file it was spooled to.
+	// What follows it is the next request of a client that pipelines.
+	std::string received;
+	client.takeBuffer(received, requestLength);
+	parseHttpRequest(Body::adopt(received), req, res, client.takeSpool());
+	record.method = req.getMethod();
+	record.path = req.getPath();
+	record.protocol = req.getProtocol();
+	record.referer = req.getHeader("Referer");
+	record.userAgent = req.getHeader("User-Agent");
+	if (res.getStatus() == 400 || res.getStatus() == 413)
 	{
 		res.setHeader("Connection", "close");
 		makeReadyforSend(res, client);
 		return;
 	}
+	// The upgraded request is answered over HTTP/2, as stream 1
+	if (isHttp2Upgrade(req))
+		upgradeToHttp2(client, req);
+	processRequest(req, res, client);
+}
+
+// Everything after parsing, shared by HTTP/1.1 and the streams of HTTP/2 connections:
+// resolves the virtual host and location and runs the handler. The response is always
+// passed to makeReadyforSend.
+void Server::processRequest(Request &req, Response &res, Socket &client)
+{
+	AccessRecord &record = client.getRecord();
 
 	// Checking if the request contains a "Host" header and returning 'Bad Request' if not
-	if (req.getHeaders().count("Host") == 0)
+	if (!req.hasHeader("Host"))
 	{
 		res.setStatus(400);
 		res.setHeader("Connection", "close");
@@ -108,24 +435,18 @@ void Server::handleClient(Socket &client)
 
 	// Getting server config based on the "Host" header
 	{
-		// Getting the first serverConf that matches ip, port and name
-		ServerConfig *serverConfig = findExactServerConfig(client.getIPv4(), client.getPort(), req.getHeader("Host"));
-		// If name does not match: Getting the first serverConf that matches ip and port
-		if (!serverConfig)
-			serverConfig = findServerConfig(client.getIPv4(), client.getPort());
-		// If still no match, something went wrong
-		if (!serverConfig)
-			throw std::runtime_error("Unexpected: ServerConfig not found.");
+		ServerConfig *serverConfig = resolveServerConfig(client, req.getHeader("Host"));
 		req.setServerConfig(serverConfig);
+		record.vhost = serverConfig->getServerName();
+		record.log = findAccessLog(serverConfig);
 	}
 
 	client.increaseNbrRequests();
 
-	std::map<std::string, std::string> headers = req.getHeaders();
 	std::string connectionHeader;
 
-	if (headers.count("Connection"))
-		connectionHeader = headers["Connection"];
+	if (req.hasHeader("Connection"))
+		connectionHeader = req.getHeader("Connection");
 	else
 		connectionHeader = (req.getProtocol() == "HTTP/1.1") ? "keep-alive" : "close";
 
@@ -134,7 +455,7 @@ void Server::handleClient(Socket &client)
 
 	res.setHeader("Connection", connectionHeader);
 
-	if (req.getProtocol() != "HTTP/1.1")
+	if (req.getProtocol() != "HTTP/1.1" && !client.getHttp2())
 	{
 		res.setStatus(505);
 		res.setHeader("Connection", "close");
@@ -147,38 +468,41 @@ void Server::handleClient(Socket &client)
 	matchLocation(req, locations);
 
 	const LocationConfig *loc = req.getMatchedLocation();
-	if (loc)
+	if (checkLimits(req, res, client))
 	{
-		if (req.getPath() == "/")
-			req.setPath(req.getServerConfig()->getIndex());
-		if (!loc->getRedirect().empty())
-		{
-			res.setStatus(301);
-			res.setHeader("Location", loc->getRedirect());
-
-			std::string html =
-				"<html><head><title>301 Moved</title></head><body>"
-				"<h1>301 Moved Permanently</h1>"
-				"<p>Redirecting to <a href=\"" +
-				loc->getRedirect() + "\">" +
-				loc->getRedirect() + "</a></p></body></html>";
-
-			res.setBody(html);
-			std::ostringstream oss;
-			oss << html.size();
-			res.setHeader("Content-Length", oss.str());
-			makeReadyforSend(res, client);
-			return;
-		}
+		makeReadyforSend(res, client);
+		return;
+	}
+	// The handlers below need a location
+	if (!loc)
+	{
+		_canned.applyError(res, req.getServerConfig(), 404);
+		makeReadyforSend(res, client);
+		return;
+	}
+	if (req.getPath() == "/")
+		req.setPath(req.getServerConfig()->getIndex());
+	if (!loc->getRedirect().empty())
+	{
+		_canned.applyRedirect(res, loc);
+		makeReadyforSend(res, client);
+		return;
+	}
 
-		// Refactored CGI handling
-		if (handleCgiRequest(req, res, loc, client))
-			return;
+	if (!loc->getStubStatus().empty())
+	{
+		handleStatusRequest(req, res, loc);
+		makeReadyforSend(res, client);
+		return;
 	}
 
-	std::string method = req.getMethod();
-	std::string path = req.getPath();
-	std::string body = req.getBody();
+	// Refactored CGI handling
+	if (handleCgiRequest(req, res, loc, client))
+		return;
+
+	const std::string &method = req.getMethod();
+	const std::string &path = req.getPath();
+	const Body &body = req.getBody();
 
 	// Get allowed methods from the matched location
 	const std::vector<std::string> &allowedMethods = loc->getMethods();
@@ -186,40 +510,58 @@ void Server::handleClient(Socket &client)
 	// Check if the method is allowed
 	if (std::find(allowedMethods.begin(), allowedMethods.end(), method) == allowedMethods.end())
 	{
-		// Method not allowed, respond with 405
-		res.setStatus(405);
-
-		// Add the Allow header with the permitted methods
-		std::ostringstream allowHeader;
-		for (size_t i = 0; i < allowedMethods.size(); ++i)
-		{
-			if (i > 0)
-				allowHeader << ", ";
-			allowHeader << allowedMethods[i];
-		}
-		res.setHeader("Allow", allowHeader.str());
-
-		// Set the response body
-		std::string html =
-			"<html><head><title>405 Method Not Allowed</title></head><body>"
-			"<h1>405 Method Not Allowed</h1>"
-			"<p>The method " +
-			method + " is not allowed for the requested resource.</p>"
-					 "</body></html>";
-		res.setHeader("Content-Type", "text/html");
-		res.setHeader("Content-Length", intToStr(html.size()));
-		res.setBody(html);
-
+		// Method not allowed, respond with 405 and the permitted methods
+		_canned.applyAllow(res, loc);
+		_canned.applyError(res, req.getServerConfig(), 405);
 		makeReadyforSend(res, client);
 		return;
 	}
 
+	// File handlers hand their work to the disk pool and answer when it is done
+	bool waiting = false;
 	if (method == "GET")
-		handleGetRequest(res, req);
+		waiting = handleGetRequest(res, req, client);
 	else if (method == "POST")
-		handlePostRequest(req, res, path, body);
+		waiting = handlePostRequest(req, res, path, body, client);
 	else if (method == "DELETE")
-		handleDeleteRequest(res, path);
+		waiting = handleDeleteRequest(res, path, client);
+
+	if (!waiting)
+		makeReadyforSend(res, client);
+}
+
+// Applies limit_conn and limit_req of the matched location, or of the server if the
+// location sets none. Returns true if the request was rejected with 429; requests
+// inside the burst are processed now but their response is held back (Socket::setSendAt).
+bool Server::checkLimits(const Request& req, Response& res, Socket& client)
+{
+	const ServerConfig *server = req.getServerConfig();
+	const LocationConfig *loc = req.getMatchedLocation();
+	int limitConn = (loc && loc->getLimitConn() >= 0) ? loc->getLimitConn() : server->getLimitConn();
+	const LimitReq &limitReq = (loc && !loc->getLimitReq().zone.empty()) ? loc->getLimitReq() : server->getLimitReq();
+
+	std::string retryAfter;
+	if (limitConn > 0 && _rateLimiter.connections(client.getClientAddr()) > static_cast<unsigned int>(limitConn))
+		retryAfter = "1";
+	else if (!limitReq.zone.empty())
+	{
+		double now = monotonicTime();
+		double delay = _rateLimiter.acquire(limitReq, client.getClientAddr(), now);
+		if (delay > 0)
+			client.setSendAt(now + delay);
+		if (delay >= 0)
+			return false;
+		retryAfter = intToStr(static_cast<int>(1 / limitReq.rate + 0.999));
+	}
+	else
+		return false;
 
-	makeReadyforSend(res, client);
+	LOG_INFO("Rate limit exceeded for " + client.getClientIPv4() + " on " + req.getPath());
+	std::string body = "<html><body><h1>429 Too Many Requests</h1></body></html>";
+	res.setStatus(429);
+	res.setHeader("Retry-After", retryAfter);
+	res.setHeader("Content-Type", "text/html");
+	res.setBody(body);
+	res.setHeader("Content-Length", intToStr(body.size()));
+	return true;
 }
@@ -0,0 +1,251 @@
+#include "../include/Server.hpp"
+#include "../include/Socket.hpp"
+#include "../include/Request.hpp"
+#include "../include/Http2.hpp"
+#include "../include/Webserver.hpp"
+#include "../include/Logger.hpp"
+#include "../include/Utils.hpp"
+
+static bool containsToken(std::string value, const char *token)
+{
+	std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+	return value.find(token) != std::string::npos;
+}
+
+// "Upgrade: h2c" together with HTTP2-Settings and a Connection header listing both (RFC 7540 3.2)
+bool isHttp2Upgrade(const Request &req)
+{
+	return req.getProtocol() == "HTTP/1.1" && req.hasHeader("HTTP2-Settings")
+		&& containsToken(req.getHeader("Upgrade"), "h2c")
+		&& containsToken(req.getHeader("Connection"), "upgrade");
+}
+
+// HTTP/2 field names are lowercase, the handlers look headers up by their usual spelling
+static void addCanonicalHeader(Request &req, Arena &arena, const std::string &name, const std::string &value)
+{
+	char *canonical = arena.copy(name.data(), name.size());
+	for (size_t i = 0; i < name.size(); ++i)
+	{
+		if (i == 0 || canonical[i - 1] == '-')
+			canonical[i] = static_cast<char>(std::toupper(static_cast<unsigned char>(canonical[i])));
+	}
+	req.addHeader(canonical, name.size(), arena.copy(value.data(), value.size()), value.size());
+}
+
+// Stream bodies beyond what one HTTP/1.1 connection keeps in memory are spooled where the
+// listener's default server spools its own
+Http2Session *Server::newHttp2Session(const Socket &client)
+{
+	const ServerConfig *config = findServerConfig(client.getIPv4(), client.getPort());
+	return new Http2Session(_http2BodyLimit, _http2HeaderLimit, config ? config->getRoot() : std::string("."),
+		config ? config->getClientBodyBufferSize() : 0);
+}
+
+// Prior knowledge: the buffer starts with the connection preface
+void Server::startHttp2(Socket &client)
+{
+	LOG_INFO("Client " + intToStr(client.getFd()) + " speaks HTTP/2");
+	client.setHttp2(newHttp2Session(client));
+	client.getRecord().reset();
+	std::string received(client.getBuffer());
+	client.clearBuffer();
+	if (client.getHttp2()->receive(received.data(), received.size()))
+		dispatchHttp2Requests(client);
+	flushHttp2(client);
+}
+
+// Sends 101 and switches the connection over; the request itself is then answered on stream 1.
+// A malformed HTTP2-Settings header leaves the connection on HTTP/1.1.
+void Server::upgradeToHttp2(Socket &client, const Request &req)
+{
+	Http2Session *session = newHttp2Session(client);
+	if (!session->startUpgrade(req.getHeader("HTTP2-Settings")))
+	{
+		delete session;
+		return;
+	}
+	LOG_INFO("Client " + intToStr(client.getFd()) + " upgraded to HTTP/2");
+	static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+	client.clearBuffer();
+	client.appendToBuffer(switching, sizeof(switching) - 1);
+	client.setHttp2(session);
+	// The client may send the connection preface right behind the request
+	std::string early;
+	client.takePipelined(early);
+	if (!early.empty())
+		session->receive(early.data(), early.size());
+}
+
+// Read and write readiness of an HTTP/2 connection. Its buffer only holds frames waiting
+// to be sent; everything received goes straight into the session.
+void Server::serviceHttp2(Socket &client, short revents)
+{
+	int fd = client.getFd();
+	Http2Session &session = *client.getHttp2();
+	if (revents & POLLIN)
+	{
+		const char *buffer;
+		ssize_t bytes = receiveFrom(client, buffer);
+		if (bytes == 0 || (bytes == -1 && errno != EAGAIN))
+		{
+			releaseReceived(buffer);
+			deleteClient(client);
+			return;
+		}
+		// With TLS the socket can be readable without a whole record being there yet
+		if (bytes > 0)
+		{
+			_metrics.bytesReceived(bytes);
+			client.updateActivity();
+			if (session.receive(buffer, bytes))
+				dispatchHttp2Requests(client);
+			else
+				LOG_INFO("HTTP/2 connection error with client " + intToStr(fd) + ", sending GOAWAY");
+		}
+		releaseReceived(buffer);
+	}
+	if (revents & POLLOUT)
+	{
+		const std::string &buffer = client.getBuffer();
+		ssize_t bytesSent = client.transmit(buffer.data(), buffer.size());
+		_metrics.syscalls(1);
+		if (bytesSent == -1 && errno == EAGAIN)
+			bytesSent = 0;
+		else if (bytesSent == -1)
+		{
+			logError("Send failed to client " + intToStr(fd) + ": " + std::string(strerror(errno)) + ", deleting client");
+			deleteClient(client);
+			return;
+		}
+		_metrics.bytesSent(bytesSent);
+		client.trimBuffer(bytesSent);
+		client.updateActivity();
+	}
+	// After a connection error the connection is closed once the GOAWAY is out
+	if (session.isClosing() && client.getBuffer().empty() && !session.wantsWrite())
+	{
+		deleteClient(client);
+		return;
+	}
+	flushHttp2(client);
+}
+
+void Server::dispatchHttp2Requests(Socket &client)
+{
+	int streamId;
+	HeaderList headers;
+	Body body;
+	bool tooLarge;
+	while (client.getHttp2()->takeRequest(streamId, headers, body, tooLarge))
+		dispatchHttp2Request(client, streamId, headers, body, tooLarge);
+}
+
+// Turns a stream into a Request for the HTTP/1.1 handlers. The session only limits bodies
+// to the largest client_max_body_size of all servers, the location's limit is applied here.
+void Server::dispatchHttp2Request(Socket &client, int streamId, const HeaderList &headers, const Body &body, bool tooLarge)
+{
+	client.getHttp2()->setCurrentStream(streamId);
+	Arena &arena = client.getArena();
+	arena.reset();
+	Request req(&arena);
+	Response res;
+
+	std::string authority;
+	std::string cookies;
+	for (size_t i = 0; i < headers.size(); ++i)
+	{
+		const std::string &name = headers[i].first;
+		const std::string &value = headers[i].second;
+		if (name == ":method")
+			req.setMethod(value);
+		else if (name == ":path")
+			req.setPath(value);
+		else if (name == ":authority")
+			authority = value;
+		else if (name == "cookie")
+			// Sent as separate fields for better compression (RFC 9113 8.2.3)
+			cookies += (cookies.empty() ? "" : "; ") + value;
+		else if (name[0] != ':')
+			addCanonicalHeader(req, arena, name, value);
+	}
+	if (!cookies.empty())
+		addCanonicalHeader(req, arena, "cookie", cookies);
+	if (!authority.empty() && !req.hasHeader("Host"))
+		addCanonicalHeader(req, arena, "host", authority);
+	req.setProtocol("HTTP/2.0");
+	req.setBody(body);
+
+	AccessRecord &record = client.getRecord();
+	record.start = monotonicTime();
+	record.headersDone = record.start;
+	record.log = findAccessLog(findServerConfig(client.getIPv4(), client.getPort()));
+	record.method = req.getMethod();
+	record.path = req.getPath();
+	record.protocol = req.getProtocol();
+	record.referer = req.getHeader("Referer");
+	record.userAgent = req.getHeader("User-Agent");
+
+	ServerConfig *serverConfig = resolveServerConfig(client, req.getHeader("Host"));
+	req.setServerConfig(serverConfig);
+	matchLocation(req, serverConfig->getLocations());
+	if (tooLarge || req.getBody().size() > req.getClientMaxBodySize())
+	{
+		LOG_INFO("Request body on stream " + intToStr(streamId) + " of client " + intToStr(client.getFd()) + " exceeds client_max_body_size");
+		rejectRequest(client, 413);
+		return;
+	}
+	processRequest(req, res, client);
+}
+
+// Hands the response to the session as the answer of the current stream. Streams are logged
+// here: when their last byte leaves is not tracked, so the time is the handler's.
+void Server::submitHttp2Response(Response &response, Socket &client, int bodyFd)
+{
+	Http2Session &session = *client.getHttp2();
+	HeaderList headers(response.getHeaders().begin(), response.getHeaders().end());
+	size_t fileSize = (bodyFd != -1) ? response.getBodyFileSize() : 0;
+	session.submitResponse(session.getCurrentStream(), response.getStatus(), headers, response.getBody(), bodyFd, fileSize);
+
+	AccessRecord &record = client.getRecord();
+	record.status = response.getStatus();
+	record.handlerDone = monotonicTime();
+	record.end = record.handlerDone;
+	record.bytesSent = response.getBody().size() + fileSize;
+	_metrics.requestDone(record.vhost, record.status, record.end - record.start);
+	if (record.log)
+		record.log->write(record);
+	record.reset();
+	client.setRequestConfig(NULL, NULL);
+
+	// limit_req holds back the whole connection, releaseDelayedResponses flushes it later
+	if (client.getSendAt() != 0)
+	{
+		findPollFd(client.getFd()).events = _readPaused ? 0 : POLLIN;
+		_delayed.push_back(client.getFd());
+		return;
+	}
+	flushHttp2(client);
+}
+
+// Moves frames from the session into the buffer, keeping it between the send watermarks
+// like a file body, and asks for POLLOUT while anything is waiting
+void Server::flushHttp2(Socket &client)
+{
+	Http2Session &session = *client.getHttp2();
+	size_t buffered = client.getBuffer().size();
+	if (buffered < SEND_LOW_WATERMARK)
+	{
+		std::string frames;
+		session.produce(frames, SEND_HIGH_WATERMARK - buffered);
+		client.appendToBuffer(frames.data(), frames.size());
+	}
+	if (client.getSendAt() != 0)
+		return;
+	// A peer that sends PINGs, SETTINGS or resets without reading the answers is not read
+	// from either until the queue is back under the watermark
+	pollfd &pfd = findPollFd(client.getFd());
+	bool backlogged = client.getBuffer().size() + session.getControlSize() > SEND_HIGH_WATERMARK;
+	pfd.events = (_readPaused || backlogged) ? 0 : POLLIN;
+	if (!client.getBuffer().empty() || session.wantsWrite())
+		pfd.events |= POLLOUT;
+}
@@ -3,82 +3,145 @@
 #include "../include/Request.hpp"
 #include "../include/Webserver.hpp"
 #include "../include/CGIHandler.hpp"
+#include "../include/Scan.hpp"
 #include "../include/Logger.hpp"
 #include "../include/Utils.hpp"
 
-void Server::handleGetRequest(Response &res, const Request &req)
+// Looks the file up through the disk pool; finishGetRequest answers once it is back
+bool Server::handleGetRequest(Response &res, const Request &req, Socket &client)
 {
-	const std::string &path = req.getPath();
-	std::string fullPath = "www" + path;
+	// The query string only matters to directory listings
+	std::string path = req.getPath();
+	std::string query;
+	size_t queryStart = path.find('?');
+	if (queryStart != std::string::npos)
+	{
+		query = path.substr(queryStart + 1);
+		path.erase(queryStart);
+	}
+	DiskWait wait;
+	wait.kind = DiskWait::GET;
+	wait.response = res;
+	wait.path = "www" + path;
+	wait.query = query;
+	wait.server = req.getServerConfig();
+	wait.location = req.getMatchedLocation();
 
-	// Check if path is a directory
-	if (isDirectory(fullPath))
+	DiskJob *job = new DiskJob(DiskJob::OPEN);
+	job->path = wait.path;
+	// Large files are streamed from disk instead of being read into memory at once
+	job->limit = SEND_HIGH_WATERMARK;
+	submitDiskJob(client, job, wait);
+	return true;
+}
+
+void Server::finishGetRequest(Response &res, const DiskWait &wait, DiskJob &job)
+{
+	const std::string &fullPath = wait.path;
+	if (job.directory)
 	{
 		// If it's a directory, check if we should serve directory listing
-		const LocationConfig *loc = req.getMatchedLocation();
+		const LocationConfig *loc = wait.location;
 		if (loc && loc->isAutoindex())
 		{
-			logInfo("Directory listing requested: " + fullPath);
-			list_directory(fullPath, res);
-			return;
-		}
-		else
-		{
-			// Autoindex is disabled, return 403 Forbidden
-			logWarning("403 Forbidden: Directory listing disabled for " + fullPath);
-			std::string body = "<html><body><h1>403 Forbidden</h1><p>Directory listing is disabled.</p></body></html>";
-			res.setStatus(403);
-			res.setHeader("Content-Type", "text/html");
-			res.setHeader("Content-Length", intToStr(body.size()));
-			res.setBody(body);
+			LOG_INFO("Directory listing requested: " + fullPath);
+			list_directory(fullPath, wait.query, loc, res);
 			return;
 		}
+		// Autoindex is disabled, return 403 Forbidden
+		logWarning("403 Forbidden: Directory listing disabled for " + fullPath);
+		_canned.applyError(res, wait.server, 403);
+		return;
+	}
+	// Answered with the error page loaded at startup
+	if (job.error)
+	{
+		_canned.applyError(res, wait.server, 404);
+		return;
 	}
 
-	// Handle regular file request
-	std::ifstream file(fullPath.c_str(), std::ios::binary);
+	std::string type = getContentType(fullPath);
+	LOG_INFO("200 OK: " + fullPath + " (" + type + ")");
+	res.setStatus(200);
+	res.setHeader("Content-Type", type);
+	if (job.fd != -1)
+	{
+		res.setBodyFile(fullPath, job.size, job.fd);
+		job.fd = -1;
+		return;
+	}
+	res.setHeader("Content-Length", intToStr(job.data.size()));
+	res.setBody(job.data);
+}
 
-	if (!file.is_open())
+// Continues a request whose disk job is back; the response goes to makeReadyforSend
+void Server::finishDiskJob(Socket &client, DiskWait &wait, DiskJob &job)
+{
+	Response res = wait.response;
+	std::string body;
+	switch (wait.kind)
 	{
-		const ServerConfig *serverConfig = req.getServerConfig();
-		if (serverConfig)
-		{
-			const std::string &errorPagePath = serverConfig->getErrorPage(404);
-			if (!errorPagePath.empty())
+		case DiskWait::GET:
+			finishGetRequest(res, wait, job);
+			break;
+		case DiskWait::UPLOAD:
+			if (job.error)
 			{
-				std::string customErrorPage = "www/" + errorPagePath;
-				std::ifstream errorFile(customErrorPage.c_str(), std::ios::binary);
-				if (errorFile.is_open())
-				{
-					std::ostringstream content;
-					content << errorFile.rdbuf();
-					errorFile.close();
-					res.setStatus(404);
-					res.setHeader("Content-Type", "text/html");
-					res.setHeader("Content-Length", intToStr(content.str().size()));
-					res.setBody(content.str());
-					return;
-				}
+				logError("Failed to write " + job.path + ": " + std::string(std::strerror(job.error)));
+				res.setStatus(500);
+				res.setBody("Failed to open file for writing: " + job.path);
+				break;
 			}
-		}
-	}
-	else
-	{
-		std::ostringstream content;
-		content << file.rdbuf();
-
-		std::string type = getContentType(fullPath);
-		logInfo("200 OK: " + fullPath + " (" + type + ")");
-		res.setStatus(200);
-		res.setHeader("Content-Type", type);
-		res.setHeader("Content-Length", intToStr(content.str().size()));
-		res.setBody(content.str());
+			body =
+				"<html><body>"
+				"<script>alert('File uploaded!'); window.location.href='/';</script>"
+				"</body></html>";
+			res.setStatus(200);
+			res.setHeader("Content-Type", "text/html");
+			res.setHeader("Content-Length", intToStr(body.size()));
+			res.setBody(body);
+			break;
+		case DiskWait::POST:
+			if (job.error)
+			{
+				logError("Failed to write " + job.path + ": " + std::string(std::strerror(job.error)));
+				res.setStatus(500);
+				body = "Failed to open file for writing: " + job.path;
+				res.setHeader("Content-Type", "text/plain");
+				res.setHeader("Content-Length", intToStr(body.size()));
+				res.setBody(body);
+				break;
+			}
+			LOG_INFO("POST request successful: Upload file has been filled: " + job.path);
+			body =
+				"<html><body>\n"
+				"<h1>POST Received</h1>\n"
+				"<br>\n"
+				"<p>Path: " +
+				wait.path + "</p>\n"
+					   "</body></html>";
+			res.setStatus(200);
+			res.setHeader("Content-Type", "text/html");
+			res.setHeader("Content-Length", intToStr(body.size()));
+			res.setBody(body);
+			break;
+		case DiskWait::DELETE:
+			finishDeleteRequest(res, wait.path, job.path, job.error);
+			break;
+		case DiskWait::BODY:
+			return;
 	}
+	makeReadyforSend(res, client);
 }
 
-void Server::handlePostRequest(Request &req, Response &res, const std::string &path, const std::string &requestBody)
+// Returns true if the response comes from the disk pool, false if it is ready in res
+bool Server::handlePostRequest(Request &req, Response &res, const std::string &path, const Body &requestBody, Socket &client)
 {
 	std::string uploadDir = "www/upload/";
+	DiskWait wait;
+	wait.response = res;
+	wait.path = path;
+	DiskJob *job = new DiskJob(DiskJob::WRITE);
 
 	// Check if this is a file upload (multipart/form-data)
 	if (path == "/upload")
@@ -93,18 +156,20 @@ void Server::handlePostRequest(Request &req, Response &res, const std::string &p
 		}
 		if (boundary.empty())
 		{
+			delete job;
 			res.setStatus(400);
 			res.setBody("No boundary found in Content-Type");
-			return;
+			return false;
 		}
 
 		// Find the start of the file content
 		size_t fileStart = requestBody.find("\r\n\r\n");
 		if (fileStart == std::string::npos)
 		{
+			delete job;
 			res.setStatus(400);
 			res.setBody("Malformed multipart body");
-			return;
+			return false;
 		}
 		fileStart += 4; // Skip past the header
 
@@ -112,100 +177,75 @@ void Server::handlePostRequest(Request &req, Response &res, const std::string &p
 		size_t fileEnd = requestBody.find(boundary, fileStart);
 		if (fileEnd == std::string::npos)
 		{
+			delete job;
 			res.setStatus(400);
 			res.setBody("Malformed multipart body (no end boundary)");
-			return;
+			return false;
 		}
-		std::string fileContent = requestBody.substr(fileStart, fileEnd - fileStart - 2); // -2 for \r\n
 
 		// Extract filename from Content-Disposition
 		size_t filenamePos = requestBody.find("filename=\"");
 		if (filenamePos == std::string::npos)
 		{
+			delete job;
 			res.setStatus(400);
 			res.setBody("No filename found in multipart body");
-			return;
+			return false;
 		}
 		filenamePos += 10;
 		size_t filenameEnd = requestBody.find("\"", filenamePos);
-		std::string filename = requestBody.substr(filenamePos, filenameEnd - filenamePos);
+		std::string filename = requestBody.slice(filenamePos, filenameEnd - filenamePos).str();
 
-		std::string fullPath = uploadDir + filename;
-		std::ofstream outFile(fullPath.c_str(), std::ios::binary);
-		if (!outFile.is_open())
-		{
-			res.setStatus(500);
-			res.setBody("Failed to open file for writing: " + fullPath);
-			return;
-		}
-		outFile.write(fileContent.c_str(), fileContent.size());
-		outFile.close();
-
-		std::string body =
-			"<html><body>"
-			"<script>alert('File uploaded!'); window.location.href='/';</script>"
-			"</body></html>";
-		res.setStatus(200);
-		res.setHeader("Content-Type", "text/html");
-		res.setHeader("Content-Length", intToStr(body.size()));
-		res.setBody(body);
-		return;
+		wait.kind = DiskWait::UPLOAD;
+		job->path = uploadDir + filename;
+		// The job writes a slice of the request's buffer, the file content is not copied
+		job->body = requestBody.slice(fileStart, fileEnd - fileStart - 2); // -2 for \r\n
+		submitDiskJob(client, job, wait);
+		return true;
 	}
 
 	// Fallback: normal POST (not file upload)
-	std::string fullPath = "www" + path;
-	std::ofstream outFile(fullPath.c_str());
-	if (!outFile.is_open())
-	{
-		logError("Failed to open file for writing: " + fullPath);
-		res.setStatus(500);
-		std::string err = "Failed to open file for writing: " + fullPath;
-		res.setHeader("Content-Type", "text/plain");
-		res.setHeader("Content-Length", intToStr(err.size()));
-		res.setBody(err);
-		return;
-	}
-
-	if (outFile << requestBody)
-		logInfo("POST request successful: Upload file has been filled: " + fullPath);
-
-	outFile.close();
-	std::string body =
-		"<html><body>\n"
-		"<h1>POST Received</h1>\n"
-		"<br>\n"
-		"<p>Path: " +
-		path + "</p>\n"
-			   "</body></html>";
+	wait.kind = DiskWait::POST;
+	job->path = "www" + path;
+	job->body = requestBody;
+	submitDiskJob(client, job, wait);
+	return true;
+}
 
-	res.setStatus(200);
-	res.setHeader("Content-Type", "text/html");
-	res.setHeader("Content-Length", intToStr(body.size()));
-	res.setBody(body);
+bool Server::handleDeleteRequest(Response &res, const std::string &path, Socket &client)
+{
+	DiskWait wait;
+	wait.kind = DiskWait::DELETE;
+	wait.response = res;
+	wait.path = path;
+	DiskJob *job = new DiskJob(DiskJob::REMOVE);
+	job->path = "www" + path;
+	submitDiskJob(client, job, wait);
+	return true;
 }
 
-void Server::handleDeleteRequest(Response &res, const std::string &path)
+// error is the errno of remove(), 0 if it succeeded
+void Server::finishDeleteRequest(Response &res, const std::string &path, const std::string &fullPath, int error)
 {
-	std::string fullPath = "www" + path;
 	std::ostringstream body;
 
-	if (std::remove(fullPath.c_str()) == 0)
+	if (error == 0)
 	{
-		logInfo("File deleted successfully: " + fullPath);
+		LOG_INFO("File deleted successfully: " + fullPath);
 		res.setStatus(200);
 		body << "<html><body><h1>File Deleted</h1><p>Deleted: " << path << "</p></body></html>";
 	}
 	else
 	{
 		// File no found
-		if (errno == ENOENT)
+		if (error == ENOENT)
 		{
 			logWarning("404 Not Found for DELETE: " + fullPath);
 			res.setStatus(404);
 			body << "<html><body><h1>404 Not Found</h1><p>File not found: " << path << "</p></body></html>";
 		}
 		// Permission denied
-		else if (errno == EACCES || errno == EPERM)
+		else if (error == EACCES || error == EPERM)
 		{
 			logError("403 Forbidden for DELETE: " + fullPath);
 			res.setStatus(403);
@@ -214,7 +254,7 @@ void Server::handleDeleteRequest(Response &res, const std::string &path)
 		// Other errors
 		else
 		{
-			logError("500 Internal Server Error for DELETE: " + fullPath + " - " + std::string(strerror(errno)));
+			logError("500 Internal Server Error for DELETE: " + fullPath + " - " + std::string(strerror(error)));
 			res.setStatus(500);
 			body << "<html><body><h1>500 Internal Server Error</h1><p>Error deleting: " << path << "</p></body></html>";
 		}
@@ -224,3 +264,38 @@ void Server::handleDeleteRequest(Response &res, const std::string &path)
 	res.setHeader("Content-Type", "text/html");
 	res.setHeader("Content-Length", intToStr(body.str().size()));
 }
+
+// Serves the server counters for a location with `stub_status`, as plain text or in the
+// Prometheus format (selected by the directive or by ?format=prometheus)
+void Server::handleStatusRequest(const Request &req, Response &res, const LocationConfig *loc)
+{
+	Metrics::Gauges gauges;
+	gauges.reading = 0;
+	gauges.writing = 0;
+	gauges.waiting = 0;
+	for (int fd = 0; fd < _sockets.getLimit(); ++fd)
+	{
+		const Socket *client = _sockets.find(fd);
+		if (!client || client->getType() != Socket::CLIENT)
+			continue;
+		// Requests waiting for the disk count as being answered
+		if (client->getState() != Socket::RECEIVING)
+			++gauges.writing;
+		else if (!client->getBuffer().empty())
+			++gauges.reading;
+		else
+			++gauges.waiting;
+	}
+	gauges.cacheHits = _cgiCache.getHits();
+	gauges.cacheMisses = _cgiCache.getMisses();
+	gauges.buffered = Socket::getBufferedTotal();
+	gauges.events = _ring ? "io_uring" : "poll";
+
+	bool prometheus = loc->getStubStatus() == "prometheus" ||
+		req.getPath().find("format=prometheus") != std::string::npos;
+	std::string body = prometheus ? _metrics.renderPrometheus(gauges) : _metrics.renderText(gauges);
+	res.setStatus(200);
+	res.setHeader("Content-Type", prometheus ? "text/plain; version=0.0.4" : "text/plain");
+	res.setHeader("Cache-Control", "no-store");
+	res.setBody(body);
+}
@@ -0,0 +1,295 @@
+#include "../include/Hpack.hpp"
+#include <cctype>
+#include <cstdio>
+
+// RFC 7541 Appendix A, index 1 to 61
+static const char *const STATIC_TABLE[][2] = {
+	{ ":authority", "" }, { ":method", "GET" }, { ":method", "POST" }, { ":path", "/" },
+	{ ":path", "/index.html" }, { ":scheme", "http" }, { ":scheme", "https" }, { ":status", "200" },
+	{ ":status", "204" }, { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+	{ ":status", "404" }, { ":status", "500" }, { "accept-charset", "" }, { "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" }, { "accept-ranges", "" }, { "accept", "" }, { "access-control-allow-origin", "" },
+	{ "age", "" }, { "allow", "" }, { "authorization", "" }, { "cache-control", "" },
+	{ "content-disposition", "" }, { "content-encoding", "" }, { "content-language", "" }, { "content-length", "" },
+	{ "content-location", "" }, { "content-range", "" }, { "content-type", "" }, { "cookie", "" },
+	{ "date", "" }, { "etag", "" }, { "expect", "" }, { "expires", "" },
+	{ "from", "" }, { "host", "" }, { "if-match", "" }, { "if-modified-since", "" },
+	{ "if-none-match", "" }, { "if-range", "" }, { "if-unmodified-since", "" }, { "last-modified", "" },
+	{ "link", "" }, { "location", "" }, { "max-forwards", "" }, { "proxy-authenticate", "" },
+	{ "proxy-authorization", "" }, { "range", "" }, { "referer", "" }, { "refresh", "" },
+	{ "retry-after", "" }, { "server", "" }, { "set-cookie", "" }, { "strict-transport-security", "" },
+	{ "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" }, { "via", "" },
+	{ "www-authenticate", "" },
+};
+static const size_t STATIC_TABLE_SIZE = sizeof(STATIC_TABLE) / sizeof(STATIC_TABLE[0]);
+
+// The Huffman code of RFC 7541 Appendix B is canonical, so it is fully described by the
+// number of codes of each bit length and the symbols ordered by (code length, symbol).
+// Codes of one length are consecutive numbers, starting where the previous length ended.
+static const unsigned short HUFFMAN_COUNTS[31] = {
+	0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+static const unsigned short HUFFMAN_SYMBOLS[257] = {
+	48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+	52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+	110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+	77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+	119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+	43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+	195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+	179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+	163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+	233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+	158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+	144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+	200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+	212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+	2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+	21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+	256
+};
+static const unsigned short HUFFMAN_EOS = 256;
+
+// Padding has to be shorter than a byte and consist of the most significant bits of EOS (all ones)
+bool huffmanDecode(const unsigned char *data, size_t size, std::string &out)
+{
+	unsigned int code = 0; // bits of the symbol being read
+	int length = 0;
+	unsigned int first = 0; // first code of the current length
+	size_t offset = 0; // position of that code's symbol in HUFFMAN_SYMBOLS
+	for (size_t i = 0; i < size; ++i)
+	{
+		for (int bit = 7; bit >= 0; --bit)
+		{
+			code = (code << 1) | ((data[i] >> bit) & 1);
+			++length;
+			unsigned int count = HUFFMAN_COUNTS[length];
+			if (code - first < count)
+			{
+				unsigned short symbol = HUFFMAN_SYMBOLS[offset + code - first];
+				if (symbol == HUFFMAN_EOS)
+					return false;
+				out += static_cast<char>(symbol);
+				code = 0;
+				length = 0;
+				first = 0;
+				offset = 0;
+				continue;
+			}
+			if (length == 30)
+				return false;
+			first = (first + count) << 1;
+			offset += count;
+		}
+	}
+	return length < 8 && code == (1u << length) - 1;
+}
+
+// Integers with an N-bit prefix (RFC 7541 5.1). Values that do not fit into 32 bits are
+// never legitimate for the sizes and indexes they describe.
+static bool decodeInteger(const unsigned char *&pos, const unsigned char *end, int prefixBits, size_t &value)
+{
+	if (pos >= end)
+		return false;
+	size_t max = (1u << prefixBits) - 1;
+	value = *pos++ & max;
+	if (value < max)
+		return true;
+	for (int shift = 0; pos < end && shift <= 28; shift += 7)
+	{
+		unsigned char byte = *pos++;
+		value += static_cast<size_t>(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+static bool decodeString(const unsigned char *&pos, const unsigned char *end, std::string &out)
+{
+	if (pos >= end)
+		return false;
+	bool huffman = *pos & 0x80;
+	size_t length;
+	if (!decodeInteger(pos, end, 7, length) || length > static_cast<size_t>(end - pos))
+		return false;
+	out.clear();
+	if (huffman)
+	{
+		if (!huffmanDecode(pos, length, out))
+			return false;
+	}
+	else
+		out.assign(reinterpret_cast<const char *>(pos), length);
+	pos += length;
+	return true;
+}
+
+HpackDecoder::HpackDecoder() : _tableSize(0), _maxTableSize(DEFAULT_TABLE_SIZE) {}
+
+// Index 1 to 61 is the static table, the dynamic table follows with its newest entry
+bool HpackDecoder::lookup(size_t index, Entry &entry) const
+{
+	if (index == 0)
+		return false;
+	if (index <= STATIC_TABLE_SIZE)
+	{
+		entry.first = STATIC_TABLE[index - 1][0];
+		entry.second = STATIC_TABLE[index - 1][1];
+		return true;
+	}
+	index -= STATIC_TABLE_SIZE + 1;
+	if (index >= _table.size())
+		return false;
+	entry = _table[index];
+	return true;
+}
+
+// An entry costs its name and value plus 32 bytes of overhead (RFC 7541 4.1)
+void HpackDecoder::evict(size_t maxSize)
+{
+	while (_tableSize > maxSize)
+	{
+		_tableSize -= _table.back().first.size() + _table.back().second.size() + 32;
+		_table.pop_back();
+	}
+}
+
+// An entry larger than the whole table empties it and is not added
+void HpackDecoder::insert(const std::string &name, const std::string &value)
+{
+	size_t size = name.size() + value.size() + 32;
+	if (size > _maxTableSize)
+	{
+		evict(0);
+		return;
+	}
+	evict(_maxTableSize - size);
+	_table.push_front(Entry(name, value));
+	_tableSize += size;
+}
+
+bool HpackDecoder::decode(const char *block, size_t size, HeaderList &headers, size_t maxListSize, bool &tooLarge)
+{
+	const unsigned char *pos = reinterpret_cast<const unsigned char *>(block);
+	const unsigned char *end = pos + size;
+	bool fieldSeen = false;
+	size_t listSize = 0;
+	tooLarge = false;
+	while (pos < end)
+	{
+		unsigned char first = *pos;
+		Entry entry;
+		size_t index;
+		if (first & 0x80)
+		{
+			// Indexed field; past the limit the entry is only checked, not copied
+			if (!decodeInteger(pos, end, 7, index))
+				return false;
+			if (tooLarge)
+			{
+				if (index == 0 || index > STATIC_TABLE_SIZE + _table.size())
+					return false;
+				continue;
+			}
+			if (!lookup(index, entry))
+				return false;
+		}
+		else if ((first & 0xe0) == 0x20)
+		{
+			// Dynamic table size update, only allowed before the first field and up to our limit
+			if (fieldSeen || !decodeInteger(pos, end, 5, index) || index > DEFAULT_TABLE_SIZE)
+				return false;
+			_maxTableSize = index;
+			evict(_maxTableSize);
+			continue;
+		}
+		else
+		{
+			// Literal field: with incremental indexing (01), without indexing (0000) or never indexed (0001)
+			bool indexing = (first & 0xc0) == 0x40;
+			if (!decodeInteger(pos, end, indexing ? 6 : 4, index))
+				return false;
+			if (index == 0)
+			{
+				if (!decodeString(pos, end, entry.first))
+					return false;
+			}
+			else if (!lookup(index, entry))
+				return false;
+			if (!decodeString(pos, end, entry.second))
+				return false;
+			if (indexing)
+				insert(entry.first, entry.second);
+		}
+		fieldSeen = true;
+		if (tooLarge)
+			continue;
+		listSize += entry.first.size() + entry.second.size() + 32;
+		if (listSize > maxListSize)
+		{
+			tooLarge = true;
+			HeaderList().swap(headers);
+			continue;
+		}
+		headers.push_back(entry);
+	}
+	return true;
+}
+
+static void encodeInteger(std::string &out, unsigned char flags, int prefixBits, size_t value)
+{
+	size_t max = (1u << prefixBits) - 1;
+	if (value < max)
+	{
+		out += static_cast<char>(flags | value);
+		return;
+	}
+	out += static_cast<char>(flags | max);
+	for (value -= max; value >= 128; value >>= 7)
+		out += static_cast<char>((value & 0x7f) | 0x80);
+	out += static_cast<char>(value);
+}
+
+static void encodeString(std::string &out, const std::string &value)
+{
+	encodeInteger(out, 0x00, 7, value.size());
+	out += value;
+}
+
+// The common statuses have a complete entry in the static table and take a single byte
+void hpackEncodeStatus(std::string &out, int status)
+{
+	char digits[16];
+	snprintf(digits, sizeof(digits), "%d", status);
+	for (size_t i = 7; i < 14; ++i)
+	{
+		if (std::string(STATIC_TABLE[i][1]) == digits)
+		{
+			encodeInteger(out, 0x80, 7, i + 1);
+			return;
+		}
+	}
+	encodeInteger(out, 0x00, 4, 8);
+	encodeString(out, digits);
+}
+
+// HTTP/2 field names are lowercase; the name is taken from the static table when it is there
+void hpackEncodeField(std::string &out, const std::string &name, const std::string &value)
+{
+	std::string lower(name);
+	for (size_t i = 0; i < lower.size(); ++i)
+		lower[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(lower[i])));
+	for (size_t i = 14; i < STATIC_TABLE_SIZE; ++i)
+	{
+		if (lower == STATIC_TABLE[i][0])
+		{
+			encodeInteger(out, 0x00, 4, i + 1);
+			encodeString(out, value);
+			return;
+		}
+	}
+	out += '\0';
+	encodeString(out, lower);
+	encodeString(out, value);
+}
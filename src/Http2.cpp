@@ -0,0 +1,723 @@
+#include "../include/Http2.hpp"
+#include "../include/Utils.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <strings.h>
+#include <unistd.h>
+
+const char Http2Session::PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+const size_t Http2Session::PREFACE_SIZE = sizeof(PREFACE) - 1;
+
+// What the peer may send before it has to wait for a WINDOW_UPDATE. Received DATA is
+// handed back right away, so this only bounds how much is in flight per stream; what is
+// buffered is bounded by spooling bodies past bodyBufferSize.
+static const unsigned long RECEIVE_WINDOW = 1 << 20;
+// Largest header block accepted across HEADERS and CONTINUATION frames
+static const size_t MAX_HEADER_BLOCK = 64 * 1024;
+static const unsigned long MAX_WINDOW = 0x7fffffff;
+
+static unsigned long read32(const char *data)
+{
+	const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+	return (static_cast<unsigned long>(bytes[0]) << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+}
+
+static void append32(std::string &out, unsigned long value)
+{
+	out += static_cast<char>((value >> 24) & 0xff);
+	out += static_cast<char>((value >> 16) & 0xff);
+	out += static_cast<char>((value >> 8) & 0xff);
+	out += static_cast<char>(value & 0xff);
+}
+
+static bool writeAll(int fd, const char *data, size_t size)
+{
+	size_t done = 0;
+	while (done < size)
+	{
+		ssize_t bytes = write(fd, data + done, size - done);
+		if (bytes == -1 && errno == EINTR)
+			continue;
+		if (bytes == -1)
+			return false;
+		done += bytes;
+	}
+	return true;
+}
+
+// The HTTP2-Settings header is base64url without padding (RFC 7540 3.2.1)
+static bool decodeBase64Url(const std::string &in, std::string &out)
+{
+	unsigned long bits = 0;
+	int count = 0;
+	for (size_t i = 0; i < in.size(); ++i)
+	{
+		char c = in[i];
+		int value;
+		if (c >= 'A' && c <= 'Z')
+			value = c - 'A';
+		else if (c >= 'a' && c <= 'z')
+			value = c - 'a' + 26;
+		else if (c >= '0' && c <= '9')
+			value = c - '0' + 52;
+		else if (c == '-' || c == '+')
+			value = 62;
+		else if (c == '_' || c == '/')
+			value = 63;
+		else if (c == '=')
+			break;
+		else
+			return false;
+		bits = (bits << 6) | value;
+		count += 6;
+		if (count >= 8)
+		{
+			count -= 8;
+			out += static_cast<char>((bits >> count) & 0xff);
+		}
+	}
+	return true;
+}
+
+// Request pseudo-header fields (RFC 9113 8.3.1); names must be lowercase
+static bool isValidRequest(const HeaderList &headers)
+{
+	bool method = false, path = false;
+	for (size_t i = 0; i < headers.size(); ++i)
+	{
+		const std::string &name = headers[i].first;
+		if (name.empty())
+			return false;
+		for (size_t j = 0; j < name.size(); ++j)
+		{
+			if (name[j] >= 'A' && name[j] <= 'Z')
+				return false;
+		}
+		if (name == ":method")
+			method = !headers[i].second.empty();
+		else if (name == ":path")
+			path = !headers[i].second.empty();
+	}
+	return method && path;
+}
+
+// Not sent in HTTP/2 (RFC 9113 8.2.2); content-length is written from the actual body
+static bool isSkippedResponseField(const std::string &name)
+{
+	static const char *const skipped[] = { "connection", "keep-alive", "proxy-connection",
+		"transfer-encoding", "upgrade", "content-length" };
+	for (size_t i = 0; i < sizeof(skipped) / sizeof(skipped[0]); ++i)
+	{
+		if (name.size() == std::strlen(skipped[i]) && strncasecmp(name.c_str(), skipped[i], name.size()) == 0)
+			return true;
+	}
+	return false;
+}
+
+Http2Session::Stream::Stream()
+	: spoolFd(-1), spooled(0), requestComplete(false), tooLarge(false), responded(false), dataOffset(0),
+	  bodyFd(-1), bodyRemaining(0), sendWindow(DEFAULT_WINDOW)
+{
+}
+
+bool Http2Session::Stream::hasData() const
+{
+	return dataOffset < data.size() || bodyRemaining > 0;
+}
+
+int Http2Session::matchPreface(const std::string &data)
+{
+	size_t size = std::min(data.size(), PREFACE_SIZE);
+	if (data.compare(0, size, PREFACE, size) != 0)
+		return -1;
+	return size == PREFACE_SIZE ? 1 : 0;
+}
+
+// Our SETTINGS are the first frame the server sends
+Http2Session::Http2Session(size_t maxBodySize, size_t maxHeaderListSize, const std::string &spoolDirectory,
+	size_t bodyBufferSize)
+	: _prefaceReceived(false), _closing(false), _lastStreamId(0), _currentStream(0), _lastServed(0),
+	  _continuationStream(0), _continuationEndStream(false), _sendWindow(DEFAULT_WINDOW),
+	  _peerInitialWindow(DEFAULT_WINDOW), _maxBodySize(maxBodySize), _maxHeaderListSize(maxHeaderListSize),
+	  _spoolDirectory(spoolDirectory), _bodyBufferSize(bodyBufferSize), _bufferedBodies(0)
+{
+	std::string settings;
+	settings += '\0';
+	settings += '\x03';
+	append32(settings, MAX_CONCURRENT_STREAMS);
+	settings += '\0';
+	settings += '\x04';
+	append32(settings, RECEIVE_WINDOW);
+	settings += '\0';
+	settings += '\x06';
+	append32(settings, _maxHeaderListSize);
+	writeFrame(_control, SETTINGS, 0, 0, settings.data(), settings.size());
+	writeWindowUpdate(0, RECEIVE_WINDOW - DEFAULT_WINDOW);
+}
+
+Http2Session::~Http2Session()
+{
+	while (!_streams.empty())
+		closeStream(_streams.begin());
+}
+
+bool Http2Session::startUpgrade(const std::string &settings)
+{
+	std::string payload;
+	if (!decodeBase64Url(settings, payload) || payload.size() % 6 != 0 || !applySettings(payload.data(), payload.size()))
+		return false;
+	Stream &stream = _streams[1];
+	stream.requestComplete = true;
+	stream.sendWindow = _peerInitialWindow;
+	_lastStreamId = 1;
+	_currentStream = 1;
+	return true;
+}
+
+bool Http2Session::receive(const char *data, size_t size)
+{
+	if (_closing)
+		return false;
+	_input.append(data, size);
+	size_t pos = 0;
+	if (!_prefaceReceived)
+	{
+		int preface = matchPreface(_input);
+		if (preface < 0)
+			return connectionError(PROTOCOL_ERROR);
+		if (preface == 0)
+			return true;
+		_prefaceReceived = true;
+		pos = PREFACE_SIZE;
+	}
+	bool ok = true;
+	while (ok && _input.size() - pos >= 9)
+	{
+		const unsigned char *header = reinterpret_cast<const unsigned char *>(_input.data() + pos);
+		size_t length = (header[0] << 16) | (header[1] << 8) | header[2];
+		if (length > MAX_FRAME_SIZE)
+		{
+			ok = connectionError(FRAME_SIZE_ERROR);
+			break;
+		}
+		if (_input.size() - pos - 9 < length)
+			break;
+		int streamId = static_cast<int>(read32(_input.data() + pos + 5) & MAX_WINDOW);
+		ok = processFrame(header[3], header[4], streamId, _input.data() + pos + 9, length);
+		pos += 9 + length;
+	}
+	_input.erase(0, pos);
+	return ok;
+}
+
+bool Http2Session::processFrame(int type, int flags, int streamId, const char *payload, size_t length)
+{
+	// A header block has to be continued right away on its own stream
+	if (_continuationStream && (type != CONTINUATION || streamId != _continuationStream))
+		return connectionError(PROTOCOL_ERROR);
+
+	switch (type)
+	{
+	case DATA:
+		return onData(flags, streamId, payload, length);
+	case HEADERS:
+		return onHeaders(flags, streamId, payload, length);
+	case PRIORITY:
+		if (streamId == 0)
+			return connectionError(PROTOCOL_ERROR);
+		if (length != 5)
+			resetStream(streamId, FRAME_SIZE_ERROR);
+		return true;
+	case RST_STREAM:
+		if (streamId == 0 || streamId > _lastStreamId)
+			return connectionError(PROTOCOL_ERROR);
+		if (length != 4)
+			return connectionError(FRAME_SIZE_ERROR);
+		if (_streams.find(streamId) != _streams.end())
+			closeStream(_streams.find(streamId));
+		return true;
+	case SETTINGS:
+		return onSettings(flags, streamId, payload, length);
+	case PING:
+		if (streamId != 0)
+			return connectionError(PROTOCOL_ERROR);
+		if (length != 8)
+			return connectionError(FRAME_SIZE_ERROR);
+		if (!(flags & ACK))
+			writeFrame(_control, PING, ACK, 0, payload, length);
+		return true;
+	case GOAWAY:
+		// The peer opens no more streams; the ones in progress are still answered
+		return streamId == 0 || connectionError(PROTOCOL_ERROR);
+	case WINDOW_UPDATE:
+		return onWindowUpdate(streamId, payload, length);
+	case CONTINUATION:
+		if (!_continuationStream)
+			return connectionError(PROTOCOL_ERROR);
+		_headerBlock.append(payload, length);
+		if (_headerBlock.size() > MAX_HEADER_BLOCK)
+			return connectionError(ENHANCE_YOUR_CALM);
+		if (!(flags & END_HEADERS))
+			return true;
+		_continuationStream = 0;
+		return onHeaderBlock(streamId, _continuationEndStream);
+	case PUSH_PROMISE:
+		// Only servers push
+		return connectionError(PROTOCOL_ERROR);
+	default:
+		// Unknown frame types are ignored (RFC 9113 4.1)
+		return true;
+	}
+}
+
+bool Http2Session::onHeaders(int flags, int streamId, const char *payload, size_t length)
+{
+	if (streamId == 0 || streamId % 2 == 0)
+		return connectionError(PROTOCOL_ERROR);
+	size_t start = 0;
+	size_t padding = 0;
+	if (flags & PADDED)
+	{
+		if (length < 1)
+			return connectionError(FRAME_SIZE_ERROR);
+		padding = static_cast<unsigned char>(payload[0]);
+		start = 1;
+	}
+	if (flags & PRIORITY_FLAG)
+		start += 5;
+	if (start + padding > length)
+		return connectionError(PROTOCOL_ERROR);
+	_headerBlock.assign(payload + start, length - start - padding);
+	if (!(flags & END_HEADERS))
+	{
+		_continuationStream = streamId;
+		_continuationEndStream = flags & END_STREAM;
+		return true;
+	}
+	return onHeaderBlock(streamId, flags & END_STREAM);
+}
+
+// The block is decoded even for streams that are refused, to keep the HPACK state in sync
+bool Http2Session::onHeaderBlock(int streamId, bool endStream)
+{
+	HeaderList headers;
+	bool tooLarge;
+	bool decoded = _decoder.decode(_headerBlock.data(), _headerBlock.size(), headers, _maxHeaderListSize, tooLarge);
+	_headerBlock.clear();
+	if (!decoded)
+		return connectionError(COMPRESSION_ERROR);
+
+	StreamMap::iterator it = _streams.find(streamId);
+	if (it != _streams.end())
+	{
+		// Trailers end the request; their fields are not used
+		if (it->second.requestComplete)
+		{
+			resetStream(streamId, STREAM_CLOSED);
+			return true;
+		}
+		if (!endStream)
+			return connectionError(PROTOCOL_ERROR);
+		it->second.requestComplete = true;
+		_ready.push_back(streamId);
+		return true;
+	}
+	if (streamId <= _lastStreamId)
+		return connectionError(STREAM_CLOSED);
+	_lastStreamId = streamId;
+	if (_streams.size() >= MAX_CONCURRENT_STREAMS)
+	{
+		resetStream(streamId, REFUSED_STREAM);
+		return true;
+	}
+	if (tooLarge)
+	{
+		resetStream(streamId, ENHANCE_YOUR_CALM);
+		return true;
+	}
+	if (!isValidRequest(headers))
+	{
+		resetStream(streamId, PROTOCOL_ERROR);
+		return true;
+	}
+	Stream &stream = _streams[streamId];
+	stream.sendWindow = _peerInitialWindow;
+	stream.headers.swap(headers);
+	if (endStream)
+	{
+		stream.requestComplete = true;
+		_ready.push_back(streamId);
+	}
+	return true;
+}
+
+// Flow control counts the whole payload including padding; it is given back right away
+bool Http2Session::onData(int flags, int streamId, const char *payload, size_t length)
+{
+	if (streamId == 0)
+		return connectionError(PROTOCOL_ERROR);
+	if (length)
+		writeWindowUpdate(0, length);
+	size_t start = 0;
+	size_t padding = 0;
+	if (flags & PADDED)
+	{
+		if (length < 1)
+			return connectionError(FRAME_SIZE_ERROR);
+		padding = static_cast<unsigned char>(payload[0]);
+		start = 1;
+	}
+	if (start + padding > length)
+		return connectionError(PROTOCOL_ERROR);
+
+	StreamMap::iterator it = _streams.find(streamId);
+	if (it == _streams.end() || it->second.requestComplete)
+	{
+		if (streamId > _lastStreamId)
+			return connectionError(PROTOCOL_ERROR);
+		resetStream(streamId, STREAM_CLOSED);
+		return true;
+	}
+	Stream &stream = it->second;
+	size_t size = length - start - padding;
+	if (!stream.tooLarge && stream.body.size() + stream.spooled + size > _maxBodySize)
+	{
+		stream.tooLarge = true;
+		_bufferedBodies -= stream.body.size();
+		std::string().swap(stream.body);
+		if (stream.spoolFd != -1)
+			close(stream.spoolFd);
+		stream.spoolFd = -1;
+		stream.spooled = 0;
+	}
+	if (!stream.tooLarge && !appendBody(stream, payload + start, size))
+	{
+		resetStream(streamId, INTERNAL_ERROR);
+		return true;
+	}
+	if (flags & END_STREAM)
+	{
+		stream.requestComplete = true;
+		_ready.push_back(streamId);
+	}
+	else if (length)
+		writeWindowUpdate(streamId, length);
+	return true;
+}
+
+// Into memory while all streams together stay within bodyBufferSize, into the stream's
+// spool file from the moment that would be exceeded; false if the file cannot be written
+bool Http2Session::appendBody(Stream &stream, const char *data, size_t size)
+{
+	if (stream.spoolFd == -1 && _bufferedBodies + size <= _bodyBufferSize)
+	{
+		stream.body.append(data, size);
+		_bufferedBodies += size;
+		return true;
+	}
+	if (stream.spoolFd == -1)
+	{
+		stream.spoolFd = openSpoolFile(_spoolDirectory);
+		if (stream.spoolFd == -1 || !writeAll(stream.spoolFd, stream.body.data(), stream.body.size()))
+			return false;
+		stream.spooled = stream.body.size();
+		_bufferedBodies -= stream.body.size();
+		std::string().swap(stream.body);
+	}
+	if (!writeAll(stream.spoolFd, data, size))
+		return false;
+	stream.spooled += size;
+	return true;
+}
+
+bool Http2Session::onSettings(int flags, int streamId, const char *payload, size_t length)
+{
+	if (streamId != 0)
+		return connectionError(PROTOCOL_ERROR);
+	if (flags & ACK)
+		return length == 0 || connectionError(FRAME_SIZE_ERROR);
+	if (length % 6 != 0)
+		return connectionError(FRAME_SIZE_ERROR);
+	if (!applySettings(payload, length))
+		return false;
+	writeFrame(_control, SETTINGS, ACK, 0, NULL, 0);
+	return true;
+}
+
+// Only the settings that change what we send matter: the initial stream window and
+// the frame size limit. Our encoder does not use the dynamic table.
+bool Http2Session::applySettings(const char *payload, size_t length)
+{
+	for (size_t i = 0; i + 6 <= length; i += 6)
+	{
+		int id = (static_cast<unsigned char>(payload[i]) << 8) | static_cast<unsigned char>(payload[i + 1]);
+		unsigned long value = read32(payload + i + 2);
+		if (id == 0x2 && value > 1)
+			return connectionError(PROTOCOL_ERROR);
+		if (id == 0x4)
+		{
+			if (value > MAX_WINDOW)
+				return connectionError(FLOW_CONTROL_ERROR);
+			// Changes the window of every open stream by the difference (RFC 9113 6.9.2)
+			long delta = static_cast<long>(value) - _peerInitialWindow;
+			for (StreamMap::iterator it = _streams.begin(); it != _streams.end(); ++it)
+				it->second.sendWindow += delta;
+			_peerInitialWindow = value;
+		}
+		if (id == 0x5 && (value < MAX_FRAME_SIZE || value > 0xffffff))
+			return connectionError(PROTOCOL_ERROR);
+	}
+	return true;
+}
+
+bool Http2Session::onWindowUpdate(int streamId, const char *payload, size_t length)
+{
+	if (length != 4)
+		return connectionError(FRAME_SIZE_ERROR);
+	unsigned long increment = read32(payload) & MAX_WINDOW;
+	if (streamId == 0)
+	{
+		if (increment == 0)
+			return connectionError(PROTOCOL_ERROR);
+		if (_sendWindow + increment > MAX_WINDOW)
+			return connectionError(FLOW_CONTROL_ERROR);
+		_sendWindow += increment;
+		return true;
+	}
+	StreamMap::iterator it = _streams.find(streamId);
+	if (it == _streams.end())
+		return true;
+	if (increment == 0)
+		resetStream(streamId, PROTOCOL_ERROR);
+	else if (it->second.sendWindow + increment > MAX_WINDOW)
+		resetStream(streamId, FLOW_CONTROL_ERROR);
+	else
+		it->second.sendWindow += increment;
+	return true;
+}
+
+// Queues a GOAWAY; the caller closes the connection once it is sent
+bool Http2Session::connectionError(ErrorCode code)
+{
+	if (!_closing)
+	{
+		std::string payload;
+		append32(payload, _lastStreamId);
+		append32(payload, code);
+		writeFrame(_control, GOAWAY, 0, 0, payload.data(), payload.size());
+		_closing = true;
+	}
+	return false;
+}
+
+void Http2Session::resetStream(int streamId, ErrorCode code)
+{
+	std::string payload;
+	append32(payload, code);
+	writeFrame(_control, RST_STREAM, 0, streamId, payload.data(), payload.size());
+	StreamMap::iterator it = _streams.find(streamId);
+	if (it != _streams.end())
+		closeStream(it);
+}
+
+void Http2Session::closeStream(StreamMap::iterator it)
+{
+	if (it->second.bodyFd != -1)
+		close(it->second.bodyFd);
+	if (it->second.spoolFd != -1)
+		close(it->second.spoolFd);
+	_bufferedBodies -= it->second.body.size();
+	_streams.erase(it);
+}
+
+bool Http2Session::takeRequest(int &streamId, HeaderList &headers, Body &body, bool &tooLarge)
+{
+	while (!_ready.empty())
+	{
+		int id = _ready.front();
+		_ready.pop_front();
+		// Reset by the peer in the meantime
+		StreamMap::iterator it = _streams.find(id);
+		if (it == _streams.end())
+			continue;
+		streamId = id;
+		headers.clear();
+		headers.swap(it->second.headers);
+		Stream &stream = it->second;
+		if (stream.spoolFd != -1)
+			body = Body::map(stream.spoolFd, stream.spooled);
+		else
+		{
+			_bufferedBodies -= stream.body.size();
+			body = Body::adopt(stream.body);
+		}
+		stream.spoolFd = -1;
+		stream.spooled = 0;
+		tooLarge = stream.tooLarge;
+		return true;
+	}
+	return false;
+}
+
+// HEADERS go out with the control frames, so they always precede the stream's DATA
+void Http2Session::submitResponse(int streamId, int status, const HeaderList &headers, const std::string &body,
+	int bodyFd, size_t bodyFileSize)
+{
+	StreamMap::iterator it = _streams.find(streamId);
+	if (it == _streams.end())
+	{
+		if (bodyFd != -1)
+			close(bodyFd);
+		return;
+	}
+	if (bodyFd == -1)
+		bodyFileSize = 0;
+	size_t contentLength = body.size() + bodyFileSize;
+
+	std::string block;
+	hpackEncodeStatus(block, status);
+	for (size_t i = 0; i < headers.size(); ++i)
+	{
+		if (!isSkippedResponseField(headers[i].first))
+			hpackEncodeField(block, headers[i].first, headers[i].second);
+	}
+	char digits[32];
+	snprintf(digits, sizeof(digits), "%lu", static_cast<unsigned long>(contentLength));
+	hpackEncodeField(block, "content-length", digits);
+
+	for (size_t pos = 0; pos < block.size(); pos += MAX_FRAME_SIZE)
+	{
+		size_t size = std::min(block.size() - pos, static_cast<size_t>(MAX_FRAME_SIZE));
+		int flags = (pos + size == block.size()) ? END_HEADERS : 0;
+		if (pos == 0 && contentLength == 0)
+			flags |= END_STREAM;
+		writeFrame(_control, pos == 0 ? HEADERS : CONTINUATION, flags, streamId, block.data() + pos, size);
+	}
+
+	Stream &stream = it->second;
+	stream.responded = true;
+	stream.data = body;
+	stream.dataOffset = 0;
+	stream.bodyFd = bodyFd;
+	stream.bodyRemaining = bodyFileSize;
+	if (contentLength == 0)
+		closeStream(it);
+}
+
+// Round-robin over the streams that have data and window left, starting after the last one served
+Http2Session::StreamMap::iterator Http2Session::nextSendable()
+{
+	StreamMap::iterator it = _streams.upper_bound(_lastServed);
+	for (size_t i = 0; i < _streams.size(); ++i, ++it)
+	{
+		if (it == _streams.end())
+			it = _streams.begin();
+		if (it->second.responded && it->second.sendWindow > 0 && it->second.hasData())
+			return it;
+	}
+	return _streams.end();
+}
+
+void Http2Session::produce(std::string &out, size_t limit)
+{
+	out += _control;
+	_control.clear();
+	if (_closing)
+		return;
+	char buffer[MAX_FRAME_SIZE];
+	while (out.size() < limit && _sendWindow > 0)
+	{
+		StreamMap::iterator it = nextSendable();
+		if (it == _streams.end())
+			break;
+		Stream &stream = it->second;
+		_lastServed = it->first;
+		size_t size = std::min(static_cast<long>(MAX_FRAME_SIZE), std::min(_sendWindow, stream.sendWindow));
+		const char *data;
+		if (stream.dataOffset < stream.data.size())
+		{
+			size = std::min(size, stream.data.size() - stream.dataOffset);
+			data = stream.data.data() + stream.dataOffset;
+			stream.dataOffset += size;
+		}
+		else
+		{
+			ssize_t bytes = read(stream.bodyFd, buffer, std::min(size, stream.bodyRemaining));
+			if (bytes <= 0)
+			{
+				// The file ended early or cannot be read, only this stream fails
+				resetStream(it->first, INTERNAL_ERROR);
+				continue;
+			}
+			size = bytes;
+			data = buffer;
+			stream.bodyRemaining -= size;
+		}
+		writeFrame(out, DATA, stream.hasData() ? 0 : END_STREAM, it->first, data, size);
+		_sendWindow -= size;
+		stream.sendWindow -= size;
+		if (!stream.hasData())
+			closeStream(it);
+	}
+}
+
+bool Http2Session::wantsWrite() const
+{
+	if (!_control.empty())
+		return true;
+	if (_closing || _sendWindow <= 0)
+		return false;
+	for (StreamMap::const_iterator it = _streams.begin(); it != _streams.end(); ++it)
+	{
+		if (it->second.responded && it->second.sendWindow > 0 && it->second.hasData())
+			return true;
+	}
+	return false;
+}
+
+size_t Http2Session::getControlSize() const
+{
+	return _control.size();
+}
+
+// No stream open and nothing left to send
+bool Http2Session::isIdle() const
+{
+	return _streams.empty() && _control.empty();
+}
+
+bool Http2Session::isClosing() const
+{
+	return _closing;
+}
+
+int Http2Session::getCurrentStream() const
+{
+	return _currentStream;
+}
+
+void Http2Session::setCurrentStream(int streamId)
+{
+	_currentStream = streamId;
+}
+
+void Http2Session::writeFrame(std::string &out, int type, int flags, int streamId, const char *payload, size_t length)
+{
+	out += static_cast<char>((length >> 16) & 0xff);
+	out += static_cast<char>((length >> 8) & 0xff);
+	out += static_cast<char>(length & 0xff);
+	out += static_cast<char>(type);
+	out += static_cast<char>(flags);
+	append32(out, static_cast<unsigned long>(streamId) & MAX_WINDOW);
+	if (length)
+		out.append(payload, length);
+}
+
+void Http2Session::writeWindowUpdate(int streamId, size_t increment)
+{
+	std::string payload;
+	append32(payload, increment);
+	writeFrame(_control, WINDOW_UPDATE, 0, streamId, payload.data(), payload.size());
+}
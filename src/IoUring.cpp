@@ -0,0 +1,481 @@
+#include "../include/IoUring.hpp"
+#include "../include/BufferPool.hpp"
+#include "../include/Webserver.hpp"
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+
+IoUring::Slot::Slot()
+	: mode(POLL), index(0), poll(0), pollEvents(0), recv(0), targets(NULL), received(false),
+	  receivedResult(0), receivedBuffer(-1)
+{
+	for (int i = 0; i < ACCEPT_BATCH; ++i)
+		accepts[i] = 0;
+}
+
+IoUring::IoUring()
+	: _fd(-1), _sqEntries(0), _cqEntries(0), _sqRing(NULL), _cqRing(NULL), _sqRingSize(0), _cqRingSize(0),
+	  _sqes(NULL), _sqHead(NULL), _sqTail(NULL), _sqMask(NULL), _sqArray(NULL), _cqHead(NULL), _cqTail(NULL),
+	  _cqMask(NULL), _cqes(NULL), _pendingTail(0), _bufferRing(NULL), _buffers(NULL), _bufferRingSize(0),
+	  _bufferTail(0), _sequence(0), _syscalls(0)
+{
+}
+
+IoUring* IoUring::create(std::string &reason)
+{
+	IoUring *ring = new IoUring();
+	if (!ring->setup(reason))
+	{
+		delete ring;
+		return NULL;
+	}
+	return ring;
+}
+
+#ifdef __linux__
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+IoUring::~IoUring()
+{
+	// Closing the ring cancels everything in flight before the memory it used goes away
+	if (_fd != -1)
+		close(_fd);
+	for (size_t fd = 0; fd < _slots.size(); ++fd)
+	{
+		for (size_t i = 0; i < _slots[fd].accepted.size(); ++i)
+		{
+			if (_slots[fd].accepted[i].fd != -1)
+				close(_slots[fd].accepted[i].fd);
+		}
+	}
+	if (_sqRing)
+		munmap(_sqRing, _sqRingSize);
+	if (_cqRing && _cqRing != _sqRing)
+		munmap(_cqRing, _cqRingSize);
+	if (_sqes)
+		munmap(_sqes, _sqEntries * sizeof(io_uring_sqe));
+	if (_bufferRing)
+		munmap(_bufferRing, _bufferRingSize);
+	if (_buffers)
+		munmap(_buffers, IO_URING_RECV_BUFFERS * BufferPool::SLAB_SIZE);
+	for (size_t i = 0; i < _targets.size(); ++i)
+		delete[] _targets[i];
+}
+
+static std::string systemError(const char *what)
+{
+	return std::string(what) + ": " + std::strerror(errno);
+}
+
+bool IoUring::setup(std::string &reason)
+{
+	io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+	// Every fd can have a poll, a recv and a cancel in flight, so completions get more room
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+	params.cq_entries = IO_URING_ENTRIES * 4;
+	_fd = syscall(__NR_io_uring_setup, IO_URING_ENTRIES, &params);
+	if (_fd == -1 && errno == EINVAL)
+	{
+		params.flags = IORING_SETUP_CQSIZE;
+		_fd = syscall(__NR_io_uring_setup, IO_URING_ENTRIES, &params);
+	}
+	if (_fd == -1)
+	{
+		reason = systemError("io_uring_setup");
+		return false;
+	}
+	const unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+	if ((params.features & needed) != needed)
+	{
+		reason = "kernel lacks required io_uring features";
+		return false;
+	}
+	_sqEntries = params.sq_entries;
+	_cqEntries = params.cq_entries;
+
+	// One mapping holds both rings (IORING_FEAT_SINGLE_MMAP)
+	_sqRingSize = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+		params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+	void *rings = mmap(NULL, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+	if (rings == MAP_FAILED)
+	{
+		reason = systemError("mmap of the io_uring rings");
+		return false;
+	}
+	_sqRing = rings;
+	_cqRing = rings;
+	void *sqes = mmap(NULL, _sqEntries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+	{
+		reason = systemError("mmap of the submission queue entries");
+		return false;
+	}
+	_sqes = static_cast<io_uring_sqe *>(sqes);
+	char *base = static_cast<char *>(rings);
+	_sqHead = reinterpret_cast<unsigned *>(base + params.sq_off.head);
+	_sqTail = reinterpret_cast<unsigned *>(base + params.sq_off.tail);
+	_sqMask = reinterpret_cast<unsigned *>(base + params.sq_off.ring_mask);
+	_sqArray = reinterpret_cast<unsigned *>(base + params.sq_off.array);
+	_cqHead = reinterpret_cast<unsigned *>(base + params.cq_off.head);
+	_cqTail = reinterpret_cast<unsigned *>(base + params.cq_off.tail);
+	_cqMask = reinterpret_cast<unsigned *>(base + params.cq_off.ring_mask);
+	_cqes = reinterpret_cast<io_uring_cqe *>(base + params.cq_off.cqes);
+	_pendingTail = *_sqTail;
+
+	// Provided buffers for recv: the kernel picks one when data arrives, so idle
+	// connections do not hold a buffer while they wait
+	_bufferRingSize = IO_URING_RECV_BUFFERS * sizeof(io_uring_buf);
+	void *bufferRing = mmap(NULL, _bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	void *buffers = mmap(NULL, IO_URING_RECV_BUFFERS * BufferPool::SLAB_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	_bufferRing = (bufferRing == MAP_FAILED) ? NULL : static_cast<io_uring_buf_ring *>(bufferRing);
+	_buffers = (buffers == MAP_FAILED) ? NULL : static_cast<char *>(buffers);
+	if (!_bufferRing || !_buffers)
+	{
+		reason = systemError("mmap of the receive buffers");
+		return false;
+	}
+	io_uring_buf_reg registration;
+	std::memset(&registration, 0, sizeof(registration));
+	registration.ring_addr = reinterpret_cast<uintptr_t>(_bufferRing);
+	registration.ring_entries = IO_URING_RECV_BUFFERS;
+	registration.bgid = 0;
+	if (syscall(__NR_io_uring_register, _fd, IORING_REGISTER_PBUF_RING, &registration, 1) == -1)
+	{
+		reason = systemError("registering the provided buffer ring");
+		return false;
+	}
+	for (int i = 0; i < IO_URING_RECV_BUFFERS; ++i)
+		recycle(i);
+	return true;
+}
+
+IoUring::Slot& IoUring::slot(int fd)
+{
+	if (static_cast<size_t>(fd) >= _slots.size())
+		_slots.resize(fd + 1);
+	return _slots[fd];
+}
+
+void IoUring::watch(int fd, Mode mode)
+{
+	if (slot(fd).mode == mode)
+		return;
+	forget(fd);
+	Slot &s = slot(fd);
+	s.mode = mode;
+	if (mode == ACCEPT)
+	{
+		s.targets = new AcceptTarget[ACCEPT_BATCH];
+		_targets.push_back(s.targets);
+	}
+}
+
+void IoUring::forget(int fd)
+{
+	if (fd < 0 || static_cast<size_t>(fd) >= _slots.size())
+		return;
+	Slot &s = _slots[fd];
+	cancelAll(s);
+	if (s.received && s.receivedBuffer != -1)
+		recycle(s.receivedBuffer);
+	for (size_t i = 0; i < s.accepted.size(); ++i)
+	{
+		if (s.accepted[i].fd != -1)
+			close(s.accepted[i].fd);
+	}
+	// An accept that is being cancelled may still write to the old targets, they are kept
+	s = Slot();
+}
+
+void IoUring::cancelAll(Slot &s)
+{
+	if (s.poll)
+		cancel(s.poll);
+	if (s.recv)
+		cancel(s.recv);
+	for (int i = 0; i < ACCEPT_BATCH; ++i)
+	{
+		if (s.accepts[i])
+			cancel(s.accepts[i]);
+	}
+}
+
+io_uring_sqe* IoUring::nextSqe()
+{
+	// A full submission queue is flushed right away, that is rare with IO_URING_ENTRIES
+	if (_pendingTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries)
+		enter(0, 0);
+	unsigned index = _pendingTail & *_sqMask;
+	_sqArray[index] = index;
+	++_pendingTail;
+	io_uring_sqe *sqe = &_sqes[index];
+	std::memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+// user_data: sequence number, operation, accept index and fd
+uint64_t IoUring::submit(int op, int fd, int index, short events)
+{
+	io_uring_sqe *sqe = nextSqe();
+	uint64_t data = (static_cast<uint64_t>(++_sequence) << 32) | (op << 28) | (index << 24) | fd;
+	sqe->user_data = data;
+	sqe->fd = fd;
+	if (op == OP_POLL)
+	{
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = events;
+	}
+	else if (op == OP_RECV)
+	{
+		sqe->opcode = IORING_OP_RECV;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = 0;
+		sqe->len = BufferPool::SLAB_SIZE;
+	}
+	else
+	{
+		AcceptTarget &target = _slots[fd].targets[index];
+		target.length = sizeof(target.addr);
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->addr = reinterpret_cast<uintptr_t>(&target.addr);
+		sqe->addr2 = reinterpret_cast<uintptr_t>(&target.length);
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	}
+	return data;
+}
+
+void IoUring::cancel(uint64_t target)
+{
+	io_uring_sqe *sqe = nextSqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = target;
+	sqe->user_data = static_cast<uint64_t>(OP_CANCEL) << 28;
+}
+
+// Submits what is queued and, with minComplete, waits up to timeoutMs (-1: no limit)
+int IoUring::enter(unsigned minComplete, int timeoutMs)
+{
+	__atomic_store_n(_sqTail, _pendingTail, __ATOMIC_RELEASE);
+	unsigned toSubmit = _pendingTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+	__kernel_timespec timeout;
+	io_uring_getevents_arg arg;
+	std::memset(&arg, 0, sizeof(arg));
+	if (timeoutMs >= 0)
+	{
+		timeout.tv_sec = timeoutMs / 1000;
+		timeout.tv_nsec = (timeoutMs % 1000) * 1000000L;
+		arg.ts = reinterpret_cast<uintptr_t>(&timeout);
+	}
+	++_syscalls;
+	int ret = syscall(__NR_io_uring_enter, _fd, toSubmit, minComplete,
+		IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	if (ret == -1 && errno == ETIME)
+		return 0;
+	return ret;
+}
+
+int IoUring::wait(std::vector<pollfd> &fds, int timeoutMs)
+{
+	bool ready = false;
+	for (size_t i = 0; i < fds.size(); ++i)
+	{
+		pollfd &pfd = fds[i];
+		pfd.revents = 0;
+		Slot &s = slot(pfd.fd);
+		s.index = i;
+		bool wantsInput = pfd.events & POLLIN;
+		short pollEvents = pfd.events & (s.mode == POLL ? (POLLIN | POLLOUT) : POLLOUT);
+		if (s.poll && s.pollEvents != pollEvents)
+		{
+			cancel(s.poll);
+			s.poll = 0;
+		}
+		if (!s.poll && pollEvents)
+		{
+			s.poll = submit(OP_POLL, pfd.fd, 0, pollEvents);
+			s.pollEvents = pollEvents;
+		}
+		// A recv in flight while the server does not read is left alone, what it gets is
+		// kept until the server asks for input again
+		if (s.mode == RECEIVE && wantsInput)
+		{
+			if (s.received)
+				pfd.revents |= POLLIN;
+			else if (!s.recv)
+				s.recv = submit(OP_RECV, pfd.fd, 0, 0);
+		}
+		if (s.mode == ACCEPT && wantsInput)
+		{
+			if (!s.accepted.empty())
+				pfd.revents |= POLLIN;
+			for (int k = 0; k < ACCEPT_BATCH; ++k)
+			{
+				if (!s.accepts[k])
+					s.accepts[k] = submit(OP_ACCEPT, pfd.fd, k, 0);
+			}
+		}
+		ready = ready || pfd.revents;
+	}
+	// Results that are already there only need the submission, not a wait
+	int ret = enter(ready ? 0 : 1, ready ? 0 : timeoutMs);
+	int savedErrno = errno;
+
+	unsigned head = *_cqHead;
+	unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+	for (; head != tail; ++head)
+		complete(_cqes[head & *_cqMask], fds);
+	__atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+
+	int count = 0;
+	for (size_t i = 0; i < fds.size(); ++i)
+		count += (fds[i].revents != 0);
+	if (count == 0 && ret == -1)
+	{
+		errno = savedErrno;
+		return -1;
+	}
+	return count;
+}
+
+// Results of requests that are no longer current (cancelled, or their fd was forgotten)
+// only have their resources returned
+void IoUring::complete(const io_uring_cqe &cqe, std::vector<pollfd> &fds)
+{
+	uint64_t data = cqe.user_data;
+	int fd = data & 0xffffff;
+	int index = (data >> 24) & 0xf;
+	int op = (data >> 28) & 0xf;
+	if (op == OP_CANCEL)
+		return;
+	Slot *s = (static_cast<size_t>(fd) < _slots.size()) ? &_slots[fd] : NULL;
+	pollfd *pfd = (s && s->index < fds.size() && fds[s->index].fd == fd) ? &fds[s->index] : NULL;
+	if (s && op == OP_POLL && data == s->poll)
+	{
+		s->poll = 0;
+		if (cqe.res > 0 && pfd)
+			pfd->revents |= cqe.res;
+	}
+	else if (s && op == OP_RECV && data == s->recv)
+	{
+		s->recv = 0;
+		s->received = true;
+		s->receivedResult = cqe.res;
+		s->receivedBuffer = (cqe.flags & IORING_CQE_F_BUFFER) ? static_cast<int>(cqe.flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+		if (pfd && (pfd->events & POLLIN))
+			pfd->revents |= POLLIN;
+	}
+	else if (s && op == OP_ACCEPT && data == s->accepts[index])
+	{
+		s->accepts[index] = 0;
+		Accepted accepted;
+		accepted.fd = (cqe.res >= 0) ? cqe.res : -1;
+		accepted.error = (cqe.res >= 0) ? 0 : -cqe.res;
+		accepted.addr = s->targets[index].addr;
+		s->accepted.push_back(accepted);
+		if (pfd && (pfd->events & POLLIN))
+			pfd->revents |= POLLIN;
+	}
+	else
+		discard(op, cqe);
+}
+
+void IoUring::discard(int op, const io_uring_cqe &cqe)
+{
+	if (op == OP_RECV && (cqe.flags & IORING_CQE_F_BUFFER))
+		recycle(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+	else if (op == OP_ACCEPT && cqe.res >= 0)
+		close(cqe.res);
+}
+
+// Hands a buffer back to the kernel by appending it to the provided buffer ring
+void IoUring::recycle(int bufferId)
+{
+	io_uring_buf *entries = reinterpret_cast<io_uring_buf *>(_bufferRing);
+	io_uring_buf &entry = entries[_bufferTail & (IO_URING_RECV_BUFFERS - 1)];
+	entry.addr = reinterpret_cast<uintptr_t>(_buffers + static_cast<size_t>(bufferId) * BufferPool::SLAB_SIZE);
+	entry.len = BufferPool::SLAB_SIZE;
+	entry.bid = bufferId;
+	++_bufferTail;
+	__atomic_store_n(&_bufferRing->tail, _bufferTail, __ATOMIC_RELEASE);
+}
+
+bool IoUring::takeReceived(int fd, const char *&data, ssize_t &bytes)
+{
+	if (fd < 0 || static_cast<size_t>(fd) >= _slots.size() || !_slots[fd].received)
+		return false;
+	Slot &s = _slots[fd];
+	s.received = false;
+	data = NULL;
+	// All buffers were in use: the socket is readable, the caller reads it itself
+	if (s.receivedResult == -ENOBUFS)
+		return false;
+	if (s.receivedResult < 0)
+	{
+		errno = -s.receivedResult;
+		bytes = -1;
+		return true;
+	}
+	if (s.receivedBuffer != -1)
+		data = _buffers + static_cast<size_t>(s.receivedBuffer) * BufferPool::SLAB_SIZE;
+	bytes = s.receivedResult;
+	return true;
+}
+
+bool IoUring::ownsBuffer(const char *data) const
+{
+	return data && _buffers && data >= _buffers && data < _buffers + IO_URING_RECV_BUFFERS * BufferPool::SLAB_SIZE;
+}
+
+void IoUring::releaseBuffer(const char *data)
+{
+	recycle((data - _buffers) / BufferPool::SLAB_SIZE);
+}
+
+bool IoUring::takeAccepted(int fd, int &clientFd, sockaddr_in &addr)
+{
+	if (fd < 0 || static_cast<size_t>(fd) >= _slots.size() || _slots[fd].accepted.empty())
+		return false;
+	Accepted accepted = _slots[fd].accepted.front();
+	_slots[fd].accepted.pop_front();
+	clientFd = accepted.fd;
+	addr = accepted.addr;
+	if (clientFd == -1)
+		errno = accepted.error;
+	return true;
+}
+
+#else
+
+IoUring::~IoUring() {}
+
+bool IoUring::setup(std::string &reason)
+{
+	reason = "io_uring is Linux only";
+	return false;
+}
+
+void IoUring::watch(int, Mode) {}
+void IoUring::forget(int) {}
+int IoUring::wait(std::vector<pollfd> &fds, int timeoutMs) { return poll(fds.data(), fds.size(), timeoutMs); }
+bool IoUring::takeReceived(int, const char *&, ssize_t &) { return false; }
+bool IoUring::ownsBuffer(const char *) const { return false; }
+void IoUring::releaseBuffer(const char *) {}
+bool IoUring::takeAccepted(int, int &, sockaddr_in &) { return false; }
+
+#endif
+
+unsigned long IoUring::takeSyscalls()
+{
+	unsigned long syscalls = _syscalls;
+	_syscalls = 0;
+	return syscalls;
+}
@@ -5,14 +5,134 @@
 #include "../include/CGIHandler.hpp"
 #include "../include/Logger.hpp"
 #include "../include/Utils.hpp"
-#include <dirent.h>
-#include <algorithm>
+#include <cstdlib>
 
-void Server::list_directory(const std::string &path, Response& res)
+// Value of name=value in a query string, empty if it is not there
+static std::string queryParam(const std::string &query, const std::string &name)
 {
-	DIR* dir = opendir(path.c_str());
-	if (!dir) {
-		logError("Failed to open directory: " + path + " - " + std::string(strerror(errno)));
+	size_t pos = 0;
+	while (pos <= query.size())
+	{
+		size_t end = query.find('&', pos);
+		if (end == std::string::npos)
+			end = query.size();
+		if (query.compare(pos, name.size(), name) == 0 && pos + name.size() < end && query[pos + name.size()] == '=')
+			return query.substr(pos + name.size() + 1, end - pos - name.size() - 1);
+		pos = end + 1;
+	}
+	return "";
+}
+
+static void appendHtmlEscaped(std::string &out, const std::string &text)
+{
+	for (size_t i = 0; i < text.size(); ++i)
+	{
+		switch (text[i])
+		{
+			case '&': out += "&amp;"; break;
+			case '<': out += "&lt;"; break;
+			case '>': out += "&gt;"; break;
+			case '"': out += "&quot;"; break;
+			default: out += text[i];
+		}
+	}
+}
+
+static void appendJsonString(std::string &out, const std::string &text)
+{
+	out += '"';
+	for (size_t i = 0; i < text.size(); ++i)
+	{
+		unsigned char c = text[i];
+		if (c == '"' || c == '\\')
+		{
+			out += '\\';
+			out += c;
+		}
+		else if (c < 0x20)
+		{
+			char escaped[8];
+			snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+			out += escaped;
+		}
+		else
+			out += c;
+	}
+	out += '"';
+}
+
+static std::string renderHtml(const std::string &urlPath, const std::vector<DirectoryCache::Entry> &entries,
+	size_t first, size_t last, size_t page, size_t pages)
+{
+	std::string html;
+	html.reserve(256 + (last - first) * 64);
+	html += "<html><head><title>Index of ";
+	appendHtmlEscaped(html, urlPath);
+	html += "</title></head><body>\n<h1>Index of ";
+	appendHtmlEscaped(html, urlPath);
+	html += "</h1>\n<ul>\n";
+
+	// Add parent directory link if not at root
+	if (urlPath != "/")
+		html += "<li><a href=\"../\">[Parent Directory]</a></li>\n";
+
+	for (size_t i = first; i < last; ++i)
+	{
+		const DirectoryCache::Entry &entry = entries[i];
+		html += "<li><a href=\"";
+		appendHtmlEscaped(html, entry.name);
+		if (entry.isDirectory)
+			html += "/";
+		html += "\">";
+		appendHtmlEscaped(html, entry.name);
+		if (entry.isDirectory)
+			html += "/";
+		html += "</a></li>\n";
+	}
+	html += "</ul>\n";
+
+	if (pages > 1)
+	{
+		html += "<p>";
+		if (page > 1)
+			html += "<a href=\"?page=" + intToStr(page - 1) + "\">Previous</a> ";
+		html += "Page " + intToStr(page) + " of " + intToStr(pages);
+		if (page < pages)
+			html += " <a href=\"?page=" + intToStr(page + 1) + "\">Next</a>";
+		html += "</p>\n";
+	}
+	html += "</body></html>\n";
+	return html;
+}
+
+static std::string renderJson(const std::string &urlPath, const std::vector<DirectoryCache::Entry> &entries,
+	size_t first, size_t last, size_t page, size_t pages)
+{
+	std::string json;
+	json.reserve(128 + (last - first) * 48);
+	json += "{\"path\":";
+	appendJsonString(json, urlPath);
+	json += ",\"page\":" + intToStr(page) + ",\"pages\":" + intToStr(pages)
+		+ ",\"total\":" + intToStr(entries.size()) + ",\"entries\":[";
+	for (size_t i = first; i < last; ++i)
+	{
+		if (i > first)
+			json += ',';
+		json += "{\"name\":";
+		appendJsonString(json, entries[i].name);
+		json += entries[i].isDirectory ? ",\"type\":\"directory\"}" : ",\"type\":\"file\"}";
+	}
+	json += "]}\n";
+	return json;
+}
+
+// Autoindex page for a directory, AUTOINDEX_PAGE_SIZE entries per page (?page=n). The format
+// is HTML unless the location sets `autoindex_format json` or the query asks for format=json.
+// Sorted entries and rendered pages come from _autoindexCache.
+void Server::list_directory(const std::string &path, const std::string &query, const LocationConfig *loc, Response& res)
+{
+	DirectoryCache::Listing *listing = _autoindexCache.lookup(path);
+	if (!listing) {
 		res.setStatus(500);
 		std::string body = "<html><body><h1>500 Internal Server Error</h1><p>Cannot read directory.</p></body></html>";
 		res.setHeader("Content-Type", "text/html");
@@ -30,59 +150,39 @@ void Server::list_directory(const std::string &path, Response& res)
 		urlPath = "/";
 	}
 
-	// Start building HTML response
-	std::ostringstream html;
-	html << "<html><head><title>Index of " << urlPath << "</title></head><body>\n";
-	html << "<h1>Index of " << urlPath << "</h1>\n";
-	html << "<ul>\n";
-
-	// Add parent directory link if not at root
-	if (urlPath != "/") {
-		html << "<li><a href=\"../\">[Parent Directory]</a></li>\n";
-	}
-
-	// Read directory entries
-	std::vector<std::string> entries;
-	struct dirent* entry;
-	while ((entry = readdir(dir)) != NULL) {
-		std::string name = entry->d_name;
-
-		// Skip current and parent directory entries
-		if (name == "." || name == "..") {
-			continue;
-		}
-		entries.push_back(name);
+	std::string format = queryParam(query, "format");
+	bool json = format.empty() ? (loc && loc->getAutoindexFormat() == "json") : format == "json";
+	const std::vector<DirectoryCache::Entry> &entries = listing->entries;
+	size_t pages = entries.empty() ? 1 : (entries.size() + AUTOINDEX_PAGE_SIZE - 1) / AUTOINDEX_PAGE_SIZE;
+	std::string pageParam = queryParam(query, "page");
+	long page = pageParam.empty() ? 1 : std::strtol(pageParam.c_str(), NULL, 10);
+	if (page < 1 || static_cast<size_t>(page) > pages)
+	{
+		std::string body = "<html><body><h1>404 Not Found</h1><p>No such page.</p></body></html>";
+		res.setStatus(404);
+		res.setHeader("Content-Type", "text/html");
+		res.setHeader("Content-Length", intToStr(body.size()));
+		res.setBody(body);
+		return;
 	}
-	closedir(dir);
-
-	// Simple alphabetical sort
-	std::sort(entries.begin(), entries.end());
 
-	// Generate list items for each entry
-	for (std::vector<std::string>::const_iterator it = entries.begin();
-		 it != entries.end(); ++it) {
-		const std::string& name = *it;
-		std::string fullEntryPath = path + "/" + name;
-
-		bool isDir = isDirectory(fullEntryPath);
-		std::string displayName = name;
-		if (isDir) {
-			displayName += "/";
-		}
-
-		html << "<li><a href=\"" << name;
-		if (isDir) html << "/";
-		html << "\">" << displayName << "</a></li>\n";
+	std::string key = (json ? "json:" : "html:") + intToStr(page);
+	std::map<std::string, std::string>::iterator rendered = listing->pages.find(key);
+	if (rendered == listing->pages.end())
+	{
+		size_t first = (page - 1) * AUTOINDEX_PAGE_SIZE;
+		size_t last = std::min(first + AUTOINDEX_PAGE_SIZE, entries.size());
+		std::string body = json ? renderJson(urlPath, entries, first, last, page, pages)
+			: renderHtml(urlPath, entries, first, last, page, pages);
+		// Only the pages actually requested are kept, and not too many of them
+		if (listing->pages.size() >= AUTOINDEX_CACHED_PAGES)
+			listing->pages.clear();
+		rendered = listing->pages.insert(std::make_pair(key, body)).first;
+		LOG_INFO("Directory listing generated for: " + path);
 	}
 
-	html << "</ul>\n";
-	html << "</body></html>\n";
-
-	std::string responseBody = html.str();
 	res.setStatus(200);
-	res.setHeader("Content-Type", "text/html");
-	res.setHeader("Content-Length", intToStr(responseBody.size()));
-	res.setBody(responseBody);
-
-	logInfo("Directory listing generated for: " + path);
+	res.setHeader("Content-Type", json ? "application/json" : "text/html");
+	res.setHeader("Content-Length", intToStr(rendered->second.size()));
+	res.setBody(rendered->second);
 }
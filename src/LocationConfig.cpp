@@ -2,8 +2,9 @@
 #include "../include/Utils.hpp"
 #include "../include/Logger.hpp"
 #include <sstream>
+#include <stdexcept>
 
-LocationConfig::LocationConfig() : autoindex(false)
+LocationConfig::LocationConfig() : autoindex(false), autoindex_format("html"), cgi_cache_ttl(0), cgi_cache_stale(0), limit_conn(-1), client_max_body_size(-1)
 {
 	methods.push_back("GET");
 	autoindex = false;
@@ -36,6 +37,13 @@ void LocationConfig::parseBlock(std::istream &stream)
 			iss >> val;
 			autoindex = (val == "on");
 		}
+		else if (key == "autoindex_format")
+		{
+			// autoindex_format html|json
+			iss >> autoindex_format;
+			if (autoindex_format != "html" && autoindex_format != "json")
+				throw std::runtime_error("Invalid autoindex_format: " + autoindex_format);
+		}
 		else if (key == "allow_methods")
 		{
 			methods.clear();
@@ -55,6 +63,50 @@ void LocationConfig::parseBlock(std::istream &stream)
 			iss >> cgi_path;
 		else if (key == "cgi_ext")
 			iss >> cgi_ext;
+		else if (key == "stub_status")
+		{
+			// stub_status [on|text|prometheus|off]
+			std::string val = "text";
+			iss >> val;
+			if (val == "on")
+				val = "text";
+			if (val != "text" && val != "prometheus" && val != "off")
+				throw std::runtime_error("Invalid stub_status format: " + val);
+			stub_status = (val == "off") ? "" : val;
+		}
+		else if (key == "client_max_body_size")
+		{
+			// Overrides the server's limit for this location
+			std::string val;
+			iss >> val;
+			client_max_body_size = parseSize(val);
+			if (client_max_body_size < 0)
+				throw std::runtime_error("Invalid client_max_body_size: " + val);
+		}
+		else if (key == "limit_req")
+			limit_req = LimitReq::parse(iss);
+		else if (key == "limit_conn")
+		{
+			// limit_conn <connections per client IP> (0 = off)
+			if (!(iss >> limit_conn) || limit_conn < 0)
+				throw std::runtime_error("Invalid limit_conn value");
+		}
+		else if (key == "cgi_cache")
+		{
+			// cgi_cache <ttl> [stale=<ttl>] | off
+			std::string val;
+			iss >> val;
+			cgi_cache_ttl = (val == "off") ? 0 : parseDuration(val);
+			if (cgi_cache_ttl < 0)
+				throw std::runtime_error("Invalid cgi_cache duration: " + val);
+			while (iss >> val)
+			{
+				if (val.compare(0, 6, "stale=") == 0)
+					cgi_cache_stale = parseDuration(val.substr(6));
+				if (cgi_cache_stale < 0)
+					throw std::runtime_error("Invalid cgi_cache stale duration: " + val);
+			}
+		}
 	}
 }
 
@@ -62,11 +114,18 @@ const std::string &LocationConfig::getPath() const { return path; }
 const std::string &LocationConfig::getRoot() const { return root; }
 const std::string &LocationConfig::getIndex() const { return index; }
 bool LocationConfig::isAutoindex() const { return autoindex; }
+const std::string &LocationConfig::getAutoindexFormat() const { return autoindex_format; }
 const std::vector<std::string> &LocationConfig::getMethods() const { return methods; }
 const std::string &LocationConfig::getRedirect() const { return redirect; }
 const std::string &LocationConfig::getCgiPath() const { return cgi_path; }
 const std::string &LocationConfig::getCgiExt() const { return cgi_ext; }
 const std::string &LocationConfig::getUploadDir() const { return upload_dir; }
+int LocationConfig::getCgiCacheTtl() const { return cgi_cache_ttl; }
+int LocationConfig::getCgiCacheStale() const { return cgi_cache_stale; }
+const std::string &LocationConfig::getStubStatus() const { return stub_status; }
+const LimitReq &LocationConfig::getLimitReq() const { return limit_req; }
+int LocationConfig::getLimitConn() const { return limit_conn; }
+long LocationConfig::getClientMaxBodySize() const { return client_max_body_size; }
 
 void LocationConfig::setUploadDir(const std::string &dir) { upload_dir = dir; }
 void LocationConfig::setPath(const std::string &p) { path = p; }
@@ -88,7 +147,8 @@ void LocationConfig::print() const
 			   << "\nAutoindex: " << (autoindex ? "on" : "off")
 			   << "\nRedirect: " << redirect
 			   << "\nCGI Path: " << cgi_path
-			   << "\nCGI Ext: " << cgi_ext;
+			   << "\nCGI Ext: " << cgi_ext
+			   << "\nCGI Cache: " << cgi_cache_ttl << "s (stale " << cgi_cache_stale << "s)";
 
 	logDebug(infoStream.str());
 	std::cout << infoStream.str() << std::endl;
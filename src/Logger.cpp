@@ -1,15 +1,28 @@
 #include "../include/Logger.hpp"
-#include <ctime>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
 
 Logger::Logger()
-    : currentLevel(INFO), fileOutputEnabled(false)
+    : currentLevel(INFO), logFd(-1), consoleOutput(true),
+      enqueuePos(0), dequeuePos(0), dropped(0), running(false), sleeping(false), cachedTime(0)
 {
+    for (unsigned long i = 0; i < RING_SIZE; ++i)
+        ring[i].sequence = i;
+    cachedStamp[0] = '\0';
+    pthread_mutex_init(&wakeLock, NULL);
+    pthread_cond_init(&wakeUp, NULL);
 }
 
 Logger::~Logger()
 {
-    if (logFile.is_open())
-        logFile.close();
+    stop();
+    if (logFd != -1)
+        close(logFd);
+    pthread_cond_destroy(&wakeUp);
+    pthread_mutex_destroy(&wakeLock);
 }
 
 Logger& Logger::getInstance()
@@ -23,31 +36,245 @@ void Logger::setLevel(Level level)
     currentLevel = level;
 }
 
+// Should be called before start(), the writer thread does not expect the fd to change
 void Logger::setLogFile(const std::string& filename)
 {
-    if (logFile.is_open())
-        logFile.close();
-    logFile.open(filename.c_str(), std::ios::app);
-    fileOutputEnabled = logFile.is_open();
+    if (logFd != -1)
+        close(logFd);
+    logFd = open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+}
+
+void Logger::setConsoleOutput(bool enabled)
+{
+    consoleOutput = enabled;
+}
+
+bool Logger::isRunning() const
+{
+    return __atomic_load_n(&running, __ATOMIC_ACQUIRE);
+}
+
+void Logger::setRunning(bool value)
+{
+    __atomic_store_n(&running, value, __ATOMIC_RELEASE);
+}
+
+void Logger::start()
+{
+    if (isRunning())
+        return;
+    setRunning(true);
+    if (pthread_create(&writer, NULL, &Logger::writerMain, this) != 0)
+        setRunning(false);
+}
+
+// Whatever the writer has not picked up yet is written here, after it has exited
+void Logger::stop()
+{
+    if (!isRunning())
+        return;
+    setRunning(false);
+    wakeWriter();
+    pthread_join(writer, NULL);
+    drain();
+}
+
+unsigned long Logger::getDroppedCount() const
+{
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
 }
 
 void Logger::log(Level level, const std::string& message)
 {
     if (level < currentLevel)
         return;
-    std::string output = "[" + getTimestamp() + "] " + levelToString(level) + ": " + message;
-    if (level >= ERROR)
-        std::cerr << output << std::endl;
-    else
-        std::cout << output << std::endl;
-    if (fileOutputEnabled && logFile.is_open())
+    if (isRunning())
+    {
+        enqueue(level, message);
+        return;
+    }
+    char line[MESSAGE_SIZE + 64];
+    size_t length = std::min(message.size(), static_cast<size_t>(MESSAGE_SIZE));
+    size_t size = format(line, level, std::time(0), message.c_str(), length);
+    if (consoleOutput)
+        writeAll(level >= ERROR ? STDERR_FILENO : STDOUT_FILENO, line, size);
+    if (logFd != -1)
+        writeAll(logFd, line, size);
+}
+
+// Bounded MPMC queue (Vyukov): a producer claims a slot by advancing enqueuePos,
+// fills it and then publishes it by bumping its sequence. When the ring is full
+// the message is dropped and counted instead of blocking the caller.
+bool Logger::enqueue(Level level, const std::string& message)
+{
+    unsigned long pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+    Slot* slot;
+    while (true)
+    {
+        slot = &ring[pos & (RING_SIZE - 1)];
+        unsigned long seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        long diff = static_cast<long>(seq) - static_cast<long>(pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&enqueuePos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+        {
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+        else
+            pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+    }
+    slot->level = level;
+    slot->time = std::time(0);
+    slot->length = std::min(message.size(), static_cast<size_t>(MESSAGE_SIZE));
+    std::memcpy(slot->message, message.data(), slot->length);
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+    // Pairs with the fence in waitForMessages: either the writer sees this message
+    // before it sleeps, or this sees it sleeping and wakes it
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sleeping, __ATOMIC_RELAXED))
+        wakeWriter();
+    return true;
+}
+
+bool Logger::hasPending() const
+{
+    const Slot* slot = &ring[dequeuePos & (RING_SIZE - 1)];
+    return __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == dequeuePos + 1;
+}
+
+// Only the writer thread calls this, with the ring found empty
+void Logger::waitForMessages()
+{
+    __atomic_store_n(&sleeping, true, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&wakeLock);
+    while (__atomic_load_n(&sleeping, __ATOMIC_RELAXED) && isRunning() && !hasPending())
+        pthread_cond_wait(&wakeUp, &wakeLock);
+    __atomic_store_n(&sleeping, false, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&wakeLock);
+}
+
+void Logger::wakeWriter()
+{
+    pthread_mutex_lock(&wakeLock);
+    __atomic_store_n(&sleeping, false, __ATOMIC_RELAXED);
+    pthread_cond_signal(&wakeUp);
+    pthread_mutex_unlock(&wakeLock);
+}
+
+// Moves every published message into batch buffers and writes them with one
+// write() per destination. Only the writer thread (or stop()) calls this.
+size_t Logger::drain()
+{
+    static char fileBatch[WRITE_BATCH];
+    static char outBatch[WRITE_BATCH];
+    static char errBatch[WRITE_BATCH];
+    size_t fileSize = 0, outSize = 0, errSize = 0, count = 0;
+
+    while (true)
     {
-        logFile << output << std::endl;
-        logFile.flush();
+        Slot* slot = &ring[dequeuePos & (RING_SIZE - 1)];
+        unsigned long seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        if (seq != dequeuePos + 1)
+            break;
+
+        char line[MESSAGE_SIZE + 64];
+        size_t size = format(line, slot->level, slot->time, slot->message, slot->length);
+        bool isError = slot->level >= ERROR;
+        __atomic_store_n(&slot->sequence, dequeuePos + RING_SIZE, __ATOMIC_RELEASE);
+        ++dequeuePos;
+        ++count;
+
+        if (logFd != -1)
+        {
+            if (fileSize + size > sizeof(fileBatch))
+            {
+                writeAll(logFd, fileBatch, fileSize);
+                fileSize = 0;
+            }
+            std::memcpy(fileBatch + fileSize, line, size);
+            fileSize += size;
+        }
+        if (consoleOutput)
+        {
+            char* batch = isError ? errBatch : outBatch;
+            size_t& batchSize = isError ? errSize : outSize;
+            if (batchSize + size > WRITE_BATCH)
+            {
+                writeAll(isError ? STDERR_FILENO : STDOUT_FILENO, batch, batchSize);
+                batchSize = 0;
+            }
+            std::memcpy(batch + batchSize, line, size);
+            batchSize += size;
+        }
     }
+    if (fileSize)
+        writeAll(logFd, fileBatch, fileSize);
+    if (outSize)
+        writeAll(STDOUT_FILENO, outBatch, outSize);
+    if (errSize)
+        writeAll(STDERR_FILENO, errBatch, errSize);
+    return count;
 }
 
-std::string Logger::levelToString(Level level) const
+void* Logger::writerMain(void* arg)
+{
+    Logger* self = static_cast<Logger*>(arg);
+    unsigned long reported = 0;
+    while (self->isRunning())
+    {
+        if (self->drain() == 0)
+            self->waitForMessages();
+        unsigned long lost = self->getDroppedCount();
+        if (lost != reported && self->logFd != -1)
+        {
+            char message[64];
+            char line[MESSAGE_SIZE + 64];
+            int length = snprintf(message, sizeof(message), "Log ring buffer full, %lu messages dropped so far", lost);
+            self->writeAll(self->logFd, line, self->format(line, WARNING, std::time(0), message, length));
+            reported = lost;
+        }
+    }
+    return NULL;
+}
+
+size_t Logger::format(char* out, Level level, std::time_t time, const char* message, size_t length)
+{
+    const char* stamp = getTimestamp(time);
+    const char* levelName = levelToString(level);
+    size_t pos = 0;
+    out[pos++] = '[';
+    std::memcpy(out + pos, stamp, std::strlen(stamp));
+    pos += std::strlen(stamp);
+    out[pos++] = ']';
+    out[pos++] = ' ';
+    std::memcpy(out + pos, levelName, std::strlen(levelName));
+    pos += std::strlen(levelName);
+    out[pos++] = ':';
+    out[pos++] = ' ';
+    std::memcpy(out + pos, message, length);
+    pos += length;
+    out[pos++] = '\n';
+    return pos;
+}
+
+void Logger::writeAll(int fd, const char* data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, data, length);
+        if (written <= 0)
+            return;
+        data += written;
+        length -= written;
+    }
+}
+
+const char* Logger::levelToString(Level level) const
 {
     switch (level)
     {
@@ -60,10 +287,16 @@ std::string Logger::levelToString(Level level) const
     }
 }
 
-std::string Logger::getTimestamp() const
+// The formatted timestamp only changes once per second, so it is cached. localtime_r: the
+// event loop formats access log timestamps at the same time.
+const char* Logger::getTimestamp(std::time_t now)
 {
-    std::time_t now = std::time(0);
-    char buf[20];
-    std::strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", std::localtime(&now));
-    return buf;
+    if (now != cachedTime || cachedStamp[0] == '\0')
+    {
+        struct tm local;
+        localtime_r(&now, &local);
+        std::strftime(cachedStamp, sizeof(cachedStamp), "%Y-%m-%d %H:%M:%S", &local);
+        cachedTime = now;
+    }
+    return cachedStamp;
 }
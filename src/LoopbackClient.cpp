@@ -0,0 +1,62 @@
+#include "../include/LoopbackClient.hpp"
+#include "../include/Server.hpp"
+#include <sys/socket.h>
+#include <cerrno>
+#include <cstdlib>
+
+LoopbackClient::LoopbackClient(Server &server, const std::string &IPv4, int port)
+	: _server(server), _fd(-1), _closed(false)
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+		throw std::runtime_error("socketpair failed: " + std::string(std::strerror(errno)));
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	_fd = fds[0];
+	_server.attachClient(fds[1], IPv4, port);
+}
+
+// The server notices the hangup on its next iteration and closes its end
+LoopbackClient::~LoopbackClient()
+{
+	close(_fd);
+}
+
+// Returns when the response is complete according to its Content-Length, when the server
+// closes the connection, or after maxIterations event loop iterations (partial response)
+std::string LoopbackClient::roundTrip(const std::string &request, int maxIterations)
+{
+	std::string response;
+	size_t sent = 0;
+	char buffer[65536];
+	for (int i = 0; i < maxIterations && !_closed; ++i)
+	{
+		if (sent < request.size())
+		{
+			ssize_t bytes = send(_fd, request.data() + sent, request.size() - sent, 0);
+			if (bytes > 0)
+				sent += bytes;
+		}
+		_server.runOnce(0);
+		ssize_t bytes;
+		while ((bytes = recv(_fd, buffer, sizeof(buffer), 0)) > 0)
+			response.append(buffer, bytes);
+		if (bytes == 0)
+			_closed = true;
+
+		size_t headerEnd = response.find("\r\n\r\n");
+		if (headerEnd == std::string::npos)
+			continue;
+		size_t lengthPos = response.find("Content-Length: ");
+		if (lengthPos == std::string::npos || lengthPos > headerEnd)
+			continue;
+		size_t length = std::strtoul(response.c_str() + lengthPos + 16, NULL, 10);
+		if (response.size() >= headerEnd + 4 + length)
+			break;
+	}
+	return response;
+}
+
+bool LoopbackClient::isClosed() const
+{
+	return _closed;
+}
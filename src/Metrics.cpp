@@ -0,0 +1,167 @@
+#include "../include/Metrics.hpp"
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+
+LatencyHistogram::LatencyHistogram()
+	: _count(0), _sum(0)
+{
+	for (int i = 0; i < BUCKETS; ++i)
+		_buckets[i] = 0;
+}
+
+// Bucket i covers (bucketUpperBound(i - 1), bucketUpperBound(i)] microseconds
+void LatencyHistogram::record(double seconds)
+{
+	double micros = seconds * 1e6;
+	int index = 0;
+	if (micros >= 1)
+	{
+		int exponent;
+		double mantissa = std::frexp(micros, &exponent); // micros = mantissa * 2^exponent, mantissa in [0.5, 1)
+		index = (exponent - 1) * SUB_BUCKETS + static_cast<int>((mantissa * 2 - 1) * SUB_BUCKETS);
+		if (index >= BUCKETS)
+			index = BUCKETS - 1;
+	}
+	++_buckets[index];
+	++_count;
+	_sum += seconds;
+}
+
+// Upper bound in seconds
+double LatencyHistogram::bucketUpperBound(int index)
+{
+	int exponent = index / SUB_BUCKETS;
+	int step = index % SUB_BUCKETS + 1;
+	return std::ldexp(1.0 + static_cast<double>(step) / SUB_BUCKETS, exponent) / 1e6;
+}
+
+double LatencyHistogram::percentile(double fraction) const
+{
+	if (_count == 0)
+		return 0;
+	unsigned long rank = static_cast<unsigned long>(std::ceil(fraction * _count));
+	if (rank == 0)
+		rank = 1;
+	unsigned long seen = 0;
+	for (int i = 0; i < BUCKETS; ++i)
+	{
+		seen += _buckets[i];
+		if (seen >= rank)
+			return bucketUpperBound(i);
+	}
+	return bucketUpperBound(BUCKETS - 1);
+}
+
+unsigned long LatencyHistogram::countBelow(double seconds) const
+{
+	unsigned long total = 0;
+	for (int i = 0; i < BUCKETS && bucketUpperBound(i) <= seconds; ++i)
+		total += _buckets[i];
+	return total;
+}
+
+unsigned long LatencyHistogram::getCount() const { return _count; }
+double LatencyHistogram::getSum() const { return _sum; }
+
+Metrics::Metrics()
+	: _accepted(0), _dropped(0), _active(0), _requests(0),
+	  _bytesIn(0), _bytesOut(0), _cgiSpawns(0), _syscalls(0)
+{
+	for (int i = 0; i < 6; ++i)
+		_statusClasses[i] = 0;
+}
+
+void Metrics::requestDone(const std::string &vhost, int status, double seconds)
+{
+	++_requests;
+	int statusClass = status / 100;
+	if (statusClass < 1 || statusClass > 5)
+		statusClass = 0;
+	++_statusClasses[statusClass];
+	_latency[vhost.empty() ? "_" : vhost].record(seconds);
+}
+
+// Same layout as nginx' stub_status, followed by the counters nginx does not have
+std::string Metrics::renderText(const Gauges &gauges) const
+{
+	std::ostringstream out;
+	out << "Active connections: " << _active << "\n"
+		<< "server accepts handled requests\n"
+		<< " " << _accepted + _dropped << " " << _accepted << " " << _requests << "\n"
+		<< "Reading: " << gauges.reading << " Writing: " << gauges.writing << " Waiting: " << gauges.waiting << "\n"
+		<< "Responses: 1xx: " << _statusClasses[1] << " 2xx: " << _statusClasses[2]
+		<< " 3xx: " << _statusClasses[3] << " 4xx: " << _statusClasses[4] << " 5xx: " << _statusClasses[5] << "\n"
+		<< "Bytes: in: " << _bytesIn << " out: " << _bytesOut << " buffered: " << gauges.buffered << "\n"
+		<< "CGI: spawns: " << _cgiSpawns << " cache hits: " << gauges.cacheHits << " cache misses: " << gauges.cacheMisses << "\n"
+		<< "Event loop: " << gauges.events << " syscalls: " << _syscalls << "\n";
+	for (std::map<std::string, LatencyHistogram>::const_iterator it = _latency.begin(); it != _latency.end(); ++it)
+	{
+		char line[256];
+		snprintf(line, sizeof(line), "Latency %s: count: %lu p50: %.6f p99: %.6f p999: %.6f\n",
+			it->first.c_str(), it->second.getCount(),
+			it->second.percentile(0.5), it->second.percentile(0.99), it->second.percentile(0.999));
+		out << line;
+	}
+	return out.str();
+}
+
+// Prometheus text exposition format (version 0.0.4)
+std::string Metrics::renderPrometheus(const Gauges &gauges) const
+{
+	static const char *classes[6] = { "other", "1xx", "2xx", "3xx", "4xx", "5xx" };
+	std::ostringstream out;
+
+	out << "# TYPE webserv_connections_accepted_total counter\n"
+		<< "webserv_connections_accepted_total " << _accepted << "\n"
+		<< "# TYPE webserv_connections_dropped_total counter\n"
+		<< "webserv_connections_dropped_total " << _dropped << "\n"
+		<< "# TYPE webserv_connections_active gauge\n"
+		<< "webserv_connections_active " << _active << "\n"
+		<< "# TYPE webserv_connections gauge\n"
+		<< "webserv_connections{state=\"reading\"} " << gauges.reading << "\n"
+		<< "webserv_connections{state=\"writing\"} " << gauges.writing << "\n"
+		<< "webserv_connections{state=\"waiting\"} " << gauges.waiting << "\n"
+		<< "# TYPE webserv_requests_total counter\n";
+	for (int i = 1; i <= 6; ++i)
+		out << "webserv_requests_total{status=\"" << classes[i % 6] << "\"} " << _statusClasses[i % 6] << "\n";
+	out << "# TYPE webserv_received_bytes_total counter\n"
+		<< "webserv_received_bytes_total " << _bytesIn << "\n"
+		<< "# TYPE webserv_sent_bytes_total counter\n"
+		<< "webserv_sent_bytes_total " << _bytesOut << "\n"
+		<< "# TYPE webserv_buffered_bytes gauge\n"
+		<< "webserv_buffered_bytes " << gauges.buffered << "\n"
+		<< "# TYPE webserv_cgi_spawns_total counter\n"
+		<< "webserv_cgi_spawns_total " << _cgiSpawns << "\n"
+		<< "# TYPE webserv_cgi_cache_hits_total counter\n"
+		<< "webserv_cgi_cache_hits_total " << gauges.cacheHits << "\n"
+		<< "# TYPE webserv_cgi_cache_misses_total counter\n"
+		<< "webserv_cgi_cache_misses_total " << gauges.cacheMisses << "\n"
+		<< "# TYPE webserv_event_loop_syscalls_total counter\n"
+		<< "webserv_event_loop_syscalls_total{backend=\"" << gauges.events << "\"} " << _syscalls << "\n";
+
+	// Only every power of two is exported as a histogram bucket to keep the output short
+	out << "# TYPE webserv_request_duration_seconds histogram\n";
+	for (std::map<std::string, LatencyHistogram>::const_iterator it = _latency.begin(); it != _latency.end(); ++it)
+	{
+		const LatencyHistogram &histogram = it->second;
+		for (int i = 4 * LatencyHistogram::SUB_BUCKETS - 1; i < 27 * LatencyHistogram::SUB_BUCKETS; i += LatencyHistogram::SUB_BUCKETS)
+		{
+			double bound = LatencyHistogram::bucketUpperBound(i);
+			out << "webserv_request_duration_seconds_bucket{vhost=\"" << it->first << "\",le=\"" << bound << "\"} "
+				<< histogram.countBelow(bound) << "\n";
+		}
+		out << "webserv_request_duration_seconds_bucket{vhost=\"" << it->first << "\",le=\"+Inf\"} " << histogram.getCount() << "\n"
+			<< "webserv_request_duration_seconds_sum{vhost=\"" << it->first << "\"} " << histogram.getSum() << "\n"
+			<< "webserv_request_duration_seconds_count{vhost=\"" << it->first << "\"} " << histogram.getCount() << "\n";
+	}
+	out << "# TYPE webserv_request_duration_quantile_seconds gauge\n";
+	for (std::map<std::string, LatencyHistogram>::const_iterator it = _latency.begin(); it != _latency.end(); ++it)
+	{
+		static const double quantiles[3] = { 0.5, 0.99, 0.999 };
+		for (int q = 0; q < 3; ++q)
+			out << "webserv_request_duration_quantile_seconds{vhost=\"" << it->first << "\",quantile=\"" << quantiles[q] << "\"} "
+				<< it->second.percentile(quantiles[q]) << "\n";
+	}
+	return out.str();
+}
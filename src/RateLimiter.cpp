@@ -0,0 +1,144 @@
+#include "../include/RateLimiter.hpp"
+#include "../include/Logger.hpp"
+#include <sstream>
+#include <stdexcept>
+#include <cstdlib>
+
+ClientTable::ClientTable()
+{
+	Entry empty = { 0, false, 0, 0, 0, 0 };
+	_slots.assign(SLOTS, empty);
+}
+
+// Fibonacci hashing; SLOTS is a power of two
+size_t ClientTable::hash(uint32_t addr)
+{
+	return (static_cast<uint32_t>(addr * 2654435761u) >> 20) & (SLOTS - 1);
+}
+
+bool ClientTable::isReclaimable(const Entry &entry, double now)
+{
+	return !entry.used || (entry.connections == 0 && now >= entry.fullAt);
+}
+
+ClientTable::Entry *ClientTable::find(uint32_t addr)
+{
+	size_t index = hash(addr);
+	for (int i = 0; i < PROBE_LIMIT; ++i)
+	{
+		Entry &entry = _slots[(index + i) & (SLOTS - 1)];
+		if (entry.used && entry.addr == addr)
+			return &entry;
+	}
+	return NULL;
+}
+
+// Returns NULL if all slots in the probe window belong to active clients
+ClientTable::Entry *ClientTable::findOrInsert(uint32_t addr, double now)
+{
+	size_t index = hash(addr);
+	Entry *free = NULL;
+	for (int i = 0; i < PROBE_LIMIT; ++i)
+	{
+		Entry &entry = _slots[(index + i) & (SLOTS - 1)];
+		if (entry.used && entry.addr == addr)
+			return &entry;
+		if (!free && isReclaimable(entry, now))
+			free = &entry;
+	}
+	if (!free)
+		return NULL;
+	free->addr = addr;
+	free->used = true;
+	free->tokens = 1;
+	free->last = now;
+	free->fullAt = 0;
+	free->connections = 0;
+	return free;
+}
+
+LimitReq::LimitReq() : rate(0), burst(0), nodelay(false) {}
+
+LimitReq LimitReq::parse(std::istream &args)
+{
+	LimitReq limit;
+	std::string val;
+	while (args >> val)
+	{
+		if (val.compare(0, 5, "zone=") == 0)
+			limit.zone = val.substr(5);
+		else if (val.compare(0, 5, "rate=") == 0)
+		{
+			char *end;
+			limit.rate = std::strtod(val.c_str() + 5, &end);
+			std::string unit(end);
+			if (unit == "r/m")
+				limit.rate /= 60;
+			else if (unit != "r/s")
+				throw std::runtime_error("Invalid limit_req rate: " + val);
+		}
+		else if (val.compare(0, 6, "burst=") == 0)
+			limit.burst = std::atoi(val.c_str() + 6);
+		else if (val == "nodelay")
+			limit.nodelay = true;
+		else
+			throw std::runtime_error("Unknown limit_req parameter: " + val);
+	}
+	if (limit.zone.empty() || limit.rate <= 0 || limit.burst < 0)
+		throw std::runtime_error("limit_req needs zone=<name> and a positive rate=");
+	return limit;
+}
+
+RateLimiter::~RateLimiter()
+{
+	for (std::map<std::string, ClientTable*>::iterator it = _zones.begin(); it != _zones.end(); ++it)
+		delete it->second;
+}
+
+// Token bucket holding at most one token, refilled at limit.rate. Up to limit.burst
+// requests may borrow tokens in advance; without nodelay they are held back until
+// their token would have arrived.
+double RateLimiter::acquire(const LimitReq &limit, uint32_t addr, double now)
+{
+	ClientTable *&zone = _zones[limit.zone];
+	if (!zone)
+		zone = new ClientTable();
+	ClientTable::Entry *entry = zone->findOrInsert(addr, now);
+	if (!entry)
+	{
+		LOG_WARNING("limit_req zone " + limit.zone + " is full, not limiting");
+		return 0;
+	}
+
+	double tokens = entry->tokens + (now - entry->last) * limit.rate;
+	if (tokens > 1)
+		tokens = 1;
+	if (tokens - 1 < -limit.burst)
+		return -1;
+	entry->tokens = tokens - 1;
+	entry->last = now;
+	entry->fullAt = now + (1 - entry->tokens) / limit.rate;
+	if (entry->tokens >= 0 || limit.nodelay)
+		return 0;
+	return -entry->tokens / limit.rate;
+}
+
+void RateLimiter::connectionOpened(uint32_t addr, double now)
+{
+	ClientTable::Entry *entry = _connections.findOrInsert(addr, now);
+	if (entry)
+		++entry->connections;
+}
+
+void RateLimiter::connectionClosed(uint32_t addr)
+{
+	ClientTable::Entry *entry = _connections.find(addr);
+	if (entry && entry->connections)
+		--entry->connections;
+}
+
+unsigned int RateLimiter::connections(uint32_t addr)
+{
+	ClientTable::Entry *entry = _connections.find(addr);
+	return entry ? entry->connections : 0;
+}
@@ -2,129 +2,231 @@
 #include "../include/Request.hpp"
 #include "../include/Logger.hpp"
 #include "../include/Utils.hpp"
+#include "../include/Scan.hpp"
 #include <cstdlib>
+#include <cstring>
 
-Request::Request() : matchedLocation(NULL), serverConfig(NULL){}
+Request::Request(Arena *arena)
+	: fields(NULL), fieldCount(0), fieldCapacity(0), matchedLocation(NULL), serverConfig(NULL),
+	  arena(arena ? arena : &ownArena) {}
 
-std::string Request::getMethod() const { return method; }
-std::string Request::getPath() const { return path; }
-std::string Request::getProtocol() const { return protocol; }
-std::map<std::string, std::string> Request::getHeaders() const { return headers; }
-std::string Request::getBody() const { return body; }
+const std::string& Request::getMethod() const { return method; }
+const std::string& Request::getPath() const { return path; }
+const std::string& Request::getProtocol() const { return protocol; }
+const Body& Request::getBody() const { return body; }
 const LocationConfig* Request::getMatchedLocation() const { return matchedLocation; }
 const ServerConfig* Request::getServerConfig() const { return serverConfig; }
+Arena& Request::getArena() { return *arena; }
 
 void Request::setMethod(const std::string& m) { method = m; }
 void Request::setPath(const std::string& p) { path = p; }
 void Request::setProtocol(const std::string& pr) { protocol = pr; }
-void Request::setHeaders(const std::map<std::string, std::string>& h) { headers = h; }
-void Request::setBody(const std::string& b) { body = b; }
+void Request::setBody(const Body& b) { body = b; }
 void Request::setMatchedLocation(const LocationConfig* loc) { matchedLocation = loc; }
 void Request::setServerConfig(ServerConfig* config) { serverConfig = config; }
 
-std::string Request::getHeader(const std::string &key) const {
-	const std::map<std::string, std::string>& hdrs = getHeaders();
-	std::map<std::string, std::string>::const_iterator it = hdrs.find(key);
-	if (it != hdrs.end())
-		return it->second;
+// The slices are stored as given, so they must point into memory that lives as long as the arena
+void Request::addHeader(const char *name, size_t nameSize, const char *value, size_t valueSize)
+{
+	if (fieldCount == fieldCapacity)
+	{
+		size_t capacity = fieldCapacity ? fieldCapacity * 2 : 16;
+		HeaderField *grown = static_cast<HeaderField *>(arena->allocate(capacity * sizeof(HeaderField)));
+		if (fieldCount)
+			std::memcpy(grown, fields, fieldCount * sizeof(HeaderField));
+		fields = grown;
+		fieldCapacity = capacity;
+	}
+	HeaderField &field = fields[fieldCount++];
+	field.name = name;
+	field.nameSize = nameSize;
+	field.value = value;
+	field.valueSize = valueSize;
+}
+
+// Searched from the back so a repeated header resolves to its last value
+const Request::HeaderField *Request::findHeader(const char *key) const
+{
+	size_t keySize = std::strlen(key);
+	for (size_t i = fieldCount; i > 0; --i)
+	{
+		const HeaderField &field = fields[i - 1];
+		if (field.nameSize == keySize && std::memcmp(field.name, key, keySize) == 0)
+			return &field;
+	}
+	return NULL;
+}
+
+std::string Request::getHeader(const char *key) const
+{
+	const HeaderField *field = findHeader(key);
+	if (field)
+		return std::string(field->value, field->valueSize);
 	return "";
 }
 
-void parseHttpRequest(const std::string &rawRequest, Request& request, Response& res)
+bool Request::hasHeader(const char *key) const
 {
-	std::istringstream stream(rawRequest);
-	std::string line;
+	return findHeader(key) != NULL;
+}
+
+// Builds a copy of the header fields, for the few callers that need all of them (CGI environment)
+std::map<std::string, std::string> Request::getHeaders() const
+{
+	std::map<std::string, std::string> headers;
+	for (size_t i = 0; i < fieldCount; ++i)
+		headers[std::string(fields[i].name, fields[i].nameSize)] = std::string(fields[i].value, fields[i].valueSize);
+	return headers;
+}
+
+// The location's client_max_body_size if it sets one, else the server's; 0 without a server config
+size_t Request::getClientMaxBodySize() const
+{
+	if (matchedLocation && matchedLocation->getClientMaxBodySize() >= 0)
+		return matchedLocation->getClientMaxBodySize();
+	return serverConfig ? serverConfig->getClientMaxBodySize() : 0;
+}
+
+static bool isSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// Splits the next whitespace separated token off [*pos, end)
+static std::string nextToken(const char *&pos, const char *end)
+{
+	while (pos < end && isSpace(*pos))
+		++pos;
+	const char *start = pos;
+	while (pos < end && !isSpace(*pos))
+		++pos;
+	return std::string(start, pos);
+}
+
+// Parses the request line and the headers. The head is copied into the request's arena
+// in one piece and the header fields are slices of that copy. Returns the offset of the
+// body in rawRequest, or 0 (with the status set to 400) if the head is malformed.
+size_t parseRequestHead(const char *rawRequest, size_t size, Request& request, Response& res)
+{
+	size_t headEnd = scanHeaderEnd(rawRequest, size);
+	size_t bodyStart = (headEnd == size) ? size : headEnd + 4;
+	if (bodyStart == 0)
+	{
+		logError("Invalid HTTP request line");
+		res.setStatus(400);
+		return 0;
+	}
+	const char *head = request.getArena().copy(rawRequest, bodyStart);
+	const char *end = head + bodyStart;
 
 	// Parse request line
-	if (!std::getline(stream, line) || line.empty())
+	const char *lineEnd = static_cast<const char *>(std::memchr(head, '\n', bodyStart));
+	if (!lineEnd)
+		lineEnd = end;
+	if (lineEnd == head)
 	{
 		logError("Invalid HTTP request line");
 		res.setStatus(400);
-		return;
+		return 0;
 	}
+	const char *pos = head;
+	std::string method = nextToken(pos, lineEnd);
+	std::string path = nextToken(pos, lineEnd);
+	std::string protocol = nextToken(pos, lineEnd);
 
-	std::istringstream requestLine(line);
-	std::string method, path, protocol;
-	requestLine >> method >> path >> protocol;
-	
 	if (method.empty() || path.empty() || protocol.empty()) {
 		logError("Invalid HTTP request format");
 		res.setStatus(400);
-		return;
+		return 0;
 	}
-	
+
 	request.setMethod(method);
 	request.setPath(path);
 	request.setProtocol(protocol);
 
-	logInfo("Received request: " + method + " " + path + " " + protocol);
-
 	// Parse headers
-	std::map<std::string, std::string> headers;
-	while (std::getline(stream, line) && line != "\r")
+	for (pos = lineEnd + 1; pos < end; pos = lineEnd + 1)
 	{
-		if (!line.empty() && line[line.size() - 1] == '\r')
-			line.erase(line.size() - 1);
-		size_t colon = line.find(':');
-		if (colon != std::string::npos)
+		lineEnd = static_cast<const char *>(std::memchr(pos, '\n', end - pos));
+		if (!lineEnd)
+			lineEnd = end;
+		const char *lineStop = lineEnd;
+		if (lineStop > pos && lineStop[-1] == '\r')
+			--lineStop;
+		if (lineStop == pos)
+			break;
+		const char *colon = static_cast<const char *>(std::memchr(pos, ':', lineStop - pos));
+		if (!colon)
 		{
-			std::string key = line.substr(0, colon);
-			std::string value = line.substr(colon + 1);
-			value.erase(0, value.find_first_not_of(" \t"));
-			headers[key] = value;
+			logError("Invalid header format: " + std::string(pos, lineStop));
+			res.setStatus(400);
+			return 0;
 		}
-		else if (!line.empty())
+		// Field names are tokens; whitespace before the colon is rejected as well (RFC 9112)
+		if (!isToken(pos, colon - pos))
 		{
-			logError("Invalid header format: " + line);
+			logError("Invalid header name: " + std::string(pos, colon));
 			res.setStatus(400);
-			return;
+			return 0;
 		}
+		const char *value = colon + 1;
+		while (value < lineStop && (*value == ' ' || *value == '\t'))
+			++value;
+		request.addHeader(pos, colon - pos, value, lineStop - value);
 	}
-	request.setHeaders(headers);
+	return bodyStart;
+}
+
+// The body is a slice of rawRequest, so it shares the receive buffer instead of copying it
+void parseHttpRequest(const Body &rawRequest, Request& request, Response& res, const Body &spooledBody)
+{
+	size_t bodyStart = parseRequestHead(rawRequest.data(), rawRequest.size(), request, res);
+	if (!bodyStart)
+		return;
+	LOG_INFO("Received request: " + request.getMethod() + " " + request.getPath() + " " + request.getProtocol());
 
-	if (headers.count("Transfer-Encoding") &&
-		headers["Transfer-Encoding"] == "chunked")
+	if (request.getHeader("Transfer-Encoding") == "chunked")
 	{
 		try {
-			request.setBody(decodeChunkedBody(stream));
+			std::istringstream stream(rawRequest.slice(bodyStart).str());
+			std::string decoded = decodeChunkedBody(stream);
+			request.setBody(Body::adopt(decoded));
+			if (request.getServerConfig() && request.getBody().size() > request.getClientMaxBodySize()) {
+				logError("Chunked body exceeds maximum size");
+				res.setStatus(413);
+				return;
+			}
 		} catch (const std::exception& e) {
 			logError("Error decoding chunked body: " + std::string(e.what()));
 			res.setStatus(400);
 			return;
 		}
 	}
-	else if (headers.count("Content-Length"))
+	else if (request.hasHeader("Content-Length"))
 	{
-		int length;
-		try {
-			length = std::atoi(headers["Content-Length"].c_str());
-			if (length < 0) {
-				logError("Invalid Content-Length value: " + headers["Content-Length"]);
-				res.setStatus(400);
-				return;
-			}
-			// Check against client max body size if the request has a server config
-			if (request.getServerConfig() && static_cast<size_t>(length) > request.getServerConfig()->getClientMaxBodySize()) {
-				logError("Content-Length exceeds maximum size: " + headers["Content-Length"]);
-				res.setStatus(413); // Payload Too Large
-				return;
-			}
-		} catch (const std::exception& e) {
-			logError("Error parsing Content-Length: " + std::string(e.what()));
+		std::string contentLength = request.getHeader("Content-Length");
+		int length = std::atoi(contentLength.c_str());
+		if (length < 0) {
+			logError("Invalid Content-Length value: " + contentLength);
 			res.setStatus(400);
 			return;
 		}
-		
-		std::string body(length, '\0');
-		stream.read(&body[0], length);
-		if (stream.gcount() != length) {
+		// Check against client max body size if the request has a server config
+		if (request.getServerConfig() && static_cast<size_t>(length) > request.getClientMaxBodySize()) {
+			logError("Content-Length exceeds maximum size: " + contentLength);
+			res.setStatus(413); // Payload Too Large
+			return;
+		}
+		Body body = spooledBody.fd() != -1 ? spooledBody : rawRequest.slice(bodyStart);
+		if (body.size() < static_cast<size_t>(length)) {
 			logError("Body size doesn't match Content-Length header");
 			res.setStatus(400);
 			return;
 		}
-		request.setBody(body);
+		request.setBody(body.slice(0, length));
 	}
 }
+
 void Request::print() const
 {
 	std::cout << "\n====== HTTP Request ======" << std::endl;
@@ -142,7 +244,7 @@ void Request::print() const
 	if (getBody().empty())
 		std::cout << "  (empty)" << std::endl;
 	else
-		std::cout << getBody() << std::endl;
+		std::cout.write(getBody().data(), getBody().size()) << std::endl;
 
 	std::cout << "===========================\n" << std::endl;
 }
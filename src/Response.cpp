@@ -2,8 +2,11 @@
 #include "../include/Server.hpp"
 #include "../include/Logger.hpp"
 #include "../include/Utils.hpp"
+#include "../include/Arena.hpp"
+#include <cstdio>
+#include <cstring>
 
-Response::Response() : _statusCode(0) {}
+Response::Response() : _statusCode(0), _bodyFileSize(0), _bodyFd(-1) {}
 
 void Response::setStatus(int code)
 {
@@ -20,6 +23,31 @@ void Response::setBody(const std::string &body)
 	_body = body;
 }
 
+// The body is sent from this file (see Server::readBody); toString then only serializes
+// the head. fd is the file if it has been opened already, makeReadyforSend takes it over.
+void Response::setBodyFile(const std::string &path, size_t size, int fd)
+{
+	_body.clear();
+	_bodyFile = path;
+	_bodyFileSize = size;
+	_bodyFd = fd;
+}
+
+const std::string& Response::getBodyFile() const
+{
+	return _bodyFile;
+}
+
+size_t Response::getBodyFileSize() const
+{
+	return _bodyFileSize;
+}
+
+int Response::getBodyFd() const
+{
+	return _bodyFd;
+}
+
 void Response::setError(int code, const std::string& message)
 {
     setStatus(code);
@@ -35,18 +63,67 @@ int Response::getStatus() const
 {
 	return _statusCode;
 }
-std::string Response::toString() const
+const std::string& Response::getBody() const
 {
-	std::ostringstream response;
-	response << "HTTP/1.1 " << _statusCode << " " << getReasonPhrase(_statusCode) << "\r\n";
+	return _body;
+}
+
+static char *put(char *pos, const char *data, size_t size)
+{
+	std::memcpy(pos, data, size);
+	return pos + size;
+}
+
+// Writes the status line and the header block into memory from the arena, so sending a
+// response does not allocate for its head; size is set to the length of the head
+const char *Response::serializeHead(Arena &arena, size_t &size) const
+{
+	char status[16];
+	char length[32];
+	int statusSize = snprintf(status, sizeof(status), "%d", _statusCode);
+	int lengthSize = snprintf(length, sizeof(length), "%lu",
+		static_cast<unsigned long>(_bodyFile.empty() ? _body.size() : _bodyFileSize));
+	const char *reason = getReasonPhrase(_statusCode);
+	size_t reasonSize = std::strlen(reason);
+
+	size = 9 + statusSize + 1 + reasonSize + 2;
+	for (std::map<std::string, std::string>::const_iterator it = _headers.begin(); it != _headers.end(); ++it)
+		if (it->first != "Content-Length")
+			size += it->first.size() + 2 + it->second.size() + 2;
+	size += 16 + lengthSize + 2 + 2;
+
+	char *head = static_cast<char *>(arena.allocate(size));
+	char *pos = put(head, "HTTP/1.1 ", 9);
+	pos = put(pos, status, statusSize);
+	pos = put(pos, " ", 1);
+	pos = put(pos, reason, reasonSize);
+	pos = put(pos, "\r\n", 2);
 	for (std::map<std::string, std::string>::const_iterator it = _headers.begin(); it != _headers.end(); ++it)
 	{
-		response << it->first << ": " << it->second << "\r\n";
+		// Always derived from the actual body below
+		if (it->first == "Content-Length")
+			continue;
+		pos = put(pos, it->first.data(), it->first.size());
+		pos = put(pos, ": ", 2);
+		pos = put(pos, it->second.data(), it->second.size());
+		pos = put(pos, "\r\n", 2);
 	}
-	response << "Content-Length: " << _body.size() << "\r\n";
-	response << "\r\n";
-	response << _body;
-	return response.str();
+	pos = put(pos, "Content-Length: ", 16);
+	pos = put(pos, length, lengthSize);
+	put(pos, "\r\n\r\n", 4);
+	return head;
+}
+
+std::string Response::toString() const
+{
+	Arena arena;
+	size_t headSize;
+	const char *head = serializeHead(arena, headSize);
+	std::string response;
+	response.reserve(headSize + _body.size());
+	response.append(head, headSize);
+	response.append(_body);
+	return response;
 }
 
 void Response::parseCgiOutput(const std::string &cgiOutput) {
@@ -65,6 +142,8 @@ void Response::parseCgiOutput(const std::string &cgiOutput) {
 				std::string key = line.substr(0, colon);
 				std::string value = line.substr(colon + 1);
 				value.erase(0, value.find_first_not_of(" \t"));
+				// CR of CRLF line ends; HTTP/2 rejects it inside a field value
+				value.erase(value.find_last_not_of("\r") + 1);
 				setHeader(key, value);
 			}
 		} else {
@@ -92,10 +171,13 @@ void Response::parseCgiOutput(const std::string &cgiOutput) {
 	X(403, "Forbidden")              \
 	X(404, "Not Found")              \
 	X(405, "Method Not Allowed")     \
+	X(408, "Request Timeout")        \
 	X(413, "Payload Too Large")      \
+	X(414, "URI Too Long")           \
 	X(415, "Unsupported Media Type") \
 	X(418, "I'm a teapot")           \
 	X(429, "Too Many Requests")      \
+	X(431, "Request Header Fields Too Large") \
 	/* Server Errors (5xx): */       \
 	X(500, "Internal Server Error")  \
 	X(501, "Not Implemented")        \
@@ -127,3 +209,8 @@ std::string Response::getHeaderValue(const std::string &key) const
 	}
 	return "";
 }
+
+const std::map<std::string, std::string>& Response::getHeaders() const
+{
+	return _headers;
+}
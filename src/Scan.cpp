@@ -0,0 +1,400 @@
+#include "../include/Scan.hpp"
+#include <cstring>
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define SCAN_X86
+# include <immintrin.h>
+#endif
+
+typedef size_t (*ScanFunction)(const char *data, size_t size);
+typedef size_t (*SubstringFunction)(const char *data, size_t size, const char *needle, size_t needleSize);
+
+struct ScanKernels
+{
+	const char *name;
+	ScanFunction crlf;
+	ScanFunction headerEnd;
+	ScanFunction nonToken;
+	SubstringFunction substring;
+};
+
+// Scalar versions: memchr for the first byte, which the C library vectorizes itself,
+// then a compare of the rest
+
+static size_t crlfScalar(const char *data, size_t size)
+{
+	if (size < 2)
+		return size;
+	const char *last = data + size - 1;
+	for (const char *pos = data; pos < last; ++pos)
+	{
+		pos = static_cast<const char *>(std::memchr(pos, '\r', last - pos));
+		if (!pos)
+			break;
+		if (pos[1] == '\n')
+			return pos - data;
+	}
+	return size;
+}
+
+static size_t headerEndScalar(const char *data, size_t size)
+{
+	if (size < 4)
+		return size;
+	const char *last = data + size - 3;
+	for (const char *pos = data; pos < last; ++pos)
+	{
+		pos = static_cast<const char *>(std::memchr(pos, '\r', last - pos));
+		if (!pos)
+			break;
+		if (std::memcmp(pos, "\r\n\r\n", 4) == 0)
+			return pos - data;
+	}
+	return size;
+}
+
+static bool isTokenChar(unsigned char c)
+{
+	if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))
+		return true;
+	return c != 0 && std::strchr("!#$%&'*+-.^_`|~", c) != NULL;
+}
+
+static size_t nonTokenScalar(const char *data, size_t size)
+{
+	for (size_t i = 0; i < size; ++i)
+		if (!isTokenChar(data[i]))
+			return i;
+	return size;
+}
+
+static size_t substringScalar(const char *data, size_t size, const char *needle, size_t needleSize)
+{
+	if (needleSize == 0)
+		return 0;
+	if (needleSize > size)
+		return size;
+	const char *last = data + size - needleSize;
+	for (const char *pos = data; pos <= last; ++pos)
+	{
+		pos = static_cast<const char *>(std::memchr(pos, needle[0], last - pos + 1));
+		if (!pos)
+			break;
+		if (std::memcmp(pos + 1, needle + 1, needleSize - 1) == 0)
+			return pos - data;
+	}
+	return size;
+}
+
+#ifdef SCAN_X86
+
+// The vector loops compare whole blocks: a match sets a bit in the byte mask, and the
+// lowest set bit is the first match. Whatever is left over after the last full block
+// goes to the scalar version.
+
+__attribute__((target("sse2")))
+static size_t crlfSse2(const char *data, size_t size)
+{
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i lf = _mm_set1_epi8('\n');
+	size_t i = 0;
+	for (; i + 17 <= size; i += 16)
+	{
+		__m128i at = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+		__m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(at, cr), _mm_cmpeq_epi8(next, lf)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + crlfScalar(data + i, size - i);
+}
+
+__attribute__((target("sse2")))
+static size_t headerEndSse2(const char *data, size_t size)
+{
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i lf = _mm_set1_epi8('\n');
+	size_t i = 0;
+	for (; i + 19 <= size; i += 16)
+	{
+		__m128i crlf = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i)), cr),
+			_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 1)), lf));
+		__m128i second = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 2)), cr),
+			_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 3)), lf));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(crlf, second));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + headerEndScalar(data + i, size - i);
+}
+
+// lo <= byte <= hi, unsigned
+__attribute__((target("sse2")))
+static inline __m128i inRange(__m128i bytes, char lo, char hi)
+{
+	__m128i offset = _mm_sub_epi8(bytes, _mm_set1_epi8(lo));
+	return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(hi - lo)), offset);
+}
+
+// tchar: letters, digits and !#$%&'*+-.^_`|~, grouped into ranges
+__attribute__((target("sse2")))
+static inline __m128i tokenBytes(__m128i bytes)
+{
+	__m128i token = inRange(_mm_or_si128(bytes, _mm_set1_epi8(0x20)), 'a', 'z');
+	token = _mm_or_si128(token, inRange(bytes, '0', '9'));
+	token = _mm_or_si128(token, inRange(bytes, '#', '\''));
+	token = _mm_or_si128(token, inRange(bytes, '*', '+'));
+	token = _mm_or_si128(token, inRange(bytes, '-', '.'));
+	token = _mm_or_si128(token, inRange(bytes, '^', '`'));
+	token = _mm_or_si128(token, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('!')));
+	token = _mm_or_si128(token, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('|')));
+	return _mm_or_si128(token, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('~')));
+}
+
+__attribute__((target("sse2")))
+static size_t nonTokenSse2(const char *data, size_t size)
+{
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16)
+	{
+		__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+		unsigned mask = ~_mm_movemask_epi8(tokenBytes(bytes)) & 0xffff;
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + nonTokenScalar(data + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static size_t crlfAvx2(const char *data, size_t size)
+{
+	const __m256i cr = _mm256_set1_epi8('\r');
+	const __m256i lf = _mm256_set1_epi8('\n');
+	size_t i = 0;
+	for (; i + 33 <= size; i += 32)
+	{
+		__m256i at = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+		__m256i next = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 1));
+		unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(at, cr), _mm256_cmpeq_epi8(next, lf)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + crlfSse2(data + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static size_t headerEndAvx2(const char *data, size_t size)
+{
+	const __m256i cr = _mm256_set1_epi8('\r');
+	const __m256i lf = _mm256_set1_epi8('\n');
+	size_t i = 0;
+	for (; i + 35 <= size; i += 32)
+	{
+		__m256i crlf = _mm256_and_si256(
+			_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i)), cr),
+			_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 1)), lf));
+		__m256i second = _mm256_and_si256(
+			_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 2)), cr),
+			_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 3)), lf));
+		unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(crlf, second));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + headerEndSse2(data + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i inRange(__m256i bytes, char lo, char hi)
+{
+	__m256i offset = _mm256_sub_epi8(bytes, _mm256_set1_epi8(lo));
+	return _mm256_cmpeq_epi8(_mm256_min_epu8(offset, _mm256_set1_epi8(hi - lo)), offset);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i tokenBytes(__m256i bytes)
+{
+	__m256i token = inRange(_mm256_or_si256(bytes, _mm256_set1_epi8(0x20)), 'a', 'z');
+	token = _mm256_or_si256(token, inRange(bytes, '0', '9'));
+	token = _mm256_or_si256(token, inRange(bytes, '#', '\''));
+	token = _mm256_or_si256(token, inRange(bytes, '*', '+'));
+	token = _mm256_or_si256(token, inRange(bytes, '-', '.'));
+	token = _mm256_or_si256(token, inRange(bytes, '^', '`'));
+	token = _mm256_or_si256(token, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('!')));
+	token = _mm256_or_si256(token, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('|')));
+	return _mm256_or_si256(token, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('~')));
+}
+
+__attribute__((target("avx2")))
+static size_t nonTokenAvx2(const char *data, size_t size)
+{
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32)
+	{
+		__m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+		unsigned mask = ~static_cast<unsigned>(_mm256_movemask_epi8(tokenBytes(bytes)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + nonTokenSse2(data + i, size - i);
+}
+
+// Candidates are the positions where both the first and the last byte of the needle
+// match; only those are compared in full. At SSE2 width this filter is no faster than
+// the C library's memchr, so the SSE2 set uses the scalar version.
+__attribute__((target("avx2")))
+static size_t substringAvx2(const char *data, size_t size, const char *needle, size_t needleSize)
+{
+	if (needleSize < 2)
+		return substringScalar(data, size, needle, needleSize);
+	const __m256i first = _mm256_set1_epi8(needle[0]);
+	const __m256i last = _mm256_set1_epi8(needle[needleSize - 1]);
+	size_t i = 0;
+	// Two blocks per round, candidates are rare in upload data
+	for (; i + needleSize - 1 + 64 <= size; i += 64)
+	{
+		const char *tailStart = data + i + needleSize - 1;
+		__m256i low = _mm256_and_si256(
+			_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i)), first),
+			_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(tailStart)), last));
+		__m256i high = _mm256_and_si256(
+			_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 32)), first),
+			_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(tailStart + 32)), last));
+		if (_mm256_testz_si256(_mm256_or_si256(low, high), _mm256_or_si256(low, high)))
+			continue;
+		for (size_t half = 0; half < 2; ++half)
+		{
+			unsigned mask = _mm256_movemask_epi8(half ? high : low);
+			for (; mask; mask &= mask - 1)
+			{
+				size_t at = i + half * 32 + __builtin_ctz(mask);
+				if (std::memcmp(data + at + 1, needle + 1, needleSize - 2) == 0)
+					return at;
+			}
+		}
+	}
+	return i + substringScalar(data + i, size - i, needle, needleSize);
+}
+
+#endif
+
+static const ScanKernels g_scalar = { "scalar", crlfScalar, headerEndScalar, nonTokenScalar, substringScalar };
+#ifdef SCAN_X86
+static const ScanKernels g_sse2 = { "sse2", crlfSse2, headerEndSse2, nonTokenSse2, substringScalar };
+static const ScanKernels g_avx2 = { "avx2", crlfAvx2, headerEndAvx2, nonTokenAvx2, substringAvx2 };
+#endif
+
+static bool supported(const ScanKernels &candidate)
+{
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+	if (&candidate == &g_avx2)
+		return __builtin_cpu_supports("avx2");
+	if (&candidate == &g_sse2)
+		return __builtin_cpu_supports("sse2");
+#endif
+	return &candidate == &g_scalar;
+}
+
+static const ScanKernels *&selected()
+{
+	static const ScanKernels *kernels = NULL;
+	if (!kernels)
+	{
+		kernels = &g_scalar;
+#ifdef SCAN_X86
+		if (supported(g_avx2))
+			kernels = &g_avx2;
+		else if (supported(g_sse2))
+			kernels = &g_sse2;
+#endif
+	}
+	return kernels;
+}
+
+size_t scanCrlf(const char *data, size_t size)
+{
+	return selected()->crlf(data, size);
+}
+
+size_t scanHeaderEnd(const char *data, size_t size)
+{
+	return selected()->headerEnd(data, size);
+}
+
+size_t scanNonToken(const char *data, size_t size)
+{
+	return selected()->nonToken(data, size);
+}
+
+size_t scanSubstring(const char *data, size_t size, const char *needle, size_t needleSize)
+{
+	return selected()->substring(data, size, needle, needleSize);
+}
+
+size_t findCrlf(const std::string &data, size_t from, size_t end)
+{
+	end = std::min(end, data.size());
+	if (from >= end)
+		return std::string::npos;
+	size_t at = scanCrlf(data.data() + from, end - from);
+	return at == end - from ? std::string::npos : from + at;
+}
+
+size_t findHeaderEnd(const std::string &data, size_t from)
+{
+	if (from >= data.size())
+		return std::string::npos;
+	size_t at = scanHeaderEnd(data.data() + from, data.size() - from);
+	return at == data.size() - from ? std::string::npos : from + at;
+}
+
+static size_t findSubstring(const std::string &data, const char *needle, size_t needleSize, size_t from, size_t end)
+{
+	end = std::min(end, data.size());
+	if (from > end)
+		return std::string::npos;
+	if (needleSize == 0)
+		return from;
+	size_t at = scanSubstring(data.data() + from, end - from, needle, needleSize);
+	return at == end - from ? std::string::npos : from + at;
+}
+
+size_t findSubstring(const std::string &data, const std::string &needle, size_t from, size_t end)
+{
+	return findSubstring(data, needle.data(), needle.size(), from, end);
+}
+
+size_t findSubstring(const std::string &data, const char *needle, size_t from, size_t end)
+{
+	return findSubstring(data, needle, std::strlen(needle), from, end);
+}
+
+bool isToken(const char *data, size_t size)
+{
+	return size > 0 && scanNonToken(data, size) == size;
+}
+
+const char *scanKernel()
+{
+	return selected()->name;
+}
+
+bool setScanKernel(const std::string &name)
+{
+	const ScanKernels *candidates[] = {
+#ifdef SCAN_X86
+		&g_avx2, &g_sse2,
+#endif
+		&g_scalar
+	};
+	for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); ++i)
+	{
+		if (name == candidates[i]->name && supported(*candidates[i]))
+		{
+			selected() = candidates[i];
+			return true;
+		}
+	}
+	return false;
+}
@@ -7,36 +7,205 @@
 #include "../include/Utils.hpp"
 #include <dirent.h>
 #include <algorithm>
+#include <netinet/tcp.h>
 
-Server::Server(const std::vector<ServerConfig>& configs)
-	: _configs(configs)
+volatile sig_atomic_t Server::_stopRequested = 0;
+
+// With listen set to false no listening sockets are created; clients can then only be
+// added through attachClient, which is how tests and benchmarks drive the server in-process
+Server::Server(const std::vector<ServerConfig>& configs, bool listen)
+	: _configs(configs), _stopping(false), _drainDeadline(0), _lastTimeoutSweep(0), _readPaused(false),
+	  _http2BodyLimit(0), _http2HeaderLimit(0), _ring(NULL), _disk(DISK_THREADS)
 {
-	logInfo("Initializing server with " + intToStr(configs.size()) + " configurations");
+	_splicePipe[0] = _splicePipe[1] = -1;
+	addPollFd(_disk.getNotifyFd(), POLLIN);
+	LOG_INFO("Initializing server with " + intToStr(configs.size()) + " configurations");
+	// HTTP/2 streams are buffered before their location is known, so up to the largest limit.
+	// Their header lists may be as large as all large_client_header_buffers of a server.
 	for (size_t i = 0; i < configs.size(); ++i)
+	{
+		_http2BodyLimit = std::max(_http2BodyLimit, configs[i].getClientMaxBodySize());
+		_http2HeaderLimit = std::max(_http2HeaderLimit,
+			configs[i].getHeaderBufferSize() * configs[i].getHeaderBufferCount());
+		const std::vector<LocationConfig> &locations = configs[i].getLocations();
+		for (size_t j = 0; j < locations.size(); ++j)
+		{
+			if (locations[j].getClientMaxBodySize() > 0)
+				_http2BodyLimit = std::max(_http2BodyLimit, static_cast<size_t>(locations[j].getClientMaxBodySize()));
+		}
+	}
+	_canned.build(_configs);
+	// One writer per log file, shared by all virtual hosts that log to it
+	for (size_t i = 0; i < configs.size(); ++i)
+	{
+		const std::string& path = configs[i].getAccessLog();
+		if (!path.empty() && _accessLogs.find(path) == _accessLogs.end())
+			_accessLogs[path] = new AccessLog(path, AccessLog::parseFormat(configs[i].getAccessLogFormat()), configs[i].getAccessLogSample());
+	}
+	for (size_t i = 0; listen && i < configs.size(); ++i)
 	{
 		const ServerConfig& config = configs[i];
 		// Only creating a socket if the current server config is the first of that ip-port-combo
 		if (findServerConfig(config.getHost(), config.getPort()) != &_configs[i])
-			return;
+			continue;
+		TlsContext *tls = config.isSsl() ? new TlsContext(config) : NULL;
 		int sock = createListeningSocket(config);
-		struct pollfd pfd;
-		pfd.fd = sock;
-		pfd.events = POLLIN;
-		pfd.revents = 0;
-		_pollFds.push_back(pfd);
-		_sockets[sock] = Socket(sock, Socket::LISTENING, Socket::RECEIVING, config.getHost() , config.getPort());
-		logInfo("Listening on " + config.getHost() + ":" + intToStr(config.getPort()));
+		if (tls)
+			_tlsContexts[sock] = tls;
+		else
+			_overloaded[sock] = &_canned.getOverloaded(&_configs[i]);
+		_sockets.insert(sock, Socket::LISTENING, config.getHost(), config.getPort());
+		addPollFd(sock, POLLIN);
+		LOG_INFO("Listening on " + config.getHost() + ":" + intToStr(config.getPort()) + (tls ? " (ssl)" : ""));
+	}
+}
+
+Server::~Server()
+{
+	// The workers may still be reading body files of the sockets closed below
+	_disk.stop();
+	for (int fd = 0; fd < _sockets.getLimit(); ++fd)
+	{
+		Socket *socket = _sockets.find(fd);
+		if (!socket)
+			continue;
+		socket->releaseTls();
+		close(fd);
+		socket->closeBody();
+		socket->closeSpool();
+		socket->releaseArena();
+		socket->releaseHttp2();
+	}
+	for (std::map<std::string, AccessLog*>::iterator it = _accessLogs.begin(); it != _accessLogs.end(); ++it)
+		delete it->second;
+	for (std::map<int, TlsContext*>::iterator it = _tlsContexts.begin(); it != _tlsContexts.end(); ++it)
+		delete it->second;
+	for (size_t i = 0; i < _cgiRefreshes.size(); ++i)
+		delete _cgiRefreshes[i];
+	for (size_t i = 0; i < _dueRefreshes.size(); ++i)
+		delete _dueRefreshes[i];
+	delete _ring;
+	if (_splicePipe[0] != -1)
+	{
+		close(_splicePipe[0]);
+		close(_splicePipe[1]);
+	}
+}
+
+// How the io_uring backend serves POLLIN for a socket: listeners accept and plain connections
+// receive through the ring, TLS reads the socket itself so it only gets readiness
+static IoUring::Mode ringMode(const Socket &socket)
+{
+	if (socket.getType() == Socket::LISTENING)
+		return IoUring::ACCEPT;
+	return socket.getTls() ? IoUring::POLL : IoUring::RECEIVE;
+}
+
+// Switches the event loop from poll() to io_uring, chosen with `events { use io_uring; }`.
+// Stays on poll() if the kernel does not support it.
+void Server::useIoUring()
+{
+	std::string reason;
+	_ring = IoUring::create(reason);
+	if (!_ring)
+	{
+		LOG_WARNING("io_uring is not available (" + reason + "), using poll");
+		return;
+	}
+	_ring->watch(_pollFds[0].fd, IoUring::POLL);
+	for (size_t i = 1; i < _pollFds.size(); ++i)
+		_ring->watch(_pollFds[i].fd, ringMode(*_sockets.find(_pollFds[i].fd)));
+	LOG_INFO("Event loop uses io_uring");
+}
+
+void Server::setDiskThreads(int threads)
+{
+	_disk.setThreads(threads);
+}
+
+// Adds O_NONBLOCK to the flags the fd already has
+static void setNonBlocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	if (flags != -1)
+		fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Socket options of the listen directive are best effort: one the system refuses is logged
+// and the listener works without it
+static void setListenOption(int sock, int level, int name, int value, const std::string &what)
+{
+	if (setsockopt(sock, level, name, &value, sizeof(value)) < 0)
+		logWarning("Cannot set " + what + " on the listening socket: " + std::string(std::strerror(errno)));
+}
+
+static void applyListenOptions(int sock, const ListenOptions &options)
+{
+	int opt = 1;
+	// Inherited by the accepted connections: responses are written in whole pieces, so
+	// Nagle's algorithm would only hold back their last segment
+	setListenOption(sock, IPPROTO_TCP, TCP_NODELAY, opt, "TCP_NODELAY");
+	if (options.reuseport)
+	{
+#ifdef SO_REUSEPORT
+		setListenOption(sock, SOL_SOCKET, SO_REUSEPORT, opt, "SO_REUSEPORT");
+#else
+		logWarning("listen parameter reuseport is not supported on this system, ignored");
+#endif
+	}
+	if (options.rcvbuf)
+		setListenOption(sock, SOL_SOCKET, SO_RCVBUF, options.rcvbuf, "SO_RCVBUF");
+	if (options.sndbuf)
+		setListenOption(sock, SOL_SOCKET, SO_SNDBUF, options.sndbuf, "SO_SNDBUF");
+	if (options.keepalive != -1)
+		setListenOption(sock, SOL_SOCKET, SO_KEEPALIVE, options.keepalive, "SO_KEEPALIVE");
+#ifdef TCP_KEEPIDLE
+	if (options.keepidle)
+		setListenOption(sock, IPPROTO_TCP, TCP_KEEPIDLE, options.keepidle, "TCP_KEEPIDLE");
+	if (options.keepintvl)
+		setListenOption(sock, IPPROTO_TCP, TCP_KEEPINTVL, options.keepintvl, "TCP_KEEPINTVL");
+	if (options.keepcnt)
+		setListenOption(sock, IPPROTO_TCP, TCP_KEEPCNT, options.keepcnt, "TCP_KEEPCNT");
+#else
+	if (options.keepidle || options.keepintvl || options.keepcnt)
+		logWarning("listen parameter so_keepalive=idle:interval:count is not supported on this system, ignored");
+#endif
+	if (options.deferred)
+	{
+#ifdef TCP_DEFER_ACCEPT
+		// Seconds to wait for the first data before the connection is accepted anyway
+		setListenOption(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, 1, "TCP_DEFER_ACCEPT");
+#else
+		logWarning("listen parameter deferred is not supported on this system, ignored");
+#endif
+	}
+	if (options.fastopen)
+	{
+#ifdef TCP_FASTOPEN
+		setListenOption(sock, IPPROTO_TCP, TCP_FASTOPEN, options.fastopen, "TCP_FASTOPEN");
+#else
+		logWarning("listen parameter fastopen is not supported on this system, ignored");
+#endif
 	}
 }
 
 int Server::createListeningSocket(const ServerConfig &config)
 {
+#ifdef SOCK_NONBLOCK
+	// Close-on-exec keeps the sockets out of CGI processes
+	int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+#else
 	int sock = socket(AF_INET, SOCK_STREAM, 0);
+#endif
 	if (sock == -1)
 	{
 		logError("Socket creation failed: " + std::string(std::strerror(errno)));
 		throw std::runtime_error("Socket creation failed");
 	}
+#ifndef SOCK_NONBLOCK
+	setNonBlocking(sock);
+	fcntl(sock, F_SETFD, FD_CLOEXEC);
+#endif
 
 	int opt = 1;
 	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *)&opt, sizeof(opt)) < 0)
@@ -45,6 +214,8 @@ int Server::createListeningSocket(const ServerConfig &config)
 		logError(error);
 		throw std::runtime_error(error);
 	}
+	const ListenOptions &options = config.getListenOptions();
+	applyListenOptions(sock, options);
 	sockaddr_in addr;
 	std::memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;
@@ -57,138 +228,414 @@ int Server::createListeningSocket(const ServerConfig &config)
 		throw std::runtime_error("Bind failed");
 	}
 
-	if (listen(sock, SOMAXCONN) == -1)
+	if (listen(sock, options.backlog) == -1)
 	{
 		logError("Listen failed: " + std::string(std::strerror(errno)));
 		throw std::runtime_error("Listen failed");
 	}
-
-	fcntl(sock, F_SETFL, O_NONBLOCK);
 	return sock;
 }
 
-void Server::acceptConnection(Socket &listeningSocket)
+// Takes a connection from the listener's backlog, already non-blocking and close-on-exec
+static int acceptClient(int listenFd, sockaddr_in &addr)
 {
-		size_t currentClients = 0;
-	for (std::map<int, Socket>::iterator it = _sockets.begin(); it != _sockets.end(); ++it)
+	socklen_t len = sizeof(addr);
+#ifdef SOCK_NONBLOCK
+	return accept4(listenFd, (sockaddr *)&addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	int fd = accept(listenFd, (sockaddr *)&addr, &len);
+	if (fd != -1)
 	{
-		if (it->second.getType() == Socket::CLIENT)
-			++currentClients;
+		setNonBlocking(fd);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
 	}
+	return fd;
+#endif
+}
 
-	if (currentClients >= MAX_SOCKETS)
+// Takes every connection waiting on the listener, so a burst of connections costs one
+// wakeup rather than one per connection
+void Server::acceptConnections(Socket &listeningSocket)
+{
+	for (;;)
 	{
-		std::cerr << "Connection refused: MAX_CLIENTS reached.\n";
-
 		sockaddr_in clientAddr;
-		socklen_t len = sizeof(clientAddr);
-		int clientFd = accept(listeningSocket.getFd(), (sockaddr *)&clientAddr, &len);
-		if (clientFd != -1)
+		int clientFd;
+		// With io_uring the connections have been accepted already
+		if (_ring)
 		{
-			Response res;
-			res.setStatus(503);
-			res.setHeader("Connection", "close");
-			res.setHeader("Content-Type", "text/html");
+			if (!_ring->takeAccepted(listeningSocket.getFd(), clientFd, clientAddr))
+				return;
+		}
+		else
+		{
+			_metrics.syscalls(1);
+			clientFd = acceptClient(listeningSocket.getFd(), clientAddr);
+		}
+		if (clientFd == -1)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			// The peer gave up while it was waiting in the backlog
+			if (errno == ECONNABORTED || errno == EINTR)
+				continue;
+			logError("Failed to accept new connection: " + std::string(std::strerror(errno)));
+			// Out of descriptors: poll() reports the listener again on the next iteration
+			if (!_ring)
+				return;
+			continue;
+		}
+		admitClient(listeningSocket, clientFd, clientAddr);
+	}
+}
 
-			std::string body =
-				"<html><body><h1>503 Service Unavailable</h1><p>Server is too busy.</p></body></html>";
-			res.setBody(body);
-			res.setHeader("Content-Length", intToStr(body.size()));
+// Registers an accepted connection, or answers 503 and closes it if there are too many
+void Server::admitClient(Socket &listeningSocket, int clientFd, const sockaddr_in &clientAddr)
+{
+	if (_sockets.getClientCount() >= MAX_SOCKETS)
+	{
+		std::cerr << "Connection refused: MAX_CLIENTS reached.\n";
 
+		// A plain text answer would only confuse a TLS client
+		if (_tlsContexts.count(listeningSocket.getFd()))
+		{
+			_metrics.connectionDropped();
+			close(clientFd);
+		}
+		else
+		{
 			logWarning("Server too busy, rejecting new connection");
-			std::string responseStr = res.toString();
-			send(clientFd, responseStr.c_str(), responseStr.size(), 0);
+			_metrics.connectionDropped();
+			// Serialized when the server started: all that is left is a send()
+			std::map<int, const std::string*>::const_iterator it = _overloaded.find(listeningSocket.getFd());
+			const std::string &answer = it != _overloaded.end() ? *it->second : _canned.getOverloaded(NULL);
+			send(clientFd, answer.data(), answer.size(), 0);
 			close(clientFd);
 		}
 		return;
 	}
-	sockaddr_in clientAddr;
-	socklen_t len = sizeof(clientAddr);
-	int clientFd = accept(listeningSocket.getFd(), (sockaddr *)&clientAddr, &len);
-	if (clientFd == -1)
+
+	Socket &client = registerClient(clientFd, listeningSocket.getIPv4(), listeningSocket.getPort(), inet_ntoa(clientAddr.sin_addr));
+	std::map<int, TlsContext*>::iterator tls = _tlsContexts.find(listeningSocket.getFd());
+	if (tls != _tlsContexts.end())
 	{
-		logError("Failed to accept new connection: " + std::string(std::strerror(errno)));
-		return;
+		client.setTls(new TlsConnection(*tls->second, clientFd));
+		if (_ring)
+			_ring->watch(clientFd, IoUring::POLL);
 	}
+	LOG_INFO("Accepted new connection on fd " + intToStr(clientFd));
+}
 
-	fcntl(clientFd, F_SETFL, O_NONBLOCK);
+// Drives the non-blocking TLS handshake of a client; once it is done the connection is
+// handled like any other
+void Server::continueHandshake(Socket &client)
+{
+	int result = client.getTls()->handshake();
+	if (result == TlsConnection::HANDSHAKE_FAILED)
+	{
+		LOG_INFO("TLS handshake with client " + intToStr(client.getFd()) + " failed");
+		deleteClient(client);
+		return;
+	}
+	client.updateActivity();
+	pollfd &pfd = findPollFd(client.getFd());
+	if (result != TlsConnection::HANDSHAKE_DONE)
+	{
+		pfd.events = result;
+		return;
+	}
+	LOG_DEBUG("TLS established with client " + intToStr(client.getFd())
+		+ (client.getTls()->isResumed() ? ", session resumed" : ""));
+	pfd.events = _readPaused ? 0 : POLLIN;
+}
 
-	// Adding client fd to Server::_pollFds vector
-	pollfd pfd = {clientFd, POLLIN, 0};
-	_pollFds.push_back(pfd);
+// Registers an already connected socket (e.g. one end of a socketpair) as if it had been
+// accepted by the listener on IPv4:port. The server takes ownership of the fd.
+void Server::attachClient(int fd, const std::string &IPv4, int port, const std::string &clientIPv4)
+{
+	setNonBlocking(fd);
+	registerClient(fd, IPv4, port, clientIPv4);
+	LOG_DEBUG("Attached client on fd " + intToStr(fd));
+}
 
-	_sockets[clientFd] = Socket(clientFd, Socket::CLIENT, Socket::RECEIVING, listeningSocket.getIPv4(), listeningSocket.getPort());
-	logInfo("Accepted new connection on fd " + intToStr(clientFd));
+Socket& Server::registerClient(int fd, const std::string &IPv4, int port, const std::string &clientIPv4)
+{
+	Socket &client = _sockets.insert(fd, Socket::CLIENT, IPv4, port);
+	client.setClientIPv4(clientIPv4);
+	addPollFd(fd, _readPaused ? 0 : POLLIN);
+	_rateLimiter.connectionOpened(client.getClientAddr(), monotonicTime());
+	_metrics.connectionAccepted();
+	return client;
 }
 
+// Called on every event loop iteration, does its work at most once per second.
+// Idle connections are closed after KEEPALIVE_TIMEOUT; clients in the middle of a
+// request that are too slow get a 408 instead.
 void Server::handleClientTimeouts()
 {
-	for (std::map<int, Socket>::iterator it = _sockets.begin(); it != _sockets.end();)
+	time_t now = time(NULL);
+	if (now == _lastTimeoutSweep)
+		return;
+	_lastTimeoutSweep = now;
+	double monotonicNow = monotonicTime();
+
+	std::vector<int> timedOut;
+	std::vector<int> tooSlow;
+	for (int fd = 0; fd < _sockets.getLimit(); ++fd)
 	{
-		Socket &client = it->second;
-		if (client.getType() != Socket::LISTENING && time(NULL) - client.getLastActivity() > 30)
+		Socket *socket = _sockets.find(fd);
+		if (!socket || socket->getType() == Socket::LISTENING)
+			continue;
+		Socket &client = *socket;
+		// The buffer of an HTTP/2 connection holds output only, it just has the idle timeout
+		if (client.getState() == Socket::RECEIVING && !client.getBuffer().empty() && !client.getHttp2())
 		{
-			logInfo("Client " + intToStr(client.getFd()) + " has timed out. Closing connection.");
-			close(client.getFd());
-			_sockets.erase(it++);
+			if (isTooSlow(client, monotonicNow))
+				tooSlow.push_back(fd);
 		}
-		else
-			++it;
+		else if (now - client.getLastActivity() > KEEPALIVE_TIMEOUT)
+			timedOut.push_back(fd);
+		else if (client.getState() == Socket::RECEIVING && now - client.getLastActivity() >= IDLE_SHRINK_SECONDS)
+			client.shrinkIdle();
+	}
+	// deleteClient also removes the pollfd, which erasing from _sockets alone would leave behind
+	for (size_t i = 0; i < timedOut.size(); ++i)
+	{
+		LOG_INFO("Client " + intToStr(timedOut[i]) + " has timed out. Closing connection.");
+		deleteClient(*_sockets.find(timedOut[i]));
+	}
+	for (size_t i = 0; i < tooSlow.size(); ++i)
+	{
+		LOG_INFO("Client " + intToStr(tooSlow[i]) + " is sending its request too slowly.");
+		rejectRequest(*_sockets.find(tooSlow[i]), 408);
 	}
 }
 
+// Checks a partially received request against client_header_timeout (whole header),
+// client_body_timeout (pause between reads) and client_min_rate (average since the
+// first byte, after MIN_RATE_GRACE seconds). The vhost is not known yet, so the
+// default server of the listener decides.
+bool Server::isTooSlow(const Socket& client, double now)
+{
+	const ServerConfig *config = findServerConfig(client.getIPv4(), client.getPort());
+	const AccessRecord &record = client.getRecord();
+	if (!config || record.start == 0)
+		return false;
+	double elapsed = now - record.start;
+	if (record.headersDone == 0 && elapsed > config->getClientHeaderTimeout())
+		return true;
+	if (record.headersDone != 0 && time(NULL) - client.getLastActivity() > config->getClientBodyTimeout())
+		return true;
+	// A spooled body has left the buffer for its file
+	size_t received = client.getBuffer().size() + client.getSpooled();
+	return config->getClientMinRate() && elapsed > MIN_RATE_GRACE
+		&& received / elapsed < config->getClientMinRate();
+}
+
+// Answers a request that will not be read any further and closes the connection afterwards
+void Server::rejectRequest(Socket& client, int status)
+{
+	Response res;
+	res.setHeader("Connection", "close");
+	_canned.applyError(res, client.getServerConfig(), status);
+	makeReadyforSend(res, client);
+}
+
 void Server::run()
 {
-	logInfo("Server started and ready to accept connections");
-	while (true)
+	LOG_INFO("Server started and ready to accept connections");
+	// Waking up at least once per second keeps the client timeouts accurate
+	while (runOnce(1000))
+		;
+	LOG_INFO("Server stopped");
+}
+
+// Runs a single iteration of the event loop: waits at most timeoutMs for events and handles them.
+// Returns false once the server has stopped and every client has been drained.
+bool Server::runOnce(int timeoutMs)
+{
+	if (_stopRequested && !_stopping)
+		stop();
+	if (_stopping)
+	{
+		drainClients();
+		if (isStopped())
+			return false;
+		timeoutMs = std::min(timeoutMs, 1000);
+	}
+	if (!_delayed.empty())
+		timeoutMs = releaseDelayedResponses(timeoutMs);
+	updateReadBackpressure();
+	// Refreshes queued by the last iteration wait for this one, which sends their stale copies.
+	// Their scripts are not polled with the sockets, the wait is cut short to check on them.
+	_dueRefreshes.insert(_dueRefreshes.end(), _cgiRefreshes.begin(), _cgiRefreshes.end());
+	_cgiRefreshes.clear();
+	if (!_dueRefreshes.empty())
+		timeoutMs = std::min(timeoutMs, CGI_REFRESH_POLL_MS);
+
+	int ret = _ring ? _ring->wait(_pollFds, timeoutMs) : poll(_pollFds.data(), _pollFds.size(), timeoutMs);
+	_metrics.syscalls(_ring ? _ring->takeSyscalls() : 1);
+	flushAccessLogs();
+	if (ret == -1)
+	{
+		// A signal (e.g. SIGINT calling requestStop) interrupted the wait
+		if (errno == EINTR)
+			return true;
+		logError("Poll error occurred");
+		std::cerr << "Poll error\n";
+		return false;
+	}
+	else if (ret == 0)
 	{
-		int ret = poll(_pollFds.data(), _pollFds.size(), 5000);
-		if (ret == -1)
+		runCgiRefreshes();
+		handleClientTimeouts(); // could be testet with telnet
+		return true;
+	}
+	for (size_t i = 0; i < _pollFds.size(); ++i)
+	{
+		// if (_pollFds[i].revents & POLLIN)
+		if (_pollFds[i].events & _pollFds[i].revents)
 		{
-			logError("Poll error occurred");
-			std::cerr << "Poll error\n";
-			break;
+			int fd = _pollFds[i].fd;
+			if (i == 0)
+			{
+				completeDiskJobs();
+				continue;
+			}
+
+			// Check if socket still exists (could be deleted during previous iteration)
+			Socket *socket = _sockets.find(fd);
+			if (!socket)
+				continue;
+
+			if (socket->getType() == Socket::LISTENING)
+				acceptConnections(*socket);
+			else if (socket->getTls() && !socket->getTls()->isEstablished())
+				continueHandshake(*socket);
+			else if (socket->getHttp2())
+				serviceHttp2(*socket, _pollFds[i].revents);
+			else
+			{
+				if (socket->getState() == Socket::RECEIVING)
+					handleClient(*socket);
+				else // Socket::SENDING
+					sendResponse(*socket);
+			}
 		}
-		else if (ret == 0)
+	}
+	runCgiRefreshes();
+	handleClientTimeouts();
+	return true;
+}
+
+// Stops reading from all clients while the connection buffers together exceed BUFFER_BUDGET,
+// until they are back below BUFFER_BUDGET_LOW. Sending goes on and frees the memory.
+void Server::updateReadBackpressure()
+{
+	size_t buffered = Socket::getBufferedTotal();
+	bool pause = _readPaused ? buffered > BUFFER_BUDGET_LOW : buffered > BUFFER_BUDGET;
+	if (pause == _readPaused)
+		return;
+	_readPaused = pause;
+	LOG_WARNING(std::string(pause ? "Pausing" : "Resuming") + " reads, " + intToStr(buffered) + " bytes buffered");
+	for (size_t i = 0; i < _pollFds.size(); ++i)
+	{
+		Socket *socket = _sockets.find(_pollFds[i].fd);
+		if (socket && socket->getType() == Socket::CLIENT && socket->getState() == Socket::RECEIVING)
 		{
-			handleClientTimeouts(); // could be testet with telnet
-			continue;
+			// HTTP/2 connections keep sending while they stop reading
+			short keep = socket->getHttp2() ? (_pollFds[i].events & POLLOUT) : 0;
+			_pollFds[i].events = keep | (pause ? 0 : POLLIN);
 		}
-		for (size_t i = 0; i < _pollFds.size(); ++i)
+	}
+}
+
+// Enables POLLOUT for delayed responses that are due and returns the poll timeout
+// shortened to the next pending one
+int Server::releaseDelayedResponses(int timeoutMs)
+{
+	double now = monotonicTime();
+	std::vector<int> pending;
+	for (size_t i = 0; i < _delayed.size(); ++i)
+	{
+		Socket *client = _sockets.find(_delayed[i]);
+		if (!client || client->getSendAt() == 0)
+			continue;
+		double wait = client->getSendAt() - now;
+		if (wait <= 0)
 		{
-			// if (_pollFds[i].revents & POLLIN)
-			if (_pollFds[i].events & _pollFds[i].revents)
-			{
-				int fd = _pollFds[i].fd;
-
-				// Check if socket still exists (could be deleted during previous iteration)
-				std::map<int, Socket>::iterator it = _sockets.find(fd);
-				if (it == _sockets.end())
-					continue;
-
-				if (it->second.getType() == Socket::LISTENING)
-					acceptConnection(it->second);
-				else
-				{
-					if (it->second.getState() == Socket::RECEIVING)
-						handleClient(it->second);
-					else // Socket::SENDING
-						sendResponse(it->second);
-				}
-			}
+			client->setSendAt(0);
+			if (client->getHttp2())
+				flushHttp2(*client);
+			else
+				findPollFd(_delayed[i]).events = POLLOUT;
+			continue;
 		}
+		pending.push_back(_delayed[i]);
+		int waitMs = static_cast<int>(wait * 1000) + 1;
+		if (timeoutMs < 0 || waitMs < timeoutMs)
+			timeoutMs = waitMs;
+	}
+	_delayed.swap(pending);
+	return timeoutMs;
+}
+
+// Graceful shutdown: closes the listening sockets right away and gives the connected
+// clients drainSeconds to finish the request they are in. Responses sent while draining
+// carry "Connection: close".
+void Server::stop(int drainSeconds)
+{
+	if (_stopping)
+		return;
+	LOG_INFO("Stopping server, draining clients for at most " + intToStr(drainSeconds) + "s");
+	_stopping = true;
+	_drainDeadline = time(NULL) + drainSeconds;
+
+	for (int fd = 0; fd < _sockets.getLimit(); ++fd)
+	{
+		Socket *socket = _sockets.find(fd);
+		if (!socket || socket->getType() != Socket::LISTENING)
+			continue;
+		close(fd);
+		removePollFd(fd);
+		_sockets.erase(fd);
+	}
+}
+
+// Async-signal-safe: only sets a flag that the next runOnce turns into stop()
+void Server::requestStop()
+{
+	_stopRequested = 1;
+}
+
+bool Server::isStopped() const
+{
+	return _stopping && _sockets.empty();
+}
+
+// Closes the clients that are between requests, and all of them once the drain deadline has passed
+void Server::drainClients()
+{
+	bool expired = time(NULL) >= _drainDeadline;
+	for (int fd = 0; fd < _sockets.getLimit(); ++fd)
+	{
+		Socket *client = _sockets.find(fd);
+		if (client && (expired || (client->getState() == Socket::RECEIVING && client->getBuffer().empty()
+			&& (!client->getHttp2() || client->getHttp2()->isIdle()))))
+			deleteClient(*client);
 	}
 }
 
 void Server::printSockets()
 {
-	logDebug("===== Socket List =====");
+	LOG_DEBUG("===== Socket List =====");
 	std::ostringstream socketInfo;
-	for (std::map<int, Socket>::iterator it = _sockets.begin(); it != _sockets.end(); ++it)
+	for (int fd = 0; fd < _sockets.getLimit(); ++fd)
 	{
-		socketInfo << "Key in map: " << it->first << ", " << it->second;
+		if (_sockets.find(fd))
+			socketInfo << "Slot: " << fd << ", " << *_sockets.find(fd);
 	}
-	logDebug(socketInfo.str());
+	LOG_DEBUG(socketInfo.str());
 	std::cout << socketInfo.str();
 
 	socketInfo.str("");
@@ -199,7 +646,7 @@ void Server::printSockets()
 				  << ", Event: " << decodeEvents(it->events)
 				  << ", Revent: " << decodeEvents(it->revents);
 	}
-	logDebug(socketInfo.str());
+	LOG_DEBUG(socketInfo.str());
 	std::cout << socketInfo.str() << std::endl;
 }
 
@@ -207,18 +654,56 @@ void Server::printSockets()
 // Historically, this function sent the response to the client, but now it only prepares the buffer
 void Server::makeReadyforSend(Response& response, Socket& client)
 {
-	// Converting the response class to a string and storing it in the client's buffer
-	std::string string = response.toString();
+	if (_stopping)
+		response.setHeader("Connection", "close");
+
+	int bodyFd = response.getBodyFd();
+	if (bodyFd == -1 && !response.getBodyFile().empty())
+	{
+		bodyFd = open(response.getBodyFile().c_str(), O_RDONLY);
+		if (bodyFd == -1)
+		{
+			logError("Cannot open " + response.getBodyFile() + ": " + std::string(std::strerror(errno)));
+			response = Response();
+			response.setStatus(500);
+			response.setHeader("Connection", "close");
+		}
+	}
+	if (client.getHttp2())
+	{
+		submitHttp2Response(response, client, bodyFd);
+		return;
+	}
+
+	// Serializing the head into the connection's arena and storing head and body in the client's buffer
+	size_t headSize;
+	const char *head = response.serializeHead(client.getArena(), headSize);
 	client.clearBuffer();
-	client.appendToBuffer(string.c_str(), string.size());
+	client.appendToBuffer(head, headSize);
+	client.appendToBuffer(response.getBody().data(), response.getBody().size());
+	if (bodyFd != -1)
+	{
+		client.setBodyFile(bodyFd, response.getBodyFileSize());
+		if (client.hasPendingBody() && !client.sendsBodyDirectly())
+			readBody(client);
+	}
+
+	AccessRecord& record = client.getRecord();
+	record.status = response.getStatus();
+	record.handlerDone = monotonicTime();
 
 	// Setting the client state to SENDING
 	client.setState(Socket::SENDING);
 
-	// Changing the pollfd event to POLLOUT
+	// Changing the pollfd event to POLLOUT, or to nothing until a limit_req delay is over
 	pollfd& pfd = findPollFd(client.getFd());
 	pfd.events = POLLOUT;
 	pfd.revents = 0;
+	if (client.getSendAt() != 0)
+	{
+		pfd.events = 0;
+		_delayed.push_back(client.getFd());
+	}
 
 	// Preparing connection close if needed
 	if (response.getHeaderValue("Connection") == "close")
@@ -228,37 +713,77 @@ void Server::makeReadyforSend(Response& response, Socket& client)
 // Sends the response inside the socket's buffer to the client
 void Server::sendResponse(Socket& client)
 {
-	// Sending the response to the client
+	// Sending the response to the client; a file body sent with sendfile comes after the buffer
 	const std::string& buffer = client.getBuffer();
-	ssize_t bufferSize = buffer.size();
-	ssize_t bytesSent = send(client.getFd(), buffer.c_str(), bufferSize, 0);
-	logDebug("Sent " + intToStr(bytesSent) + " bytes to client " + intToStr(client.getFd()));
+	bool direct = buffer.empty() && client.hasPendingBody() && client.sendsBodyDirectly();
+	// Nothing to send until the disk pool has read more of the body
+	if (buffer.empty() && client.isReadingBody())
+	{
+		findPollFd(client.getFd()).events = 0;
+		return;
+	}
+	if (client.hasPendingBody() && !client.isCorked())
+	{
+		client.setCorked(true);
+		_metrics.syscalls(1);
+	}
+	ssize_t bytesSent = direct ? client.sendBodyDirectly() : client.transmit(buffer.data(), buffer.size());
+	_metrics.syscalls(1);
+	LOG_DEBUG("Sent " + intToStr(bytesSent) + " bytes to client " + intToStr(client.getFd()));
 
+	// TLS may have to wait for the socket although poll() reported it writable
+	if (bytesSent == -1 && errno == EAGAIN)
+		return;
 	// If send failed, delete the client.
 	// (Even though this is not expected, it should not terminate the server, so we don't throw an exception here.)
-	if (bytesSent == -1)
+	if (bytesSent == -1 || (direct && bytesSent == 0))
 	{
 		logError("Send failed to client " + intToStr(client.getFd()) + ": " + std::string(strerror(errno)) + ", deleting client");
 		deleteClient(client);
 		return;
 	}
 
+	AccessRecord& record = client.getRecord();
+	if (record.firstByte == 0 && bytesSent > 0)
+		record.firstByte = monotonicTime();
+	record.bytesSent += bytesSent;
+	_metrics.bytesSent(bytesSent);
+
 	// Trimming the part of the buffer that was sent
-	client.trimBuffer(bytesSent);
-	logDebug("Trimmed buffer for client " + intToStr(client.getFd()) + ", new size: " + intToStr(client.getBuffer().size()));
+	if (!direct)
+		client.trimBuffer(bytesSent);
+	LOG_DEBUG("Trimmed buffer for client " + intToStr(client.getFd()) + ", new size: " + intToStr(client.getBuffer().size()));
+
+	// Reading more of a file body only once the peer has taken most of what is buffered
+	if (client.hasPendingBody() && !client.sendsBodyDirectly() && !client.isReadingBody()
+		&& client.getBuffer().size() < SEND_LOW_WATERMARK)
+		readBody(client);
 
 	// If the buffer was not sent completely, return so that the rest of the response can be sent again later
-	if (bytesSent < bufferSize)
+	if (!client.getBuffer().empty() || client.hasPendingBody())
 	{
-		logDebug("Sent partial response to client " + intToStr(client.getFd()) + ", bytes sent: " + intToStr(bytesSent));
+		LOG_DEBUG("Sent partial response to client " + intToStr(client.getFd()) + ", bytes sent: " + intToStr(bytesSent));
+		if (client.getBuffer().empty() && client.isReadingBody())
+			findPollFd(client.getFd()).events = 0;
 		return;
 	}
-	logDebug("Sent full response to client " + intToStr(client.getFd()));
+	LOG_DEBUG("Sent full response to client " + intToStr(client.getFd()));
+	if (client.isCorked())
+	{
+		client.setCorked(false);
+		_metrics.syscalls(1);
+	}
+	record.end = monotonicTime();
+	_metrics.requestDone(record.vhost, record.status, record.end - record.start);
+	if (record.log)
+		record.log->write(record);
+	record.reset();
+	client.setRequestConfig(NULL, NULL);
 
 	// If the client needs to close the connection, delete it
 	if (client.getNeedsToClose())
 	{
-		logInfo("Closing connection for and deleting client " + intToStr(client.getFd()));
+		LOG_INFO("Closing connection for and deleting client " + intToStr(client.getFd()));
 		deleteClient(client);
 		return;
 	}
@@ -267,8 +792,87 @@ void Server::sendResponse(Socket& client)
 	client.clearBuffer();
 	client.setState(Socket::RECEIVING);
 	pollfd& pfd = findPollFd(client.getFd());
-	pfd.events = POLLIN;
+	pfd.events = _readPaused ? 0 : POLLIN;
 	pfd.revents = 0;
+	// A request pipelined behind the one just answered is already here, poll() would not report it
+	if (client.resumePipelined())
+		handleReceived(client);
+}
+
+// Hands a handler's blocking file operation to the disk pool. An HTTP/1.1 connection has
+// nothing else to do until it is back; an HTTP/2 connection goes on with its other streams.
+void Server::submitDiskJob(Socket &client, DiskJob *job, DiskWait &wait)
+{
+	wait.client = client.getFd();
+	wait.stream = client.getHttp2() ? client.getHttp2()->getCurrentStream() : 0;
+	wait.record = client.getRecord();
+	_diskWaits[_disk.submit(job)] = wait;
+	if (client.getHttp2())
+		return;
+	client.setState(Socket::WAITING);
+	findPollFd(client.getFd()).events = 0;
+}
+
+// Reads the next piece of a file body, enough to fill the buffer up to SEND_HIGH_WATERMARK.
+// What is in the page cache is read right away; the disk pool only waits for the disk.
+void Server::readBody(Socket &client)
+{
+	if (client.readCachedBody(SEND_HIGH_WATERMARK))
+		return;
+	DiskJob *job = new DiskJob(DiskJob::READ);
+	job->fd = client.getBodyFd();
+	job->limit = std::min(client.getBodyRemaining(), SEND_HIGH_WATERMARK - client.getBuffer().size());
+	DiskWait wait;
+	wait.kind = DiskWait::BODY;
+	wait.client = client.getFd();
+	_diskWaits[_disk.submit(job)] = wait;
+	client.setReadingBody(true);
+}
+
+// Picks up the jobs the disk pool has finished and continues their requests
+void Server::completeDiskJobs()
+{
+	_disk.acknowledge();
+	DiskJob *job;
+	while ((job = _disk.takeCompleted()) != NULL)
+	{
+		std::map<unsigned long, DiskWait>::iterator it = _diskWaits.find(job->id);
+		// The client is gone; what the job opened is not needed any more
+		if (it == _diskWaits.end())
+		{
+			if (job->fd != -1)
+				close(job->fd);
+			delete job;
+			continue;
+		}
+		DiskWait wait = it->second;
+		_diskWaits.erase(it);
+		Socket &client = *_sockets.find(wait.client);
+		if (wait.kind == DiskWait::BODY)
+		{
+			client.setReadingBody(false);
+			if (job->error || job->data.empty())
+			{
+				logError("Response body file ended early for client " + intToStr(client.getFd()) + ", deleting client");
+				deleteClient(client);
+			}
+			else
+			{
+				client.appendBody(job->data);
+				if (client.getSendAt() == 0)
+					findPollFd(client.getFd()).events = POLLOUT;
+			}
+			delete job;
+			continue;
+		}
+		client.getRecord() = wait.record;
+		if (client.getHttp2())
+			client.getHttp2()->setCurrentStream(wait.stream);
+		finishDiskJob(client, wait, *job);
+		if (job->fd != -1)
+			close(job->fd);
+		delete job;
+	}
 }
 
 // Returns the first serverConfig from the list that matches IP and port
@@ -295,12 +899,54 @@ ServerConfig* Server::findExactServerConfig(const std::string IPv4, int port, st
 }
 
 
+// Returns the access log the virtual host writes to, or NULL if it has none
+AccessLog* Server::findAccessLog(const ServerConfig* config)
+{
+	if (!config || config->getAccessLog().empty())
+		return NULL;
+	std::map<std::string, AccessLog*>::iterator it = _accessLogs.find(config->getAccessLog());
+	return it == _accessLogs.end() ? NULL : it->second;
+}
+
+void Server::flushAccessLogs()
+{
+	time_t now = time(NULL);
+	for (std::map<std::string, AccessLog*>::iterator it = _accessLogs.begin(); it != _accessLogs.end(); ++it)
+		it->second->flushIfDue(now);
+}
+
 pollfd& Server::findPollFd(int targetFD)
 {
-	for (size_t i = 0; i < _pollFds.size(); ++i)
+	if (!_sockets.find(targetFD))
+		throw std::runtime_error("PollFd not found for fd: " + intToStr(targetFD));
+	return _pollFds[_sockets.getPollIndex(targetFD)];
+}
+
+// The socket has to be in _sockets already, its slot keeps the index of the pollfd
+void Server::addPollFd(int fd, short events)
+{
+	pollfd pfd = {fd, events, 0};
+	// The first entry, the disk pool's, is not a socket and never moves
+	if (!_pollFds.empty())
+		_sockets.setPollIndex(fd, _pollFds.size());
+	_pollFds.push_back(pfd);
+	if (_ring)
+		_ring->watch(fd, ringMode(*_sockets.find(fd)));
+}
+
+// Moves the last pollfd into the freed place. runOnce walks _pollFds by index while handlers
+// remove entries, so a moved entry may wait until the next poll; poll is level-triggered and
+// reports it again.
+void Server::removePollFd(int fd)
+{
+	size_t index = _sockets.getPollIndex(fd);
+	size_t last = _pollFds.size() - 1;
+	if (index != last)
 	{
-		if (_pollFds[i].fd == targetFD)
-			return _pollFds[i];
+		_pollFds[index] = _pollFds[last];
+		_sockets.setPollIndex(_pollFds[index].fd, index);
 	}
-	throw std::runtime_error("PollFd not found for fd: " + intToStr(targetFD));
+	_pollFds.pop_back();
+	if (_ring)
+		_ring->forget(fd);
 }
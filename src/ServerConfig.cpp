@@ -2,6 +2,10 @@
 #include "../include/Utils.hpp"
 #include "../include/Logger.hpp"
 #include <sstream>
+#include <stdexcept>
+#include <cstdlib>
+#include <climits>
+#include <sys/socket.h>
 
 // one of the important things is that the order here
 // need to match the declaration order
@@ -11,10 +15,91 @@ ServerConfig::ServerConfig()
 	  server_name(""),
 	  root("www"),
 	  index("/index.html"),
-	  client_max_body_size(1000000)
+	  client_max_body_size(1000000),
+	  client_body_buffer_size(1024 * 1024),
+	  access_log_format("combined"),
+	  access_log_sample(1),
+	  limit_conn(0),
+	  client_header_timeout(30),
+	  client_body_timeout(30),
+	  header_buffer_count(4),
+	  header_buffer_size(8192),
+	  client_min_rate(0),
+	  ssl(false),
+	  listen_options(),
+	  ssl_session_timeout(300),
+	  ssl_session_tickets(true)
 {
 }
 
+ListenOptions::ListenOptions()
+	: backlog(SOMAXCONN), deferred(false), fastopen(0), reuseport(false), rcvbuf(0), sndbuf(0),
+	  keepalive(-1), keepidle(0), keepintvl(0), keepcnt(0)
+{
+}
+
+static int listenNumber(const std::string &param, const std::string &value)
+{
+	char *end;
+	long num = std::strtol(value.c_str(), &end, 10);
+	if (value.empty() || *end != '\0' || num <= 0 || num > INT_MAX)
+		throw std::runtime_error("Invalid listen parameter: " + param);
+	return static_cast<int>(num);
+}
+
+static int listenSize(const std::string &param, const std::string &value)
+{
+	long size = parseSize(value);
+	if (size <= 0 || size > INT_MAX)
+		throw std::runtime_error("Invalid listen parameter: " + param);
+	return static_cast<int>(size);
+}
+
+bool ListenOptions::parse(const std::string &param)
+{
+	std::string::size_type eq = param.find('=');
+	std::string name = param.substr(0, eq);
+	std::string value = (eq == std::string::npos) ? "" : param.substr(eq + 1);
+	if (param == "deferred")
+		deferred = true;
+	else if (param == "reuseport")
+		reuseport = true;
+	else if (eq == std::string::npos)
+		return false;
+	else if (name == "backlog")
+		backlog = listenNumber(param, value);
+	else if (name == "fastopen")
+		fastopen = listenNumber(param, value);
+	else if (name == "rcvbuf")
+		rcvbuf = listenSize(param, value);
+	else if (name == "sndbuf")
+		sndbuf = listenSize(param, value);
+	else if (name == "so_keepalive")
+	{
+		keepalive = (value != "off");
+		if (value == "on" || value == "off")
+			return true;
+		// idle:interval:count, each part may be left out
+		std::string parts[3];
+		std::istringstream fields(value);
+		for (int i = 0; i < 3; ++i)
+		{
+			if (!std::getline(fields, parts[i], ':') && i < 2)
+				throw std::runtime_error("Invalid listen parameter: " + param);
+		}
+		std::string rest;
+		if (std::getline(fields, rest))
+			throw std::runtime_error("Invalid listen parameter: " + param);
+		keepidle = parts[0].empty() ? 0 : parseDuration(parts[0]);
+		keepintvl = parts[1].empty() ? 0 : parseDuration(parts[1]);
+		keepcnt = parts[2].empty() ? 0 : listenNumber(param, parts[2]);
+		if (keepidle < 0 || keepintvl < 0)
+			throw std::runtime_error("Invalid listen parameter: " + param);
+	}
+	else
+		return false;
+	return true;
+}
 
 // this functions reads line by line the config file and extracts the
 // first word then assigns the vealue for the class. If a location block
@@ -33,7 +118,19 @@ void ServerConfig::parseBlock(std::istream &stream)
 		iss >> key;
 
 		if (key == "listen")
+		{
+			// listen <port> [ssl] [backlog=n] [deferred] [fastopen=n] [reuseport] [rcvbuf=size]
+			// [sndbuf=size] [so_keepalive=on|off|[idle]:[interval]:[count]]
 			iss >> port;
+			std::string val;
+			while (iss >> val)
+			{
+				if (val == "ssl")
+					ssl = true;
+				else if (!listen_options.parse(val))
+					throw std::runtime_error("Unknown listen parameter: " + val);
+			}
+		}
 		else if (key == "host")
 			iss >> host;
 		else if (key == "server_name")
@@ -43,7 +140,106 @@ void ServerConfig::parseBlock(std::istream &stream)
 		else if (key == "index")
 			iss >> index;
 		else if (key == "client_max_body_size")
-			iss >> client_max_body_size;
+		{
+			std::string val;
+			iss >> val;
+			long size = parseSize(val);
+			if (size < 0)
+				throw std::runtime_error("Invalid client_max_body_size: " + val);
+			client_max_body_size = size;
+		}
+		else if (key == "client_body_buffer_size")
+		{
+			// client_body_buffer_size <size>: larger bodies are written to a temporary file
+			// in the server's root as they arrive instead of being held in memory
+			std::string val;
+			iss >> val;
+			long size = parseSize(val);
+			if (size < 0)
+				throw std::runtime_error("Invalid client_body_buffer_size: " + val);
+			client_body_buffer_size = size;
+		}
+		else if (key == "access_log")
+		{
+			// access_log <path> [combined|json] [sample=N] | off
+			iss >> access_log;
+			if (access_log == "off")
+				access_log.clear();
+			std::string val;
+			while (iss >> val)
+			{
+				if (val.compare(0, 7, "sample=") == 0)
+					access_log_sample = std::atoi(val.substr(7).c_str());
+				else
+					access_log_format = val;
+			}
+			if (access_log_format != "combined" && access_log_format != "json")
+				throw std::runtime_error("Unknown access_log format: " + access_log_format);
+			if (access_log_sample < 1)
+				throw std::runtime_error("Invalid access_log sample rate");
+		}
+		else if (key == "limit_req")
+			limit_req = LimitReq::parse(iss);
+		else if (key == "limit_conn")
+		{
+			// limit_conn <connections per client IP> (0 = off)
+			if (!(iss >> limit_conn) || limit_conn < 0)
+				throw std::runtime_error("Invalid limit_conn value");
+		}
+		else if (key == "client_header_timeout" || key == "client_body_timeout")
+		{
+			// client_header_timeout <duration>: the whole request header must arrive within it
+			// client_body_timeout <duration>: longest pause between two reads of the body
+			std::string val;
+			iss >> val;
+			int timeout = parseDuration(val);
+			if (timeout <= 0)
+				throw std::runtime_error("Invalid " + key + ": " + val);
+			(key == "client_header_timeout" ? client_header_timeout : client_body_timeout) = timeout;
+		}
+		else if (key == "large_client_header_buffers")
+		{
+			// large_client_header_buffers <number> <size>: the request line and every header
+			// line must fit into <size>, the whole header into <number> * <size>
+			std::string val;
+			iss >> header_buffer_count >> val;
+			long size = parseSize(val);
+			if (header_buffer_count <= 0 || size <= 0)
+				throw std::runtime_error("Invalid large_client_header_buffers");
+			header_buffer_size = size;
+		}
+		else if (key == "client_min_rate")
+		{
+			// client_min_rate <bytes per second>, 0 = off
+			std::string val;
+			iss >> val;
+			long rate = parseSize(val);
+			if (rate < 0)
+				throw std::runtime_error("Invalid client_min_rate: " + val);
+			client_min_rate = rate;
+		}
+		else if (key == "ssl_certificate")
+			iss >> ssl_certificate;
+		else if (key == "ssl_certificate_key")
+			iss >> ssl_certificate_key;
+		else if (key == "ssl_session_timeout")
+		{
+			// ssl_session_timeout <duration>: lifetime of cached sessions and of a ticket key
+			std::string val;
+			iss >> val;
+			ssl_session_timeout = parseDuration(val);
+			if (ssl_session_timeout <= 0)
+				throw std::runtime_error("Invalid ssl_session_timeout: " + val);
+		}
+		else if (key == "ssl_session_tickets")
+		{
+			// ssl_session_tickets on|off
+			std::string val;
+			iss >> val;
+			if (val != "on" && val != "off")
+				throw std::runtime_error("Invalid ssl_session_tickets value: " + val);
+			ssl_session_tickets = (val == "on");
+		}
 		else if (key == "error_page")
 		{
 			int code;
@@ -84,6 +280,10 @@ void ServerConfig::initialisedCheck() const {
 		logError("Configuration error: Index file not set");
 		throw std::runtime_error("Index file not set.");
 	}
+	if (ssl && (ssl_certificate.empty() || ssl_certificate_key.empty())) {
+		logError("Configuration error: ssl listener without ssl_certificate and ssl_certificate_key");
+		throw std::runtime_error("ssl_certificate and ssl_certificate_key are required with listen ... ssl.");
+	}
 }
 
 const std::string& ServerConfig::getHost() const { return host; }
@@ -92,8 +292,25 @@ const std::string& ServerConfig::getServerName() const { return server_name; }
 const std::string& ServerConfig::getRoot() const { return root; }
 const std::string& ServerConfig::getIndex() const { return index; }
 size_t ServerConfig::getClientMaxBodySize() const { return client_max_body_size; }
+size_t ServerConfig::getClientBodyBufferSize() const { return client_body_buffer_size; }
 const std::map<int, std::string>& ServerConfig::getErrorPages() const { return error_pages; }
 const std::vector<LocationConfig>& ServerConfig::getLocations() const { return locations; }
+const std::string& ServerConfig::getAccessLog() const { return access_log; }
+const std::string& ServerConfig::getAccessLogFormat() const { return access_log_format; }
+int ServerConfig::getAccessLogSample() const { return access_log_sample; }
+const LimitReq& ServerConfig::getLimitReq() const { return limit_req; }
+int ServerConfig::getLimitConn() const { return limit_conn; }
+int ServerConfig::getClientHeaderTimeout() const { return client_header_timeout; }
+int ServerConfig::getClientBodyTimeout() const { return client_body_timeout; }
+int ServerConfig::getHeaderBufferCount() const { return header_buffer_count; }
+size_t ServerConfig::getHeaderBufferSize() const { return header_buffer_size; }
+size_t ServerConfig::getClientMinRate() const { return client_min_rate; }
+bool ServerConfig::isSsl() const { return ssl; }
+const ListenOptions& ServerConfig::getListenOptions() const { return listen_options; }
+const std::string& ServerConfig::getSslCertificate() const { return ssl_certificate; }
+const std::string& ServerConfig::getSslCertificateKey() const { return ssl_certificate_key; }
+int ServerConfig::getSslSessionTimeout() const { return ssl_session_timeout; }
+bool ServerConfig::getSslSessionTickets() const { return ssl_session_tickets; }
 
 const std::string& ServerConfig::getErrorPage(int code) const {
 	static const std::string empty;
@@ -113,7 +330,8 @@ void ServerConfig::print() const
 			<< "\nRoot: " << root
 			<< "\nIndex: " << index
 			<< "\nServername: " << server_name
-			<< "\nClient Max Body Size: " << client_max_body_size;
+			<< "\nClient Max Body Size: " << client_max_body_size
+			<< "\nAccess Log: " << (access_log.empty() ? "off" : access_log + " (" + access_log_format + ")");
 	
 	logDebug(infoStream.str());
 	std::cout << infoStream.str() << std::endl;
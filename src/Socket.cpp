@@ -1,51 +1,140 @@
 #include "../include/Socket.hpp"
+#include "../include/Http2.hpp"
+#include "../include/Tls.hpp"
+#include "../include/Utils.hpp"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <cstdlib>
+#include <cerrno>
+#include <algorithm>
+
+size_t Socket::_bufferedTotal = 0;
 
 Socket::Socket()
 : _fd(-1)
-, _lastActivity(std::time(NULL))
 , _type(LISTENING)
 , _state(RECEIVING)
+, _needsToClose(false)
+, _lastActivity(std::time(NULL))
+, _sendAt(0)
+, _bodyFd(-1)
+, _bodyRemaining(0)
+, _arena(NULL)
+, _http2(NULL)
+, _tls(NULL)
+, _corked(false)
+, _readingBody(false)
 , _nbrRequests(0)
+, _clientAddr(0)
+, _serverConfig(NULL)
+, _location(NULL)
+, _spoolFd(-1)
+, _spooled(0)
+, _spoolExpected(0)
 {}
 
 Socket::Socket(int newFD, Type newType, State newState, const std::string IPv4, const int port)
 : _fd(newFD)
-, _lastActivity(std::time(NULL))
 , _type(newType)
 , _state(newState)
+, _needsToClose(false)
+, _lastActivity(std::time(NULL))
+, _sendAt(0)
+, _bodyFd(-1)
+, _bodyRemaining(0)
+, _arena(NULL)
+, _http2(NULL)
+, _tls(NULL)
+, _corked(false)
+, _readingBody(false)
 , _nbrRequests(0)
-, _IPv4(IPv4)
+, _clientAddr(0)
+, _serverConfig(NULL)
+, _location(NULL)
+, _spoolFd(-1)
+, _spooled(0)
+, _spoolExpected(0)
 , _port(port)
+, _IPv4(IPv4)
 {}
 
 Socket::Socket(const Socket& other)
 : _fd(other._fd)
-, _buffer(other._buffer)
-, _lastActivity(other._lastActivity)
 , _type(other._type)
 , _state(other._state)
+, _needsToClose(other._needsToClose)
+, _lastActivity(other._lastActivity)
+, _sendAt(other._sendAt)
+, _buffer(other._buffer)
+, _pipelined(other._pipelined)
+, _bodyFd(other._bodyFd)
+, _bodyRemaining(other._bodyRemaining)
+, _arena(other._arena)
+, _http2(other._http2)
+, _tls(other._tls)
+, _corked(other._corked)
+, _readingBody(other._readingBody)
 , _nbrRequests(other._nbrRequests)
-, _IPv4(other._IPv4)
+, _clientAddr(other._clientAddr)
+, _serverConfig(other._serverConfig)
+, _location(other._location)
+, _spoolFd(other._spoolFd)
+, _spooled(other._spooled)
+, _spoolExpected(other._spoolExpected)
 , _port(other._port)
-{}
+, _IPv4(other._IPv4)
+, _clientIPv4(other._clientIPv4)
+, _record(other._record)
+{
+	_bufferedTotal += _buffer.size() + _pipelined.size();
+}
 
 Socket& Socket::operator=(const Socket& other)
 {
 	if (this != &other)
 	{
+		_bufferedTotal -= _buffer.size() + _pipelined.size();
+		_bufferedTotal += other._buffer.size() + other._pipelined.size();
 		_fd = other._fd;
 		_buffer = other._buffer;
+		_pipelined = other._pipelined;
 		_lastActivity = other._lastActivity;
 		_type = other._type;
 		_state = other._state;
 		_nbrRequests = other._nbrRequests;
 		_IPv4 = other._IPv4;
 		_port = other._port;
+		_needsToClose = other._needsToClose;
+		_clientIPv4 = other._clientIPv4;
+		_clientAddr = other._clientAddr;
+		_sendAt = other._sendAt;
+		_serverConfig = other._serverConfig;
+		_location = other._location;
+		_record = other._record;
+		_bodyFd = other._bodyFd;
+		_bodyRemaining = other._bodyRemaining;
+		_arena = other._arena;
+		_http2 = other._http2;
+		_tls = other._tls;
+		_corked = other._corked;
+		_readingBody = other._readingBody;
+		_spoolFd = other._spoolFd;
+		_spooled = other._spooled;
+		_spoolExpected = other._spoolExpected;
 	}
 	return *this;
 }
 
-Socket::~Socket() {}
+// The body file, the spool file, the arena, the HTTP/2 session and the TLS state are owned by the server (see Server::deleteClient), copies only share them
+Socket::~Socket()
+{
+	_bufferedTotal -= _buffer.size() + _pipelined.size();
+}
 
 int Socket::getFd() const
 {
@@ -75,6 +164,271 @@ bool Socket::getNeedsToClose() const
 {
 	return _needsToClose;
 }
+const std::string& Socket::getClientIPv4() const
+{
+	return _clientIPv4;
+}
+AccessRecord& Socket::getRecord()
+{
+	return _record;
+}
+const AccessRecord& Socket::getRecord() const
+{
+	return _record;
+}
+void Socket::setClientIPv4(const std::string& clientIPv4)
+{
+	_clientIPv4 = clientIPv4;
+	_clientAddr = inet_addr(clientIPv4.c_str());
+	_record.clientAddr = clientIPv4;
+}
+
+uint32_t Socket::getClientAddr() const
+{
+	return _clientAddr;
+}
+
+// Monotonic time before which a delayed response (limit_req burst) must not be sent
+double Socket::getSendAt() const
+{
+	return _sendAt;
+}
+
+void Socket::setSendAt(double sendAt)
+{
+	_sendAt = sendAt;
+}
+
+// Virtual host and location of the request being received, known once its header is complete
+ServerConfig* Socket::getServerConfig() const
+{
+	return _serverConfig;
+}
+
+const LocationConfig* Socket::getLocation() const
+{
+	return _location;
+}
+
+void Socket::setRequestConfig(ServerConfig* serverConfig, const LocationConfig* location)
+{
+	_serverConfig = serverConfig;
+	_location = location;
+}
+
+// Bytes held in the buffers of all sockets
+size_t Socket::getBufferedTotal()
+{
+	return _bufferedTotal;
+}
+
+bool Socket::hasPendingBody() const
+{
+	return _bodyFd != -1;
+}
+
+// The response body still to be read from fd after the buffer has been sent
+void Socket::setBodyFile(int fd, size_t size)
+{
+	_bodyFd = fd;
+	_bodyRemaining = size;
+	if (size == 0)
+		closeBody();
+}
+
+size_t Socket::getBodyRemaining() const
+{
+	return _bodyRemaining;
+}
+
+int Socket::getBodyFd() const
+{
+	return _bodyFd;
+}
+
+// Appends a piece of the body file read by the disk pool; the file is closed once all
+// of it has been read
+void Socket::appendBody(const std::string &data)
+{
+	appendToBuffer(data.data(), data.size());
+	_bodyRemaining -= std::min(data.size(), _bodyRemaining);
+	if (_bodyRemaining == 0)
+		closeBody();
+}
+
+// Reads as much of the body as the page cache holds, until watermark bytes are buffered,
+// without waiting for the disk. false if the rest has to come from the disk pool (or the
+// system cannot read without blocking).
+bool Socket::readCachedBody(size_t watermark)
+{
+#ifdef RWF_NOWAIT
+	char chunk[65536];
+	while (_bodyFd != -1 && _buffer.size() < watermark)
+	{
+		struct iovec piece;
+		piece.iov_base = chunk;
+		piece.iov_len = std::min(std::min(sizeof(chunk), _bodyRemaining), watermark - _buffer.size());
+		// Offset -1 reads at the file position, like read()
+		ssize_t bytes = preadv2(_bodyFd, &piece, 1, -1, RWF_NOWAIT);
+		// EAGAIN means not cached; errors and a short file are left for the pool to find
+		if (bytes <= 0)
+			return false;
+		appendToBuffer(chunk, bytes);
+		_bodyRemaining -= bytes;
+		if (_bodyRemaining == 0)
+			closeBody();
+	}
+	return true;
+#else
+	(void)watermark;
+	return false;
+#endif
+}
+
+// A read of the body file is in flight; the file must stay open until it is back
+void Socket::setReadingBody(bool reading)
+{
+	_readingBody = reading;
+}
+
+bool Socket::isReadingBody() const
+{
+	return _readingBody;
+}
+
+// Gives up the body file without closing it, for the read in flight to close it
+void Socket::detachBody()
+{
+	_bodyFd = -1;
+	_bodyRemaining = 0;
+	_readingBody = false;
+}
+
+void Socket::closeBody()
+{
+	if (_bodyFd != -1)
+		close(_bodyFd);
+	_bodyFd = -1;
+	_bodyRemaining = 0;
+}
+
+// Created on first use, so only connections that have sent a request own one
+Arena& Socket::getArena()
+{
+	if (!_arena)
+		_arena = new Arena();
+	return *_arena;
+}
+
+void Socket::releaseArena()
+{
+	delete _arena;
+	_arena = NULL;
+}
+
+// Set once the connection has switched to HTTP/2; the buffer then only holds frames to send
+Http2Session* Socket::getHttp2() const
+{
+	return _http2;
+}
+
+void Socket::setHttp2(Http2Session* session)
+{
+	_http2 = session;
+}
+
+void Socket::releaseHttp2()
+{
+	delete _http2;
+	_http2 = NULL;
+}
+
+// Set on connections accepted by an ssl listener; all reads and writes go through it
+TlsConnection* Socket::getTls() const
+{
+	return _tls;
+}
+
+void Socket::setTls(TlsConnection* tls)
+{
+	_tls = tls;
+}
+
+void Socket::releaseTls()
+{
+	delete _tls;
+	_tls = NULL;
+}
+
+// recv() and send() on the connection, through TLS if it has it
+ssize_t Socket::receive(char* buffer, size_t size)
+{
+	if (_tls)
+		return _tls->read(buffer, size);
+	return recv(_fd, buffer, size, 0);
+}
+
+ssize_t Socket::transmit(const char* data, size_t size)
+{
+	if (_tls)
+		return _tls->write(data, size);
+	return send(_fd, data, size, 0);
+}
+
+// With kernel TLS a file body is not read into the buffer but sent from the page cache
+// with sendfile once the buffer is empty
+bool Socket::sendsBodyDirectly() const
+{
+	return _tls && _tls->canSendFile();
+}
+
+ssize_t Socket::sendBodyDirectly()
+{
+	off_t offset = lseek(_bodyFd, 0, SEEK_CUR);
+	ssize_t sent = (offset == -1) ? -1 : _tls->sendFile(_bodyFd, offset, _bodyRemaining);
+	if (sent <= 0)
+		return sent;
+	lseek(_bodyFd, sent, SEEK_CUR);
+	_bodyRemaining -= sent;
+	if (_bodyRemaining == 0)
+		closeBody();
+	return sent;
+}
+
+// While corked, the kernel only sends full segments, so the headers of a response with a
+// file body go out together with the body's first bytes instead of in a small segment
+// of their own. Uncorking flushes whatever is left.
+void Socket::setCorked(bool corked)
+{
+	if (corked == _corked)
+		return;
+#if defined(TCP_CORK)
+	int value = corked;
+	if (setsockopt(_fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value)) == 0)
+		_corked = corked;
+#elif defined(TCP_NOPUSH)
+	int value = corked;
+	if (setsockopt(_fd, IPPROTO_TCP, TCP_NOPUSH, &value, sizeof(value)) == 0)
+		_corked = corked;
+#endif
+}
+
+bool Socket::isCorked() const
+{
+	return _corked;
+}
+
+// Called for keep-alive connections waiting for their next request: gives back the
+// capacity the buffer kept from the last request and the arena's slabs, so all that
+// is left is the Socket itself
+void Socket::shrinkIdle()
+{
+	if (_buffer.empty())
+		std::string().swap(_buffer);
+	if (_pipelined.empty())
+		std::string().swap(_pipelined);
+	releaseArena();
+}
 Socket::State Socket::getState() const
 {
 	return _state;
@@ -84,14 +438,147 @@ Socket::State Socket::getState() const
 
 void Socket::appendToBuffer(const char* data, size_t len) {
     _buffer.append(data, len);
+	_bufferedTotal += len;
 	updateActivity();
 }
 
 void Socket::clearBuffer()
 {
+	_bufferedTotal -= _buffer.size();
 	_buffer.clear();
 }
 
+bool Socket::startSpool(const std::string &directory, size_t expected)
+{
+	closeSpool();
+	_spoolFd = openSpoolFile(directory);
+	if (_spoolFd == -1)
+		return false;
+	_spooled = 0;
+	_spoolExpected = expected;
+	return true;
+}
+
+bool Socket::isSpooling() const
+{
+	return _spoolFd != -1;
+}
+
+bool Socket::spoolBody(size_t headerSize)
+{
+	if (_buffer.size() <= headerSize)
+		return true;
+	size_t length = std::min(_buffer.size() - headerSize, _spoolExpected - _spooled);
+	size_t done = 0;
+	while (done < length)
+	{
+		ssize_t bytes = write(_spoolFd, _buffer.data() + headerSize + done, length - done);
+		if (bytes == -1 && errno == EINTR)
+			continue;
+		if (bytes == -1)
+			return false;
+		done += bytes;
+	}
+	_buffer.erase(headerSize, done);
+	_bufferedTotal -= done;
+	_spooled += done;
+	return true;
+}
+
+ssize_t Socket::spliceBody(const int pipe[2])
+{
+#ifdef SPLICE_F_MOVE
+	ssize_t received = splice(_fd, NULL, pipe[1], NULL, _spoolExpected - _spooled,
+		SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (received <= 0)
+		return received;
+	ssize_t done = 0;
+	while (done < received)
+	{
+		ssize_t bytes = splice(pipe[0], NULL, _spoolFd, NULL, received - done, SPLICE_F_MOVE);
+		if (bytes == -1 && errno == EINTR)
+			continue;
+		if (bytes <= 0)
+			return -1;
+		done += bytes;
+	}
+	_spooled += done;
+	updateActivity();
+	return done;
+#else
+	(void)pipe;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+size_t Socket::getSpooled() const
+{
+	return _spooled;
+}
+
+Body Socket::takeSpool()
+{
+	if (_spoolFd == -1)
+		return Body();
+	Body body = Body::map(_spoolFd, _spooled);
+	_spoolFd = -1;
+	_spooled = 0;
+	_spoolExpected = 0;
+	return body;
+}
+
+void Socket::closeSpool()
+{
+	if (_spoolFd != -1)
+		close(_spoolFd);
+	_spoolFd = -1;
+	_spooled = 0;
+	_spoolExpected = 0;
+}
+
+void Socket::reserveBuffer(size_t size)
+{
+	_buffer.reserve(size);
+}
+
+void Socket::takeBuffer(std::string &into)
+{
+	_bufferedTotal -= _buffer.size();
+	into.clear();
+	into.swap(_buffer);
+}
+
+void Socket::takeBuffer(std::string &into, size_t length)
+{
+	if (length < _buffer.size())
+	{
+		_pipelined.assign(_buffer, length, std::string::npos);
+		_buffer.resize(length);
+	}
+	_bufferedTotal -= _buffer.size();
+	into.clear();
+	into.swap(_buffer);
+}
+
+// Called with the buffer empty, once the previous response is out
+bool Socket::resumePipelined()
+{
+	if (_pipelined.empty())
+		return false;
+	_buffer.swap(_pipelined);
+	_pipelined.clear();
+	updateActivity();
+	return true;
+}
+
+void Socket::takePipelined(std::string &into)
+{
+	_bufferedTotal -= _pipelined.size();
+	into.clear();
+	into.swap(_pipelined);
+}
+
 time_t Socket::getLastActivity() const
 {
 	return _lastActivity;
@@ -123,6 +610,7 @@ void Socket::trimBuffer(size_t len)
 	if (len < _buffer.size())
 	{
 		_buffer.erase(0, len);
+		_bufferedTotal -= len;
 	}
 	else
 	{
@@ -135,7 +623,7 @@ std::ostream& operator<<(std::ostream& lhs, const Socket& rhs)
 {
 	lhs << "Socket FD: " << rhs._fd
 		<< ", Type: " << (rhs._type == Socket::LISTENING ? "LISTENING" : "CLIENT")
-		<< ", State: " << (rhs._state == Socket::RECEIVING ? "RECEIVING" : "SENDING")
+		<< ", State: " << (rhs._state == Socket::RECEIVING ? "RECEIVING" : rhs._state == Socket::SENDING ? "SENDING" : "WAITING")
 		<< ", Buffer Size: " << rhs._buffer.size()
 		<< ", IPv4: " << rhs._IPv4
 		<< ", Port: " << rhs._port
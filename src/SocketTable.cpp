@@ -0,0 +1,92 @@
+#include "../include/SocketTable.hpp"
+#include <new>
+
+SocketTable::SocketTable() : _free(NULL), _size(0), _clients(0) {}
+
+SocketTable::~SocketTable()
+{
+	for (size_t fd = 0; fd < _slots.size(); ++fd)
+	{
+		if (_slots[fd].socket)
+			erase(fd);
+	}
+	while (_free)
+	{
+		FreeNode *next = _free->next;
+		::operator delete(_free);
+		_free = next;
+	}
+}
+
+Socket *SocketTable::find(int fd) const
+{
+	if (fd < 0 || static_cast<size_t>(fd) >= _slots.size())
+		return NULL;
+	return _slots[fd].socket;
+}
+
+// Replaces a socket still registered under fd, which can only be a leftover of a closed connection
+Socket &SocketTable::insert(int fd, Socket::Type type, const std::string &IPv4, int port)
+{
+	if (find(fd))
+		erase(fd);
+	if (static_cast<size_t>(fd) >= _slots.size())
+	{
+		Slot empty = { NULL, 0 };
+		_slots.resize(fd + 1, empty);
+	}
+	void *storage;
+	if (_free)
+	{
+		storage = _free;
+		_free = _free->next;
+	}
+	else
+		storage = ::operator new(sizeof(Socket));
+	Socket *socket = new (storage) Socket(fd, type, Socket::RECEIVING, IPv4, port);
+	_slots[fd].socket = socket;
+	++_size;
+	if (type == Socket::CLIENT)
+		++_clients;
+	return *socket;
+}
+
+void SocketTable::erase(int fd)
+{
+	Socket *socket = find(fd);
+	if (!socket)
+		return;
+	if (socket->getType() == Socket::CLIENT)
+		--_clients;
+	--_size;
+	_slots[fd].socket = NULL;
+	socket->~Socket();
+	FreeNode *node = static_cast<FreeNode *>(static_cast<void *>(socket));
+	node->next = _free;
+	_free = node;
+}
+
+int SocketTable::getLimit() const
+{
+	return static_cast<int>(_slots.size());
+}
+
+bool SocketTable::empty() const
+{
+	return _size == 0;
+}
+
+size_t SocketTable::getClientCount() const
+{
+	return _clients;
+}
+
+size_t SocketTable::getPollIndex(int fd) const
+{
+	return _slots[fd].pollIndex;
+}
+
+void SocketTable::setPollIndex(int fd, size_t index)
+{
+	_slots[fd].pollIndex = index;
+}
@@ -0,0 +1,298 @@
+#include "../include/Tls.hpp"
+#include "../include/ServerConfig.hpp"
+#include "../include/Webserver.hpp"
+#include "../include/Logger.hpp"
+#include "../include/Utils.hpp"
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+
+#ifdef WEBSERV_SSL
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#include <openssl/core_names.h>
+
+static std::string lastError()
+{
+	unsigned long code = ERR_get_error();
+	ERR_clear_error();
+	if (code == 0)
+		return "unknown error";
+	char message[256];
+	ERR_error_string_n(code, message, sizeof(message));
+	return message;
+}
+
+// ALPN: HTTP/2 if the client offers it, its connection preface then follows the handshake
+static int selectProtocol(SSL *, const unsigned char **out, unsigned char *outSize,
+	const unsigned char *offered, unsigned int offeredSize, void *)
+{
+	static const unsigned char supported[] = "\x02h2\x08http/1.1";
+	unsigned char *selected;
+	if (SSL_select_next_proto(&selected, outSize, supported, sizeof(supported) - 1, offered, offeredSize)
+		!= OPENSSL_NPN_NEGOTIATED)
+		return SSL_TLSEXT_ERR_NOACK;
+	*out = selected;
+	return SSL_TLSEXT_ERR_OK;
+}
+
+TlsContext::TlsContext(const ServerConfig &config)
+	: _ctx(SSL_CTX_new(TLS_server_method())), _keyLifetime(config.getSslSessionTimeout())
+{
+	if (!_ctx)
+		throw std::runtime_error("SSL_CTX_new failed: " + lastError());
+	const std::string &certificate = config.getSslCertificate();
+	const std::string &key = config.getSslCertificateKey();
+	if (SSL_CTX_use_certificate_chain_file(_ctx, certificate.c_str()) != 1
+		|| SSL_CTX_use_PrivateKey_file(_ctx, key.c_str(), SSL_FILETYPE_PEM) != 1
+		|| SSL_CTX_check_private_key(_ctx) != 1)
+	{
+		std::string error = "Cannot load " + certificate + " and " + key + ": " + lastError();
+		SSL_CTX_free(_ctx);
+		logError(error);
+		throw std::runtime_error(error);
+	}
+	SSL_CTX_set_min_proto_version(_ctx, TLS1_2_VERSION);
+	// KTLS: OpenSSL hands the keys to the kernel after the handshake where it can
+	SSL_CTX_set_options(_ctx, SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_ENABLE_KTLS);
+	// The send buffer is trimmed and appended to between partial writes; idle connections
+	// give their record buffers back
+	SSL_CTX_set_mode(_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+		| SSL_MODE_RELEASE_BUFFERS);
+	SSL_CTX_set_alpn_select_cb(_ctx, selectProtocol, NULL);
+
+	static const unsigned char sessionContext[] = "webserv";
+	SSL_CTX_set_session_id_context(_ctx, sessionContext, sizeof(sessionContext) - 1);
+	SSL_CTX_set_session_cache_mode(_ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(_ctx, SSL_SESSION_CACHE_SIZE);
+	SSL_CTX_set_timeout(_ctx, _keyLifetime);
+
+	std::memset(_keys, 0, sizeof(_keys));
+	if (!config.getSslSessionTickets())
+	{
+		// Resumption then only works through the session cache
+		SSL_CTX_set_options(_ctx, SSL_OP_NO_TICKET);
+		return;
+	}
+	if (!generateTicketKey(_keys[0], time(NULL)))
+	{
+		SSL_CTX_free(_ctx);
+		throw std::runtime_error("Cannot generate a session ticket key: " + lastError());
+	}
+	SSL_CTX_set_app_data(_ctx, this);
+	SSL_CTX_set_tlsext_ticket_key_evp_cb(_ctx, ticketKeyCallback);
+}
+
+TlsContext::~TlsContext()
+{
+	OPENSSL_cleanse(_keys, sizeof(_keys));
+	SSL_CTX_free(_ctx);
+}
+
+ssl_ctx_st* TlsContext::get() const
+{
+	return _ctx;
+}
+
+bool TlsContext::generateTicketKey(TicketKey &key, time_t now)
+{
+	if (RAND_bytes(key.name, sizeof(key.name)) != 1 || RAND_bytes(key.aesKey, sizeof(key.aesKey)) != 1
+		|| RAND_bytes(key.hmacKey, sizeof(key.hmacKey)) != 1)
+		return false;
+	key.created = now;
+	return true;
+}
+
+// Done lazily when a ticket is issued or checked. If no new key can be generated the
+// current one stays in use.
+void TlsContext::rotateTicketKeys(time_t now)
+{
+	if (now - _keys[0].created < _keyLifetime)
+		return;
+	TicketKey next;
+	if (!generateTicketKey(next, now))
+	{
+		logError("Cannot rotate the session ticket key: " + lastError());
+		return;
+	}
+	OPENSSL_cleanse(&_keys[1], sizeof(_keys[1]));
+	_keys[1] = _keys[0];
+	_keys[0] = next;
+	OPENSSL_cleanse(&next, sizeof(next));
+	LOG_DEBUG("Rotated the session ticket key");
+}
+
+// Encrypts new tickets with the current key. A ticket under the previous key is accepted
+// and replaced by a new one (return value 2), an unknown key means a full handshake.
+int TlsContext::ticketKeyCallback(ssl_st *ssl, unsigned char *name, unsigned char *iv,
+	evp_cipher_ctx_st *cipher, evp_mac_ctx_st *mac, int encrypt)
+{
+	TlsContext &self = *static_cast<TlsContext *>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+	self.rotateTicketKeys(time(NULL));
+	const TicketKey *key = NULL;
+	if (encrypt)
+	{
+		key = &self._keys[0];
+		std::memcpy(name, key->name, sizeof(key->name));
+		if (RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) != 1
+			|| EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key->aesKey, iv) != 1)
+			return -1;
+	}
+	else
+	{
+		for (size_t i = 0; i < 2 && !key; ++i)
+		{
+			if (self._keys[i].created != 0 && std::memcmp(name, self._keys[i].name, sizeof(self._keys[i].name)) == 0)
+				key = &self._keys[i];
+		}
+		if (!key)
+			return 0;
+		if (EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key->aesKey, iv) != 1)
+			return -1;
+	}
+	OSSL_PARAM params[3];
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, const_cast<unsigned char *>(key->hmacKey), sizeof(key->hmacKey));
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char *>("sha256"), 0);
+	params[2] = OSSL_PARAM_construct_end();
+	if (EVP_MAC_CTX_set_params(mac, params) != 1)
+		return -1;
+	return (encrypt || key == &self._keys[0]) ? 1 : 2;
+}
+
+TlsConnection::TlsConnection(TlsContext &context, int fd)
+	: _ssl(SSL_new(context.get())), _established(false)
+{
+	if (_ssl && SSL_set_fd(_ssl, fd) != 1)
+	{
+		SSL_free(_ssl);
+		_ssl = NULL;
+	}
+	if (_ssl)
+		SSL_set_accept_state(_ssl);
+}
+
+// Sends close_notify if that is possible without waiting; the fd is closed by the server
+TlsConnection::~TlsConnection()
+{
+	if (!_ssl)
+		return;
+	if (_established)
+		SSL_shutdown(_ssl);
+	ERR_clear_error();
+	SSL_free(_ssl);
+}
+
+int TlsConnection::handshake()
+{
+	if (!_ssl)
+		return HANDSHAKE_FAILED;
+	ERR_clear_error();
+	int ret = SSL_do_handshake(_ssl);
+	if (ret == 1)
+	{
+		_established = true;
+		return HANDSHAKE_DONE;
+	}
+	int error = SSL_get_error(_ssl, ret);
+	if (error == SSL_ERROR_WANT_READ)
+		return POLLIN;
+	if (error == SSL_ERROR_WANT_WRITE)
+		return POLLOUT;
+	LOG_DEBUG("TLS handshake failed: " + lastError());
+	return HANDSHAKE_FAILED;
+}
+
+bool TlsConnection::isEstablished() const
+{
+	return _established;
+}
+
+bool TlsConnection::isResumed() const
+{
+	return _ssl && SSL_session_reused(_ssl);
+}
+
+// The receive slabs hold a whole record (16 KiB), so nothing is left inside OpenSSL
+// that poll() would not report
+ssize_t TlsConnection::read(char *buffer, size_t size)
+{
+	ERR_clear_error();
+	errno = 0;
+	return result(SSL_read(_ssl, buffer, static_cast<int>(std::min(size, static_cast<size_t>(INT_MAX)))));
+}
+
+ssize_t TlsConnection::write(const char *data, size_t size)
+{
+	ERR_clear_error();
+	errno = 0;
+	return result(SSL_write(_ssl, data, static_cast<int>(std::min(size, static_cast<size_t>(INT_MAX)))));
+}
+
+bool TlsConnection::canSendFile() const
+{
+	return _ssl && BIO_get_ktls_send(SSL_get_wbio(_ssl));
+}
+
+ssize_t TlsConnection::sendFile(int fd, off_t offset, size_t size)
+{
+	ERR_clear_error();
+	ossl_ssize_t sent = SSL_sendfile(_ssl, fd, offset, size, 0);
+	if (sent >= 0)
+		return sent;
+	return result(-1);
+}
+
+// Maps an OpenSSL result to the recv()/send() convention
+ssize_t TlsConnection::result(int ret)
+{
+	if (ret > 0)
+		return ret;
+	switch (SSL_get_error(_ssl, ret))
+	{
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			return -1;
+		case SSL_ERROR_ZERO_RETURN:
+			return 0;
+		case SSL_ERROR_SYSCALL:
+			// The peer closed the connection without close_notify
+			if (errno == 0)
+				return 0;
+			return -1;
+		default:
+			LOG_DEBUG("TLS error: " + lastError());
+			errno = EPROTO;
+			return -1;
+	}
+}
+
+#else
+
+TlsContext::TlsContext(const ServerConfig &config)
+	: _ctx(NULL), _keyLifetime(config.getSslSessionTimeout())
+{
+	logError("Configuration error: listen ... ssl in a build without TLS support");
+	throw std::runtime_error("TLS support is not compiled in, build with `make SSL=1`.");
+}
+
+TlsContext::~TlsContext() {}
+
+ssl_ctx_st* TlsContext::get() const { return _ctx; }
+
+TlsConnection::TlsConnection(TlsContext &, int) : _ssl(NULL), _established(false) {}
+TlsConnection::~TlsConnection() {}
+int TlsConnection::handshake() { return HANDSHAKE_FAILED; }
+bool TlsConnection::isEstablished() const { return _established; }
+bool TlsConnection::isResumed() const { return false; }
+ssize_t TlsConnection::read(char *, size_t) { errno = ENOTSUP; return -1; }
+ssize_t TlsConnection::write(const char *, size_t) { errno = ENOTSUP; return -1; }
+bool TlsConnection::canSendFile() const { return false; }
+ssize_t TlsConnection::sendFile(int, off_t, size_t) { errno = ENOTSUP; return -1; }
+
+#endif
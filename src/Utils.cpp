@@ -2,8 +2,13 @@
 #include "../include/Logger.hpp"
 #include <iostream>
 #include <sstream>
+#include <stdexcept>
 #include <cstdlib>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ctime>
+#include <vector>
 
 std::string removeSemicolon(const std::string &str)
 {
@@ -61,7 +66,8 @@ std::string decodeChunkedBody(std::istream &stream)
 
 		std::istringstream chunkSizeStream(line);
 		size_t chunkSize;
-		chunkSizeStream >> std::hex >> chunkSize;
+		if (!(chunkSizeStream >> std::hex >> chunkSize))
+			throw std::runtime_error("Invalid chunk size line");
 
 		if (chunkSize == 0)
 			break;
@@ -80,6 +86,74 @@ std::string decodeChunkedBody(std::istream &stream)
 	return decodedBody;
 }
 
+// Seconds from an arbitrary fixed point, only meaningful for measuring intervals
+double monotonicTime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Parses a duration like "30", "30s", "5m" or "1h" into seconds, -1 if invalid
+// The file is unlinked from the start (O_TMPFILE), so nothing is left behind if the
+// server dies; where the filesystem lacks O_TMPFILE a named file is unlinked right away
+int openSpoolFile(const std::string &directory)
+{
+	int fd = -1;
+#ifdef O_TMPFILE
+	fd = open(directory.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0666);
+#endif
+	if (fd == -1)
+	{
+		std::string name = directory + "/.spool.XXXXXX";
+		std::vector<char> path(name.begin(), name.end());
+		path.push_back('\0');
+		fd = mkstemp(&path[0]);
+		if (fd == -1)
+			return -1;
+		unlink(&path[0]);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+	return fd;
+}
+
+int parseDuration(const std::string &value)
+{
+	if (value.empty())
+		return -1;
+	char *end;
+	long num = std::strtol(value.c_str(), &end, 10);
+	if (end == value.c_str() || num < 0)
+		return -1;
+	std::string unit(end);
+	if (unit.empty() || unit == "s")
+		return static_cast<int>(num);
+	if (unit == "m")
+		return static_cast<int>(num * 60);
+	if (unit == "h")
+		return static_cast<int>(num * 3600);
+	return -1;
+}
+
+// Parses a size like "512", "8k" or "1m" into bytes, -1 if invalid
+long parseSize(const std::string &value)
+{
+	if (value.empty())
+		return -1;
+	char *end;
+	long num = std::strtol(value.c_str(), &end, 10);
+	if (end == value.c_str() || num < 0)
+		return -1;
+	std::string unit(end);
+	if (unit.empty())
+		return num;
+	if (unit == "k" || unit == "K")
+		return num * 1024;
+	if (unit == "m" || unit == "M")
+		return num * 1024 * 1024;
+	return -1;
+}
+
 std::string decodeEvents(short int events)
 {
 	std::string result;
@@ -4,18 +4,18 @@
 #include <pthread.h>
 #include <signal.h>
 #include <cstdlib>
+#include <unistd.h>
 #include "../include/ConfigParser.hpp"
 #include "../include/Server.hpp"
 #include "../include/ServerConfig.hpp"
 #include "../include/Logger.hpp"
 
+// Only sets a flag: the event loop notices it, stops accepting and drains the clients,
+// so run() returns and all destructors (sockets, access logs, logger) get to run
 void handleSigint(int signal)
 {
-	if (signal == SIGINT)
-	{
-		logInfo("SIGINT received. Shutting down the server...");
-		std::exit(0);
-	}
+	if (signal == SIGINT || signal == SIGTERM)
+		Server::requestStop();
 }
 
 int main(int argc, char **argv)
@@ -25,6 +25,9 @@ int main(int argc, char **argv)
 		// Setup logger
 		Logger::getInstance().setLevel(Logger::INFO);
 		Logger::getInstance().setLogFile("webserv.log");
+		// Echoing every log line to stdout is only useful when someone is watching
+		Logger::getInstance().setConsoleOutput(isatty(STDOUT_FILENO));
+		Logger::getInstance().start();
 		Logger::getInstance().log(Logger::INFO, "Server starting up");
 
 		if (argc != 2)
@@ -33,8 +36,9 @@ int main(int argc, char **argv)
 			throw std::invalid_argument("Usage: ./webserv <config_file>.conf");
 		}
 		
-		// Register the SIGINT handler
+		// Register the SIGINT and SIGTERM handlers
 		signal(SIGINT, handleSigint);
+		signal(SIGTERM, handleSigint);
 		logInfo("SIGINT handler registered. Press Ctrl+C to stop the server.");
 
 		signal(SIGPIPE, SIG_IGN);
@@ -42,6 +46,10 @@ int main(int argc, char **argv)
 		ConfigParser parser(argv[1]);
 		std::vector<ServerConfig> servers = parser.parse();
 		Server manager(servers);
+		if (parser.getEventBackend() == "io_uring")
+			manager.useIoUring();
+		if (parser.getDiskThreads() >= 0)
+			manager.setDiskThreads(parser.getDiskThreads());
 		Logger::getInstance().log(Logger::INFO, "Server configuration loaded successfully");
 		manager.run();
 	}
@@ -6,6 +6,12 @@ import signal
 import time
 import os
 import textwrap
+import socket
+import shutil
+import ssl
+import hashlib
+import re
+import random
 
 # Temporary directory and path for test config files
 TMP_DIR = "tests/tmp"
@@ -21,6 +27,24 @@ def run_and_capture(command, timeout=2):
         raise AssertionError("Subprocess timed out")
     return proc.returncode, out, err
 
+# Reads one response with a Content-Length body from sock. pending holds what was received
+# beyond the previous response; returns the status line, the head, the body and the rest.
+def read_response(sock, pending=b""):
+    data = pending
+    while b"\r\n\r\n" not in data:
+        chunk = sock.recv(65536)
+        if not chunk:
+            raise AssertionError("Connection closed before the response head")
+        data += chunk
+    head, data = data.split(b"\r\n\r\n", 1)
+    length = int(head.lower().split(b"content-length: ")[1].split(b"\r\n")[0])
+    while len(data) < length:
+        chunk = sock.recv(65536)
+        if not chunk:
+            raise AssertionError("Connection closed before the end of the body")
+        data += chunk
+    return head.split(b"\r\n")[0], head, data[:length], data[length:]
+
 class ServerCoreTest(unittest.TestCase):
     @classmethod
     def setUpClass(cls):
@@ -42,6 +66,1285 @@ class ServerCoreTest(unittest.TestCase):
         self.assertEqual(code, 1)
         self.assertIn(b"Error: Configuration file is empty.", err)
 
+    def test_02_limit_req_rejects_excess_requests(self):
+        """Requests beyond rate + burst from one client get 429 with Retry-After."""
+        config = textwrap.dedent("""\
+            server {
+                server_name test;
+                host 127.0.0.1;
+                listen 8090;
+                root www/;
+                location / {
+                    limit_req zone=test rate=1r/s burst=2 nodelay;
+                }
+            }
+        """)
+        with open(CONFIG_PATH, "w") as f:
+            f.write(config)
+
+        server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            time.sleep(0.5)
+            statuses = []
+            for _ in range(5):
+                sock = socket.create_connection(("127.0.0.1", 8090), timeout=2)
+                sock.sendall(b"GET /index.html HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n")
+                response = sock.recv(65536)
+                sock.close()
+                statuses.append(int(response.split(b" ")[1]))
+                if statuses[-1] == 429:
+                    self.assertIn(b"Retry-After: 1", response)
+            self.assertEqual(statuses, [200, 200, 200, 429, 429])
+        finally:
+            server.terminate()
+            server.wait(timeout=5)
+
+    def test_03_slow_and_oversized_requests(self):
+        """Oversized request lines/headers get 414/431, an unfinished header gets 408."""
+        config = textwrap.dedent("""\
+            server {
+                server_name test;
+                host 127.0.0.1;
+                listen 8090;
+                root www/;
+                client_header_timeout 1s;
+                large_client_header_buffers 2 1k;
+                location / {
+                }
+            }
+        """)
+        with open(CONFIG_PATH, "w") as f:
+            f.write(config)
+
+        def status_of(request):
+            sock = socket.create_connection(("127.0.0.1", 8090), timeout=5)
+            sock.sendall(request)
+            response = sock.recv(65536)
+            sock.close()
+            return int(response.split(b" ")[1])
+
+        server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            time.sleep(0.5)
+            self.assertEqual(status_of(b"GET /" + b"a" * 2000 + b" HTTP/1.1\r\nHost: test\r\n\r\n"), 414)
+            self.assertEqual(status_of(b"GET / HTTP/1.1\r\nHost: test\r\nX-Big: " + b"b" * 1500 + b"\r\n\r\n"), 431)
+            self.assertEqual(status_of(b"GET / HTTP/1.1\r\nHost: test\r\n"), 408)
+        finally:
+            server.terminate()
+            server.wait(timeout=5)
+
+    def test_04_body_limit_checked_before_body(self):
+        """A declared body above the location limit gets 413 right after the header; 100-continue otherwise."""
+        config = textwrap.dedent("""\
+            server {
+                server_name test;
+                host 127.0.0.1;
+                listen 8090;
+                root www/;
+                location /upload {
+                    allow_methods GET POST;
+                    upload_dir www/upload;
+                    client_max_body_size 1k;
+                }
+            }
+        """)
+        with open(CONFIG_PATH, "w") as f:
+            f.write(config)
+
+        server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            time.sleep(0.5)
+            sock = socket.create_connection(("127.0.0.1", 8090), timeout=2)
+            sock.sendall(b"POST /upload HTTP/1.1\r\nHost: test\r\nContent-Length: 5000\r\nExpect: 100-continue\r\n\r\n")
+            self.assertTrue(sock.recv(65536).startswith(b"HTTP/1.1 413"))
+            sock.close()
+
+            sock = socket.create_connection(("127.0.0.1", 8090), timeout=2)
+            sock.sendall(b"GET /upload HTTP/1.1\r\nHost: test\r\nContent-Length: 10\r\nExpect: 100-continue\r\n\r\n")
+            self.assertEqual(sock.recv(65536), b"HTTP/1.1 100 Continue\r\n\r\n")
+            sock.close()
+        finally:
+            server.terminate()
+            server.wait(timeout=5)
+
+    def test_05_autoindex_pages_and_invalidation(self):
+        """Large listings are paginated, JSON on request, and new files show up without a restart."""
+        listing_dir = "www/autoindex_test"
+        config = textwrap.dedent("""\
+            server {
+                server_name test;
+                host 127.0.0.1;
+                listen 8090;
+                root www/;
+                location /autoindex_test {
+                    autoindex on;
+                }
+            }
+        """)
+        with open(CONFIG_PATH, "w") as f:
+            f.write(config)
+        os.makedirs(listing_dir, exist_ok=True)
+        for i in range(1001):
+            open(os.path.join(listing_dir, "file_%04d.txt" % i), "w").close()
+
+        def get(path):
+            sock = socket.create_connection(("127.0.0.1", 8090), timeout=2)
+            sock.sendall(b"GET " + path + b" HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n")
+            data = b""
+            while True:
+                chunk = sock.recv(65536)
+                if not chunk:
+                    break
+                data += chunk
+            sock.close()
+            return data.split(b"\r\n", 1)[0], data.split(b"\r\n\r\n", 1)[1]
+
+        server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            time.sleep(0.5)
+            status, body = get(b"/autoindex_test/?format=json")
+            self.assertIn(b"200", status)
+            self.assertIn(b'"pages":2,"total":1001', body)
+            status, body = get(b"/autoindex_test/?page=2")
+            self.assertIn(b"file_1000.txt", body)
+            self.assertNotIn(b"file_0000.txt", body)
+            status, body = get(b"/autoindex_test/?page=3")
+            self.assertIn(b"404", status)
+
+            open(os.path.join(listing_dir, "added.txt"), "w").close()
+            status, body = get(b"/autoindex_test/?format=json")
+            self.assertIn(b'"total":1002', body)
+
+            # Another path to the same directory shares its watch, both see the next change
+            status, body = get(b"/autoindex_test//?format=json")
+            self.assertIn(b"200", status)
+            self.assertIn(b'"total":1002', body)
+            open(os.path.join(listing_dir, "added_again.txt"), "w").close()
+            for path in (b"/autoindex_test/?format=json", b"/autoindex_test//?format=json"):
+                status, body = get(path)
+                self.assertIn(b'"total":1003', body, path)
+        finally:
+            server.terminate()
+            server.wait(timeout=5)
+            shutil.rmtree(listing_dir, ignore_errors=True)
+
+    def test_06_http2_prior_knowledge(self):
+        """Two streams sent at once on one HTTP/2 connection are both answered."""
+        config = textwrap.dedent("""\
+            server {
+                server_name test;
+                host 127.0.0.1;
+                listen 8090;
+                root www/;
+                location / {
+                    allow_methods GET;
+                }
+            }
+        """)
+        with open(CONFIG_PATH, "w") as f:
+            f.write(config)
+
+        def frame(kind, flags, stream, payload=b""):
+            return len(payload).to_bytes(3, "big") + bytes([kind, flags]) + stream.to_bytes(4, "big") + payload
+
+        # HPACK: :method, :scheme and :path from the static table, :authority as a literal without indexing
+        authority = b"\x01\x04test"
+        first = b"\x82\x86\x85" + authority
+        second = b"\x83\x86\x85" + authority
+
+        server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            time.sleep(0.5)
+            sock = socket.create_connection(("127.0.0.1", 8090), timeout=2)
+            sock.sendall(b"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n" + frame(4, 0, 0)
+                         + frame(1, 5, 1, first) + frame(1, 5, 3, second))
+            data = b""
+            headers = {}
+            ended = set()
+            while len(ended) < 2:
+                chunk = sock.recv(65536)
+                if not chunk:
+                    break
+                data += chunk
+                while len(data) >= 9 and len(data) >= 9 + int.from_bytes(data[:3], "big"):
+                    length = int.from_bytes(data[:3], "big")
+                    kind, flags, stream = data[3], data[4], int.from_bytes(data[5:9], "big")
+                    if kind == 1:
+                        headers[stream] = data[9:9 + length]
+                    if kind in (0, 1) and flags & 1:
+                        ended.add(stream)
+                    data = data[9 + length:]
+            sock.close()
+            # :status 200 is a single byte from the static table, 405 a literal with the indexed name
+            self.assertEqual(headers[1][:1], b"\x88")
+            self.assertEqual(headers[3][:5], b"\x08\x03405")
+            self.assertEqual(ended, {1, 3})
+        finally:
+            server.terminate()
+            server.wait(timeout=5)
+
+
+    def test_07_tls_session_resumption(self):
+        """A TLS client can resume its session on a second connection (needs a `make SSL=1` build)."""
+        cert = os.path.join(TMP_DIR, "cert.pem")
+        key = os.path.join(TMP_DIR, "key.pem")
+        config = textwrap.dedent("""\
+            server {
+                server_name test;
+                host 127.0.0.1;
+                listen 8090 ssl;
+                root www/;
+                ssl_certificate %s;
+                ssl_certificate_key %s;
+                location / {
+                }
+            }
+        """ % (cert, key))
+        with open(CONFIG_PATH, "w") as f:
+            f.write(config)
+        if shutil.which("openssl") is None:
+            self.skipTest("openssl command not found")
+        subprocess.run(["openssl", "req", "-x509", "-newkey", "rsa:2048", "-nodes", "-keyout", key, "-out", cert,
+                        "-days", "1", "-subj", "/CN=localhost"], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, check=True)
+
+        context = ssl.create_default_context()
+        context.check_hostname = False
+        context.verify_mode = ssl.CERT_NONE
+
+        def get(session=None):
+            sock = context.wrap_socket(socket.create_connection(("127.0.0.1", 8090), timeout=2), session=session)
+            sock.sendall(b"GET /index.html HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n")
+            data = b""
+            while True:
+                chunk = sock.recv(65536)
+                if not chunk:
+                    break
+                data += chunk
+            result = (data.split(b"\r\n", 1)[0], sock.session, sock.session_reused)
+            sock.close()
+            return result
+
+        server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+        try:
+            time.sleep(0.5)
+            if server.poll() is not None:
+                err = server.stderr.read()
+                if b"TLS support is not compiled in" in err:
+                    self.skipTest("webserv built without TLS support")
+                self.fail(err)
+            status, session, reused = get()
+            self.assertEqual(status, b"HTTP/1.1 200 OK")
+            self.assertFalse(reused)
+            status, session, reused = get(session)
+            self.assertEqual(status, b"HTTP/1.1 200 OK")
+            self.assertTrue(reused)
+        finally:
+            server.terminate()
+            server.wait(timeout=5)
+
+    def test_08_io_uring_event_loop(self):
+        """The io_uring backend serves keep-alive and fragmented requests like poll() does."""
+        config = textwrap.dedent("""\
+            events {
+                use io_uring;
+            }
+            server {
+                server_name test;
+                host 127.0.0.1;
+                listen 8090;
+                root www/;
+                location / {
+                }
+                location /status {
+                    stub_status on;
+                }
+            }
+        """)
+        with open(CONFIG_PATH, "w") as f:
+            f.write(config)
+
+        server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            time.sleep(0.5)
+            request = b"GET /index.html HTTP/1.1\r\nHost: test\r\n\r\n"
+            with socket.create_connection(("127.0.0.1", 8090), timeout=2) as sock:
+                for _ in range(3):
+                    sock.sendall(request)
+                    self.assertTrue(sock.recv(65536).startswith(b"HTTP/1.1 200 OK"))
+                # A request arriving in pieces
+                for piece in (request[:10], request[10:25], request[25:]):
+                    sock.sendall(piece)
+                    time.sleep(0.05)
+                self.assertTrue(sock.recv(65536).startswith(b"HTTP/1.1 200 OK"))
+            with socket.create_connection(("127.0.0.1", 8090), timeout=2) as sock:
+                sock.sendall(b"GET /status HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n")
+                status = b""
+                while True:
+                    chunk = sock.recv(65536)
+                    if not chunk:
+                        break
+                    status += chunk
+            if b"Event loop: poll" in status:
+                self.skipTest("io_uring is not available, webserv fell back to poll()")
+            self.assertIn(b"Event loop: io_uring", status)
+        finally:
+            server.terminate()
+            server.wait(timeout=5)
+
+    def test_09_listen_options(self):
+        """Socket options on listen are accepted, invalid ones rejected, and every address gets a listener."""
+        with open(CONFIG_PATH, "w") as f:
+            f.write("server {\n server_name test;\n listen 8090 backlog=many;\n root www/;\n location / {\n }\n}\n")
+        code, out, err = run_and_capture(["./webserv", CONFIG_PATH])
+        self.assertEqual(code, 1)
+        self.assertIn(b"Invalid listen parameter: backlog=many", err)
+
+        # Two servers share 8090; the one after them still needs its own listener on 8091
+        config = textwrap.dedent("""\
+            server {
+                server_name test;
+                host 127.0.0.1;
+                listen 8090 backlog=64 deferred reuseport rcvbuf=64k sndbuf=128k so_keepalive=30m::5;
+                root www/;
+                location / {
+                }
+            }
+            server {
+                server_name other;
+                host 127.0.0.1;
+                listen 8090;
+                root www/;
+                location / {
+                }
+            }
+            server {
+                server_name third;
+                host 127.0.0.1;
+                listen 8091;
+                root www/;
+                location / {
+                }
+            }
+        """)
+        with open(CONFIG_PATH, "w") as f:
+            f.write(config)
+
+        server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            time.sleep(0.5)
+            # More connections than one accept per wakeup would keep up with
+            socks = [socket.create_connection(("127.0.0.1", 8090), timeout=2) for _ in range(20)]
+            for sock in socks:
+                sock.sendall(b"GET /index.html HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n")
+            for sock in socks:
+                self.assertTrue(sock.recv(65536).startswith(b"HTTP/1.1 200 OK"))
+                sock.close()
+            with socket.create_connection(("127.0.0.1", 8091), timeout=2) as sock:
+                sock.sendall(b"GET /index.html HTTP/1.1\r\nHost: third\r\nConnection: close\r\n\r\n")
+                self.assertTrue(sock.recv(65536).startswith(b"HTTP/1.1 200 OK"))
+        finally:
+            server.terminate()
+            server.wait(timeout=5)
+
+    def test_10_disk_thread_pool(self):
+        """File reads, writes and removals give the same answers with and without disk threads."""
+        big_path = "www/upload/disk_pool_big.bin"
+        big = os.urandom(1024 * 1024)
+        with open(big_path, "wb") as f:
+            f.write(big)
+
+        def exchange(sock, request):
+            sock.sendall(request)
+            data = b""
+            while b"\r\n\r\n" not in data:
+                data += sock.recv(65536)
+            head, body = data.split(b"\r\n\r\n", 1)
+            length = int(head.lower().split(b"content-length: ")[1].split(b"\r\n")[0])
+            while len(body) < length:
+                body += sock.recv(65536)
+            return head.split(b"\r\n")[0], body
+
+        try:
+            for threads in (0, 2):
+                with open(CONFIG_PATH, "w") as f:
+                    f.write("events {\n disk_threads %d;\n}\nserver {\n server_name test;\n host 127.0.0.1;\n listen 8090;\n"
+                            " root www/;\n client_max_body_size 100000;\n error_page 404 404.html;\n"
+                            " location / {\n  allow_methods GET POST DELETE;\n }\n}\n" % threads)
+                server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+                try:
+                    time.sleep(0.5)
+                    with socket.create_connection(("127.0.0.1", 8090), timeout=5) as sock:
+                        status, body = exchange(sock, b"GET /upload/disk_pool_big.bin HTTP/1.1\r\nHost: test\r\n\r\n")
+                        self.assertEqual(status, b"HTTP/1.1 200 OK")
+                        self.assertEqual(body, big)
+                        status, body = exchange(sock, b"GET /missing.html HTTP/1.1\r\nHost: test\r\n\r\n")
+                        self.assertEqual(status, b"HTTP/1.1 404 Not Found")
+                        self.assertIn(b"404", body)
+                        status, _ = exchange(sock, b"POST /upload/disk_pool.txt HTTP/1.1\r\nHost: test\r\nContent-Length: 5\r\n\r\nhello")
+                        self.assertEqual(status, b"HTTP/1.1 200 OK")
+                        with open("www/upload/disk_pool.txt", "rb") as f:
+                            self.assertEqual(f.read(), b"hello")
+                        status, _ = exchange(sock, b"DELETE /upload/disk_pool.txt HTTP/1.1\r\nHost: test\r\n\r\n")
+                        self.assertEqual(status, b"HTTP/1.1 200 OK")
+                        status, _ = exchange(sock, b"DELETE /upload/disk_pool.txt HTTP/1.1\r\nHost: test\r\n\r\n")
+                        self.assertEqual(status, b"HTTP/1.1 404 Not Found")
+                finally:
+                    server.terminate()
+                    server.wait(timeout=5)
+        finally:
+            os.remove(big_path)
+            if os.path.exists("www/upload/disk_pool.txt"):
+                os.remove("www/upload/disk_pool.txt")
+
+    def test_11_header_scanning(self):
+        """Header names must be tokens, and a header end split across reads is still found."""
+        with open(CONFIG_PATH, "w") as f:
+            f.write("server {\n server_name test;\n host 127.0.0.1;\n listen 8090;\n root www/;\n location / {\n }\n}\n")
+        server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            time.sleep(0.5)
+            for header in (b"Bad Name: x", b"Host : test", b"X-\x01: y", b": empty"):
+                with socket.create_connection(("127.0.0.1", 8090), timeout=2) as sock:
+                    sock.sendall(b"GET /index.html HTTP/1.1\r\nHost: test\r\n" + header + b"\r\n\r\n")
+                    self.assertTrue(sock.recv(65536).startswith(b"HTTP/1.1 400"), header)
+            with socket.create_connection(("127.0.0.1", 8090), timeout=2) as sock:
+                request = b"GET /index.html HTTP/1.1\r\nHost: test\r\nX-Long: " + b"a" * 100 + b"\r\nAccept: */*\r\n\r\n"
+                split = len(request) - 3
+                sock.sendall(request[:split])
+                time.sleep(0.1)
+                sock.sendall(request[split:])
+                self.assertTrue(sock.recv(65536).startswith(b"HTTP/1.1 200 OK"))
+        finally:
+            server.terminate()
+            server.wait(timeout=5)
+
+    def test_12_body_spooling(self):
+        """Bodies above client_body_buffer_size are spooled to a file and arrive intact."""
+        with open(CONFIG_PATH, "w") as f:
+            f.write("server {\n server_name test;\n host 127.0.0.1;\n listen 8090;\n root www/;\n"
+                    " client_max_body_size 1m;\n client_body_buffer_size 1k;\n"
+                    " location / {\n  allow_methods GET POST DELETE;\n }\n}\n")
+        server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        path = "www/upload/spool.bin"
+        try:
+            time.sleep(0.5)
+            for body in (os.urandom(300000), os.urandom(200000), b"small"):
+                with socket.create_connection(("127.0.0.1", 8090), timeout=5) as sock:
+                    sock.sendall(b"POST /upload/spool.bin HTTP/1.1\r\nHost: test\r\nContent-Length: %d\r\n\r\n" % len(body)
+                                 + body[:1000])
+                    time.sleep(0.1)
+                    sock.sendall(body[1000:])
+                    self.assertTrue(sock.recv(65536).startswith(b"HTTP/1.1 200 OK"))
+                with open(path, "rb") as f:
+                    self.assertEqual(f.read(), body)
+            content = os.urandom(50000)
+            multipart = (b"--XyZ\r\nContent-Disposition: form-data; name=\"file\"; filename=\"spool.bin\"\r\n\r\n"
+                         + content + b"\r\n--XyZ--\r\n")
+            with socket.create_connection(("127.0.0.1", 8090), timeout=5) as sock:
+                sock.sendall(b"POST /upload HTTP/1.1\r\nHost: test\r\nContent-Type: multipart/form-data; boundary=XyZ\r\n"
+                             b"Content-Length: %d\r\n\r\n" % len(multipart) + multipart)
+                self.assertTrue(sock.recv(65536).startswith(b"HTTP/1.1 200 OK"))
+            with open(path, "rb") as f:
+                self.assertEqual(f.read(), content)
+            self.assertEqual([name for name in os.listdir("www") + os.listdir("www/upload") if "spool" in name
+                              and name != "spool.bin"], [])
+        finally:
+            server.terminate()
+            server.wait(timeout=5)
+            if os.path.exists(path):
+                os.remove(path)
+
+    def test_13_canned_responses(self):
+        """Error pages are loaded at startup; hosts without one get a built-in page."""
+        with open(CONFIG_PATH, "w") as f:
+            f.write("server {\n server_name test;\n host 127.0.0.1;\n listen 8090;\n root www/;\n"
+                    " error_page 404 404.html;\n location / {\n  allow_methods GET;\n }\n}\n"
+                    "server {\n server_name plain;\n host 127.0.0.1;\n listen 8090;\n root www/;\n"
+                    " location / {\n  allow_methods GET;\n }\n location /old {\n  redirect /new;\n }\n}\n")
+        server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        with open("www/404.html", "rb") as f:
+            page = f.read()
+        try:
+            time.sleep(0.5)
+
+            def exchange(request):
+                with socket.create_connection(("127.0.0.1", 8090), timeout=2) as sock:
+                    sock.sendall(request)
+                    head, body = sock.recv(65536).split(b"\r\n\r\n", 1)
+                    return head.split(b"\r\n"), body
+
+            head, body = exchange(b"GET /missing.html HTTP/1.1\r\nHost: test\r\n\r\n")
+            self.assertEqual(head[0], b"HTTP/1.1 404 Not Found")
+            self.assertEqual(body, page)
+            head, body = exchange(b"GET /missing.html HTTP/1.1\r\nHost: plain\r\n\r\n")
+            self.assertEqual(head[0], b"HTTP/1.1 404 Not Found")
+            self.assertIn(b"<h1>404 Not Found</h1>", body)
+            head, _ = exchange(b"DELETE / HTTP/1.1\r\nHost: plain\r\n\r\n")
+            self.assertEqual(head[0], b"HTTP/1.1 405 Method Not Allowed")
+            self.assertIn(b"Allow: GET", head)
+            head, body = exchange(b"GET /old HTTP/1.1\r\nHost: plain\r\n\r\n")
+            self.assertEqual(head[0], b"HTTP/1.1 301 Moved Permanently")
+            self.assertIn(b"Location: /new", head)
+            self.assertIn(b"href=\"/new\"", body)
+        finally:
+            server.terminate()
+            server.wait(timeout=5)
+
+    def test_14_spooled_upload_min_rate(self):
+        """A steady upload above client_body_buffer_size is not mistaken for a stalled one."""
+        path = "www/upload/min_rate.bin"
+        # poll() splices a spooled body into its file, io_uring receives it
+        for backend in ("poll", "io_uring"):
+            with open(CONFIG_PATH, "w") as f:
+                f.write("events {\n use %s;\n}\nserver {\n server_name test;\n host 127.0.0.1;\n listen 8090;\n"
+                        " root www/;\n client_max_body_size 1m;\n client_body_buffer_size 1k;\n client_min_rate 4000;\n"
+                        " location / {\n  allow_methods GET POST;\n }\n location /status {\n  stub_status on;\n }\n}\n"
+                        % backend)
+            server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+            try:
+                time.sleep(0.5)
+                with socket.create_connection(("127.0.0.1", 8090), timeout=2) as sock:
+                    sock.sendall(b"GET /status HTTP/1.1\r\nHost: test\r\n\r\n")
+                    if backend not in sock.recv(65536).decode():
+                        self.skipTest("io_uring is not available, webserv fell back to poll()")
+                # 20 kB/s for longer than the grace period, all of it spooled
+                body = os.urandom(140000)
+                with socket.create_connection(("127.0.0.1", 8090), timeout=5) as sock:
+                    sock.sendall(b"POST /upload/min_rate.bin HTTP/1.1\r\nHost: test\r\nContent-Length: %d\r\n\r\n"
+                                 % len(body))
+                    for start in range(0, len(body), 20000):
+                        sock.sendall(body[start:start + 20000])
+                        time.sleep(1)
+                    self.assertTrue(sock.recv(65536).startswith(b"HTTP/1.1 200 OK"), backend)
+                with open(path, "rb") as f:
+                    self.assertEqual(f.read(), body)
+            finally:
+                server.terminate()
+                server.wait(timeout=5)
+                if os.path.exists(path):
+                    os.remove(path)
+
+    def test_15_spool_paths(self):
+        """Spooled bodies are written intact whether spliced from the socket or received."""
+        path = "www/upload/spool_path.bin"
+        for backend in ("poll", "io_uring"):
+            with open(CONFIG_PATH, "w") as f:
+                f.write("events {\n use %s;\n}\nserver {\n server_name test;\n host 127.0.0.1;\n listen 8090;\n"
+                        " root www/;\n client_max_body_size 4m;\n client_body_buffer_size 1k;\n"
+                        " location / {\n  allow_methods GET POST;\n }\n location /status {\n  stub_status on;\n }\n}\n"
+                        % backend)
+            server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+            try:
+                time.sleep(0.5)
+                with socket.create_connection(("127.0.0.1", 8090), timeout=2) as sock:
+                    sock.sendall(b"GET /status HTTP/1.1\r\nHost: test\r\n\r\n")
+                    if backend not in sock.recv(65536).decode():
+                        self.skipTest("io_uring is not available, webserv fell back to poll()")
+                # The first bytes of the body arrive with the head and go through the buffer,
+                # the rest is spliced or received straight into the file
+                body = os.urandom(3 * 1024 * 1024 + 17)
+                with socket.create_connection(("127.0.0.1", 8090), timeout=5) as sock:
+                    sock.sendall(b"POST /upload/spool_path.bin HTTP/1.1\r\nHost: test\r\nContent-Length: %d\r\n\r\n"
+                                 % len(body) + body[:3000])
+                    time.sleep(0.1)
+                    for start in range(3000, len(body), 65536):
+                        sock.sendall(body[start:start + 65536])
+                    self.assertTrue(sock.recv(65536).startswith(b"HTTP/1.1 200 OK"), backend)
+                with open(path, "rb") as f:
+                    self.assertEqual(f.read(), body, backend)
+                content = os.urandom(200000)
+                multipart = (b"--XyZ\r\nContent-Disposition: form-data; name=\"file\"; filename=\"spool_path.bin\"\r\n\r\n"
+                             + content + b"\r\n--XyZ--\r\n")
+                with socket.create_connection(("127.0.0.1", 8090), timeout=5) as sock:
+                    sock.sendall(b"POST /upload HTTP/1.1\r\nHost: test\r\nContent-Type: multipart/form-data; boundary=XyZ\r\n"
+                                 b"Content-Length: %d\r\n\r\n" % len(multipart))
+                    time.sleep(0.1)
+                    sock.sendall(multipart)
+                    self.assertTrue(sock.recv(65536).startswith(b"HTTP/1.1 200 OK"), backend)
+                with open(path, "rb") as f:
+                    self.assertEqual(f.read(), content, backend)
+            finally:
+                server.terminate()
+                server.wait(timeout=5)
+                if os.path.exists(path):
+                    os.remove(path)
+
+    def test_16_cgi_cache(self):
+        """cgi_cache serves HIT and STALE copies, refreshes once, and honours Cache-Control and cookies."""
+        script = "www/cgi-bin/cache_test.py"
+        slow_marker = "www/cgi-bin/cache_test.slow"
+        with open(script, "w") as f:
+            f.write(textwrap.dedent("""\
+                import os, time, uuid
+                headers = {"short": "Cache-Control: max-age=2, stale-while-revalidate=0",
+                           "nostore": "Cache-Control: no-store", "cookie": "Set-Cookie: id=1"}
+                print("Content-Type: text/plain")
+                mode = os.environ.get("QUERY_STRING", "")
+                if mode == "slow" and os.path.exists(SLOW_MARKER):
+                    time.sleep(1.5)
+                if mode in headers:
+                    print(headers[mode])
+                print()
+                print(uuid.uuid4().hex)
+            """).replace("SLOW_MARKER", repr(os.path.abspath(slow_marker))))
+        with open(CONFIG_PATH, "w") as f:
+            f.write("server {\n server_name test;\n host 127.0.0.1;\n listen 8090;\n root www/;\n"
+                    " location / {\n }\n location /cgi-bin {\n  root www/;\n  allow_methods GET;\n"
+                    "  cgi_path /usr/bin/python3;\n  cgi_ext .py;\n  cgi_cache 2s stale=10s;\n }\n}\n")
+        server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+        def get(query, close=False):
+            with socket.create_connection(("127.0.0.1", 8090), timeout=5) as sock:
+                sock.sendall(b"GET /cgi-bin/cache_test.py" + query + b" HTTP/1.1\r\nHost: test\r\n"
+                             + (b"Connection: close\r\n" if close else b"") + b"\r\n")
+                data = b""
+                while b"\r\n\r\n" not in data:
+                    data += sock.recv(65536)
+                head, body = data.split(b"\r\n\r\n", 1)
+                length = int(head.lower().split(b"content-length: ")[1].split(b"\r\n")[0])
+                while len(body) < length:
+                    body += sock.recv(65536)
+                self.assertTrue(head.startswith(b"HTTP/1.1 200 OK"))
+                return head.split(b"X-Cache: ")[1].split(b"\r\n")[0], body
+
+        try:
+            time.sleep(0.5)
+            status, first = get(b"")
+            self.assertEqual(status, b"MISS")
+            self.assertEqual(get(b""), (b"HIT", first))
+            status, slow = get(b"?slow")
+            self.assertEqual(status, b"MISS")
+            # Fresh for at least one more second
+            status, short = get(b"?short")
+            self.assertEqual(status, b"MISS")
+            self.assertEqual(get(b"?short"), (b"HIT", short))
+            for query in (b"?nostore", b"?cookie"):
+                status, once = get(query)
+                status, twice = get(query)
+                self.assertEqual(status, b"MISS", query)
+                self.assertNotEqual(once, twice, query)
+
+            time.sleep(2.1)
+            # The refresh of ?slow takes 1.5 s and runs alongside the event loop
+            with open(slow_marker, "w"):
+                pass
+            self.assertEqual(get(b"?slow"), (b"STALE", slow))
+            started = time.time()
+            # Expired: the stale copy goes out (also to a closing connection), then the script runs again
+            self.assertEqual(get(b"", close=True), (b"STALE", first))
+            self.assertLess(time.time() - started, 0.5)
+            time.sleep(0.5)
+            status, refreshed = get(b"")
+            self.assertEqual(status, b"HIT")
+            self.assertNotEqual(refreshed, first)
+            time.sleep(1.5)
+            status, refreshed = get(b"?slow")
+            self.assertEqual(status, b"HIT")
+            self.assertNotEqual(refreshed, slow)
+            # No stale window: gone once max-age is over
+            self.assertEqual(get(b"?short")[0], b"MISS")
+        finally:
+            server.terminate()
+            server.wait(timeout=5)
+            os.remove(script)
+            if os.path.exists(slow_marker):
+                os.remove(slow_marker)
+
+    def test_17_request_bodies_intact(self):
+        """Multipart uploads and CGI POST bodies arrive byte for byte, in memory and spooled."""
+        script = "www/cgi-bin/body_digest.py"
+        with open(script, "w") as f:
+            f.write(textwrap.dedent("""\
+                import hashlib, sys
+                data = sys.stdin.buffer.read()
+                print("Content-Type: text/plain")
+                print()
+                print("%d %s" % (len(data), hashlib.sha256(data).hexdigest()))
+            """))
+        with open(CONFIG_PATH, "w") as f:
+            f.write("server {\n server_name test;\n host 127.0.0.1;\n listen 8090;\n root www/;\n"
+                    " client_max_body_size 4m;\n client_body_buffer_size 64k;\n"
+                    " location / {\n  allow_methods GET POST;\n }\n location /cgi-bin {\n  root www/;\n"
+                    "  allow_methods GET POST;\n  cgi_path /usr/bin/python3;\n  cgi_ext .py;\n }\n}\n")
+        server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        path = "www/upload/body_test.bin"
+        boundary = b"----BodyTestBoundary7MA4YWxk"
+
+        def post(head, body):
+            with socket.create_connection(("127.0.0.1", 8090), timeout=10) as sock:
+                # In pieces, so the body is split across reads at odd places
+                request = head + b"Content-Length: %d\r\n\r\n" % len(body) + body
+                for start in range(0, len(request), 70001):
+                    sock.sendall(request[start:start + 70001])
+                data = b""
+                while b"\r\n\r\n" not in data:
+                    data += sock.recv(65536)
+                response_head, response_body = data.split(b"\r\n\r\n", 1)
+                length = int(response_head.lower().split(b"content-length: ")[1].split(b"\r\n")[0])
+                while len(response_body) < length:
+                    response_body += sock.recv(65536)
+                self.assertTrue(response_head.startswith(b"HTTP/1.1 200 OK"), response_head)
+                return response_body
+
+        try:
+            time.sleep(0.5)
+            for size in (1000, 300000):
+                # Almost a boundary, right before the real one
+                content = os.urandom(size) + b"\r\n" + boundary[:-1] + b"x\r\n--"
+                self.assertNotIn(boundary, content)
+                multipart = (b"--" + boundary + b"\r\nContent-Disposition: form-data; name=\"file\"; "
+                             b"filename=\"body_test.bin\"\r\nContent-Type: application/octet-stream\r\n\r\n"
+                             + content + b"\r\n--" + boundary + b"--\r\n")
+                post(b"POST /upload HTTP/1.1\r\nHost: test\r\nContent-Type: multipart/form-data; boundary="
+                     + boundary + b"\r\n", multipart)
+                with open(path, "rb") as f:
+                    self.assertEqual(f.read(), content, size)
+
+                body = os.urandom(size)
+                digest = post(b"POST /cgi-bin/body_digest.py HTTP/1.1\r\nHost: test\r\n", body)
+                self.assertEqual(digest.strip(), b"%d %s" % (size, hashlib.sha256(body).hexdigest().encode()), size)
+
+                # Decoded once, by the parser
+                chunks = b"".join(b"%x\r\n" % len(body[n:n + 4096]) + body[n:n + 4096] + b"\r\n"
+                                  for n in range(0, size, 4096)) + b"0\r\n\r\n"
+                with socket.create_connection(("127.0.0.1", 8090), timeout=10) as sock:
+                    sock.sendall(b"POST /cgi-bin/body_digest.py HTTP/1.1\r\nHost: test\r\n"
+                                 b"Transfer-Encoding: chunked\r\n\r\n" + chunks)
+                    status, _, digest, _ = read_response(sock)
+                self.assertEqual(status, b"HTTP/1.1 200 OK")
+                self.assertEqual(digest.strip(), b"%d %s" % (size, hashlib.sha256(body).hexdigest().encode()), size)
+        finally:
+            server.terminate()
+            server.wait(timeout=5)
+            os.remove(script)
+            if os.path.exists(path):
+                os.remove(path)
+
+    def test_18_log_flushed_at_shutdown(self):
+        """Log lines still queued for the writer thread reach webserv.log when the server stops."""
+        with open(CONFIG_PATH, "w") as f:
+            f.write("server {\n server_name test;\n host 127.0.0.1;\n listen 8090;\n root www/;\n location / {\n }\n}\n")
+        start = os.path.getsize("webserv.log") if os.path.exists("webserv.log") else 0
+        server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            time.sleep(0.5)
+            # Connections serve at most MAX_REQUESTS (100) requests
+            for _ in range(4):
+                with socket.create_connection(("127.0.0.1", 8090), timeout=2) as sock:
+                    for _ in range(50):
+                        sock.sendall(b"GET /empty.html HTTP/1.1\r\nHost: test\r\n\r\n")
+                        self.assertTrue(sock.recv(65536).startswith(b"HTTP/1.1 200 OK"))
+            # Right away, while the writer thread still has lines to pick up
+            server.send_signal(signal.SIGTERM)
+            self.assertEqual(server.wait(timeout=5), 0)
+        finally:
+            if server.poll() is None:
+                server.kill()
+                server.wait(timeout=5)
+        with open("webserv.log", "rb") as f:
+            f.seek(start)
+            written = f.read()
+        self.assertEqual(written.count(b"200 OK: www/empty.html"), 200)
+        self.assertIn(b"INFO: Server stopped", written)
+
+    def test_19_access_log_line(self):
+        """Requests are logged in the combined format, flushed within a second and at shutdown."""
+        log_path = os.path.join(TMP_DIR, "access.log")
+        if os.path.exists(log_path):
+            os.remove(log_path)
+        with open(CONFIG_PATH, "w") as f:
+            f.write("server {\n server_name test;\n host 127.0.0.1;\n listen 8090;\n root www/;\n"
+                    " access_log %s combined;\n location / {\n }\n}\n" % log_path)
+        server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        line = re.compile(rb'^127\.0\.0\.1 - - \[[^\]]+\] "GET /(\w+)\.html HTTP/1\.1" (\d+) (\d+) "(.*)" "(.*)" test '
+                          rb'hp=\d+\.\d{3} ht=\d+\.\d{3} fb=\d+\.\d{3} rt=\d+\.\d{3}$')
+
+        def get(path, agent=b"log-test/1.0"):
+            with socket.create_connection(("127.0.0.1", 8090), timeout=2) as sock:
+                sock.sendall(b"GET " + path + b" HTTP/1.1\r\nHost: test\r\nReferer: http://test/\r\n"
+                             b"User-Agent: " + agent + b"\r\nConnection: close\r\n\r\n")
+                while sock.recv(65536):
+                    pass
+
+        try:
+            time.sleep(0.5)
+            get(b"/index.html")
+            # Written by the event loop once the flush interval is over
+            deadline = time.time() + 3
+            while time.time() < deadline and not (os.path.exists(log_path) and os.path.getsize(log_path)):
+                time.sleep(0.1)
+            with open(log_path, "rb") as f:
+                lines = f.read().splitlines()
+            self.assertEqual(len(lines), 1)
+            match = line.match(lines[0])
+            self.assertIsNotNone(match, lines[0])
+            self.assertEqual(match.group(1, 2, 4, 5), (b"index", b"200", b"http://test/", b"log-test/1.0"))
+            self.assertGreater(int(match.group(3)), os.path.getsize("www/index.html"))
+            # Still in the buffer when the server stops
+            get(b"/missing.html")
+            # A client cannot close the quotes or forge a line of its own
+            get(b"/empty.html", b'x" 200 "\\\x1b\x7f')
+            server.send_signal(signal.SIGTERM)
+            server.wait(timeout=5)
+            with open(log_path, "rb") as f:
+                lines = f.read().splitlines()
+            self.assertEqual(len(lines), 3)
+            self.assertEqual(line.match(lines[1]).group(1, 2), (b"missing", b"404"))
+            self.assertEqual(line.match(lines[2]).group(1, 5), (b"empty", b"x\\x22 200 \\x22\\x5C\\x1B\\x7F"))
+        finally:
+            if server.poll() is None:
+                server.terminate()
+                server.wait(timeout=5)
+            if os.path.exists(log_path):
+                os.remove(log_path)
+
+    def test_20_graceful_stop_drains(self):
+        """On SIGTERM idle connections close, a request in flight is still answered, then the server exits."""
+        with open(CONFIG_PATH, "w") as f:
+            f.write("server {\n server_name test;\n host 127.0.0.1;\n listen 8090;\n root www/;\n location / {\n }\n}\n")
+        server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            time.sleep(0.5)
+            request = b"GET /index.html HTTP/1.1\r\nHost: test\r\n\r\n"
+            idle = socket.create_connection(("127.0.0.1", 8090), timeout=2)
+            idle.sendall(request)
+            self.assertTrue(idle.recv(65536).startswith(b"HTTP/1.1 200 OK"))
+            busy = socket.create_connection(("127.0.0.1", 8090), timeout=2)
+            busy.sendall(request[:20])
+            time.sleep(0.2)
+
+            server.send_signal(signal.SIGTERM)
+            time.sleep(0.3)
+            # The idle connection is closed, the listener is gone
+            self.assertEqual(idle.recv(65536), b"")
+            with self.assertRaises(ConnectionRefusedError):
+                socket.create_connection(("127.0.0.1", 8090), timeout=2)
+            self.assertIsNone(server.poll())
+            # The request in flight is finished and its connection closed afterwards
+            busy.sendall(request[20:])
+            response = b""
+            while True:
+                chunk = busy.recv(65536)
+                if not chunk:
+                    break
+                response += chunk
+            self.assertTrue(response.startswith(b"HTTP/1.1 200 OK"))
+            self.assertIn(b"Connection: close", response)
+            self.assertEqual(server.wait(timeout=5), 0)
+            idle.close()
+            busy.close()
+        finally:
+            if server.poll() is None:
+                server.kill()
+                server.wait(timeout=5)
+
+    def test_21_keep_alive_pipelined(self):
+        """Many requests on one connection, one by one and pipelined across reads, before and after it idles."""
+        script = "www/cgi-bin/pipeline_digest.py"
+        with open(script, "w") as f:
+            f.write(textwrap.dedent("""\
+                import hashlib, sys
+                data = sys.stdin.buffer.read()
+                print("Content-Type: text/plain")
+                print()
+                print("%d %s" % (len(data), hashlib.sha256(data).hexdigest()))
+            """))
+        with open("www/index.html", "rb") as f:
+            index = f.read()
+        with open("www/empty.html", "rb") as f:
+            empty = f.read()
+        files = [(b"/index.html", index), (b"/empty.html", empty)]
+
+        def get(path, pad):
+            # The padding makes a batch span several receive slabs and splits requests between them
+            return b"GET " + path + b" HTTP/1.1\r\nHost: test\r\nX-Pad: " + b"p" * pad + b"\r\n\r\n"
+
+        def digest(body):
+            return b"%d %s" % (len(body), hashlib.sha256(body).hexdigest().encode())
+
+        try:
+            for backend in ("poll", "io_uring"):
+                with open(CONFIG_PATH, "w") as f:
+                    f.write("events {\n use %s;\n}\nserver {\n server_name test;\n host 127.0.0.1;\n listen 8090;\n"
+                            " root www/;\n location / {\n }\n location /status {\n  stub_status;\n }\n"
+                            " location /cgi-bin {\n  root www/;\n  allow_methods GET POST;\n  cgi_path /usr/bin/python3;\n"
+                            "  cgi_ext .py;\n }\n}\n" % backend)
+                server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+                try:
+                    time.sleep(0.5)
+                    with socket.create_connection(("127.0.0.1", 8090), timeout=5) as sock:
+                        sock.sendall(b"GET /status HTTP/1.1\r\nHost: test\r\n\r\n")
+                        status, _, body, _ = read_response(sock)
+                        if backend.encode() not in body:
+                            self.skipTest("io_uring is not available, webserv fell back to poll()")
+
+                        for i in range(20):
+                            path, content = files[i % 2]
+                            sock.sendall(get(path, i * 37))
+                            status, _, body, rest = read_response(sock)
+                            self.assertEqual(status, b"HTTP/1.1 200 OK")
+                            self.assertEqual(body, content, (backend, i))
+                            self.assertEqual(rest, b"")
+
+                        # Well over one 16 KiB slab in a single send, with request bodies in between
+                        posted = os.urandom(5000)
+                        chunked = os.urandom(3000)
+                        batch = [(get(files[i % 2][0], 300 + i), files[i % 2][1]) for i in range(50)]
+                        batch.insert(17, (b"POST /cgi-bin/pipeline_digest.py HTTP/1.1\r\nHost: test\r\n"
+                                          b"Content-Length: %d\r\n\r\n" % len(posted) + posted, digest(posted)))
+                        batch.insert(33, (b"POST /cgi-bin/pipeline_digest.py HTTP/1.1\r\nHost: test\r\n"
+                                          b"Transfer-Encoding: chunked\r\n\r\n"
+                                          + b"".join(b"%x\r\n" % 1000 + chunked[n:n + 1000] + b"\r\n"
+                                                     for n in range(0, len(chunked), 1000))
+                                          + b"0\r\n\r\n", digest(chunked)))
+                        requests = b"".join(request for request, _ in batch)
+                        self.assertGreater(len(requests), 16384)
+                        sock.sendall(requests)
+                        pending = b""
+                        for i, (_, content) in enumerate(batch):
+                            status, _, body, pending = read_response(sock, pending)
+                            self.assertEqual(status, b"HTTP/1.1 200 OK", (backend, i))
+                            self.assertEqual(body.strip() if i in (17, 33) else body, content, (backend, i))
+                        self.assertEqual(pending, b"")
+
+                        # Idle long enough for its buffer and arena to be given back, then used again
+                        time.sleep(2.5)
+                        sock.sendall(b"".join(get(path, 5000) for path, _ in files))
+                        pending = b""
+                        for path, content in files:
+                            status, _, body, pending = read_response(sock, pending)
+                            self.assertEqual(body, content, (backend, path))
+                        for i in range(10):
+                            path, content = files[i % 2]
+                            sock.sendall(get(path, 0))
+                            status, _, body, _ = read_response(sock)
+                            self.assertEqual(body, content, (backend, i))
+
+                    # Chunk sizes that cannot be right end the connection with 400 behind the
+                    # request answered before them, and the server keeps serving everyone else
+                    for size_line in (b"FFFFFFFFFFFFFFEC", b"10000000000000000", b"zz", b"-1", b"5 x"):
+                        with socket.create_connection(("127.0.0.1", 8090), timeout=5) as sock:
+                            sock.sendall(get(b"/empty.html", 0) + b"POST /cgi-bin/pipeline_digest.py HTTP/1.1\r\n"
+                                         b"Host: test\r\nTransfer-Encoding: chunked\r\n\r\n" + size_line + b"\r\nabc")
+                            status, _, body, pending = read_response(sock)
+                            self.assertEqual(body, empty, (backend, size_line))
+                            status, head, _, _ = read_response(sock, pending)
+                            self.assertEqual(status, b"HTTP/1.1 400 Bad Request", (backend, size_line))
+                            self.assertIn(b"Connection: close", head)
+                        with socket.create_connection(("127.0.0.1", 8090), timeout=2) as sock:
+                            sock.sendall(get(b"/index.html", 0))
+                            self.assertEqual(read_response(sock)[2], index, (backend, size_line))
+                finally:
+                    server.terminate()
+                    server.wait(timeout=5)
+        finally:
+            os.remove(script)
+
+    def test_22_keep_alive_large_files(self):
+        """Streamed large files and small files alternate on one connection, one by one and pipelined."""
+        big_path = "www/upload/keep_alive_big.bin"
+        big = os.urandom(1024 * 1024 + 333)
+        with open(big_path, "wb") as f:
+            f.write(big)
+        with open("www/index.html", "rb") as f:
+            index = f.read()
+        with open("www/empty.html", "rb") as f:
+            empty = f.read()
+        files = [(b"/upload/keep_alive_big.bin", big), (b"/index.html", index), (b"/empty.html", empty)]
+        with open(CONFIG_PATH, "w") as f:
+            f.write("server {\n server_name test;\n host 127.0.0.1;\n listen 8090;\n root www/;\n location / {\n }\n}\n")
+        server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            time.sleep(0.5)
+            with socket.create_connection(("127.0.0.1", 8090), timeout=5) as sock:
+                for i in range(30):
+                    path, content = files[i % len(files)]
+                    sock.sendall(b"GET " + path + b" HTTP/1.1\r\nHost: test\r\n\r\n")
+                    status, _, body, rest = read_response(sock)
+                    self.assertEqual(status, b"HTTP/1.1 200 OK")
+                    self.assertEqual(body, content, (i, path))
+                    self.assertEqual(rest, b"")
+                # Requests queued behind a file that is still being streamed
+                order = [files[i % len(files)] for i in range(12)]
+                sock.sendall(b"".join(b"GET " + path + b" HTTP/1.1\r\nHost: test\r\n\r\n" for path, _ in order))
+                pending = b""
+                for i, (path, content) in enumerate(order):
+                    status, _, body, pending = read_response(sock, pending)
+                    self.assertEqual(status, b"HTTP/1.1 200 OK")
+                    self.assertEqual(body, content, (i, path))
+                self.assertEqual(pending, b"")
+                # A slow reader keeps the server between its send watermarks for a while
+                sock.sendall(b"GET /upload/keep_alive_big.bin HTTP/1.1\r\nHost: test\r\n\r\n"
+                             b"GET /empty.html HTTP/1.1\r\nHost: test\r\n\r\n")
+                data = b""
+                while len(data) < len(big):
+                    data += sock.recv(32768)
+                    time.sleep(0.005)
+                status, _, body, pending = read_response(sock, data)
+                self.assertEqual(body, big)
+                status, _, body, pending = read_response(sock, pending)
+                self.assertEqual(body, empty)
+        finally:
+            server.terminate()
+            server.wait(timeout=5)
+            os.remove(big_path)
+
+    def test_23_reused_fds_keep_their_own_requests(self):
+        """Connections opened in freed fds while others are mid-request each get their own responses."""
+        with open("www/index.html", "rb") as f:
+            index = f.read()
+        with open("www/empty.html", "rb") as f:
+            empty = f.read()
+        files = [(b"/index.html", index), (b"/empty.html", empty)]
+        with open(CONFIG_PATH, "w") as f:
+            f.write("server {\n server_name test;\n host 127.0.0.1;\n listen 8090;\n root www/;\n location / {\n }\n}\n")
+        server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        connections = []
+        try:
+            time.sleep(0.5)
+            rng = random.Random(39)
+            for _ in range(30):
+                connections.append(socket.create_connection(("127.0.0.1", 8090), timeout=5))
+            for turn in range(8):
+                # Every connection has half of its request in, with headers of a different size each time
+                requests = []
+                for n, sock in enumerate(connections):
+                    path, content = files[(n + turn) % 2]
+                    request = (b"GET " + path + b" HTTP/1.1\r\nHost: test\r\nX-Conn: %d\r\n" % n
+                               + b"X-Pad: " + b"r" * rng.randrange(0, 3000) + b"\r\n\r\n")
+                    split = rng.randrange(1, len(request))
+                    sock.sendall(request[:split])
+                    requests.append((sock, request[split:], content))
+                time.sleep(0.05)
+                rng.shuffle(requests)
+                for sock, rest, content in requests:
+                    sock.sendall(rest)
+                for sock, _, content in requests:
+                    status, _, body, pending = read_response(sock)
+                    self.assertEqual(status, b"HTTP/1.1 200 OK")
+                    self.assertEqual(body, content, turn)
+                    self.assertEqual(pending, b"")
+                # A third of them go, new ones take their fds while the others stay open
+                for sock in rng.sample(connections, 10):
+                    connections.remove(sock)
+                    sock.close()
+                time.sleep(0.05)
+                for _ in range(10):
+                    connections.append(socket.create_connection(("127.0.0.1", 8090), timeout=5))
+        finally:
+            for sock in connections:
+                sock.close()
+            server.terminate()
+            server.wait(timeout=5)
+
+    def test_24_http2_header_list_limit(self):
+        """A header list over the advertised limit resets its stream and leaves the HPACK state intact."""
+        with open(CONFIG_PATH, "w") as f:
+            f.write("server {\n server_name test;\n host 127.0.0.1;\n listen 8090;\n root www/;\n"
+                    " large_client_header_buffers 4 8k;\n location / {\n }\n}\n")
+
+        def frame(kind, flags, stream, payload=b""):
+            return len(payload).to_bytes(3, "big") + bytes([kind, flags]) + stream.to_bytes(4, "big") + payload
+
+        def integer(flags, prefix, value):
+            limit = (1 << prefix) - 1
+            if value < limit:
+                return bytes([flags | value])
+            out = bytes([flags | limit])
+            value -= limit
+            while value >= 128:
+                out += bytes([(value & 0x7f) | 0x80])
+                value >>= 7
+            return out + bytes([value])
+
+        def read_frames(sock, data, until):
+            frames = []
+            while not any(until(f) for f in frames):
+                chunk = sock.recv(65536)
+                self.assertTrue(chunk, "connection closed")
+                data += chunk
+                while len(data) >= 9 and len(data) >= 9 + int.from_bytes(data[:3], "big"):
+                    length = int.from_bytes(data[:3], "big")
+                    frames.append((data[3], data[4], int.from_bytes(data[5:9], "big"), data[9:9 + length]))
+                    data = data[9 + length:]
+            return frames, data
+
+        request = b"\x82\x86\x84\x01\x04test"
+        # x-big is added to the dynamic table, then repeated by its one-byte index (62)
+        value = b"v" * 4000
+        big_entry = b"\x40" + integer(0, 7, 5) + b"x-big" + integer(0, 7, len(value)) + value
+        server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            time.sleep(0.5)
+            with socket.create_connection(("127.0.0.1", 8090), timeout=5) as sock:
+                sock.sendall(b"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n" + frame(4, 0, 0))
+                frames, data = read_frames(sock, b"", lambda f: f[0] == 4 and not f[1] & 1)
+                settings = [f[3] for f in frames if f[0] == 4 and not f[1] & 1][0]
+                values = dict((int.from_bytes(settings[i:i + 2], "big"), int.from_bytes(settings[i + 2:i + 6], "big"))
+                              for i in range(0, len(settings), 6))
+                self.assertEqual(values.get(6), 4 * 8192)
+
+                sock.sendall(frame(1, 5, 1, request + big_entry + b"\xbe" * 12000))
+                frames, data = read_frames(sock, data, lambda f: f[0] == 3 and f[2] == 1)
+                reset = [f for f in frames if f[0] == 3 and f[2] == 1][0]
+                self.assertEqual(int.from_bytes(reset[3], "big"), 0xb)
+
+                # The entry added by the refused block is still there for the next one
+                sock.sendall(frame(1, 5, 3, request + b"\xbe"))
+                frames, data = read_frames(sock, data, lambda f: f[0] in (0, 1) and f[2] == 3 and f[1] & 1)
+                self.assertEqual([f[3][:1] for f in frames if f[0] == 1 and f[2] == 3], [b"\x88"])
+        finally:
+            server.terminate()
+            server.wait(timeout=5)
+
+    def test_25_http2_bounded_buffers(self):
+        """HTTP/2 request bodies over the buffer size are spooled intact, and a peer that does not read is not read from."""
+        script = "www/cgi-bin/h2_digest.py"
+        with open(script, "w") as f:
+            f.write(textwrap.dedent("""\
+                import hashlib, sys
+                data = sys.stdin.buffer.read()
+                print("Content-Type: text/plain")
+                print()
+                print("%d %s" % (len(data), hashlib.sha256(data).hexdigest()))
+            """))
+        with open(CONFIG_PATH, "w") as f:
+            f.write("server {\n server_name test;\n host 127.0.0.1;\n listen 8090;\n root www/;\n"
+                    " client_max_body_size 1m;\n client_body_buffer_size 16k;\n location / {\n }\n"
+                    " location /cgi-bin {\n  root www/;\n  allow_methods GET POST;\n  cgi_path /usr/bin/python3;\n"
+                    "  cgi_ext .py;\n }\n}\n")
+
+        def frame(kind, flags, stream, payload=b""):
+            return len(payload).to_bytes(3, "big") + bytes([kind, flags]) + stream.to_bytes(4, "big") + payload
+
+        def read_frames(sock, data, until):
+            frames = []
+            while not until(frames):
+                chunk = sock.recv(65536)
+                self.assertTrue(chunk, "connection closed")
+                data += chunk
+                while len(data) >= 9 and len(data) >= 9 + int.from_bytes(data[:3], "big"):
+                    length = int.from_bytes(data[:3], "big")
+                    frames.append((data[3], data[4], int.from_bytes(data[5:9], "big"), data[9:9 + length]))
+                    data = data[9 + length:]
+            return frames, data
+
+        # :method POST, :scheme http, :path as a literal, :authority test
+        path = b"/cgi-bin/h2_digest.py"
+        post = b"\x83\x86\x04" + bytes([len(path)]) + path + b"\x01\x04test"
+        get = b"\x82\x86\x84\x01\x04test"
+        server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            time.sleep(0.5)
+            with socket.create_connection(("127.0.0.1", 8090), timeout=10) as sock:
+                sock.sendall(b"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n" + frame(4, 0, 0))
+                # Three bodies arrive interleaved, all together far over client_body_buffer_size
+                bodies = dict((stream, os.urandom(200000 + stream)) for stream in (1, 3, 5))
+                sock.sendall(b"".join(frame(1, 4, stream, post) for stream in bodies))
+                for offset in range(0, 200006, 16384):
+                    for stream, body in bodies.items():
+                        part = body[offset:offset + 16384]
+                        if part:
+                            last = offset + 16384 >= len(body)
+                            sock.sendall(frame(0, 1 if last else 0, stream, part))
+                ended = lambda frames: set(f[2] for f in frames if f[0] in (0, 1) and f[1] & 1) >= set(bodies)
+                frames, data = read_frames(sock, b"", ended)
+                for stream, body in bodies.items():
+                    answer = b"".join(f[3] for f in frames if f[0] == 0 and f[2] == stream)
+                    self.assertEqual(answer.strip(), b"%d %s" % (len(body), hashlib.sha256(body).hexdigest().encode()))
+
+                # PINGs from a peer that reads none of the ACKs: the server stops reading
+                # instead of queueing ACKs without limit
+                sock.setblocking(False)
+                batch = b"".join(frame(6, 0, 0, n.to_bytes(8, "big")) for n in range(1000))
+                accepted = 0
+                deadline = time.time() + 3
+                while time.time() < deadline and accepted < 64 * 1024 * 1024:
+                    try:
+                        accepted += sock.send(batch[accepted % len(batch):])
+                    except BlockingIOError:
+                        time.sleep(0.01)
+                self.assertLess(accepted, 64 * 1024 * 1024)
+                # Once the peer reads, every complete PING is answered, then the one cut in the middle
+                sock.settimeout(10)
+                pings = accepted // 17
+                frames, data = read_frames(sock, data, lambda frames: sum(1 for f in frames if f[0] == 6) >= pings)
+                cut = accepted % len(batch)
+                if accepted % 17:
+                    sock.sendall(batch[cut:cut + 17 - accepted % 17])
+                    frames, data = read_frames(sock, data, lambda frames: any(f[0] == 6 for f in frames))
+                sock.sendall(frame(1, 5, 7, get))
+                frames, data = read_frames(sock, data, lambda frames: any(f[0] == 1 and f[2] == 7 for f in frames))
+                self.assertEqual([f[3][:1] for f in frames if f[0] == 1 and f[2] == 7], [b"\x88"])
+        finally:
+            server.terminate()
+            server.wait(timeout=5)
+            os.remove(script)
+
+    def test_26_idle_logger_sleeps(self):
+        """An idle server's log writer thread sleeps until a message arrives instead of polling."""
+        with open(CONFIG_PATH, "w") as f:
+            f.write("server {\n server_name test;\n host 127.0.0.1;\n listen 8090;\n root www/;\n location / {\n }\n}\n")
+        server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        tasks = "/proc/%d/task" % server.pid
+
+        def wakeups():
+            total = 0
+            for task in os.listdir(tasks):
+                with open(os.path.join(tasks, task, "status")) as f:
+                    total += sum(int(l.split()[1]) for l in f if l.startswith("voluntary_ctxt_switches"))
+            return total
+
+        try:
+            time.sleep(0.5)
+            if not os.path.isdir(tasks):
+                self.skipTest("/proc is not available")
+            before = wakeups()
+            time.sleep(2)
+            # Only the event loop's one-second poll timeout; polling the ring every 10 ms was ~200
+            self.assertLess(wakeups() - before, 20)
+            # A message after the idle stretch still reaches the log promptly
+            start = os.path.getsize("webserv.log")
+            with socket.create_connection(("127.0.0.1", 8090), timeout=2) as sock:
+                sock.sendall(b"GET /empty.html HTTP/1.1\r\nHost: test\r\n\r\n")
+                self.assertTrue(sock.recv(65536).startswith(b"HTTP/1.1 200 OK"))
+            time.sleep(0.2)
+            with open("webserv.log", "rb") as f:
+                f.seek(start)
+                self.assertIn(b"200 OK: www/empty.html", f.read())
+        finally:
+            server.terminate()
+            server.wait(timeout=5)
+
+    def test_27_cgi_output_cap(self):
+        """CGI output is kept up to the send high watermark (256 KiB), a larger one fails with a 500."""
+        script = "www/cgi-bin/output_size.py"
+        with open(script, "w") as f:
+            f.write(textwrap.dedent("""\
+                import os, sys
+                sys.stdout.write("Content-Type: text/plain\\r\\n\\r\\n")
+                sys.stdout.write("x" * int(os.environ["QUERY_STRING"]))
+            """))
+        with open(CONFIG_PATH, "w") as f:
+            f.write("server {\n server_name test;\n host 127.0.0.1;\n listen 8090;\n root www/;\n"
+                    " location / {\n }\n location /cgi-bin {\n  root www/;\n  allow_methods GET;\n"
+                    "  cgi_path /usr/bin/python3;\n  cgi_ext .py;\n }\n}\n")
+        server = subprocess.Popen(["./webserv", CONFIG_PATH], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            time.sleep(0.5)
+            for size, expected in ((200000, b"HTTP/1.1 200 OK"), (300000, b"HTTP/1.1 500")):
+                with socket.create_connection(("127.0.0.1", 8090), timeout=10) as sock:
+                    sock.sendall(b"GET /cgi-bin/output_size.py?%d HTTP/1.1\r\nHost: test\r\n\r\n" % size)
+                    status, _, body, _ = read_response(sock)
+                self.assertTrue(status.startswith(expected), status)
+                if size == 200000:
+                    self.assertEqual(body, b"x" * size)
+                else:
+                    self.assertIn(b"CGI output too large", body)
+        finally:
+            server.terminate()
+            server.wait(timeout=5)
+            os.remove(script)
 
     # -------------------------
     # TEMPLATE FOR NEW TESTS
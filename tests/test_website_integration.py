@@ -74,6 +74,19 @@ class WebsiteIntegrationTest(unittest.TestCase):
     def test_03_generic_path_returns_generic(self):
         self.assertResponseMatchesFile("/generic.html", "www/generic.html")
 
+    def test_04_status_endpoint_counts_requests(self):
+        requests.get(self.base_url + "/index.html", timeout=2)
+        res = requests.get(self.base_url + "/status", timeout=2)
+        self.assertEqual(res.status_code, 200)
+        self.assertIn("Active connections:", res.text)
+        self.assertRegex(res.text, r"2xx: [1-9]")
+
+    def test_05_status_endpoint_prometheus_format(self):
+        res = requests.get(self.base_url + "/status?format=prometheus", timeout=2)
+        self.assertEqual(res.status_code, 200)
+        self.assertIn("webserv_requests_total{status=\"2xx\"}", res.text)
+        self.assertIn("webserv_request_duration_seconds_bucket", res.text)
+
     # Template for adding more tests ---------------------------------------
     # def test_XX_description(self):
     #     """Short explanation of what this test checks"""